@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Remembers, for each album in the user's own music, an audio file that
+// has the album art embedded in it, so the art for the album can be found
+// without asking a server. Files are added as we extract their art, so
+// the index grows as the user's music is thumbnailed.
+//
+// The index can hold max_entries albums. Once it is full, new albums are
+// not added until remove() makes room.
+
+class AlbumIndex final
+{
+public:
+    explicit AlbumIndex(int max_entries);
+    ~AlbumIndex();
+
+    AlbumIndex(AlbumIndex const&) = delete;
+    AlbumIndex& operator=(AlbumIndex const&) = delete;
+
+    // Returns the file for the album, or the empty string if there is none.
+    std::string find(std::string const& artist, std::string const& album) const;
+
+    // Records path as the file for the album. Albums without an artist
+    // or a name are ignored, because they don't identify an album.
+    void add(std::string const& artist, std::string const& album, std::string const& path);
+
+    // Forgets the file for the album if it is path, for example, because
+    // the file no longer exists or has no art anymore.
+    void remove(std::string const& artist, std::string const& album, std::string const& path);
+
+    int64_t size() const;
+
+    // Replaces the contents of the index with those saved in path. Returns
+    // false if there is no index there or it has the wrong format.
+    bool load(std::string const& path);
+
+    // Saves the index to path, unless it hasn't changed since it was loaded or saved.
+    void save(std::string const& path) const;
+
+private:
+    typedef std::pair<std::string, std::string> AlbumKey;
+
+    int const max_entries_;
+    mutable std::mutex mutex_;
+    std::map<AlbumKey, std::string> files_;
+    mutable bool dirty_ = false;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <internal/image.h>
+
 #include <QObject>
 
 namespace unity
@@ -44,8 +46,22 @@ public:
     virtual QByteArray const& data() const = 0;
     virtual QString url_string() const = 0;
 
+    // An image is decoded while it downloads. Each time more data has
+    // arrived, dataReceived() is emitted, and decode_received() decodes it.
+    // decode_received() can be called from any thread, so the decoding need
+    // not run on the event loop, but calls must not overlap with each other
+    // or with image(). Calling it is optional; image() decodes whatever is left.
+    virtual void decode_received() = 0;
+
+    // Once the download has finished successfully, decodes the rest of the
+    // data and returns the image. Throws if the data is damaged, or is not
+    // an image. Until decoding shows that the data is an image, data() holds
+    // it; after that, data() is empty, because the data is no longer needed.
+    virtual Image image() = 0;
+
 Q_SIGNALS:
     void finished();
+    void dataReceived();
 
 protected:
     ArtReply(QObject* parent = nullptr)
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Counting Bloom filter over a set of string keys. may_contain() never
+// returns false for a key that was added and not removed since, and returns
+// true for a key that is not in the filter with a probability of about 1%
+// while the filter holds no more than expected_entries keys.
+// Each position holds a four-bit counter instead of a bit, so keys can be
+// removed again. remove() must be called only for a key that is in the
+// filter; otherwise, may_contain() can return false for other keys.
+// A counter that overflows stays at its maximum, so the keys that share
+// it can no longer drop out of the filter (which only costs false positives).
+// add(), remove() and may_contain() are lock-free and can be called concurrently.
+
+class BloomFilter final
+{
+public:
+    explicit BloomFilter(int64_t expected_entries);
+    ~BloomFilter();
+
+    BloomFilter(BloomFilter const&) = delete;
+    BloomFilter& operator=(BloomFilter const&) = delete;
+
+    void add(std::string const& key) noexcept;
+    void remove(std::string const& key) noexcept;
+    bool may_contain(std::string const& key) const noexcept;
+    void clear() noexcept;
+
+    int64_t num_counters() const noexcept;
+
+    // Number of keys in the filter, that is, the number of calls to add()
+    // minus the number of calls to remove() since the filter was last cleared.
+    int64_t num_added() const noexcept;
+
+    // Writes the filter to path, tagged with token. The file is the same
+    // on every platform with the same byte order, because the counter
+    // positions depend only on hash functions of our own.
+    void save(std::string const& path, std::string const& token) const;
+
+    // Replaces the contents of the filter with those saved in path.
+    // Returns false, and leaves the filter unchanged, if path does not
+    // exist, was saved with a different token, or was saved by a filter of
+    // a different size. The file is removed in all cases, so a filter that
+    // is not saved again (for example, because of a crash) is never restored.
+    bool load(std::string const& path, std::string const& token);
+
+private:
+    int64_t const num_counters_;
+    int64_t const num_words_;
+    std::unique_ptr<std::atomic<uint64_t>[]> words_;
+    std::atomic<int64_t> num_added_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QSize>
+
+#include <string>
+
+#include <sys/types.h>
+#include <time.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// The key for a local file is a fixed-width binary string: a tag byte, a 128-bit
+// hash of the canonical path, the inode, the modification time in nanoseconds,
+// and the file size. The inode change time is not part of the key, so a chmod
+// doesn't make us regenerate the thumbnails. (Access is checked separately
+// for each request.) Keys for remote art are artist and album joined by '\0'.
+
+int const LOCAL_KEY_SIZE = 1 + 16 + 3 * 8;
+
+std::string local_cache_key(std::string const& canonical_path, ino_t ino, timespec const& mtime, off_t size);
+
+// Returns true if key was made by local_cache_key().
+bool is_local_cache_key(std::string const& key);
+
+// Returns the key for the thumbnail of the given size. Local keys get the width and
+// height appended as 32-bit big-endian integers, remote keys get '\0' width '\0' height.
+std::string sized_cache_key(std::string const& key, QSize const& size);
+
+// Splits a key made by sized_cache_key() or legacy_sized_cache_key() into
+// the source key and the size. Returns false if sized_key is neither.
+bool split_sized_cache_key(std::string const& sized_key, std::string& key, QSize& size);
+
+// The key of a local file, and the key for its thumbnails, for caches written
+// with cache version 2. These are only needed to find entries that were not
+// migrated yet.
+std::string legacy_local_cache_key(std::string const& canonical_path,
+                                   ino_t ino,
+                                   timespec const& mtime,
+                                   timespec const& ctime);
+std::string legacy_sized_cache_key(std::string const& key, QSize const& size);
+
+// Returns the key in a form that is fit for log messages.
+std::string printable_cache_key(std::string const& key);
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -18,12 +18,19 @@
 
 #pragma once
 
+#include <internal/bloom_filter.h>
+
 #include <core/persistent_string_cache.h>
 
 #include <boost/filesystem.hpp>
 #include <QDebug>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
 
 namespace unity
 {
@@ -41,6 +48,18 @@ namespace internal
 //
 // In addition, the constructor also deals with caches that are re-sized when opened.
 //
+// Optionally, the helper maintains a counting Bloom filter of the keys in the
+// cache, so get() and contains_key() can report a definite miss without a DB
+// look-up. Keys are added when they are first written and removed when the
+// cache reports that they were evicted or invalidated.
+//
+// An event handler installed with set_event_handler() stays installed
+// if the cache is re-created during recovery.
+//
+// With write-behind enabled, put() queues the write and returns immediately.
+// A background thread writes the queued entries in batches. Until an entry
+// is written, get() and contains_key() find it in the queue.
+//
 // This is a template so we can inject a mock cache for testing.
 
 template<typename CacheT>
@@ -51,6 +70,8 @@ public:
 
     using UPtr = std::unique_ptr<CacheHelper<CacheT>>;  // Convenience definition for clients.
 
+    ~CacheHelper();
+
     CacheT& cache() const
     {
         return *c_;
@@ -68,11 +89,45 @@ public:
              std::string const& value,
              std::chrono::time_point<std::chrono::system_clock> expiry_time = std::chrono::system_clock::time_point());
     bool contains_key(std::string const& key) const;
-    core::PersistentCacheStats stats() const;
+    core::PersistentCacheStats stats() const;  // Flushes queued writes first.
     void clear_stats();
     void invalidate();
     void compact();
 
+    // Enables the Bloom filter. The filter is restored from filter_path if
+    // save_bloom_filter() wrote it there and the cache has not changed since.
+    // Otherwise, the filter is used only once the cache is known to be empty,
+    // because the DB provides no way to enumerate the keys it contains.
+    // expected_entries is the number of keys the cache is expected to hold.
+    void enable_bloom_filter(std::string const& filter_path, int64_t expected_entries);
+    void save_bloom_filter() const;
+
+    // Number of look-ups since the last clear_stats() that the Bloom filter
+    // answered without going to the DB.
+    int64_t filtered_misses() const;
+
+    // Calls handler for the events selected by events. The handler may be
+    // called with the cache locked, so it must not call back into the cache.
+    // Once the whole cache has been emptied, either by invalidate() or because
+    // it was re-created during recovery, handler is called with an empty key
+    // and the invalidate event. With write-behind enabled, the put event is
+    // reported when the write is queued, and again once it is written.
+    typedef std::function<void(std::string const& key, core::CacheEvent event)> EventHandler;
+    void set_event_handler(core::CacheEvent events, EventHandler handler);
+
+    // Returns a token that identifies the current contents of the cache, so
+    // data derived from the cache and saved alongside it can be validated
+    // when it is restored.
+    std::string content_token() const;
+
+    // Enables write-behind. If the keys and values waiting to be written
+    // add up to more than max_pending_bytes, put() waits for the queue to
+    // drain, so the queue cannot grow without bound.
+    void enable_write_behind(int64_t max_pending_bytes);
+
+    // Waits until all queued writes have been written.
+    void flush() const;
+
 private:
     CacheHelper<CacheT>(std::string const& cache_path,
                         int64_t max_size_in_bytes,
@@ -112,11 +167,50 @@ private:
 
     void recover() const;
     void init_cache();
+    void install_handler();
+    void on_event(std::string const& key, core::CacheEvent ev);
+    bool put_to_cache(std::string const& key,
+                      std::string const& value,
+                      std::chrono::time_point<std::chrono::system_clock> expiry_time);
+    bool definitely_missing(std::string const& key) const;
+    bool find_pending(std::string const& key, std::string* value) const;
+    void write_pending();
 
     std::string const path_;
     int64_t const size_;
     core::CacheDiscardPolicy const policy_;
     mutable std::unique_ptr<CacheT> c_;
+
+    std::unique_ptr<BloomFilter> filter_;
+    std::string filter_path_;
+    std::atomic<bool> filter_valid_;                 // True if filter_ holds every key in the cache.
+    mutable std::atomic<int64_t> filtered_misses_;
+    std::mutex filter_mutex_;                        // Serializes put() with invalidate().
+    std::mutex put_key_mutex_;
+    std::string put_key_;                            // Key being written by put_to_cache(), if any.
+    bool put_key_removed_ = false;                   // True if put_key_ was evicted meanwhile.
+
+    EventHandler handler_;
+    core::CacheEvent handler_events_ = core::CacheEvent(0);
+    std::function<void()> install_handler_;          // Installs on_event() on c_.
+
+    struct PendingWrite
+    {
+        std::string value;
+        std::chrono::time_point<std::chrono::system_clock> expiry_time;
+    };
+    typedef std::unordered_map<std::string, PendingWrite> PendingMap;
+
+    mutable std::mutex pending_mutex_;
+    mutable std::condition_variable pending_cv_;     // Signals the writer that there is work.
+    mutable std::condition_variable drained_cv_;     // Signals flush() and put() that a batch was written.
+    PendingMap pending_;                             // Queued writes.
+    PendingMap in_flight_;                           // Writes in the batch that is being written.
+    int64_t pending_bytes_ = 0;                      // Keys and values in pending_ and in_flight_.
+    int64_t max_pending_bytes_ = 0;
+    bool stop_ = false;
+    std::mutex write_mutex_;                         // Held while a batch is written.
+    std::thread writer_;
 };
 
 // Convenience definition for the normal use case with a real cache.
@@ -146,6 +240,8 @@ CacheHelper<CacheT>::CacheHelper(std::string const& cache_path,
     : path_(cache_path)
     , size_(max_size_in_bytes)
     , policy_(policy)
+    , filter_valid_(false)
+    , filtered_misses_(0)
 {
     call<void>([&]{ init_cache(); });
 }
@@ -155,16 +251,43 @@ inline
 CacheHelper<CacheT>::CacheHelper(std::string const& cache_path)
     : path_(cache_path)
     , c_(move(CacheT::open(path_)))
+    , filter_valid_(false)
+    , filtered_misses_(0)
 {
     auto stats = c_->stats();
     size_ = stats->max_size_in_bytes();
     policy_ = stats->policy();
 }
 
+template<typename CacheT>
+inline
+CacheHelper<CacheT>::~CacheHelper()
+{
+    if (writer_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            stop_ = true;
+        }
+        pending_cv_.notify_one();
+        writer_.join();  // The writer drains the queue before it exits.
+    }
+}
+
 template<typename CacheT>
 inline
 core::Optional<std::string> CacheHelper<CacheT>::get(std::string const& key) const
 {
+    // Queued entries are added to the filter only once they are written.
+    std::string value;
+    if (find_pending(key, &value))
+    {
+        return core::Optional<std::string>(value);
+    }
+    if (definitely_missing(key))
+    {
+        return core::Optional<std::string>();
+    }
     return call<core::Optional<std::string>>([&]{ return c_->get(key); });
 }
 
@@ -174,13 +297,47 @@ bool CacheHelper<CacheT>::put(std::string const& key,
                               std::string const& value,
                               std::chrono::time_point<std::chrono::system_clock> expiry_time)
 {
-    return call<bool>([&]{ return c_->put(key, value, expiry_time); });
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    if (!writer_.joinable())
+    {
+        return put_to_cache(key, value, expiry_time);
+    }
+
+    {
+        int64_t const size = key.size() + value.size();
+        std::unique_lock<std::mutex> pending_lock(pending_mutex_);
+        drained_cv_.wait(pending_lock, [&]
+        {
+            return pending_bytes_ + size <= max_pending_bytes_ || (pending_.empty() && in_flight_.empty());
+        });
+        auto it = pending_.find(key);
+        if (it != pending_.end())
+        {
+            pending_bytes_ -= key.size() + it->second.value.size();
+        }
+        pending_[key] = PendingWrite{value, expiry_time};
+        pending_bytes_ += size;
+    }
+    pending_cv_.notify_one();
+    if (handler_)
+    {
+        handler_(key, core::CacheEvent::put);
+    }
+    return true;
 }
 
 template<typename CacheT>
 inline
 bool CacheHelper<CacheT>::contains_key(std::string const& key) const
 {
+    if (find_pending(key, nullptr))
+    {
+        return true;
+    }
+    if (definitely_missing(key))
+    {
+        return false;
+    }
     return c_->contains_key(key);
 }
 
@@ -188,6 +345,7 @@ template<typename CacheT>
 inline
 core::PersistentCacheStats CacheHelper<CacheT>::stats() const
 {
+    flush();
     return c_->stats();
 }
 
@@ -196,22 +354,322 @@ inline
 void CacheHelper<CacheT>::clear_stats()
 {
     c_->clear_stats();
+    filtered_misses_ = 0;
 }
 
 template<typename CacheT>
 inline
 void CacheHelper<CacheT>::invalidate()
 {
-    call<void>([&]{ c_->invalidate(); });
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    {
+        // Waits for the batch that is being written, if any, so it
+        // cannot write entries back after the cache is emptied.
+        std::lock_guard<std::mutex> write_lock(write_mutex_);
+        std::lock_guard<std::mutex> pending_lock(pending_mutex_);
+        pending_.clear();
+        pending_bytes_ = 0;
+        drained_cv_.notify_all();
+        call<void>([&]{ c_->invalidate(); });
+    }
+    if (filter_)
+    {
+        // The cache is empty now, so the filter is exact from here on.
+        filter_->clear();
+        filter_valid_ = true;
+    }
+    if (handler_)
+    {
+        handler_(std::string(), core::CacheEvent::invalidate);
+    }
 }
 
 template<typename CacheT>
 inline
 void CacheHelper<CacheT>::compact()
 {
+    flush();
     call<void>([&]{ c_->compact(); });
 }
 
+template<typename CacheT>
+void CacheHelper<CacheT>::enable_bloom_filter(std::string const& filter_path, int64_t expected_entries)
+{
+    assert(!filter_);
+
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    filter_path_ = filter_path;
+    filter_.reset(new BloomFilter(expected_entries));
+    install_handler_ = [this]{ install_handler(); };
+    install_handler_();
+    try
+    {
+        if (filter_->load(filter_path_, content_token()))
+        {
+            filter_valid_ = true;
+            return;
+        }
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "CacheHelper: cannot load Bloom filter:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+    if (c_->size() == 0)
+    {
+        filter_valid_ = true;
+        return;
+    }
+    qDebug() << "CacheHelper: no usable Bloom filter for" << QString::fromStdString(path_)
+             << "(look-ups use the DB until the cache is cleared)";
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::save_bloom_filter() const
+{
+    if (!filter_valid_)
+    {
+        return;  // An incomplete filter must not be restored later.
+    }
+    try
+    {
+        filter_->save(filter_path_, content_token());
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "CacheHelper: cannot save Bloom filter:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
+template<typename CacheT>
+inline
+int64_t CacheHelper<CacheT>::filtered_misses() const
+{
+    return filtered_misses_;
+}
+
+template<typename CacheT>
+inline
+bool CacheHelper<CacheT>::definitely_missing(std::string const& key) const
+{
+    if (!filter_valid_ || filter_->may_contain(key))
+    {
+        return false;
+    }
+    ++filtered_misses_;
+    return true;
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::set_event_handler(core::CacheEvent events, EventHandler handler)
+{
+    handler_ = handler;
+    handler_events_ = events;
+    install_handler_ = [this]{ install_handler(); };
+    install_handler_();
+}
+
+// The cache calls a single handler per event, so on_event() serves both
+// the Bloom filter and the handler passed to set_event_handler().
+
+template<typename CacheT>
+void CacheHelper<CacheT>::install_handler()
+{
+    auto events = handler_ ? handler_events_ : core::CacheEvent(0);
+    if (filter_)
+    {
+        events = events | core::CacheEvent::invalidate | core::CacheEvent::evict_lru | core::CacheEvent::evict_ttl;
+    }
+    c_->set_handler(events, [this](std::string const& key, core::CacheEvent ev, core::PersistentCacheStats const&)
+    {
+        on_event(key, ev);
+    });
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::on_event(std::string const& key, core::CacheEvent ev)
+{
+    bool const removed = ev == core::CacheEvent::invalidate
+                         || ev == core::CacheEvent::evict_lru
+                         || ev == core::CacheEvent::evict_ttl;
+    if (removed && filter_valid_ && !key.empty())
+    {
+        filter_->remove(key);
+        std::lock_guard<std::mutex> lock(put_key_mutex_);
+        if (key == put_key_)
+        {
+            put_key_removed_ = true;
+        }
+    }
+    if (handler_ && unsigned(ev & handler_events_) != 0)
+    {
+        handler_(key, ev);
+    }
+}
+
+// Writes an entry to the DB and keeps the filter in step with it. A key
+// is added to the filter only if it is not in the DB yet, so each key in
+// the DB is counted once and drops out of the filter when it is evicted.
+// The key is added before it is written, so there is no window in which
+// the filter reports a false miss for it.
+
+template<typename CacheT>
+bool CacheHelper<CacheT>::put_to_cache(std::string const& key,
+                                       std::string const& value,
+                                       std::chrono::time_point<std::chrono::system_clock> expiry_time)
+{
+    return call<bool>([&]
+    {
+        if (!filter_valid_)
+        {
+            return c_->put(key, value, expiry_time);
+        }
+
+        // If the existing entry expires while we overwrite it, on_event()
+        // removes the key, and we must count it again.
+        {
+            std::lock_guard<std::mutex> lock(put_key_mutex_);
+            put_key_ = key;
+            put_key_removed_ = false;
+        }
+        bool const present = filter_->may_contain(key) && c_->contains_key(key);
+        if (!present)
+        {
+            filter_->add(key);
+        }
+        bool const stored = c_->put(key, value, expiry_time);
+        bool removed;
+        {
+            std::lock_guard<std::mutex> lock(put_key_mutex_);
+            put_key_.clear();
+            removed = put_key_removed_;
+        }
+        if (present && removed && stored)
+        {
+            filter_->add(key);
+        }
+        else if (!present && !stored)
+        {
+            filter_->remove(key);
+        }
+        return stored;
+    });
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::enable_write_behind(int64_t max_pending_bytes)
+{
+    assert(!writer_.joinable());
+    assert(max_pending_bytes > 0);
+
+    max_pending_bytes_ = max_pending_bytes;
+    writer_ = std::thread([this]{ write_pending(); });
+}
+
+template<typename CacheT>
+void CacheHelper<CacheT>::flush() const
+{
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    drained_cv_.wait(lock, [this]{ return pending_.empty() && in_flight_.empty(); });
+}
+
+// Returns true if key is waiting to be written and has not expired.
+// If value is not null, it is set to the queued value.
+
+template<typename CacheT>
+bool CacheHelper<CacheT>::find_pending(std::string const& key, std::string* value) const
+{
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    if (pending_.empty() && in_flight_.empty())
+    {
+        return false;
+    }
+    auto it = pending_.find(key);
+    if (it == pending_.end())
+    {
+        it = in_flight_.find(key);
+        if (it == in_flight_.end())
+        {
+            return false;
+        }
+    }
+    auto const& expiry_time = it->second.expiry_time;
+    if (expiry_time != std::chrono::system_clock::time_point() && expiry_time <= std::chrono::system_clock::now())
+    {
+        return false;
+    }
+    if (value)
+    {
+        *value = it->second.value;
+    }
+    return true;
+}
+
+// Body of the writer thread. Each time round the loop, we take all of the
+// queued writes as one batch, so a burst of puts costs a single wake-up.
+// The batch stays visible to get() until it has been written.
+
+template<typename CacheT>
+void CacheHelper<CacheT>::write_pending()
+{
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(pending_mutex_);
+            pending_cv_.wait(lock, [this]{ return stop_ || !pending_.empty(); });
+            if (pending_.empty())
+            {
+                return;  // Stopped, and nothing left to write.
+            }
+        }
+
+        std::lock_guard<std::mutex> write_lock(write_mutex_);
+        int64_t batch_bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            in_flight_.swap(pending_);  // pending_ may have been emptied by invalidate() meanwhile.
+        }
+        for (auto const& w : in_flight_)
+        {
+            batch_bytes += w.first.size() + w.second.value.size();
+            try
+            {
+                put_to_cache(w.first, w.second.value, w.second.expiry_time);
+            }
+            // LCOV_EXCL_START
+            catch (std::exception const& e)
+            {
+                qWarning() << "CacheHelper: cannot write queued entry:" << e.what();
+            }
+            catch (...)
+            {
+                qWarning() << "CacheHelper: cannot write queued entry: unknown exception";
+            }
+            // LCOV_EXCL_STOP
+        }
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex_);
+            in_flight_.clear();
+            pending_bytes_ -= batch_bytes;
+        }
+        drained_cv_.notify_all();
+    }
+}
+
+// Saved data matches the cache only if the cache still has the same
+// number of entries and bytes as when the data was saved. This guards
+// against data that no longer matches the DB, for example, because
+// the cache files were replaced while the service was not running.
+
+template<typename CacheT>
+std::string CacheHelper<CacheT>::content_token() const
+{
+    return std::to_string(c_->size()) + " " + std::to_string(c_->size_in_bytes());
+}
+
 // Called if a call on the underlying cache throws an exception.
 // If the exception was not a system_error, or was a system error with
 // any code other than 666, we just let it escape. Otherwise, if the
@@ -245,6 +703,16 @@ void CacheHelper<CacheT>::recover() const
             c_.reset();
             boost::filesystem::remove_all(path_);
             const_cast<CacheHelper*>(this)->init_cache();
+            if (filter_)
+            {
+                // The cache is empty now, so the filter is exact from here on.
+                filter_->clear();
+                const_cast<CacheHelper*>(this)->filter_valid_ = true;
+            }
+            if (handler_)
+            {
+                handler_(string(), core::CacheEvent::invalidate);
+            }
         }
         catch (std::exception const& inner)
         {
@@ -276,6 +744,10 @@ using namespace std;
         c_ = move(CacheT::open(path_));
         c_->resize(size_);
     }
+    if (install_handler_)
+    {
+        install_handler_();
+    }
 }
 
 }  // namespace internal
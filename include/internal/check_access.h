@@ -18,6 +18,11 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <string>
 
 namespace unity
@@ -32,9 +37,73 @@ namespace internal
 // Returns true if the given AppArmor profile can read the given path.
 // Note that if path is a symlink, the check will be against the
 // symlink path rather than the symlink target.
+// The answers are cached (see AccessCache).
 bool apparmor_can_read(std::string const& apparmor_label,
                        std::string const& path);
 
+// Remembers the answers to AppArmor queries, because a confined app
+// often asks for the same thumbnails again, such as while scrolling.
+//
+// Only the answer for each label and path is remembered. An answer for one
+// path says nothing about another one, even in the same directory, because
+// a policy can refuse single files, such as "deny /dir/secret r", or files
+// whose names match a pattern, such as "/dir/[^.]* r".
+//
+// Entries expire after ttl, and everything is forgotten whenever the policy
+// revision changes, so a policy reload takes effect right away. If the cache
+// holds max_entries entries, expired ones are dropped; if that does not help,
+// the cache starts over.
+
+class AccessCache final
+{
+public:
+    typedef std::function<bool(std::string const& label, std::string const& path)> QueryFunc;
+    typedef std::function<std::string()> RevisionFunc;
+
+    AccessCache(QueryFunc const& query,
+                RevisionFunc const& revision,
+                std::chrono::milliseconds ttl,
+                int max_entries);
+    ~AccessCache();
+
+    AccessCache(AccessCache const&) = delete;
+    AccessCache& operator=(AccessCache const&) = delete;
+
+    bool can_read(std::string const& label, std::string const& path);
+
+    struct Stats
+    {
+        int64_t hits = 0;           // Answered from the entry for the path.
+        int64_t misses = 0;         // Had to query AppArmor.
+        int64_t invalidations = 0;  // Times the policy revision changed.
+    };
+
+    Stats stats() const;
+
+private:
+    struct Entry
+    {
+        bool allowed;
+        std::chrono::steady_clock::time_point expiry;
+    };
+    typedef std::map<std::string, Entry> Map;
+
+    void check_revision();
+    void make_room(std::chrono::steady_clock::time_point now);
+
+    QueryFunc const query_;
+    RevisionFunc const revision_;
+    std::chrono::milliseconds const ttl_;
+    int const max_entries_;
+    mutable std::mutex mutex_;
+    std::string current_revision_;
+    Map paths_;  // Keyed by label + '\0' + path.
+    Stats stats_;
+};
+
+// Stats of the cache used by apparmor_can_read().
+AccessCache::Stats apparmor_cache_stats();
+
 }  // namespace internal
 
 }  // namespace thumbnailer
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Returns a 128-bit hash of data.
+std::string content_hash(std::string const& data);
+
+// A cache entry can hold a reference to the entry for another key instead
+// of the data, so identical images that are stored for different keys,
+// such as the cover art embedded in every track of an album, take space only
+// once. No image starts with the reference tag, so entries that hold data
+// need no tag of their own.
+std::string reference_value(std::string const& key);
+
+// Returns true and sets key if value was made by reference_value().
+bool is_reference_value(std::string const& value, std::string& key);
+
+// Remembers which cache key holds the data with a given content hash, so
+// a new entry with the same data can be stored as a reference to that key.
+// The index is kept in memory only. References that were stored already
+// name the key they refer to, so they remain valid across restarts, and
+// the index fills again as entries are added.
+//
+// The index may be out of date: the key may have been evicted from the cache
+// since. Callers check that the key still exists before referring to it.
+// When the index is full, it is cleared.
+//
+// All methods are thread-safe.
+
+class ContentIndex final
+{
+public:
+    explicit ContentIndex(int max_entries);
+    ~ContentIndex();
+
+    ContentIndex(ContentIndex const&) = delete;
+    ContentIndex& operator=(ContentIndex const&) = delete;
+
+    // Returns the key that holds the data with the given hash,
+    // or the empty string if we don't know of one.
+    std::string owner(std::string const& hash) const;
+    void set_owner(std::string const& hash, std::string const& key);
+
+    void clear();
+    int64_t size() const;
+
+private:
+    int const max_entries_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::string> owners_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/image.h>
+
+#include <cstdint>
+#include <string>
+
+#include <time.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// The thumbnail cache that desktop applications share, as described by the
+// freedesktop.org Thumbnail Managing Standard. Thumbnails are PNG files in
+// cache_dir/normal (128 pixels), large (256), x-large (512), and xx-large (1024),
+// named by the MD5 hash of the URI of the file. Each holds the URI and the
+// modification time of the file in tEXt chunks, so stale thumbnails can be
+// recognized.
+
+class DesktopThumbnails final
+{
+public:
+    // cache_dir is usually $XDG_CACHE_HOME/thumbnails.
+    explicit DesktopThumbnails(std::string const& cache_dir);
+    ~DesktopThumbnails();
+
+    DesktopThumbnails(DesktopThumbnails const&) = delete;
+    DesktopThumbnails& operator=(DesktopThumbnails const&) = delete;
+
+    // Returns the PNG data of the smallest thumbnail of the file at path that
+    // is at least size pixels large and was made from the file as it was at
+    // mtime, or the empty string if there is none.
+    std::string find(std::string const& path, time_t mtime, int size) const;
+
+    // Stores image, which was decoded from the file at path, as its thumbnail
+    // in the largest flavor that is no larger than image. Returns false if
+    // image is smaller than 128 pixels, or the thumbnail cannot be written.
+    bool store(std::string const& path,
+               time_t mtime,
+               int64_t file_size,
+               std::string const& mime_type,
+               Image const& image) const;
+
+    // Returns the path of the thumbnail of the file at path in the flavor of
+    // the given size, which must be one of 128, 256, 512, or 1024.
+    std::string thumbnail_path(std::string const& path, int size) const;
+
+private:
+    std::string const cache_dir_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Decides which client's request runs next once more than max_active
+// requests are waiting, so a client that asks for thousands of thumbnails
+// cannot make everyone else wait behind its backlog.
+//
+// Each client has a queue of its own, and the queues are served by deficit
+// round-robin: on each visit, a client may start requests that cost up to its
+// quantum, plus whatever it did not use on previous visits while it had
+// requests waiting. The quantum of a client whose name starts with one of the
+// boosted prefixes is BOOST times as large as that of other clients.
+//
+// Like RateLimiter, this performs no locking because it is only intended to be
+// used from the event loop thread.
+
+class FairScheduler final
+{
+public:
+    static int const BOOST = 4;
+
+    FairScheduler(int max_active, std::vector<std::string> const& boosted_prefixes = {});
+    ~FairScheduler();
+
+    FairScheduler(FairScheduler const&) = delete;
+    FairScheduler& operator=(FairScheduler const&) = delete;
+
+    typedef std::function<bool() noexcept> CancelFunc;
+
+    // Schedules job for client. The job runs immediately if fewer than
+    // max_active requests are running and no one else is waiting.
+    // The returned function cancels the job if it is still waiting,
+    // and returns true if it did.
+    CancelFunc schedule(std::string const& client, std::function<void()> job, int cost = 1);
+
+    // Notifies that a job for client has completed. Every job that runs
+    // must be matched by exactly one call to done().
+    void done(std::string const& client);
+
+    struct ClientStats
+    {
+        int queued = 0;
+        int active = 0;
+        int64_t completed = 0;
+        int max_queued = 0;
+        bool boosted = false;
+    };
+
+    // Stats for the clients that have requests waiting or running.
+    std::map<std::string, ClientStats> client_stats() const;
+
+    int active() const noexcept;
+    int queued() const noexcept;
+
+private:
+    struct Job
+    {
+        std::function<void()> func;
+        int cost;
+    };
+
+    struct Client
+    {
+        ClientStats stats;
+        std::deque<std::shared_ptr<Job>> queue;
+        int quantum = 1;
+        int deficit = 0;
+        bool in_round = false;
+        bool visiting = false;
+    };
+
+    void dispatch();
+    void forget_if_idle(std::map<std::string, Client>::iterator it);
+
+    int const max_active_;
+    std::vector<std::string> const boosted_prefixes_;
+    int active_;
+    int queued_;
+    std::map<std::string, Client> clients_;
+    std::deque<std::string> round_;  // Clients with waiting jobs, in the order they are visited.
+    bool dispatching_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
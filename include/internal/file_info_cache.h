@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <unity/util/ResourcePtr.h>
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Remembers the canonical path, the stat() information and the content type
+// of recently requested files, so repeated requests for the same file, such as
+// for different thumbnail sizes, don't touch the file system at all.
+//
+// Entries are keyed by the path passed to get(). When we resolve a path, we
+// watch every directory that we look up a name in with inotify, including the
+// directories that symbolic links lead to. Anything that happens to one of
+// those names, such as a file being written, a directory on the way being
+// renamed or a link being re-pointed, invalidates the entries whose path goes
+// through it. The events are read by a thread of our own, so a lookup never
+// makes a system call. If inotify is not available, every lookup goes to the
+// file system.
+//
+// If the cache is full, the least recently used entry is dropped.
+//
+// All methods are thread-safe.
+
+class FileInfoCache final
+{
+public:
+    explicit FileInfoCache(int max_entries);
+    ~FileInfoCache();
+
+    FileInfoCache(FileInfoCache const&) = delete;
+    FileInfoCache& operator=(FileInfoCache const&) = delete;
+
+    struct FileInfo
+    {
+        std::string canonical_path;
+        ino_t ino;
+        mode_t mode;
+        off_t size;
+        timespec mtime;
+        timespec ctime;
+        bool readable;  // True if we can open the file for reading.
+    };
+
+    // Returns the information for path, which must be absolute. Throws
+    // if path does not exist or cannot be canonicalised.
+    FileInfo get(std::string const& path);
+
+    // Returns the content type of the file at canonical_path, if it was
+    // set since the file last changed, and the empty string otherwise.
+    std::string content_type(std::string const& canonical_path);
+
+    // Remembers the content type of the file at canonical_path. This does
+    // nothing if the file has changed since get() returned canonical_path.
+    void set_content_type(std::string const& canonical_path, std::string const& content_type);
+
+    struct Stats
+    {
+        int64_t entries = 0;
+        int64_t hits = 0;
+        int64_t misses = 0;
+        int64_t invalidations = 0;  // Changes that made us forget entries.
+    };
+
+    Stats stats() const;
+
+private:
+    // A name that we looked up in a watched directory while resolving a path.
+    struct Dependency
+    {
+        int wd;
+        std::string name;
+    };
+
+    struct Entry
+    {
+        FileInfo info;
+        std::string content_type;
+        std::vector<Dependency> deps;
+        std::list<std::string>::iterator lru_pos;
+    };
+    typedef std::map<std::string, Entry> Map;
+
+    std::string resolve(std::string const& path, std::vector<Dependency>& deps, bool& watched, struct stat& st);
+    int watch(std::string const& dir, uint32_t mask);
+    void unwatch(std::vector<Dependency> const& deps);
+    void add_entry(std::string const& key, FileInfo const& info, std::vector<Dependency> const& deps);
+    void remove_entry(Map::iterator it);
+    void invalidate(int wd, uint32_t mask, std::string const& name);
+    void clear();
+    void read_events();
+
+    int const max_entries_;
+    mutable std::mutex mutex_;
+    Map entries_;                                      // Keyed by the path passed to get() and by the canonical path.
+    std::list<std::string> lru_;                       // Keys of entries_, most recently used first.
+    std::map<int, int> watch_refs_;                    // Dependencies on each watch, including those of get() in progress.
+    std::map<int, std::map<std::string, std::set<std::string>>> dependents_;  // Entries that depend on a name in a directory.
+    Stats stats_;
+    bool watching_ = false;   // False if we can't tell when an entry goes stale.
+    int64_t generation_ = 0;  // Incremented whenever something changes in a watched directory.
+    unity::util::ResourcePtr<int, decltype(&::close)> inotify_fd_;
+    unity::util::ResourcePtr<int, decltype(&::close)> stop_read_fd_;   // Closing stop_write_fd_ stops read_events().
+    unity::util::ResourcePtr<int, decltype(&::close)> stop_write_fd_;
+    std::thread reader_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Decides how long the service stays alive once it has become idle.
+//
+// The policy remembers the most recent idle gaps (the time from the end of one
+// burst of requests to the start of the next one) and picks a timeout that covers
+// most of them, so the service stays alive if another request is likely to arrive
+// soon. If some of those gaps are longer than the maximum timeout, the timeout
+// covers the longest gaps that fit. If even the median gap is longer than the
+// maximum timeout, staying alive does not help, so the service exits after the
+// minimum timeout instead. Until we have seen enough gaps, the timeout is the
+// default timeout.
+
+class IdlePolicy final
+{
+public:
+    IdlePolicy(std::chrono::milliseconds min_timeout,
+               std::chrono::milliseconds default_timeout,
+               std::chrono::milliseconds max_timeout);
+
+    IdlePolicy(IdlePolicy const&) = delete;
+    IdlePolicy& operator=(IdlePolicy const&) = delete;
+
+    std::chrono::milliseconds timeout() const noexcept;
+
+    // Records a gap that the service stayed alive for. If the gap is longer than the
+    // default timeout, we would have exited without the adaptive timeout, so the
+    // next request would have paid for a cold start.
+    void add_gap(std::chrono::milliseconds gap);
+
+    int num_gaps() const noexcept;
+    int64_t cold_starts_avoided() const noexcept;
+
+    // The history survives restarts, so we learn about gaps that were longer than
+    // the timeout. save() records the time of the last activity; load() adds the
+    // gap from that time until now, on the assumption that the service was started
+    // for a request that just arrived. Both throw if the file cannot be accessed;
+    // load() returns false if the file does not exist or cannot be parsed.
+    void save(std::string const& path, std::chrono::system_clock::time_point last_activity) const;
+    bool load(std::string const& path);
+
+private:
+    void push_gap(std::chrono::milliseconds gap);
+    void update_timeout();
+
+    std::chrono::milliseconds const min_timeout_;
+    std::chrono::milliseconds const default_timeout_;
+    std::chrono::milliseconds const max_timeout_;
+    std::chrono::milliseconds timeout_;
+    std::deque<std::chrono::milliseconds> gaps_;  // Most recent last.
+    int64_t cold_starts_avoided_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
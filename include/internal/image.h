@@ -23,9 +23,12 @@
 #include <QByteArray>
 #include <QSize>
 
+#include <map>
 #include <string>
 
+struct _ExifLoader;
 struct _GdkPixbuf;
+struct _GdkPixbufLoader;
 
 namespace unity
 {
@@ -40,6 +43,7 @@ class Image
 {
 public:
     class Reader;
+    class Decoder;
 
     // Default constructor does nothing.
     Image() = default;
@@ -59,6 +63,12 @@ public:
     int width() const;
     int height() const;
 
+    // Returns the dimensions of the source the image was loaded from,
+    // before any scaling, or an invalid size if they are not known
+    // (for example, if an embedded EXIF thumbnail was loaded and the EXIF
+    // data does not record the dimensions of the main image).
+    QSize source_size() const;
+
     // Return the pixel value at the (x,y) coordinates as an integer:
     //     r << 24 | g << 16 | b << 8 | a
     int pixel(int x, int y) const;
@@ -82,11 +92,56 @@ public:
     // Returns image as PNG data.
     std::string png_data() const;
 
+    // Returns image as PNG data with a tEXt chunk for each entry in text.
+    std::string png_data(std::map<std::string, std::string> const& text) const;
+
 private:
     void load(Reader& reader, QSize requested_size);
+    void orient(int orientation);
 
     gobj_ptr<struct _GdkPixbuf> pixbuf_;
     bool has_alpha_ = false;
+    QSize source_size_;
+};
+
+// Decodes an image from data that arrives in pieces, such as the body of
+// a download, so decoding overlaps with the transfer, and the encoded data
+// does not have to be kept. As with the Image constructors, the image is
+// scaled to fit within requested_size while it is decoded, and it is rotated
+// if required by the EXIF metadata. Embedded EXIF thumbnails are not used.
+
+class Image::Decoder
+{
+public:
+    explicit Decoder(QSize requested_size = QSize());
+    ~Decoder();
+
+    Decoder(Decoder const&) = delete;
+    Decoder& operator=(Decoder const&) = delete;
+
+    // Decodes the next piece of data. Throws if the data is damaged,
+    // or if it is not an image in a format that we know.
+    void write(char const* data, size_t length);
+
+    // Returns true once the dimensions of the image have been decoded,
+    // that is, once we know that the data is an image.
+    bool prepared() const;
+
+    // Decodes what remains of the data and returns the image.
+    // Throws if the data does not contain a complete image.
+    Image finish();
+
+private:
+    static void size_prepared(struct _GdkPixbufLoader* loader, int width, int height, void* user_data);
+    void read_exif();
+
+    struct _GdkPixbufLoader* loader_;
+    struct _ExifLoader* exif_loader_;  // Null once the EXIF data has been read.
+    bool closed_ = false;
+    bool prepared_ = false;
+    int orientation_ = 1;
+    QSize requested_size_;
+    QSize source_size_;
 };
 
 }  // namespace internal
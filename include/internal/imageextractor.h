@@ -53,6 +53,11 @@ public:
     void extract();
     QByteArray read();
 
+    // Kills vs-thumb if it is still running. finished() is emitted
+    // once it has exited, and read() then throws. Returns true if
+    // vs-thumb was running.
+    bool cancel();
+
 Q_SIGNALS:
     void finished();
 
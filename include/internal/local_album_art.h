@@ -33,6 +33,11 @@ namespace internal
 
 std::string extract_local_album_art(std::string const& filename);
 
+// As above, and sets artist and album to the tags of the file, or to the
+// empty string if the file doesn't have them.
+
+std::string extract_local_album_art(std::string const& filename, std::string& artist, std::string& album);
+
 }  // namespace internal
 
 }  // namespace thumbnailer
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QSize>
+
+#include <chrono>
+#include <string>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Watches the requests for thumbnails of local files and predicts when an
+// application browses a directory, such as a gallery that scrolls through
+// a folder of photos. A run is a sequence of requests for files in the same
+// directory at the same size, each arriving within window of the one before.
+// Once a run is threshold requests long, the files that follow the most recent
+// one are likely to be asked for next, and predict() returns true. It returns
+// true again after each further stride requests of the same run, so the
+// prediction moves along with the application.
+
+class LocalityPredictor final
+{
+public:
+    LocalityPredictor(int threshold, std::chrono::milliseconds window, int stride);
+    ~LocalityPredictor();
+
+    LocalityPredictor(LocalityPredictor const&) = delete;
+    LocalityPredictor& operator=(LocalityPredictor const&) = delete;
+
+    // Records a request for path at size, and returns true if the files that
+    // follow path in its directory should be prefetched at that size.
+    bool predict(std::string const& path, QSize const& size);
+
+private:
+    int const threshold_;
+    std::chrono::milliseconds const window_;
+    int const stride_;
+    std::string dir_;                                  // Directory of the current run.
+    QSize size_;
+    int run_length_;
+    std::chrono::steady_clock::time_point last_request_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/thumbnailer.h>
+
+#include <QSize>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Walks directory trees and makes thumbnails of the given sizes for the media
+// files in them, so the thumbnails are cached before anyone asks for them, such
+// as after the caches were cleared.
+//
+// Indexing runs in a thread of its own at the lowest CPU and I/O priority.
+// It pauses while other requests exist and while the device runs on battery,
+// and it finishes early once the thumbnail cache is nearly full, so it never
+// evicts thumbnails that someone asked for.
+//
+// The trees are walked in a fixed order, and the path of the last file that
+// was done is saved in state_path from time to time. start() continues after
+// that file, even in a different instance of the service. The roots and sizes
+// are saved as well, so we can tell whether a completed run is still current.
+
+class MediaIndexer final
+{
+public:
+    // finished is called by the indexing thread when indexing completes
+    // by itself, that is, without a call to stop(). pause_changed is called
+    // by the indexing thread when indexing pauses for the device running on
+    // battery, and when it continues.
+    MediaIndexer(Thumbnailer& thumbnailer,
+                 std::vector<std::string> const& roots,
+                 std::vector<QSize> const& sizes,
+                 std::string const& state_path,
+                 std::function<void()> const& finished = nullptr,
+                 std::function<void()> const& pause_changed = nullptr);
+    ~MediaIndexer();
+
+    MediaIndexer(MediaIndexer const&) = delete;
+    MediaIndexer& operator=(MediaIndexer const&) = delete;
+
+    // Starts indexing where the previous run left off. If that run completed,
+    // indexing starts from the beginning. Does nothing if indexing is running.
+    void start();
+
+    // Stops indexing and remembers how far it got.
+    void stop();
+
+    bool running() const;
+
+    // True while indexing waits for the device to be charging.
+    bool paused() const;
+
+    // True if indexing was running when the previous instance was destroyed,
+    // so it should be started again.
+    bool interrupted() const;
+
+    // True if a run completed for the same roots and sizes, and the thumbnail
+    // cache has not been emptied since, so another run would find nothing to do.
+    bool up_to_date() const;
+
+    // Progress of the current or most recent run, keyed by names such as
+    // "index.files_done".
+    std::map<std::string, int64_t> counters() const;
+
+private:
+    enum class State { stopped, running, complete };
+
+    bool halt();
+    void run();
+    bool wait_until_idle();
+    void save_state(State state);
+
+    Thumbnailer& thumbnailer_;
+    std::vector<std::string> const roots_;
+    std::vector<QSize> const sizes_;
+    std::string const state_path_;
+    std::function<void()> const finished_;
+    std::function<void()> const pause_changed_;
+    std::string const config_;                 // Roots and sizes, as saved in state_path_.
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+    std::atomic<bool> stop_;
+    State saved_state_;                        // What state_path_ says.
+    std::string saved_config_;                 // The roots and sizes that state_path_ is for.
+    std::chrono::steady_clock::time_point next_power_check_;
+    std::string cursor_;                       // Path of the last file that was done. Protected by mutex_.
+    bool running_ = false;
+    bool paused_ = false;                      // Waiting for the device to be charging.
+    bool cache_full_ = false;
+    int64_t files_total_ = 0;                  // Files in the trees, counted when a run starts.
+    int64_t files_done_ = 0;                   // Files up to and including cursor_.
+    int64_t files_indexed_ = 0;                // Files done by the current run.
+    int64_t thumbnails_ = 0;                   // Thumbnails made by the current run.
+    std::chrono::steady_clock::duration busy_time_ = {};  // Time spent making thumbnails in this run.
+};
+
+// Returns true if the device runs on battery. Devices without a battery,
+// and devices whose power supply we can't determine, count as charging.
+bool on_battery_power();
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <unity/util/ResourcePtr.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Watches directory trees with inotify and calls new_file with the path of
+// each file that is written or moved into one of them, such as a photo that
+// was just taken or a song that was just copied. Directories that are created
+// or moved into a tree are watched as well, and the files they already hold
+// are reported. Hidden files and directories are ignored.
+//
+// new_file is called by a thread of our own, so it must be thread-safe and
+// should return quickly. If inotify is not available, or a directory does not
+// exist, nothing is reported for it.
+
+class MediaWatcher final
+{
+public:
+    typedef std::function<void(std::string const& path)> NewFileFunc;
+
+    MediaWatcher(std::vector<std::string> const& dirs, NewFileFunc const& new_file);
+    ~MediaWatcher();
+
+    MediaWatcher(MediaWatcher const&) = delete;
+    MediaWatcher& operator=(MediaWatcher const&) = delete;
+
+    // The directories that are watched by default: the XDG pictures,
+    // videos, and music directories, and the DCIM directory in $HOME.
+    static std::vector<std::string> default_directories();
+
+    int watched_directories() const;
+
+private:
+    void watch_tree(std::string const& dir, bool report_files);
+    void read_events();
+
+    NewFileFunc new_file_;
+    std::map<int, std::string> watched_dirs_;  // Only touched by the constructor and read_events().
+    std::atomic<int> watch_count_;
+    unity::util::ResourcePtr<int, decltype(&::close)> inotify_fd_;
+    unity::util::ResourcePtr<int, decltype(&::close)> stop_read_fd_;   // Closing stop_write_fd_ stops read_events().
+    unity::util::ResourcePtr<int, decltype(&::close)> stop_write_fd_;
+    std::thread reader_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QByteArray>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// In-memory LRU cache of encoded thumbnails that sits in front of the
+// on-disk thumbnail cache. The cache is split into shards, each with its
+// own lock and an equal share of the byte budget, so look-ups on the DBus
+// thread rarely contend with the worker threads that add entries.
+// Values are implicitly shared, so a hit does not copy the image data.
+// A cache with a budget of zero never stores anything.
+
+class MemoryCache final
+{
+public:
+    explicit MemoryCache(int64_t max_size_in_bytes, int num_shards = 16);
+    ~MemoryCache();
+
+    MemoryCache(MemoryCache const&) = delete;
+    MemoryCache& operator=(MemoryCache const&) = delete;
+
+    // Returns a null QByteArray if key is not in the cache.
+    QByteArray get(std::string const& key);
+
+    // Adds or replaces the entry for key, evicting the least-recently
+    // used entries of the shard as necessary. Values that would not fit
+    // into a shard on their own are ignored.
+    void put(std::string const& key, QByteArray const& value);
+
+    // Adds an entry as the least-recently used one of its shard, but only
+    // if key is not present yet and the entry fits without evicting anything.
+    // Returns true if the entry was added.
+    bool preload(std::string const& key, QByteArray const& value);
+
+    // Returns up to max_keys keys, roughly in order of decreasing recency.
+    std::vector<std::string> hot_keys(size_t max_keys) const;
+
+    void invalidate();
+
+    struct Stats
+    {
+        int64_t size;               // Number of entries.
+        int64_t size_in_bytes;      // Includes an estimate of the per-entry overhead.
+        int64_t max_size_in_bytes;
+        int64_t hits;
+        int64_t misses;
+        int64_t evictions;
+    };
+
+    Stats stats() const;
+    void clear_stats();
+
+private:
+    struct Shard;
+
+    Shard& shard_for(std::string const& key) const;
+
+    int64_t max_size_in_bytes_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -29,7 +29,18 @@ namespace thumbnailer
 namespace internal
 {
 
-std::string get_mimetype(std::string const& filename);  // Throws if there is an error.
+// Number of bytes at the start of a file that sniff_mimetype() looks at.
+int const SNIFF_SIZE = 4096;
+
+// Returns the content type of a file that starts with head, if head has
+// the signature of one of the image, audio, or video types that we see most
+// often, and the empty string otherwise. The types are the ones that GIO
+// uses, except that RAW photos that are TIFF files inside are image/tiff.
+std::string sniff_mimetype(std::string const& head);
+
+// Returns the content type of filename. The type is sniffed if possible,
+// and looked up with GIO otherwise. Throws if there is an error.
+std::string get_mimetype(std::string const& filename);
 
 }  // namespace internal
 
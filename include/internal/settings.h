@@ -22,6 +22,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 typedef struct _GSettings GSettings;
 typedef struct _GSettingsSchema GSettingsSchema;
@@ -47,15 +48,29 @@ public:
     int full_size_cache_size() const;
     int thumbnail_cache_size() const;
     int failure_cache_size() const;
+    int memory_cache_size() const;
     int max_thumbnail_size() const;
     int retry_not_found_hours() const;
     int retry_error_max_seconds() const;
     int max_downloads() const;
+    int max_download_size() const;  // In kilobytes
     int max_extractions() const;
     int extraction_timeout() const;  // In seconds
+    int max_idle_time() const;       // In seconds
+    std::vector<std::string> boosted_clients() const;
     int max_backlog() const;
     bool trace_client() const;
     int log_level() const;
+    bool watch_new_media() const;
+    std::vector<std::string> new_media_directories() const;  // Empty means the default directories.
+    std::vector<int> new_media_sizes() const;
+    bool index_media() const;
+    bool prefetch_siblings() const;
+    bool read_desktop_thumbnails() const;
+    bool write_desktop_thumbnails() const;
+    bool volume_caches() const;
+    int volume_cache_size() const;
+    int volume_cache_total_size() const;
 
 private:
     std::string get_string(char const* key, std::string const& default_value) const;
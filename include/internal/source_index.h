@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QSize>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Per-source record of what the persistent caches hold for a source
+// (the thumbnail sizes, the full-size image, and a failure entry), plus
+// what we learned about the source when we last decoded it.
+// A single look-up tells the thumbnailer which caches are worth reading.
+//
+// The index for a cache tier is complete if it is known to mention every
+// entry in that cache. Only then does an absent entry mean that the cache
+// does not hold it. An entry that the index does mention may still have
+// disappeared from the cache, so callers remove it if a read misses.
+// All methods are thread-safe.
+
+class SourceIndex final
+{
+public:
+    enum class Tier { full_size, thumbnail, failure, LAST__ };
+
+    struct Record
+    {
+        std::vector<QSize> thumbnail_sizes;                     // Sizes in the thumbnail cache.
+        bool has_full_size = false;                             // In the full-size cache.
+        bool failed = false;                                    // In the failure cache.
+        std::chrono::system_clock::time_point failure_expiry;   // Epoch if the failure does not expire.
+        QSize source_size;                                      // Invalid if not known.
+        std::string content_type;                               // Empty if not known.
+    };
+
+    // Snapshot of the record for a source, together with which of the
+    // tiers the index is complete for.
+    struct Lookup
+    {
+        Record record;
+        bool complete[int(Tier::LAST__)];
+
+        bool may_have_thumbnail(QSize const& size) const;
+        bool may_have_full_size() const;
+        bool may_have_failure() const;
+    };
+
+    SourceIndex();
+    ~SourceIndex();
+
+    SourceIndex(SourceIndex const&) = delete;
+    SourceIndex& operator=(SourceIndex const&) = delete;
+
+    Lookup lookup(std::string const& key) const;
+
+    void add_thumbnail(std::string const& key, QSize const& size);
+    void remove_thumbnail(std::string const& key, QSize const& size);
+    void set_full_size(std::string const& key, bool present);
+    void set_failure(std::string const& key, std::chrono::system_clock::time_point expiry);
+    void remove_failure(std::string const& key);
+    void set_source_info(std::string const& key, QSize const& source_size, std::string const& content_type);
+
+    // Updates the index for an event reported by the cache for tier.
+    // Keys in the thumbnail cache have the size appended to the source key
+    // (see sized_cache_key()). An invalidate event with an empty key
+    // means that the whole cache was emptied.
+    void cache_event(Tier tier, std::string const& key, bool added);
+
+    // Forgets the entries of a tier. If the cache was emptied, the tier is complete from now on.
+    void clear(Tier tier, bool complete);
+    void set_complete(Tier tier, bool complete);
+    bool complete(Tier tier) const;
+
+    int64_t size() const;
+
+    // Writes the index to path. tokens holds one token per tier that
+    // identifies the state of the corresponding cache. Tiers that are not
+    // complete are saved without their token, so they are not complete
+    // after loading either.
+    void save(std::string const& path, std::vector<std::string> const& tokens) const;
+
+    // Replaces the contents of the index with those saved in path. A tier
+    // is complete after loading only if its token matches the one it was
+    // saved with; for the other tiers, the saved entries are discarded.
+    // Returns false, and leaves the index unchanged, if the file does not exist
+    // or cannot be parsed. The file is removed in all cases.
+    bool load(std::string const& path, std::vector<std::string> const& tokens);
+
+private:
+    void clear_tier(Tier tier);
+    void drop_if_empty(std::unordered_map<std::string, Record>::iterator it);
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Record> records_;
+    bool complete_[int(Tier::LAST__)];
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
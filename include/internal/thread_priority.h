@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Makes the calling thread run only when nothing else wants the CPU or the disk,
+// by putting it into the SCHED_IDLE scheduling class and the idle I/O class.
+// On Linux, both belong to the thread, not to the process, and a child process
+// that the thread starts, such as vs-thumb, inherits them. Failures are logged
+// and otherwise ignored.
+void lower_thread_priority();
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
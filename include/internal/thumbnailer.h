@@ -18,16 +18,31 @@
 
 #pragma once
 
+#include <internal/album_index.h>
 #include <internal/artdownloader.h>
 #include <internal/backoff_adjuster.h>
 #include <internal/cachehelper.h>
+#include <internal/content_index.h>
+#include <internal/desktop_thumbnails.h>
+#include <internal/file_info_cache.h>
+#include <internal/memory_cache.h>
+#include <internal/source_index.h>
+#include <internal/volume_caches.h>
 
 #include <QObject>
 #include <QSize>
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace unity
 {
@@ -68,17 +83,76 @@ public:
     virtual QByteArray thumbnail() = 0;
     virtual void download(std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) = 0;
 
+    // Stops a download() that is in progress because nobody wants the
+    // result any more. downloadFinished is still emitted, but thumbnail()
+    // must not be called after that. Returns true if an extraction was
+    // stopped; remote downloads are cheap and are left to complete.
+    virtual bool cancel_download() = 0;
+
+    // Returns the thumbnail with status cache_hit if it is held in
+    // the in-memory cache, and a null QByteArray otherwise. This
+    // never touches the disk, so it is cheap enough to call on the
+    // DBus thread before handing the request to a thread pool.
+    virtual QByteArray cached_thumbnail() = 0;
+
+    // The parts of thumbnail() that mostly wait for I/O, so the caller
+    // can run them in a different thread pool from the parts that
+    // mostly need the CPU. Calling them is optional; thumbnail() does
+    // whatever they have not done already.
+    //
+    // probe_caches() looks for the thumbnail and for a cached failure in
+    // the persistent caches. It returns the thumbnail with status
+    // cache_hit, or an empty QByteArray otherwise. If a failure is
+    // cached, the status is cached_failure, and there is no need to
+    // call thumbnail().
+    //
+    // read_source() reads a local source file into memory, so thumbnail()
+    // only has to decode it. It does nothing for remote artwork and for
+    // sources that are extracted by download().
+    virtual QByteArray probe_caches() = 0;
+    virtual void read_source() = 0;
+
+    // Decodes the part of a download that has arrived so far, so remote
+    // artwork is decoded while it downloads. downloadDataReceived is emitted
+    // each time more data has arrived; the caller can then run decode_received()
+    // in a thread pool. Calls must not overlap with each other or with
+    // thumbnail(). Calling it is optional; thumbnail() decodes whatever is left.
+    virtual void decode_received() = 0;
+
+    // Estimated CPU cost of the work that is left for thumbnail() and for
+    // download(), where one core is worth COST_PER_CORE. Callers use these
+    // as weights for a RateLimiter, so the requests that run at the same time
+    // add up to the number of cores, whatever mix of sources they are for.
+    // A video extraction costs a whole core; a thumbnail that comes from an
+    // embedded EXIF thumbnail costs a quarter of one. decode_cost() is most
+    // accurate once read_source() has run.
+    static int const COST_PER_CORE = 4;
+    virtual int decode_cost() const = 0;
+    virtual int download_cost() const = 0;
+
     // Returns status of thumbnail() set by thumbnail();
     virtual FetchStatus status() const = 0;
 
     virtual std::string const& key() const = 0;
 
     // Check that the client has access to the thumbnail.  Throws an
-    // exception on authentication failure.
+    // exception on authentication failure. A request may instead change
+    // its key to that of a thumbnail the client has access to, and leave
+    // the group it was coalesced with.
     virtual void check_client_credentials(uid_t user, std::string const& apparmor_label) = 0;
 
+    // Joins this request to the group of concurrent requests for the same
+    // source that leader belongs to. leader must have the same key(). The
+    // first member of the group that fetches or decodes the source keeps the
+    // image in memory until the last member is gone, so the other members,
+    // including those that join later, can be scaled from it without reading
+    // the full-size cache or decoding the source a second time. Members that
+    // need the source while another member decodes it wait for that member.
+    virtual void coalesce_with(ThumbnailRequest& leader) = 0;
+
 Q_SIGNALS:
     void downloadFinished();
+    void downloadDataReceived();
 };
 
 class RequestBase;
@@ -108,22 +182,76 @@ public:
         core::PersistentCacheStats full_size_stats;
         core::PersistentCacheStats thumbnail_stats;
         core::PersistentCacheStats failure_stats;
+        MemoryCache::Stats memory_stats;
     };
 
     AllStats stats() const;
 
-    enum class CacheSelector { all, full_size_cache, thumbnail_cache, failure_cache, LAST__ };
+    enum class CacheSelector { all, full_size_cache, thumbnail_cache, failure_cache, memory_cache, LAST__ };
 
     void clear_stats(CacheSelector selector);
     void clear(CacheSelector selector);
     void compact(CacheSelector selector);
 
+    // Counters for things that are not reflected in the cache stats,
+    // keyed by a dotted name, such as "coalescing.hits".
+    typedef std::map<std::string, int64_t> CounterMap;
+
+    CounterMap counters() const;
+
+    // Returns what is known about the source of request without reading or
+    // decoding anything: the thumbnail sizes that are cached for it, whether
+    // a full-size image or a failure is cached, and the source dimensions and
+    // content type, if the source has been decoded before.
+    SourceIndex::Record source_record(ThumbnailRequest const& request) const;
+
+    // Starts reading the thumbnails that were in the in-memory cache when the
+    // previous instance shut down back into the in-memory cache, so they are
+    // hot before they are asked for again. This runs in the background and
+    // pauses while any requests exist.
+    void preload_hot_set();
+
+    // Queues the local file at path, so thumbnails of the given sizes are made
+    // for it ahead of time, in the same way as for get_thumbnail(). The thumbnails
+    // are made one at a time by a thread that runs at the lowest CPU and I/O
+    // priority, and that pauses while any other requests exist. Files that are
+    // not images, videos, or audio files are ignored. Anything that is still
+    // queued when the thumbnailer is destroyed is dropped.
+    void generate_in_background(std::string const& path, std::vector<QSize> const& sizes);
+
+    // Makes thumbnails of the given size for up to count files that follow path
+    // in its directory, in name order, because they are likely to be asked for
+    // next. This happens in the way generate_in_background() works, once nothing
+    // else is queued. Each call replaces the files that are still waiting from
+    // the previous call, which the client has most likely moved on from.
+    // Requests for prefetched thumbnails are counted as prefetch hits.
+    void prefetch_siblings(std::string const& path, QSize const& size, int count);
+
+    // Makes the thumbnails in the calling thread, in the way generate_in_background()
+    // does, but at the priority of the caller. Returns early once stop is set.
+    // Returns the number of thumbnails that were made; those that were cached
+    // already don't count.
+    int generate_thumbnails(std::string const& path,
+                            std::vector<QSize> const& sizes,
+                            std::atomic<bool> const& stop);
+
 private:
-    ArtDownloader* downloader() const
-    {
-        return downloader_.get();
-    }
+    ArtDownloader* downloader();
     void apply_upgrade_actions(std::string const& cache_dir);
+    void init_source_index();
+    std::vector<std::string> source_index_tokens() const;
+    void save_hot_set() const;
+    void preload(std::vector<std::string> const& keys);
+    void generate_queued();
+    void prefetch(std::string const& path, QSize const& size);
+    void note_request(std::string const& path, QSize const& size);
+    int generate(std::string const& path, QSize const& size, std::atomic<bool> const& stop);
+    bool wait_for_download(ThumbnailRequest& request, std::atomic<bool> const& stop);
+    core::Optional<std::string> get_entry(PersistentCacheHelper& cache, std::string const& key);
+    void put_entry(PersistentCacheHelper& cache,
+                   ContentIndex& content,
+                   std::string const& key,
+                   std::string const& value);
 
     typedef std::vector<PersistentCacheHelper*> CacheVec;
     CacheVec select_caches(CacheSelector selector) const;
@@ -131,11 +259,57 @@ private:
     PersistentCacheHelper::UPtr full_size_cache_;         // Small cache of full (original) size images.
     PersistentCacheHelper::UPtr thumbnail_cache_;         // Large cache of scaled images.
     PersistentCacheHelper::UPtr failure_cache_;           // Cache for failed attempts (value is always empty).
+    std::unique_ptr<MemoryCache> memory_cache_;           // Recently used thumbnails, in front of thumbnail_cache_.
+    std::unique_ptr<SourceIndex> source_index_;           // What the three persistent caches hold for each source.
+    std::unique_ptr<FileInfoCache> file_info_cache_;      // Canonical path, stat() and content type of local files.
+    std::unique_ptr<ContentIndex> thumbnail_content_;     // Which keys hold which thumbnails and sources.
+    std::unique_ptr<ContentIndex> full_size_content_;     // Which keys hold which full-size images.
+    std::unique_ptr<DesktopThumbnails> desktop_thumbnails_;  // Thumbnails shared with desktop applications.
+    bool read_desktop_thumbnails_;
+    bool write_desktop_thumbnails_;
+    std::atomic<int64_t> desktop_hits_;                   // Thumbnails scaled from a desktop thumbnail.
+    std::atomic<int64_t> desktop_stores_;                 // Desktop thumbnails we wrote.
+    std::unique_ptr<VolumeCaches> volume_caches_;         // Null unless the volume-caches setting is on.
+    std::atomic<int64_t> volume_hits_;                    // Thumbnails found in the cache of a removable volume.
+    std::atomic<int64_t> volume_stores_;                  // Thumbnails stored in the cache of a removable volume.
+    std::unique_ptr<AlbumIndex> album_index_;             // Which local files have the art for which albums.
+    std::string album_index_path_;
+    std::atomic<int64_t> local_album_hits_;               // Album art found in local files instead of downloaded.
+    std::string source_index_path_;
     int max_size_;                                        // Max thumbnail size in pixels.
     int retry_not_found_hours_;                           // Retry wait time for authoritative "no artwork" answer.
     std::chrono::milliseconds extraction_timeout_;        // How long to wait before giving up during extraction.
     std::unique_ptr<ArtDownloader> downloader_;
     BackoffAdjuster backoff_;
+    std::atomic<int64_t> coalesced_requests_;             // Requests that joined a group for the same source.
+    std::atomic<int64_t> coalesced_hits_;                 // Requests scaled from an image decoded by their group.
+    std::atomic<int64_t> index_skipped_reads_;            // Cache reads avoided because of source_index_.
+    std::string hot_set_path_;
+    std::thread preload_thread_;
+    std::atomic<bool> stop_preload_;
+    std::atomic<int> live_requests_;                      // Requests that have not been destroyed yet.
+    std::atomic<int64_t> preloaded_;                      // Thumbnails added to memory_cache_ by preload().
+    std::string legacy_keys_path_;                        // Exists while caches may hold version 2 keys.
+    std::atomic<bool> migrate_legacy_keys_;               // True if legacy_keys_path_ exists.
+    std::atomic<int64_t> migrated_entries_;               // Entries copied from a version 2 key.
+    std::atomic<int64_t> shared_entries_;                 // Entries stored as a reference to another entry.
+    std::atomic<int64_t> skipped_decodes_;                // Thumbnails found by the contents of their source.
+    mutable std::mutex background_mutex_;
+    std::condition_variable background_cond_;
+    std::deque<std::pair<std::string, std::vector<QSize>>> background_queue_;  // Protected by background_mutex_.
+    std::thread background_thread_;                       // Started by the first generate_in_background().
+    std::atomic<bool> stop_background_;
+    std::atomic<int64_t> background_thumbnails_;          // Thumbnails made by generate_queued().
+    std::string prefetch_from_;                           // Siblings of this file are to be listed. Protected by background_mutex_.
+    QSize prefetch_size_;                                 // Protected by background_mutex_.
+    int prefetch_count_;                                  // Protected by background_mutex_.
+    std::deque<std::string> prefetch_queue_;              // Siblings that wait to be prefetched. Protected by background_mutex_.
+    std::deque<std::string> prefetched_order_;            // Keys in prefetched_, oldest first. Protected by background_mutex_.
+    std::set<std::string> prefetched_;                    // Prefetched thumbnails nobody asked for yet. Protected by background_mutex_.
+    int64_t prefetch_calls_;                              // Protected by background_mutex_.
+    int64_t prefetch_thumbnails_;                         // Protected by background_mutex_.
+    int64_t prefetch_hits_;                               // Prefetched thumbnails that were asked for. Protected by background_mutex_.
+    int64_t prefetch_wasted_;                             // Prefetched thumbnails forgotten before anyone asked. Protected by background_mutex_.
 
     friend class RequestBase;
 };
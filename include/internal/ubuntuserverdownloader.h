@@ -68,6 +68,8 @@ private:
     std::shared_ptr<ArtReply> download_url(QUrl const& url, std::chrono::milliseconds timeout);
 
     QString api_key_;
+    int decode_size_;            // Downloaded images are scaled to fit within this while they are decoded.
+    qint64 max_download_size_;   // In bytes
     std::shared_ptr<QNetworkAccessManager> network_manager_;
 };
 
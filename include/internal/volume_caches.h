@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <internal/cachehelper.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+// Thumbnail caches that belong to removable volumes, such as SD cards and USB
+// drives. A volume counts as removable if it is mounted below one of roots,
+// which is where udisks mounts such volumes.
+//
+// The cache for a volume is kept in cache_dir, in a directory named after the
+// UUID of the file system, so the thumbnails are found again when the volume
+// is mounted at a different path. Volumes without a UUID don't get a cache.
+// We never write to the volume itself: an open database on the volume would
+// make unmounting it fail. Thumbnails in a volume cache are keyed by the path
+// relative to the root of the volume, so the keys don't change when the mount
+// point does.
+//
+// Caches are opened on demand. A background thread closes each cache once it
+// has not been used for idle_time, so the caches of volumes that were removed
+// don't stay open until the next request. The mount table is read again at
+// most every few seconds.
+//
+// Each cache is at most max_cache_size, and all of them together at most
+// max_total_size on disk. When a cache is opened and the total is exceeded,
+// the caches that have not been opened for the longest time are removed,
+// unless they are in use.
+
+class VolumeCaches final
+{
+public:
+    VolumeCaches(std::string const& cache_dir,
+                 int64_t max_cache_size,
+                 int64_t max_total_size,
+                 std::vector<std::string> const& roots = { "/media", "/run/media" },
+                 std::string const& mount_info = "/proc/self/mountinfo",
+                 std::string const& uuid_dir = "/dev/disk/by-uuid",
+                 std::chrono::milliseconds idle_time = std::chrono::seconds(10));
+    ~VolumeCaches();
+
+    VolumeCaches(VolumeCaches const&) = delete;
+    VolumeCaches& operator=(VolumeCaches const&) = delete;
+
+    // If path, which must be canonical, is on a removable volume, returns the
+    // cache for that volume and sets relative_path to the path of the file
+    // relative to the root of the volume. Otherwise, or if the cache cannot
+    // be opened, returns null.
+    std::shared_ptr<PersistentCacheHelper> find(std::string const& path, std::string& relative_path);
+
+    // Number of caches that are open.
+    int open_caches() const;
+
+    // Empties the caches that are in use and removes all others.
+    void clear();
+
+    // Compacts all caches, including those of volumes that are not mounted.
+    void compact();
+
+    struct Stats
+    {
+        int caches;          // Number of caches on disk.
+        int64_t disk_size;   // Bytes used by all caches together.
+    };
+    Stats stats() const;
+
+private:
+    struct Volume
+    {
+        std::string mount_point;
+        dev_t device;
+        std::shared_ptr<PersistentCacheHelper> cache;
+        std::chrono::steady_clock::time_point last_used;
+        bool failed = false;  // Set if the cache could not be opened, so we don't keep trying.
+    };
+
+    void refresh_mounts();
+    std::shared_ptr<PersistentCacheHelper> open_cache(Volume const& volume);
+    std::shared_ptr<PersistentCacheHelper> in_use(std::string const& cache_path) const;
+    void trim();
+    void close_idle_caches();
+
+    std::string const cache_dir_;
+    int64_t const max_cache_size_;
+    int64_t const max_total_size_;
+    std::vector<std::string> const roots_;
+    std::string const mount_info_;
+    std::string const uuid_dir_;
+    std::chrono::milliseconds const idle_time_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Volume> volumes_;  // Keyed by mount point.
+    // Every cache we opened, keyed by path. Requests may still be using a cache
+    // after it was closed or its volume was unmounted.
+    std::map<std::string, std::weak_ptr<PersistentCacheHelper>> opened_;
+    std::chrono::steady_clock::time_point next_refresh_;
+    std::condition_variable cache_opened_;   // Wakes up closer_ when there is a new cache to watch.
+    bool stop_ = false;
+    std::thread closer_;
+};
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
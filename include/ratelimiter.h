@@ -32,6 +32,11 @@ namespace thumbnailer
 // RateLimiter is a simple class to control the level of concurrency
 // of asynchronous jobs.  It performs no locking because it is only
 // intended to be run from the event loop thread.
+//
+// Each job has a weight (1 by default), and the weights of the jobs
+// that are running at the same time add up to no more than the
+// concurrency limit. A job that weighs more than the limit runs on
+// its own.
 
 class RateLimiter
 {
@@ -50,24 +55,30 @@ public:
     // called, cancels the job in the queue (if it's still in the queue).
     // The cancel function returns true if the request could be cancelled because
     // it was still waiting, false otherwise.
-    CancelFunc schedule(std::function<void()> job);
+    CancelFunc schedule(std::function<void()> job, int weight = 1);
 
     // Schedule a job to run immediately, regardless of the concurrency limit.
-    CancelFunc schedule_now(std::function<void()> job);
+    CancelFunc schedule_now(std::function<void()> job, int weight = 1);
 
     // Notify that a job has completed. If there are queued jobs,
-    // start the one at the head of the queue. Every call to schedule()
-    // and schedule_now() *must* be matched by exactly one call to done(),
-    // unless the call is cancelled. If the call is cancelled, done() must
-    // be called only if the cancel function returns false.
-    void done();
+    // start as many of them as fit. Every call to schedule()
+    // and schedule_now() *must* be matched by exactly one call to done()
+    // with the same weight, unless the call is cancelled. If the call is
+    // cancelled, done() must be called only if the cancel function returns false.
+    void done(int weight = 1);
 
 private:
-    int const concurrency_;  // Max number of outstanding requests.
-    int running_;            // Actual number of outstanding requests.
+    struct Job
+    {
+        std::function<void()> func;
+        int weight;
+    };
+
+    int const concurrency_;  // Max total weight of outstanding requests.
+    int running_;            // Actual total weight of outstanding requests.
     // We store a shared_ptr so we can detect on cancellation
     // whether a job completed before it was cancelled.
-    std::list<std::shared_ptr<std::function<void()>>> list_;
+    std::list<std::shared_ptr<Job>> list_;
 };
 
 }  // namespace thumbnailer
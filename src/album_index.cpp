@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/album_index.h>
+
+#include <internal/file_io.h>
+
+#include <boost/filesystem.hpp>
+
+#include <sstream>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+string const ALBUM_INDEX_HEADER = "thumbnailer-albums 1\n";
+
+// Each string is saved as its length and a newline, followed by its bytes.
+
+void append_field(string& contents, string const& field)
+{
+    contents += to_string(field.size()) + '\n' + field;
+}
+
+bool read_field(istream& s, string& field)
+{
+    size_t len;
+    if (!(s >> len) || s.get() != '\n')
+    {
+        return false;
+    }
+    field.assign(len, '\0');
+    return len == 0 || bool(s.read(&field[0], len));
+}
+
+}  // namespace
+
+AlbumIndex::AlbumIndex(int max_entries)
+    : max_entries_(max_entries)
+{
+}
+
+AlbumIndex::~AlbumIndex() = default;
+
+string AlbumIndex::find(string const& artist, string const& album) const
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(AlbumKey(artist, album));
+    return it == files_.end() ? string() : it->second;
+}
+
+void AlbumIndex::add(string const& artist, string const& album, string const& path)
+{
+    if (artist.empty() || album.empty())
+    {
+        return;
+    }
+    lock_guard<mutex> lock(mutex_);
+    AlbumKey const key(artist, album);
+    // Any file of the album is as good as another, so we keep the one we have.
+    if (files_.find(key) != files_.end() || int(files_.size()) >= max_entries_)
+    {
+        return;
+    }
+    files_.emplace(key, path);
+    dirty_ = true;
+}
+
+void AlbumIndex::remove(string const& artist, string const& album, string const& path)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(AlbumKey(artist, album));
+    if (it != files_.end() && it->second == path)
+    {
+        files_.erase(it);
+        dirty_ = true;
+    }
+}
+
+int64_t AlbumIndex::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return files_.size();
+}
+
+bool AlbumIndex::load(string const& path)
+{
+    if (!boost::filesystem::exists(path))
+    {
+        return false;
+    }
+    string const contents = read_file(path);
+    if (contents.compare(0, ALBUM_INDEX_HEADER.size(), ALBUM_INDEX_HEADER) != 0)
+    {
+        return false;
+    }
+    map<AlbumKey, string> files;
+    istringstream s(contents.substr(ALBUM_INDEX_HEADER.size()));
+    string artist, album, file;
+    while (int(files.size()) < max_entries_
+           && read_field(s, artist) && read_field(s, album) && read_field(s, file))
+    {
+        files[AlbumKey(artist, album)] = file;
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    files_.swap(files);
+    dirty_ = false;
+    return true;
+}
+
+void AlbumIndex::save(string const& path) const
+{
+    string contents = ALBUM_INDEX_HEADER;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!dirty_)
+        {
+            return;
+        }
+        for (auto const& entry : files_)
+        {
+            append_field(contents, entry.first.first);
+            append_field(contents, entry.first.second);
+            append_field(contents, entry.second);
+        }
+        dirty_ = false;
+    }
+    write_file(path, contents);
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/bloom_filter.h>
+
+#include <internal/file_io.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Ten counters per entry with seven hash functions gives a false positive rate of about 1%.
+int64_t const COUNTERS_PER_ENTRY = 10;
+int const NUM_HASHES = 7;
+
+// Four bits per counter is enough: with ten counters per entry, the chance
+// of any counter reaching 15 is negligible until the filter is heavily overfilled.
+int const COUNTER_BITS = 4;
+int const COUNTERS_PER_WORD = 64 / COUNTER_BITS;
+uint64_t const COUNTER_MAX = (uint64_t(1) << COUNTER_BITS) - 1;
+
+uint64_t fnv1a(string const& key) noexcept
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : key)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// MurmurHash64A by Austin Appleby, which is in the public domain.
+
+uint64_t murmur64(string const& key) noexcept
+{
+    uint64_t const m = 0xc6a4a7935bd1e995ULL;
+    int const r = 47;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (key.size() * m);
+
+    size_t const tail = key.size() & ~size_t(7);
+    for (size_t i = 0; i < tail; i += 8)
+    {
+        uint64_t k = 0;
+        for (int b = 7; b >= 0; --b)
+        {
+            k = (k << 8) | static_cast<unsigned char>(key[i + b]);
+        }
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (tail != key.size())
+    {
+        for (size_t i = key.size(); i > tail; --i)
+        {
+            h ^= uint64_t(static_cast<unsigned char>(key[i - 1])) << (8 * (i - 1 - tail));
+        }
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+// We derive the counter positions from two independent hashes, as h1 + i * h2
+// (Kirsch and Mitzenmacher), instead of computing NUM_HASHES hashes.
+// The positions are saved to disk, so we don't use std::hash, which
+// may change with the standard library.
+// func is called with the word and the shift of each counter.
+template<typename F>
+void for_each_counter(string const& key, int64_t num_counters, F func) noexcept
+{
+    uint64_t const h1 = murmur64(key);
+    uint64_t const h2 = fnv1a(key) | 1;
+    for (int i = 0; i < NUM_HASHES; ++i)
+    {
+        uint64_t counter = (h1 + i * h2) % uint64_t(num_counters);
+        if (!func(counter / COUNTERS_PER_WORD, int(counter % COUNTERS_PER_WORD) * COUNTER_BITS))
+        {
+            break;
+        }
+    }
+}
+
+// Adds delta (1 or -1) to the counter at shift in word. A counter
+// at zero or at its maximum is left alone. Other counters in the same
+// word may change concurrently, so we retry until the word is unchanged.
+void update_counter(atomic<uint64_t>& word, int shift, int delta) noexcept
+{
+    uint64_t const one = uint64_t(1) << shift;
+    uint64_t old_word = word.load(memory_order_relaxed);
+    uint64_t new_word;
+    do
+    {
+        uint64_t const count = (old_word >> shift) & COUNTER_MAX;
+        if (count == COUNTER_MAX || (delta < 0 && count == 0))
+        {
+            return;
+        }
+        new_word = delta > 0 ? old_word + one : old_word - one;
+    }
+    while (!word.compare_exchange_weak(old_word, new_word, memory_order_relaxed));
+}
+
+string make_header(int64_t num_words, string const& token)
+{
+    assert(token.find('\n') == string::npos);
+    return "thumbnailer-bloom-filter 3 " + to_string(num_words) + " " + token + "\n";
+}
+
+}  // namespace
+
+BloomFilter::BloomFilter(int64_t expected_entries)
+    : num_counters_((max(expected_entries, int64_t(1)) * COUNTERS_PER_ENTRY + COUNTERS_PER_WORD - 1)
+                    / COUNTERS_PER_WORD * COUNTERS_PER_WORD)
+    , num_words_(num_counters_ / COUNTERS_PER_WORD)
+    , words_(new atomic<uint64_t>[num_words_])
+    , num_added_(0)
+{
+    clear();
+}
+
+BloomFilter::~BloomFilter() = default;
+
+void BloomFilter::add(string const& key) noexcept
+{
+    for_each_counter(key, num_counters_, [this](int64_t word, int shift)
+    {
+        update_counter(words_[word], shift, 1);
+        return true;
+    });
+    ++num_added_;
+}
+
+void BloomFilter::remove(string const& key) noexcept
+{
+    for_each_counter(key, num_counters_, [this](int64_t word, int shift)
+    {
+        update_counter(words_[word], shift, -1);
+        return true;
+    });
+    --num_added_;
+}
+
+bool BloomFilter::may_contain(string const& key) const noexcept
+{
+    bool found = true;
+    for_each_counter(key, num_counters_, [this, &found](int64_t word, int shift)
+    {
+        found = ((words_[word].load(memory_order_relaxed) >> shift) & COUNTER_MAX) != 0;
+        return found;
+    });
+    return found;
+}
+
+void BloomFilter::clear() noexcept
+{
+    for (int64_t i = 0; i < num_words_; ++i)
+    {
+        words_[i].store(0, memory_order_relaxed);
+    }
+    num_added_ = 0;
+}
+
+int64_t BloomFilter::num_counters() const noexcept
+{
+    return num_counters_;
+}
+
+int64_t BloomFilter::num_added() const noexcept
+{
+    return num_added_;
+}
+
+void BloomFilter::save(string const& path, string const& token) const
+{
+    // The header is followed by the number of keys in the filter, and then the counters.
+    string contents = make_header(num_words_, token);
+    auto const header_size = contents.size();
+    contents.resize(header_size + (num_words_ + 1) * sizeof(uint64_t));
+    int64_t const added = num_added_;
+    memcpy(&contents[header_size], &added, sizeof(added));
+    for (int64_t i = 0; i < num_words_; ++i)
+    {
+        uint64_t const word = words_[i].load(memory_order_relaxed);
+        memcpy(&contents[header_size + (i + 1) * sizeof(uint64_t)], &word, sizeof(word));
+    }
+    write_file(path, contents);
+}
+
+bool BloomFilter::load(string const& path, string const& token)
+{
+    if (!boost::filesystem::exists(path))
+    {
+        return false;
+    }
+    string contents = read_file(path);
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+
+    string const header = make_header(num_words_, token);
+    if (contents.size() != header.size() + (num_words_ + 1) * sizeof(uint64_t)
+        || contents.compare(0, header.size(), header) != 0)
+    {
+        return false;
+    }
+    int64_t added;
+    memcpy(&added, &contents[header.size()], sizeof(added));
+    num_added_ = added;
+    for (int64_t i = 0; i < num_words_; ++i)
+    {
+        uint64_t word;
+        memcpy(&word, &contents[header.size() + (i + 1) * sizeof(uint64_t)], sizeof(word));
+        words_[i].store(word, memory_order_relaxed);
+    }
+    return true;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/cache_key.h>
+
+#include <QCryptographicHash>
+
+#include <cstdint>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+char const LOCAL_KEY_TAG = '\x01';
+int const SIZE_SUFFIX_SIZE = 2 * 4;
+
+void append_uint(string& s, uint64_t value, int bytes)
+{
+    for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8)
+    {
+        s += char((value >> shift) & 0xff);
+    }
+}
+
+uint32_t read_uint32(string const& s, size_t pos)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        value = (value << 8) | static_cast<unsigned char>(s[pos + i]);
+    }
+    return value;
+}
+
+bool split_legacy_sized_key(string const& sized_key, string& key, QSize& size)
+{
+    auto const h_pos = sized_key.rfind('\0');
+    if (h_pos == string::npos || h_pos == 0)
+    {
+        return false;
+    }
+    auto const w_pos = sized_key.rfind('\0', h_pos - 1);
+    if (w_pos == string::npos)
+    {
+        return false;
+    }
+    try
+    {
+        size = QSize(stoi(sized_key.substr(w_pos + 1, h_pos - w_pos - 1)), stoi(sized_key.substr(h_pos + 1)));
+    }
+    catch (std::exception const&)
+    {
+        return false;
+    }
+    key = sized_key.substr(0, w_pos);
+    return true;
+}
+
+}  // namespace
+
+string local_cache_key(string const& canonical_path, ino_t ino, timespec const& mtime, off_t size)
+{
+    auto const hash = QCryptographicHash::hash(QByteArray::fromStdString(canonical_path), QCryptographicHash::Md5);
+    string key;
+    key.reserve(LOCAL_KEY_SIZE + SIZE_SUFFIX_SIZE);
+    key += LOCAL_KEY_TAG;
+    key.append(hash.constData(), hash.size());
+    append_uint(key, ino, 8);
+    append_uint(key, uint64_t(mtime.tv_sec) * 1000000000 + mtime.tv_nsec, 8);
+    append_uint(key, size, 8);
+    return key;
+}
+
+bool is_local_cache_key(string const& key)
+{
+    return key.size() == size_t(LOCAL_KEY_SIZE) && key[0] == LOCAL_KEY_TAG;
+}
+
+string sized_cache_key(string const& key, QSize const& size)
+{
+    if (!is_local_cache_key(key))
+    {
+        return legacy_sized_cache_key(key, size);
+    }
+    string sized_key = key;
+    append_uint(sized_key, uint32_t(size.width()), 4);
+    append_uint(sized_key, uint32_t(size.height()), 4);
+    return sized_key;
+}
+
+bool split_sized_cache_key(string const& sized_key, string& key, QSize& size)
+{
+    if (sized_key.size() == size_t(LOCAL_KEY_SIZE + SIZE_SUFFIX_SIZE) && sized_key[0] == LOCAL_KEY_TAG)
+    {
+        size = QSize(int(read_uint32(sized_key, LOCAL_KEY_SIZE)), int(read_uint32(sized_key, LOCAL_KEY_SIZE + 4)));
+        key = sized_key.substr(0, LOCAL_KEY_SIZE);
+        return true;
+    }
+    return split_legacy_sized_key(sized_key, key, size);
+}
+
+string legacy_local_cache_key(string const& canonical_path, ino_t ino, timespec const& mtime, timespec const& ctime)
+{
+    string key = canonical_path;
+    key += '\0';
+    key += to_string(ino);
+    key += '\0';
+    key += to_string(mtime.tv_sec) + "." + to_string(mtime.tv_nsec);
+    key += '\0';
+    key += to_string(ctime.tv_sec) + "." + to_string(ctime.tv_nsec);
+    return key;
+}
+
+string legacy_sized_cache_key(string const& key, QSize const& size)
+{
+    string sized_key = key;
+    sized_key += '\0';
+    sized_key += to_string(size.width());
+    sized_key += '\0';
+    sized_key += to_string(size.height());
+    return sized_key;
+}
+
+string printable_cache_key(string const& key)
+{
+    string printable;
+    if (is_local_cache_key(key))
+    {
+        static char const hex[] = "0123456789abcdef";
+        printable = "local:";
+        for (size_t i = 1; i < key.size(); ++i)
+        {
+            auto const c = static_cast<unsigned char>(key[i]);
+            printable += hex[c >> 4];
+            printable += hex[c & 0xf];
+        }
+        return printable;
+    }
+    for (auto c : key)
+    {
+        if (c == '\0')
+        {
+            printable += "\\0";
+        }
+        else
+        {
+            printable += c;
+        }
+    }
+    return printable;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
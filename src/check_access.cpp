@@ -20,6 +20,7 @@
 #include <internal/safe_strerror.h>
 
 #include <errno.h>
+#include <fstream>
 #include <stdexcept>
 #include <sys/apparmor.h>
 
@@ -42,13 +43,6 @@ char const aa_class = AA_CLASS_FILE;
 
 bool query_file(Access access, string const& label, string const& path)
 {
-    static bool enabled = aa_is_enabled();
-    if (!enabled)
-    {
-        // If AppArmor is not enabled, assume access is granted.
-        return true;  // LCOV_EXCL_LINE
-    }
-
     string query(AA_QUERY_CMD_LABEL, AA_QUERY_CMD_LABEL_SIZE);
     query += label;
     query += '\0';
@@ -64,6 +58,44 @@ bool query_file(Access access, string const& label, string const& path)
     return allowed;
 }
 
+// Newer kernels bump the number in this file whenever the policy changes.
+char const REVISION_FILE[] = "/sys/kernel/security/apparmor/revision";
+
+// How long we trust what we read from REVISION_FILE. Reading it on every
+// query would cost more than the cache saves.
+auto const REVISION_INTERVAL = std::chrono::seconds(1);
+
+auto const CACHE_TTL = std::chrono::seconds(30);
+int const CACHE_MAX_ENTRIES = 4096;
+
+string policy_revision()
+{
+    static mutex revision_mutex;
+    static chrono::steady_clock::time_point next_read;
+    static string revision;
+
+    lock_guard<mutex> lock(revision_mutex);
+    auto const now = chrono::steady_clock::now();
+    if (now >= next_read)
+    {
+        ifstream in(REVISION_FILE);
+        revision.clear();
+        in >> revision;  // Leaves revision empty for older kernels, which rely on the TTL only.
+        next_read = now + REVISION_INTERVAL;
+    }
+    return revision;
+}
+
+unity::thumbnailer::internal::AccessCache& access_cache()
+{
+    static unity::thumbnailer::internal::AccessCache cache(
+        [](string const& label, string const& path) { return query_file(Access::read, label, path); },
+        policy_revision,
+        CACHE_TTL,
+        CACHE_MAX_ENTRIES);
+    return cache;
+}
+
 }
 
 namespace unity
@@ -77,7 +109,98 @@ namespace internal
 
 bool apparmor_can_read(string const& apparmor_label, string const& path)
 {
-    return query_file(Access::read, apparmor_label, path);
+    static bool enabled = aa_is_enabled();
+    if (!enabled)
+    {
+        // If AppArmor is not enabled, assume access is granted.
+        return true;  // LCOV_EXCL_LINE
+    }
+    return access_cache().can_read(apparmor_label, path);
+}
+
+AccessCache::Stats apparmor_cache_stats()
+{
+    return access_cache().stats();
+}
+
+AccessCache::AccessCache(QueryFunc const& query,
+                         RevisionFunc const& revision,
+                         chrono::milliseconds ttl,
+                         int max_entries)
+    : query_(query)
+    , revision_(revision)
+    , ttl_(ttl)
+    , max_entries_(max_entries)
+    , current_revision_(revision_())
+{
+}
+
+AccessCache::~AccessCache() = default;
+
+bool AccessCache::can_read(string const& label, string const& path)
+{
+    string const path_key = label + '\0' + path;
+    int64_t invalidations;
+    {
+        lock_guard<mutex> lock(mutex_);
+
+        check_revision();
+        auto it = paths_.find(path_key);
+        if (it != paths_.end() && it->second.expiry > chrono::steady_clock::now())
+        {
+            ++stats_.hits;
+            return it->second.allowed;
+        }
+        ++stats_.misses;
+        invalidations = stats_.invalidations;
+    }
+
+    // The query is a system call, so we don't make other threads wait for it.
+    bool const allowed = query_(label, path);
+
+    lock_guard<mutex> lock(mutex_);
+    // If the policy changed while we were asking, the answer may be out of date,
+    // so we don't keep it.
+    if (invalidations == stats_.invalidations)
+    {
+        auto const now = chrono::steady_clock::now();
+        make_room(now);
+        paths_[path_key] = Entry{allowed, now + ttl_};
+    }
+    return allowed;
+}
+
+AccessCache::Stats AccessCache::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
+
+void AccessCache::check_revision()
+{
+    auto revision = revision_();
+    if (revision != current_revision_)
+    {
+        current_revision_ = move(revision);
+        paths_.clear();
+        ++stats_.invalidations;
+    }
+}
+
+void AccessCache::make_room(chrono::steady_clock::time_point now)
+{
+    if (int(paths_.size()) < max_entries_)
+    {
+        return;
+    }
+    for (auto it = paths_.begin(); it != paths_.end(); )
+    {
+        it = it->second.expiry <= now ? paths_.erase(it) : next(it);
+    }
+    if (int(paths_.size()) >= max_entries_)
+    {
+        paths_.clear();
+    }
 }
 
 }  // namespace internal
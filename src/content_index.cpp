@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/content_index.h>
+
+#include <QCryptographicHash>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// JPEG and PNG data never starts with a NUL byte.
+string const REFERENCE_TAG("\0ref\0", 5);
+int const HASH_SIZE = 16;
+
+}  // namespace
+
+string content_hash(string const& data)
+{
+    // The hash decides which image a client gets to see, so we use one
+    // for which nobody can construct a file that collides with another.
+    auto const hash = QCryptographicHash::hash(QByteArray::fromRawData(data.data(), int(data.size())),
+                                               QCryptographicHash::Sha256);
+    return string(hash.constData(), HASH_SIZE);
+}
+
+string reference_value(string const& key)
+{
+    return REFERENCE_TAG + key;
+}
+
+bool is_reference_value(string const& value, string& key)
+{
+    if (value.compare(0, REFERENCE_TAG.size(), REFERENCE_TAG) != 0)
+    {
+        return false;
+    }
+    key = value.substr(REFERENCE_TAG.size());
+    return true;
+}
+
+ContentIndex::ContentIndex(int max_entries)
+    : max_entries_(max_entries)
+{
+}
+
+ContentIndex::~ContentIndex() = default;
+
+string ContentIndex::owner(string const& hash) const
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = owners_.find(hash);
+    return it == owners_.end() ? string() : it->second;
+}
+
+void ContentIndex::set_owner(string const& hash, string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+    if (int(owners_.size()) >= max_entries_ && owners_.find(hash) == owners_.end())
+    {
+        owners_.clear();
+    }
+    owners_[hash] = key;
+}
+
+void ContentIndex::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+    owners_.clear();
+}
+
+int64_t ContentIndex::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return owners_.size();
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
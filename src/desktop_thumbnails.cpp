@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/desktop_thumbnails.h>
+
+#include <internal/file_io.h>
+#include <internal/make_directories.h>
+
+#include <boost/filesystem.hpp>
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+#include <QCryptographicHash>
+#include <QDebug>
+
+#include <algorithm>
+#include <cassert>
+#include <map>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+struct Flavor
+{
+    int size;
+    char const* dir;
+};
+
+Flavor const FLAVORS[] =
+{
+    { 128, "normal" },
+    { 256, "large" },
+    { 512, "x-large" },
+    { 1024, "xx-large" }
+};
+
+string const PNG_SIGNATURE("\x89PNG\r\n\x1a\n", 8);
+
+string file_uri(string const& path)
+{
+    char* uri = g_filename_to_uri(path.c_str(), nullptr, nullptr);
+    if (!uri)
+    {
+        return "";  // LCOV_EXCL_LINE
+    }
+    string s = uri;
+    g_free(uri);
+    return s;
+}
+
+uint32_t read_uint32(string const& data, size_t pos)
+{
+    auto const p = reinterpret_cast<unsigned char const*>(data.data()) + pos;
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
+
+// Returns the tEXt chunks of png, keyed by keyword. Applications write
+// them before the image data, so we don't look any further than that.
+
+map<string, string> png_text(string const& png)
+{
+    map<string, string> text;
+    if (png.compare(0, PNG_SIGNATURE.size(), PNG_SIGNATURE) != 0)
+    {
+        return text;
+    }
+    size_t pos = PNG_SIGNATURE.size();
+    while (pos + 8 <= png.size())
+    {
+        size_t const length = read_uint32(png, pos);
+        string const type = png.substr(pos + 4, 4);
+        if (type == "IDAT" || length > png.size() - pos - 8)
+        {
+            break;
+        }
+        if (type == "tEXt")
+        {
+            string const chunk = png.substr(pos + 8, length);
+            auto const nul = chunk.find('\0');
+            if (nul != string::npos)
+            {
+                text[chunk.substr(0, nul)] = chunk.substr(nul + 1);
+            }
+        }
+        pos += length + 12;  // Length, type, data, and CRC.
+    }
+    return text;
+}
+
+}  // namespace
+
+DesktopThumbnails::DesktopThumbnails(string const& cache_dir)
+    : cache_dir_(cache_dir)
+{
+}
+
+DesktopThumbnails::~DesktopThumbnails() = default;
+
+string DesktopThumbnails::thumbnail_path(string const& path, int size) const
+{
+    for (auto const& flavor : FLAVORS)
+    {
+        if (flavor.size == size)
+        {
+            auto const uri = file_uri(path);
+            auto const hash = QCryptographicHash::hash(QByteArray(uri.data(), int(uri.size())),
+                                                       QCryptographicHash::Md5).toHex();
+            return cache_dir_ + "/" + flavor.dir + "/" + hash.constData() + ".png";
+        }
+    }
+    assert(false);  // LCOV_EXCL_LINE
+    return "";      // LCOV_EXCL_LINE
+}
+
+string DesktopThumbnails::find(string const& path, time_t mtime, int size) const
+{
+    auto const uri = file_uri(path);
+    for (auto const& flavor : FLAVORS)
+    {
+        if (flavor.size < size)
+        {
+            continue;
+        }
+        auto const thumbnail = thumbnail_path(path, flavor.size);
+        boost::system::error_code ec;
+        if (!boost::filesystem::exists(thumbnail, ec))
+        {
+            continue;
+        }
+        try
+        {
+            auto data = read_file(thumbnail);
+            auto const text = png_text(data);
+            auto const uri_it = text.find("Thumb::URI");
+            auto const mtime_it = text.find("Thumb::MTime");
+            if (uri_it != text.end() && uri_it->second == uri
+                && mtime_it != text.end() && mtime_it->second == to_string(mtime))
+            {
+                return data;
+            }
+        }
+        catch (std::exception const&)
+        {
+            // Removed or not readable, try the next flavor.
+        }
+    }
+    return "";
+}
+
+bool DesktopThumbnails::store(string const& path,
+                              time_t mtime,
+                              int64_t file_size,
+                              string const& mime_type,
+                              Image const& image) const
+{
+    int const image_size = max(image.width(), image.height());
+    Flavor const* flavor = nullptr;
+    for (auto const& f : FLAVORS)
+    {
+        if (f.size <= image_size)
+        {
+            flavor = &f;
+        }
+    }
+    if (!flavor)
+    {
+        return false;
+    }
+
+    map<string, string> text
+    {
+        { "Software", "thumbnailer" },
+        { "Thumb::URI", file_uri(path) },
+        { "Thumb::MTime", to_string(mtime) },
+        { "Thumb::Size", to_string(file_size) }
+    };
+    if (!mime_type.empty())
+    {
+        text["Thumb::Mimetype"] = mime_type;
+    }
+    auto const source_size = image.source_size();
+    if (source_size.isValid() && mime_type.compare(0, 6, "image/") == 0)
+    {
+        text["Thumb::Image::Width"] = to_string(source_size.width());
+        text["Thumb::Image::Height"] = to_string(source_size.height());
+    }
+    try
+    {
+        make_directories(cache_dir_ + "/" + flavor->dir, 0700);
+        Image const scaled = image.scale(QSize(flavor->size, flavor->size));
+        write_file(thumbnail_path(path, flavor->size), scaled.png_data(text));
+        return true;
+    }
+    catch (std::exception const& e)
+    {
+        qWarning() << "DesktopThumbnails::store(): cannot store thumbnail for" << path.c_str() << ":" << e.what();
+        return false;
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
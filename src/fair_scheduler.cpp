@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/fair_scheduler.h>
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+int const FairScheduler::BOOST;
+
+FairScheduler::FairScheduler(int max_active, vector<string> const& boosted_prefixes)
+    : max_active_(max(max_active, 1))
+    , boosted_prefixes_(boosted_prefixes)
+    , active_(0)
+    , queued_(0)
+    , dispatching_(false)
+{
+}
+
+FairScheduler::~FairScheduler() = default;
+
+FairScheduler::CancelFunc FairScheduler::schedule(string const& client, function<void()> job, int cost)
+{
+    assert(job);
+    assert(cost > 0);
+
+    auto it = clients_.find(client);
+    if (it == clients_.end())
+    {
+        it = clients_.emplace(client, Client()).first;
+        auto& c = it->second;
+        for (auto const& prefix : boosted_prefixes_)
+        {
+            if (!prefix.empty() && client.compare(0, prefix.size(), prefix) == 0)
+            {
+                c.quantum = BOOST;
+                c.stats.boosted = true;
+                break;
+            }
+        }
+    }
+    auto& c = it->second;
+
+    if (queued_ == 0 && active_ < max_active_)
+    {
+        ++active_;
+        ++c.stats.active;
+        job();
+        return []() noexcept { return false; };  // Wasn't queued, so cancel does nothing.
+    }
+
+    auto job_p = make_shared<Job>(Job{move(job), cost});
+    c.queue.push_back(job_p);
+    ++queued_;
+    c.stats.max_queued = max(c.stats.max_queued, ++c.stats.queued);
+    if (!c.in_round)
+    {
+        c.in_round = true;
+        round_.push_back(client);
+    }
+
+    // Returned function clears the job when called, provided the job is still in the queue.
+    // dispatch() removes any cleared jobs from the queue without calling them.
+    weak_ptr<Job> weak_p(job_p);
+    return [this, client, weak_p]() noexcept
+    {
+        auto job_p = weak_p.lock();
+        if (!job_p || !job_p->func)
+        {
+            return false;
+        }
+        job_p->func = nullptr;
+        --queued_;
+        --clients_.at(client).stats.queued;
+        return true;
+    };
+}
+
+void FairScheduler::done(string const& client)
+{
+    auto it = clients_.find(client);
+    assert(it != clients_.end());
+    assert(it->second.stats.active > 0);
+    assert(active_ > 0);
+
+    --active_;
+    --it->second.stats.active;
+    ++it->second.stats.completed;
+    forget_if_idle(it);
+    dispatch();
+}
+
+map<string, FairScheduler::ClientStats> FairScheduler::client_stats() const
+{
+    map<string, ClientStats> stats;
+    for (auto const& c : clients_)
+    {
+        stats.emplace(c.first, c.second.stats);
+    }
+    return stats;
+}
+
+int FairScheduler::active() const noexcept
+{
+    return active_;
+}
+
+int FairScheduler::queued() const noexcept
+{
+    return queued_;
+}
+
+void FairScheduler::dispatch()
+{
+    if (dispatching_)
+    {
+        return;  // A job that we started completed synchronously; the outer call carries on.
+    }
+    dispatching_ = true;
+
+    while (active_ < max_active_ && !round_.empty())
+    {
+        auto it = clients_.find(round_.front());
+        assert(it != clients_.end());
+        auto& c = it->second;
+
+        // Drop cancelled jobs.
+        while (!c.queue.empty() && !c.queue.front()->func)
+        {
+            c.queue.pop_front();
+        }
+
+        if (!c.visiting)
+        {
+            c.deficit += c.quantum;
+            c.visiting = true;
+        }
+        if (!c.queue.empty() && c.queue.front()->cost <= c.deficit)
+        {
+            auto job_p = c.queue.front();
+            c.queue.pop_front();
+            c.deficit -= job_p->cost;
+            --queued_;
+            --c.stats.queued;
+            ++active_;
+            ++c.stats.active;
+            auto func = move(job_p->func);
+            job_p->func = nullptr;
+            func();
+            continue;
+        }
+
+        // Done with this client for this round.
+        c.visiting = false;
+        round_.pop_front();
+        if (c.queue.empty())
+        {
+            c.deficit = 0;  // Unused credit does not carry over once the client has nothing waiting.
+            c.in_round = false;
+            forget_if_idle(it);
+        }
+        else
+        {
+            round_.push_back(it->first);
+        }
+    }
+
+    dispatching_ = false;
+}
+
+void FairScheduler::forget_if_idle(map<string, Client>::iterator it)
+{
+    auto const& c = it->second;
+    if (!c.in_round && c.queue.empty() && c.stats.active == 0)
+    {
+        clients_.erase(it);
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/file_info_cache.h>
+
+#include <internal/safe_strerror.h>
+
+#include <boost/filesystem.hpp>
+#include <QDebug>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/inotify.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Anything that can change where a name in the directory leads, or whether we
+// can get there, including changes to the directory itself.
+uint32_t const DIR_WATCH_MASK = IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+                              | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// In the directory that holds the file, anything that can change what we know about it.
+uint32_t const FILE_WATCH_MASK = DIR_WATCH_MASK | IN_MODIFY | IN_CLOSE_WRITE;
+
+// Events after which nothing that we looked up in the directory can be trusted.
+uint32_t const DIR_GONE_MASK = IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT;
+
+// As for the kernel, to stop symbolic link loops.
+int const MAX_SYMLINKS = 40;
+
+string parent_dir(string const& path)
+{
+    auto const slash = path.rfind('/');
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+// Adds the names in path to names, in reverse order, so the first name is at the end.
+
+void push_names(vector<string>& names, string const& path)
+{
+    vector<string> path_names;
+    string::size_type pos = 0;
+    while (pos < path.size())
+    {
+        auto end = path.find('/', pos);
+        if (end == string::npos)
+        {
+            end = path.size();
+        }
+        auto const name = path.substr(pos, end - pos);
+        if (!name.empty() && name != ".")
+        {
+            path_names.push_back(name);
+        }
+        pos = end + 1;
+    }
+    names.insert(names.end(), path_names.rbegin(), path_names.rend());
+}
+
+}  // namespace
+
+FileInfoCache::FileInfoCache(int max_entries)
+    : max_entries_(max_entries)
+    , inotify_fd_(::close)
+    , stop_read_fd_(::close)
+    , stop_write_fd_(::close)
+{
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd == -1)
+    {
+        // LCOV_EXCL_START
+        qWarning().nospace() << "FileInfoCache(): cannot initialize inotify: "
+                             << QString::fromStdString(safe_strerror(errno)) << " (not caching file information)";
+        return;
+        // LCOV_EXCL_STOP
+    }
+    inotify_fd_.reset(fd);
+
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+    {
+        // LCOV_EXCL_START
+        qWarning().nospace() << "FileInfoCache(): cannot create pipe: "
+                             << QString::fromStdString(safe_strerror(errno)) << " (not caching file information)";
+        inotify_fd_.dealloc();
+        return;
+        // LCOV_EXCL_STOP
+    }
+    stop_read_fd_.reset(pipe_fd[0]);
+    stop_write_fd_.reset(pipe_fd[1]);
+
+    watching_ = true;
+    reader_ = thread(&FileInfoCache::read_events, this);
+}
+
+FileInfoCache::~FileInfoCache()
+{
+    if (reader_.joinable())
+    {
+        stop_write_fd_.dealloc();  // read_events() sees EOF on the pipe and returns.
+        reader_.join();
+    }
+}
+
+FileInfoCache::FileInfo FileInfoCache::get(string const& path)
+{
+    bool watched;
+    int64_t generation;
+    {
+        lock_guard<mutex> lock(mutex_);
+        auto it = entries_.find(path);
+        if (it != entries_.end())
+        {
+            lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+            ++stats_.hits;
+            return it->second.info;
+        }
+        ++stats_.misses;
+        watched = watching_;
+        generation = generation_;
+    }
+
+    vector<Dependency> deps;
+    FileInfo info;
+    struct stat st;
+    try
+    {
+        info.canonical_path = resolve(path, deps, watched, st);
+    }
+    catch (std::exception const&)
+    {
+        lock_guard<mutex> lock(mutex_);
+        unwatch(deps);
+        throw;
+    }
+    info.ino = st.st_ino;
+    info.mode = st.st_mode;
+    info.size = st.st_size;
+    info.mtime = st.st_mtim;
+    info.ctime = st.st_ctim;
+    info.readable = faccessat(AT_FDCWD, info.canonical_path.c_str(), R_OK, AT_EACCESS) == 0;
+
+    lock_guard<mutex> lock(mutex_);
+    // If anything changed in the directories while we were looking, it may
+    // have been on the way to this file, so we don't keep what we found.
+    if (watched && generation == generation_)
+    {
+        add_entry(path, info, deps);
+        add_entry(info.canonical_path, info, deps);  // For content_type().
+        while (int(entries_.size()) > max_entries_)
+        {
+            remove_entry(entries_.find(lru_.back()));
+        }
+        stats_.entries = entries_.size();
+    }
+    unwatch(deps);  // The entries hold references of their own.
+    return info;
+}
+
+string FileInfoCache::content_type(string const& canonical_path)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = entries_.find(canonical_path);
+    return it == entries_.end() ? string() : it->second.content_type;
+}
+
+void FileInfoCache::set_content_type(string const& canonical_path, string const& content_type)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto it = entries_.find(canonical_path);
+    if (it != entries_.end())
+    {
+        it->second.content_type = content_type;
+    }
+}
+
+FileInfoCache::Stats FileInfoCache::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return stats_;
+}
+
+// Resolves path like canonical(), one name at a time. Before we look up a
+// name in a directory, we watch the directory and add the name to deps, so we
+// hear of any change after that. Sets watched to false if a directory cannot
+// be watched, and st to the stat() information of the file.
+
+string FileInfoCache::resolve(string const& path, vector<Dependency>& deps, bool& watched, struct stat& st)
+{
+    if (path.empty() || path[0] != '/')
+    {
+        throw invalid_argument("FileInfoCache::get(): " + path + ": path must be absolute");
+    }
+    vector<string> names;  // Names still to look up, the next one last.
+    push_names(names, path);
+    string dir = "/";
+    bool have_st = false;
+    int links = 0;
+    while (!names.empty())
+    {
+        string const name = names.back();
+        names.pop_back();
+        if (name == "..")
+        {
+            dir = parent_dir(dir);
+            have_st = false;
+            continue;
+        }
+        if (watched)
+        {
+            // Changes to the contents of files only matter in the last directory.
+            int const wd = watch(dir, names.empty() ? FILE_WATCH_MASK : DIR_WATCH_MASK);
+            if (wd == -1)
+            {
+                watched = false;  // Most likely, we have run out of watches. We just don't cache the file.
+            }
+            else
+            {
+                deps.push_back(Dependency{wd, name});
+            }
+        }
+        string const next = (dir == "/" ? "" : dir) + "/" + name;
+        if (lstat(next.c_str(), &st) == -1)
+        {
+            throw runtime_error("FileInfoCache::get(): Could not stat " + next + ": " + safe_strerror(errno));
+        }
+        if (S_ISLNK(st.st_mode))
+        {
+            if (++links > MAX_SYMLINKS)
+            {
+                throw runtime_error("FileInfoCache::get(): " + path + ": too many levels of symbolic links");
+            }
+            string const target = boost::filesystem::read_symlink(next).native();
+            push_names(names, target);
+            if (!target.empty() && target[0] == '/')
+            {
+                dir = "/";
+            }
+            have_st = false;
+            continue;
+        }
+        if (!names.empty() && !S_ISDIR(st.st_mode))
+        {
+            throw runtime_error("FileInfoCache::get(): " + next + ": not a directory");
+        }
+        dir = next;
+        have_st = true;
+    }
+    if (!have_st && lstat(dir.c_str(), &st) == -1)  // path ends in "..", or is "/".
+    {
+        throw runtime_error("FileInfoCache::get(): Could not stat " + dir + ": " + safe_strerror(errno));  // LCOV_EXCL_LINE
+    }
+    return dir;
+}
+
+// Watches dir (adding mask to what we watch it for already) and returns
+// the watch descriptor, or -1 if dir cannot be watched.
+
+int FileInfoCache::watch(string const& dir, uint32_t mask)
+{
+    int const wd = inotify_add_watch(inotify_fd_.get(), dir.c_str(), mask | IN_MASK_ADD | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd != -1)
+    {
+        // invalidate() ignores events for watches that nothing refers to. That is
+        // safe for the events before this point, because we look in dir only after it.
+        lock_guard<mutex> lock(mutex_);
+        ++watch_refs_[wd];
+    }
+    return wd;
+}
+
+// Drops a reference to the watch of each dependency, and stops watching
+// directories that nothing depends on any more. Called with mutex_ locked.
+
+void FileInfoCache::unwatch(vector<Dependency> const& deps)
+{
+    for (auto const& d : deps)
+    {
+        auto it = watch_refs_.find(d.wd);
+        if (it == watch_refs_.end())
+        {
+            continue;  // clear() removed the watch already.
+        }
+        if (--it->second == 0)
+        {
+            watch_refs_.erase(it);
+            inotify_rm_watch(inotify_fd_.get(), d.wd);
+            ++generation_;  // A get() in progress may have just added the same watch.
+        }
+    }
+}
+
+// Called with mutex_ locked.
+
+void FileInfoCache::add_entry(string const& key, FileInfo const& info, vector<Dependency> const& deps)
+{
+    if (entries_.find(key) != entries_.end())
+    {
+        return;  // Nothing has changed since another thread added it.
+    }
+    lru_.push_front(key);
+    entries_[key] = Entry{info, "", deps, lru_.begin()};
+    for (auto const& d : deps)
+    {
+        ++watch_refs_[d.wd];
+        dependents_[d.wd][d.name].insert(key);
+    }
+}
+
+// Called with mutex_ locked.
+
+void FileInfoCache::remove_entry(Map::iterator it)
+{
+    for (auto const& d : it->second.deps)
+    {
+        auto dir = dependents_.find(d.wd);
+        if (dir == dependents_.end())
+        {
+            continue;
+        }
+        auto name = dir->second.find(d.name);
+        if (name != dir->second.end())
+        {
+            name->second.erase(it->first);
+            if (name->second.empty())
+            {
+                dir->second.erase(name);
+            }
+        }
+        if (dir->second.empty())
+        {
+            dependents_.erase(dir);
+        }
+    }
+    unwatch(it->second.deps);
+    lru_.erase(it->second.lru_pos);
+    entries_.erase(it);
+}
+
+// Forgets the entries that depend on name in the directory with watch
+// descriptor wd, or, if the directory itself changed, on any name in it.
+// Called with mutex_ locked.
+
+void FileInfoCache::invalidate(int wd, uint32_t mask, string const& name)
+{
+    if (watch_refs_.find(wd) == watch_refs_.end())
+    {
+        return;  // Event for a watch that we removed already.
+    }
+    ++generation_;  // A get() in progress may be looking up this name.
+
+    auto dir = dependents_.find(wd);
+    if (dir == dependents_.end())
+    {
+        return;
+    }
+    set<string> keys;
+    if (name.empty() || (mask & DIR_GONE_MASK))
+    {
+        for (auto const& n : dir->second)
+        {
+            keys.insert(n.second.begin(), n.second.end());
+        }
+    }
+    else
+    {
+        auto n = dir->second.find(name);
+        if (n == dir->second.end())
+        {
+            return;
+        }
+        keys = n->second;
+    }
+    for (auto const& key : keys)  // remove_entry() changes dependents_, so we work on a copy.
+    {
+        auto it = entries_.find(key);
+        if (it != entries_.end())
+        {
+            remove_entry(it);
+        }
+    }
+    stats_.entries = entries_.size();
+    ++stats_.invalidations;
+}
+
+// Forgets everything. Called with mutex_ locked.
+
+void FileInfoCache::clear()
+{
+    for (auto const& w : watch_refs_)
+    {
+        inotify_rm_watch(inotify_fd_.get(), w.first);
+    }
+    watch_refs_.clear();
+    dependents_.clear();
+    entries_.clear();
+    lru_.clear();
+    stats_.entries = 0;
+    ++generation_;
+}
+
+void FileInfoCache::read_events()
+{
+    pollfd fds[2] = { { inotify_fd_.get(), POLLIN, 0 }, { stop_read_fd_.get(), POLLIN, 0 } };
+    alignas(inotify_event) char buf[16 * 1024];
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;  // LCOV_EXCL_LINE
+            }
+            // LCOV_EXCL_START
+            qWarning().nospace() << "FileInfoCache::read_events(): poll failed: "
+                                 << QString::fromStdString(safe_strerror(errno));
+            break;
+            // LCOV_EXCL_STOP
+        }
+        if (fds[1].revents != 0)
+        {
+            break;  // Destructor closed the write end of the pipe.
+        }
+
+        ssize_t len;
+        while ((len = read(inotify_fd_.get(), buf, sizeof(buf))) > 0)
+        {
+            lock_guard<mutex> lock(mutex_);
+            for (char* p = buf; p < buf + len; )
+            {
+                auto const event = reinterpret_cast<inotify_event const*>(p);
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    clear();  // LCOV_EXCL_LINE  // We lost events, so we can't trust anything.
+                }
+                else
+                {
+                    invalidate(event->wd, event->mask, event->len == 0 ? string() : string(event->name));
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    // Nobody reads the events any more, so the cache can no longer tell when
+    // it is out of date.
+    lock_guard<mutex> lock(mutex_);
+    clear();
+    watching_ = false;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/idle_policy.h>
+
+#include <internal/file_io.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+string const HEADER = "thumbnailer-idle-policy 1\n";
+
+size_t const MAX_GAPS = 32;     // Number of recent gaps we base the timeout on.
+size_t const MIN_GAPS = 4;      // Below this, we use the default timeout.
+int const PERCENTILE = 80;      // Percentage of recent gaps the timeout should cover.
+
+}  // namespace
+
+IdlePolicy::IdlePolicy(chrono::milliseconds min_timeout,
+                       chrono::milliseconds default_timeout,
+                       chrono::milliseconds max_timeout)
+    : min_timeout_(min_timeout)
+    , default_timeout_(min(max(default_timeout, min_timeout), max(max_timeout, min_timeout)))
+    , max_timeout_(max(max_timeout, min_timeout))
+    , timeout_(default_timeout_)
+    , cold_starts_avoided_(0)
+{
+}
+
+chrono::milliseconds IdlePolicy::timeout() const noexcept
+{
+    return timeout_;
+}
+
+void IdlePolicy::add_gap(chrono::milliseconds gap)
+{
+    if (gap > default_timeout_)
+    {
+        ++cold_starts_avoided_;
+    }
+    push_gap(gap);
+    update_timeout();
+}
+
+int IdlePolicy::num_gaps() const noexcept
+{
+    return gaps_.size();
+}
+
+int64_t IdlePolicy::cold_starts_avoided() const noexcept
+{
+    return cold_starts_avoided_;
+}
+
+void IdlePolicy::save(string const& path, chrono::system_clock::time_point last_activity) const
+{
+    auto const last_ms = chrono::duration_cast<chrono::milliseconds>(last_activity.time_since_epoch()).count();
+
+    ostringstream s;
+    s << HEADER << last_ms << ' ' << cold_starts_avoided_ << ' ' << gaps_.size();
+    for (auto const& gap : gaps_)
+    {
+        s << ' ' << gap.count();
+    }
+    s << '\n';
+    write_file(path, s.str());
+}
+
+bool IdlePolicy::load(string const& path)
+{
+    if (!boost::filesystem::exists(path))
+    {
+        return false;
+    }
+    string const contents = read_file(path);
+    if (contents.compare(0, HEADER.size(), HEADER) != 0)
+    {
+        return false;
+    }
+    istringstream s(contents.substr(HEADER.size()));
+
+    int64_t last_ms;
+    int64_t avoided;
+    size_t num_gaps;
+    if (!(s >> last_ms >> avoided >> num_gaps) || num_gaps > MAX_GAPS)
+    {
+        return false;
+    }
+    deque<chrono::milliseconds> gaps;
+    for (size_t i = 0; i < num_gaps; ++i)
+    {
+        int64_t gap;
+        if (!(s >> gap))
+        {
+            return false;
+        }
+        gaps.push_back(chrono::milliseconds(gap));
+    }
+
+    gaps_ = move(gaps);
+    cold_starts_avoided_ = avoided;
+
+    // We did not stay alive for the gap since the last activity, so it does not count as an avoided cold start.
+    auto const last_activity = chrono::system_clock::time_point(chrono::milliseconds(last_ms));
+    auto const gap = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now() - last_activity);
+    if (gap >= chrono::milliseconds(0))  // Clock may have been set back.
+    {
+        push_gap(gap);
+    }
+    update_timeout();
+    return true;
+}
+
+void IdlePolicy::push_gap(chrono::milliseconds gap)
+{
+    gaps_.push_back(max(gap, chrono::milliseconds(0)));
+    if (gaps_.size() > MAX_GAPS)
+    {
+        gaps_.pop_front();
+    }
+}
+
+void IdlePolicy::update_timeout()
+{
+    if (gaps_.size() < MIN_GAPS)
+    {
+        timeout_ = default_timeout_;
+        return;
+    }
+
+    vector<chrono::milliseconds> sorted(gaps_.begin(), gaps_.end());
+    sort(sorted.begin(), sorted.end());
+
+    // Allow some slack, so a gap that is a little longer than usual doesn't cause a cold start.
+    auto with_slack = [](chrono::milliseconds gap)
+    {
+        return gap + gap / 4;
+    };
+
+    if (with_slack(sorted[(sorted.size() - 1) / 2]) > max_timeout_)
+    {
+        // Most requests are one-offs; staying alive for longer would only tie up memory.
+        timeout_ = min_timeout_;
+        return;
+    }
+
+    // We cover as many gaps as we can, up to the percentile, without exceeding the maximum.
+    // The median gap fits, so this stops at the median at the latest.
+    size_t n = (sorted.size() * PERCENTILE + 99) / 100 - 1;
+    while (with_slack(sorted[n]) > max_timeout_)
+    {
+        --n;
+    }
+    timeout_ = max(with_slack(sorted[n]), min_timeout_);
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
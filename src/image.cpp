@@ -32,6 +32,7 @@
 #include <cmath>
 #include <memory>
 #include <stdexcept>
+#include <vector>
 
 using namespace std;
 using namespace unity::thumbnailer::internal;
@@ -239,9 +240,19 @@ void maybe_scale_thumbnail(GdkPixbufLoader* loader, int width, int height, void*
     }
 }
 
+// Passed to maybe_scale_image(), which records the size of the
+// image before it is scaled.
+struct LoadSize
+{
+    QSize requested;
+    QSize source;
+};
+
 void maybe_scale_image(GdkPixbufLoader* loader, int width, int height, void* user_data)
 {
-    QSize requested_size = *reinterpret_cast<QSize*>(user_data);
+    LoadSize* load_size = reinterpret_cast<LoadSize*>(user_data);
+    load_size->source = QSize(width, height);
+    QSize requested_size = load_size->requested;
 
     // If no size has been requested, then keep the original size.
     if (!requested_size.isValid())
@@ -270,6 +281,69 @@ void maybe_scale_image(GdkPixbufLoader* loader, int width, int height, void* use
     gdk_pixbuf_loader_set_size(loader, image_size.width(), image_size.height());
 }
 
+// Returns the dimensions of the main image as recorded in the EXIF data,
+// or an invalid size if they are not recorded.
+
+QSize exif_pixel_dimensions(ExifData* exif)
+{
+    ExifByteOrder order = exif_data_get_byte_order(exif);
+    auto get_dimension = [exif, order](ExifTag tag) -> int
+    {
+        ExifEntry* e = exif_data_get_entry(exif, tag);
+        if (!e)
+        {
+            return -1;
+        }
+        switch (e->format)
+        {
+            case EXIF_FORMAT_SHORT:
+                return int(exif_get_short(e->data, order));
+            case EXIF_FORMAT_LONG:
+                return int(exif_get_long(e->data, order));
+            default:
+                return -1;
+        }
+    };
+    int w = get_dimension(EXIF_TAG_PIXEL_X_DIMENSION);
+    int h = get_dimension(EXIF_TAG_PIXEL_Y_DIMENSION);
+    return w > 0 && h > 0 ? QSize(w, h) : QSize();
+}
+
+// Returns the orientation recorded in the EXIF data, or 1
+// (no rotation or mirroring) if there is none.
+
+int exif_orientation(ExifData* exif)
+{
+    ExifByteOrder order = exif_data_get_byte_order(exif);
+    ExifEntry* e = exif_data_get_entry(exif, EXIF_TAG_ORIENTATION);
+    if (e)
+    {
+        exif_entry_fix(e);
+        if (e->format == EXIF_FORMAT_SHORT)
+        {
+            return exif_get_short(e->data, order);
+        }
+    }
+    return 1;
+}
+
+// Returns true if the image must be rotated by 90 degrees,
+// which swaps its width and height.
+
+bool is_rotated(int orientation)
+{
+    switch (orientation)
+    {
+        case 5:  // Rotate 90 clockwise and horizontal mirror image
+        case 6:  // Rotate 90 clockwise
+        case 7:  // Rotate 90 anti-clockwise and horizontal mirror image
+        case 8:  // Rotate 90 anti-clockwise
+            return true;
+        default:
+            return false;
+    }
+}
+
 }  // namespace
 
 Image::Image(string const& data, QSize requested_size)
@@ -317,26 +391,10 @@ void Image::load(Reader& reader, QSize requested_size)
     if (exif)
     {
         // Record the image orientation, if it is available
-        ExifByteOrder order = exif_data_get_byte_order(exif.get());
-        ExifEntry* e = exif_data_get_entry(exif.get(), EXIF_TAG_ORIENTATION);
-        if (e)
+        orientation = exif_orientation(exif.get());
+        if (is_rotated(orientation))
         {
-            exif_entry_fix(e);
-            if (e->format == EXIF_FORMAT_SHORT)
-            {
-                orientation = exif_get_short(e->data, order);
-                switch (orientation)
-                {
-                    case 5:  // Rotate 90 clockwise and horizontal mirror image
-                    case 6:  // Rotate 90 clockwise
-                    case 7:  // Rotate 90 anti-clockwise and horizontal mirror image
-                    case 8:  // Rotate 90 anti-clockwise
-                        unrotated_requested_size.transpose();
-                        break;
-                    default:
-                        break;
-                }
-            }
+            unrotated_requested_size.transpose();
         }
 
         // If there is an embedded thumbnail and we want to resize the image, check if the pixbuf is appropriate.
@@ -354,16 +412,28 @@ void Image::load(Reader& reader, QSize requested_size)
         }
     }
 
-    if (!pixbuf_)
+    if (pixbuf_)
     {
-        pixbuf_ = load_image(reader, G_CALLBACK(maybe_scale_image), &unrotated_requested_size);
+        source_size_ = exif_pixel_dimensions(exif.get());
+    }
+    else
+    {
+        LoadSize load_size{unrotated_requested_size, QSize()};
+        pixbuf_ = load_image(reader, G_CALLBACK(maybe_scale_image), &load_size);
+        source_size_ = load_size.source;
     }
     // It would be nice to scan here to see whether there actually are any transparent pixels,
     // but doing that is too expensive. So, images that support alpha always end up being
     // returned as PNG files by jpeg_data_or_png().
     has_alpha_ = gdk_pixbuf_get_has_alpha(pixbuf_.get());
 
-    // Correct the image orientation, if needed
+    orient(orientation);
+}
+
+// Corrects the image orientation, if needed.
+
+void Image::orient(int orientation)
+{
     switch (orientation)
     {
         case 1:
@@ -385,19 +455,23 @@ void Image::load(Reader& reader, QSize requested_size)
             // Rotate 90 clockwise and horizontal mirror image
             pixbuf_.reset(gdk_pixbuf_rotate_simple(pixbuf_.get(), GDK_PIXBUF_ROTATE_CLOCKWISE));
             pixbuf_.reset(gdk_pixbuf_flip(pixbuf_.get(), true));
+            source_size_.transpose();
             break;
         case 6:
             // Rotate 90 clockwise
             pixbuf_.reset(gdk_pixbuf_rotate_simple(pixbuf_.get(), GDK_PIXBUF_ROTATE_CLOCKWISE));
+            source_size_.transpose();
             break;
         case 7:
             // Rotate 90 anti-clockwise and horizontal mirror image
             pixbuf_.reset(gdk_pixbuf_rotate_simple(pixbuf_.get(), GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE));
             pixbuf_.reset(gdk_pixbuf_flip(pixbuf_.get(), true));
+            source_size_.transpose();
             break;
         case 8:
             // Rotate 90 anti-clockwise
             pixbuf_.reset(gdk_pixbuf_rotate_simple(pixbuf_.get(), GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE));
+            source_size_.transpose();
             break;
         default:
             // Impossible, according the spec. Rather than throwing or some such,
@@ -430,6 +504,11 @@ int Image::height() const
     return h;
 }
 
+QSize Image::source_size() const
+{
+    return source_size_;
+}
+
 int Image::pixel(int x, int y) const
 {
     assert(gdk_pixbuf_get_colorspace(pixbuf_.get()) == GDK_COLORSPACE_RGB);
@@ -494,6 +573,7 @@ Image Image::scale(QSize requested_size) const
     {
         throw runtime_error("Image::scale(): could not create scaled image");  // LCOV_EXCL_LINE
     }
+    scaled.source_size_ = source_size_;
     return scaled;
 }
 
@@ -538,13 +618,36 @@ string Image::jpeg_data(int quality) const
 }
 
 string Image::png_data() const
+{
+    return png_data(map<string, string>());
+}
+
+string Image::png_data(map<string, string> const& text) const
 {
     assert(pixbuf_);
 
+    vector<string> keys{ "compression" };
+    vector<string> values{ "6" };
+    for (auto const& t : text)
+    {
+        keys.push_back("tEXt::" + t.first);
+        values.push_back(t.second);
+    }
+    vector<char*> option_keys;
+    vector<char*> option_values;
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        option_keys.push_back(const_cast<char*>(keys[i].c_str()));
+        option_values.push_back(const_cast<char*>(values[i].c_str()));
+    }
+    option_keys.push_back(nullptr);
+    option_values.push_back(nullptr);
+
     gchar* buf;
     gsize size;
     GError* err = nullptr;
-    if (!gdk_pixbuf_save_to_buffer(pixbuf_.get(), &buf, &size, "png", &err, "compression", "6", NULL))
+    if (!gdk_pixbuf_save_to_bufferv(pixbuf_.get(), &buf, &size, "png",
+                                    option_keys.data(), option_values.data(), &err))
     {
         // LCOV_EXCL_START
         string msg = string("Image::png_data(): cannot convert to png: ") + err->message;
@@ -557,4 +660,134 @@ string Image::png_data() const
     return s;
 }
 
+Image::Decoder::Decoder(QSize requested_size)
+    : loader_(gdk_pixbuf_loader_new())
+    , exif_loader_(exif_loader_new())
+    , requested_size_(requested_size)
+{
+    if (!loader_ || !exif_loader_)
+    {
+        // LCOV_EXCL_START
+        if (loader_)
+        {
+            gdk_pixbuf_loader_close(loader_, NULL);
+            g_object_unref(loader_);
+        }
+        if (exif_loader_)
+        {
+            exif_loader_unref(exif_loader_);
+        }
+        throw runtime_error("Image::Decoder(): cannot allocate loader");
+        // LCOV_EXCL_STOP
+    }
+    g_signal_connect(loader_, "size-prepared", G_CALLBACK(size_prepared), this);
+}
+
+Image::Decoder::~Decoder()
+{
+    if (!closed_)
+    {
+        gdk_pixbuf_loader_close(loader_, NULL);
+    }
+    g_object_unref(loader_);
+    if (exif_loader_)
+    {
+        exif_loader_unref(exif_loader_);
+    }
+}
+
+void Image::Decoder::write(char const* data, size_t length)
+{
+    if (closed_)
+    {
+        throw runtime_error("Image::Decoder::write(): decoder is closed");
+    }
+    auto const bytes = reinterpret_cast<unsigned char const*>(data);
+    // The EXIF loader tells us when it has seen all of the EXIF data,
+    // or that there isn't any.
+    if (exif_loader_ && !exif_loader_write(exif_loader_, const_cast<unsigned char*>(bytes), length))
+    {
+        read_exif();
+    }
+    GError* err = nullptr;
+    if (!gdk_pixbuf_loader_write(loader_, bytes, length, &err))
+    {
+        closed_ = true;  // The loader closes itself if it fails.
+        string msg = string("Image::Decoder::write(): cannot decode image: ") + err->message;
+        g_error_free(err);
+        throw runtime_error(msg);
+    }
+}
+
+bool Image::Decoder::prepared() const
+{
+    return prepared_;
+}
+
+Image Image::Decoder::finish()
+{
+    if (closed_)
+    {
+        throw runtime_error("Image::Decoder::finish(): decoder is closed");
+    }
+    read_exif();
+    closed_ = true;
+    GError* err = nullptr;
+    if (!gdk_pixbuf_loader_close(loader_, &err))
+    {
+        string msg = string("Image::Decoder::finish(): cannot decode image: ") + err->message;
+        g_error_free(err);
+        throw runtime_error(msg);
+    }
+    gobj_ptr<GdkPixbuf> pixbuf(gdk_pixbuf_loader_get_pixbuf(loader_));
+    if (!pixbuf)
+    {
+        throw runtime_error("Image::Decoder::finish(): cannot create pixbuf");  // LCOV_EXCL_LINE
+    }
+    // gdk_pixbuf_loader_get_pixbuf() returns a borrowed reference
+    g_object_ref(pixbuf.get());
+
+    Image image;
+    image.pixbuf_ = move(pixbuf);
+    image.has_alpha_ = gdk_pixbuf_get_has_alpha(image.pixbuf_.get());
+    image.source_size_ = source_size_;
+    image.orient(orientation_);
+    return image;
+}
+
+void Image::Decoder::size_prepared(GdkPixbufLoader* loader, int width, int height, void* user_data)
+{
+    Decoder* decoder = reinterpret_cast<Decoder*>(user_data);
+    decoder->prepared_ = true;
+
+    // In a JPEG file, the EXIF data precedes the image, so we know
+    // the orientation by now.
+    decoder->read_exif();
+    LoadSize load_size{decoder->requested_size_, QSize()};
+    if (is_rotated(decoder->orientation_))
+    {
+        load_size.requested.transpose();
+    }
+    maybe_scale_image(loader, width, height, &load_size);
+    decoder->source_size_ = load_size.source;
+}
+
+// Records the orientation from the EXIF data that has arrived so far,
+// and stops looking for EXIF data.
+
+void Image::Decoder::read_exif()
+{
+    if (!exif_loader_)
+    {
+        return;
+    }
+    ExifDataPtr exif(exif_loader_get_data(exif_loader_), do_exif_data_unref);
+    if (exif)
+    {
+        orientation_ = exif_orientation(exif.get());
+    }
+    exif_loader_unref(exif_loader_);
+    exif_loader_ = nullptr;
+}
+
 #pragma GCC diagnostic pop
@@ -177,6 +177,18 @@ void ImageExtractor::timeout()
              to_string(timeout_ms_) + " milliseconds";
 }
 
+bool ImageExtractor::cancel()
+{
+    if (process_.state() == QProcess::NotRunning)
+    {
+        return false;
+    }
+    timer_.stop();
+    process_.kill();
+    error_ = "extraction cancelled for " + filename_;
+    return true;
+}
+
 void ImageExtractor::error()
 {
     if (process_.error() == QProcess::ProcessError::FailedToStart)
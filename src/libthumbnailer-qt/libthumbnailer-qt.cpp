@@ -28,6 +28,7 @@
 #include <boost/filesystem.hpp>
 #include <QSharedPointer>
 
+#include <atomic>
 #include <memory>
 
 namespace unity
@@ -44,6 +45,23 @@ namespace internal
 
 class ThumbnailerImpl;
 
+// A job sends a request with the id by which the service can cancel it.
+typedef std::function<QDBusPendingReply<QByteArray>(QString const& request_id)> RequestJob;
+
+namespace
+{
+
+// Returns a new id for a request. The service tells the requests of a bus
+// connection apart by their id, and a connection can be shared by several
+// Thumbnailer instances, so the ids are unique within the process.
+QString new_request_id()
+{
+    static std::atomic<unsigned long long> last_id(0);
+    return QString::number(++last_id);
+}
+
+}  // namespace
+
 class RequestImpl : public QObject
 {
     Q_OBJECT
@@ -51,7 +69,7 @@ public:
     RequestImpl(QString const& details,
                 QSize const& requested_size,
                 ThumbnailerImpl* thumbnailer,
-                std::function<QDBusPendingReply<QByteArray>()> const& job,
+                RequestJob const& job,
                 bool trace_client);
 
     ~RequestImpl();
@@ -99,8 +117,9 @@ private:
     QString details_;
     QSize requested_size_;
     ThumbnailerImpl* thumbnailer_;
-    std::function<QDBusPendingReply<QByteArray>()> job_;
+    RequestJob job_;
     std::function<void()> send_request_;
+    QString request_id_;
 
     std::unique_ptr<QDBusPendingCallWatcher> watcher_;
     RateLimiter::CancelFunc cancel_func_;
@@ -128,11 +147,12 @@ public:
 
     RateLimiter& limiter();
     Q_INVOKABLE void pump_limiter();
+    void cancelOnServer(QString const& request_id);
 
 private:
     QSharedPointer<Request> createRequest(QString const& details,
                                           QSize const& requested_size,
-                                          std::function<QDBusPendingReply<QByteArray>()> const& job);
+                                          RequestJob const& job);
     std::unique_ptr<ThumbnailerInterface> iface_;
     bool trace_client_;
     std::unique_ptr<RateLimiter> limiter_;
@@ -141,7 +161,7 @@ private:
 RequestImpl::RequestImpl(QString const& details,
                          QSize const& requested_size,
                          ThumbnailerImpl* thumbnailer,
-                         std::function<QDBusPendingReply<QByteArray>()> const& job,
+                         RequestJob const& job,
                          bool trace_client)
     : details_(details)
     , requested_size_(requested_size)
@@ -166,7 +186,8 @@ RequestImpl::RequestImpl(QString const& details,
     // without exceeding max_backlog().
     send_request_ = [this]
     {
-        watcher_.reset(new QDBusPendingCallWatcher(job_()));
+        request_id_ = new_request_id();
+        watcher_.reset(new QDBusPendingCallWatcher(job_(request_id_)));
         connect(watcher_.get(), &QDBusPendingCallWatcher::finished, this, &RequestImpl::dbusCallFinished);
     };
     cancel_func_ = thumbnailer_->limiter().schedule(send_request_);
@@ -191,6 +212,10 @@ RequestImpl::~RequestImpl()
         // a chance to destroy the next request.
         QMetaObject::invokeMethod(thumbnailer_, "pump_limiter", Qt::QueuedConnection);
         disconnect();
+        if (!finished_)
+        {
+            thumbnailer_->cancelOnServer(request_id_);  // Nobody is going to look at the result.
+        }
     }
 }
 
@@ -295,6 +320,12 @@ void RequestImpl::cancel()
         // because that would schedule the next request in the queue.
         QMetaObject::invokeMethod(this, "dbusCallFinished", Qt::QueuedConnection);
     }
+    else
+    {
+        // The request is with the service already. We still wait for the reply,
+        // but the service stops working on the request and replies sooner.
+        thumbnailer_->cancelOnServer(request_id_);
+    }
 }
 
 void RequestImpl::waitForFinished()
@@ -358,9 +389,9 @@ QSharedPointer<Request> ThumbnailerImpl::getAlbumArt(QString const& artist,
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getAlbumArt: (" << requestedSize.width() << "," << requestedSize.height()
       << ") \"" << artist << "\", \"" << album << "\"";
-    auto job = [this, artist, album, requestedSize]
+    auto job = [this, artist, album, requestedSize](QString const& request_id)
     {
-        return iface_->GetAlbumArt(artist, album, requestedSize);
+        return iface_->GetAlbumArt(artist, album, requestedSize, request_id);
     };
     return createRequest(details, requestedSize, job);
 }
@@ -373,9 +404,9 @@ QSharedPointer<Request> ThumbnailerImpl::getArtistArt(QString const& artist,
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getArtistArt: (" << requestedSize.width() << "," << requestedSize.height()
       << ") \"" << artist << "\", \"" << album << "\"";
-    auto job = [this, artist, album, requestedSize]
+    auto job = [this, artist, album, requestedSize](QString const& request_id)
     {
-        return iface_->GetArtistArt(artist, album, requestedSize);
+        return iface_->GetArtistArt(artist, album, requestedSize, request_id);
     };
     return createRequest(details, requestedSize, job);
 }
@@ -385,7 +416,7 @@ QSharedPointer<Request> ThumbnailerImpl::getThumbnail(QString const& filename, Q
     QString details;
     QTextStream s(&details, QIODevice::WriteOnly);
     s << "getThumbnail: (" << requestedSize.width() << "," << requestedSize.height() << ") " << filename;
-    auto job = [this, filename, requestedSize]
+    auto job = [this, filename, requestedSize](QString const& request_id)
     {
         // Remote end requires an absolute path.
         QString canonical_name = filename;
@@ -397,14 +428,14 @@ QSharedPointer<Request> ThumbnailerImpl::getThumbnail(QString const& filename, Q
         {
             // If name can't be canonicalised, errors will be dealt with on the server side.
         }
-        return iface_->GetThumbnail(canonical_name, requestedSize);
+        return iface_->GetThumbnail(canonical_name, requestedSize, request_id);
     };
     return createRequest(details, requestedSize, job);
 }
 
 QSharedPointer<Request> ThumbnailerImpl::createRequest(QString const& details,
                                                        QSize const& requested_size,
-                                                       std::function<QDBusPendingReply<QByteArray>()> const& job)
+                                                       RequestJob const& job)
 {
     if (trace_client_)
     {
@@ -430,6 +461,13 @@ void ThumbnailerImpl::pump_limiter()
     return limiter_->done();
 }
 
+void ThumbnailerImpl::cancelOnServer(QString const& request_id)
+{
+    // We don't wait for the reply. A service that predates Cancel() returns
+    // an error, which does no harm because the request simply runs to completion.
+    iface_->Cancel(request_id);
+}
+
 }  // namespace internal
 
 Request::Request(internal::RequestImpl* impl)
@@ -377,6 +377,13 @@ unique_ptr<ArtExtractor> make_extractor(string const& filename, TagLib::FileRef
 }  // namespace
 
 string extract_local_album_art(string const& filename)
+{
+    string artist;
+    string album;
+    return extract_local_album_art(filename, artist, album);
+}
+
+string extract_local_album_art(string const& filename, string& artist, string& album)
 {
     TagLib::FileRef fileref(filename.c_str(), false, TagLib::AudioProperties::Fast);
     if (fileref.isNull())
@@ -385,6 +392,9 @@ string extract_local_album_art(string const& filename)
         throw runtime_error(filename + ": cannot create TagLib::FileRef");
     }
 
+    auto const tag = fileref.tag();
+    artist = tag ? tag->artist().to8Bit(true) : "";
+    album = tag ? tag->album().to8Bit(true) : "";
     return make_extractor(filename, fileref)->get_album_art();
 }
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/locality_predictor.h>
+
+#include <cassert>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+LocalityPredictor::LocalityPredictor(int threshold, chrono::milliseconds window, int stride)
+    : threshold_(threshold)
+    , window_(window)
+    , stride_(stride)
+    , run_length_(0)
+{
+    assert(threshold > 0);
+    assert(stride > 0);
+}
+
+LocalityPredictor::~LocalityPredictor() = default;
+
+bool LocalityPredictor::predict(string const& path, QSize const& size)
+{
+    auto const slash = path.rfind('/');
+    string const dir = slash == string::npos ? string() : path.substr(0, slash);
+    auto const now = chrono::steady_clock::now();
+    if (dir == dir_ && size == size_ && now - last_request_ <= window_)
+    {
+        ++run_length_;
+    }
+    else
+    {
+        dir_ = dir;
+        size_ = size;
+        run_length_ = 1;
+    }
+    last_request_ = now;
+
+    return run_length_ >= threshold_ && (run_length_ - threshold_) % stride_ == 0;
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
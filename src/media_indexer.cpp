@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/media_indexer.h>
+
+#include <internal/env_vars.h>
+#include <internal/file_io.h>
+#include <internal/thread_priority.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <QDebug>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+string const STATE_HEADER = "thumbnailer-index 2\n";
+
+// How often the cursor is saved while indexing, so a crash costs little work.
+int const SAVE_INTERVAL = 50;
+
+// Indexing finishes once the thumbnail cache is this full.
+double const MAX_CACHE_FILL = 0.9;
+
+// How long we wait before looking at the power supply again.
+chrono::seconds const POWER_CHECK_INTERVAL(10);
+
+namespace fs = boost::filesystem;
+
+bool is_hidden(fs::path const& path)
+{
+    auto const name = path.filename().native();
+    return !name.empty() && name[0] == '.';
+}
+
+bool is_below(string const& path, string const& dir)
+{
+    return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 && path[dir.size()] == '/';
+}
+
+// Calls visit for each regular file below dir, in the order of fs::path,
+// which compares paths element by element. Hidden files and directories
+// and symbolic links are skipped, as are the files up to and including
+// cursor. Returns false as soon as visit returns false.
+
+bool walk(string const& dir, string const& cursor, function<bool(string const&)> const& visit)
+{
+    vector<fs::path> entries;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        if (!is_hidden(it->path()))
+        {
+            entries.push_back(it->path());
+        }
+    }
+    sort(entries.begin(), entries.end());
+
+    for (auto const& entry : entries)
+    {
+        auto const status = fs::symlink_status(entry, ec);
+        if (ec)
+        {
+            continue;  // LCOV_EXCL_LINE
+        }
+        auto const path = entry.native();
+        bool const done = !cursor.empty() && entry <= fs::path(cursor);
+        if (fs::is_directory(status))
+        {
+            // Everything below a directory that comes before the cursor is done,
+            // unless the cursor is below that directory.
+            if ((!done || is_below(cursor, path)) && !walk(path, cursor, visit))
+            {
+                return false;
+            }
+        }
+        else if (fs::is_regular_file(status) && !done && !visit(path))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Describes what the indexer covers, such as "128x128,256x256:/home/user/Pictures:/home/user/Videos".
+
+string make_config(vector<string> const& roots, vector<QSize> const& sizes)
+{
+    string config;
+    for (auto const& size : sizes)
+    {
+        config += (config.empty() ? "" : ",") + to_string(size.width()) + "x" + to_string(size.height());
+    }
+    for (auto const& root : roots)
+    {
+        config += ":" + root;
+    }
+    return config;
+}
+
+string trimmed_file(string const& path)
+{
+    try
+    {
+        return boost::trim_copy(read_file(path));
+    }
+    catch (std::exception const&)
+    {
+        return "";
+    }
+}
+
+}  // namespace
+
+bool on_battery_power()
+{
+    char const* dir = getenv(POWER_SUPPLY_DIR);
+    string const supply_dir = dir && *dir ? dir : "/sys/class/power_supply";
+
+    bool have_battery = false;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(supply_dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        auto const supply = it->path().native();
+        auto const type = trimmed_file(supply + "/type");
+        if (type == "Battery")
+        {
+            have_battery = true;
+            auto const status = trimmed_file(supply + "/status");
+            if (status == "Charging" || status == "Full")
+            {
+                return false;
+            }
+        }
+        else if (trimmed_file(supply + "/online") == "1")
+        {
+            return false;  // Mains or USB power.
+        }
+    }
+    return have_battery;
+}
+
+MediaIndexer::MediaIndexer(Thumbnailer& thumbnailer,
+                           vector<string> const& roots,
+                           vector<QSize> const& sizes,
+                           string const& state_path,
+                           function<void()> const& finished,
+                           function<void()> const& pause_changed)
+    : thumbnailer_(thumbnailer)
+    , roots_(roots)
+    , sizes_(sizes)
+    , state_path_(state_path)
+    , finished_(finished)
+    , pause_changed_(pause_changed)
+    , config_(make_config(roots, sizes))
+    , stop_(false)
+    , saved_state_(State::stopped)
+{
+    string contents;
+    try
+    {
+        if (fs::exists(state_path_))
+        {
+            contents = read_file(state_path_);
+        }
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "MediaIndexer(): cannot read state:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+    if (contents.compare(0, STATE_HEADER.size(), STATE_HEADER) != 0)
+    {
+        return;
+    }
+    auto const state_end = contents.find('\n', STATE_HEADER.size());
+    auto const config_end = state_end == string::npos ? string::npos : contents.find('\n', state_end + 1);
+    if (config_end == string::npos)
+    {
+        return;
+    }
+    auto const state = contents.substr(STATE_HEADER.size(), state_end - STATE_HEADER.size());
+    if (state == "running")
+    {
+        saved_state_ = State::running;
+    }
+    else if (state == "complete")
+    {
+        saved_state_ = State::complete;
+    }
+    saved_config_ = contents.substr(state_end + 1, config_end - state_end - 1);
+    cursor_ = contents.substr(config_end + 1);
+}
+
+MediaIndexer::~MediaIndexer()
+{
+    // If we are still running, the next instance continues where we stopped.
+    if (halt())
+    {
+        save_state(State::running);
+    }
+}
+
+void MediaIndexer::start()
+{
+    if (running())
+    {
+        return;
+    }
+    if (thread_.joinable())
+    {
+        thread_.join();  // Previous run finished by itself.
+    }
+    lock_guard<mutex> lock(mutex_);
+    if (saved_state_ == State::complete)
+    {
+        cursor_.clear();
+    }
+    running_ = true;
+    paused_ = false;
+    cache_full_ = false;
+    files_indexed_ = 0;
+    thumbnails_ = 0;
+    busy_time_ = chrono::steady_clock::duration::zero();
+    stop_ = false;
+    next_power_check_ = chrono::steady_clock::time_point();
+    thread_ = thread(&MediaIndexer::run, this);
+}
+
+void MediaIndexer::stop()
+{
+    if (halt())
+    {
+        save_state(State::stopped);
+    }
+}
+
+// Stops the indexing thread. Returns true if it was still running.
+
+bool MediaIndexer::halt()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+    lock_guard<mutex> lock(mutex_);
+    bool const was_running = running_;
+    running_ = false;
+    paused_ = false;
+    return was_running;
+}
+
+bool MediaIndexer::running() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return running_;
+}
+
+bool MediaIndexer::paused() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return paused_;
+}
+
+bool MediaIndexer::interrupted() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return saved_state_ == State::running;
+}
+
+// Clearing the caches, or deleting them while the service isn't running,
+// leaves the thumbnail cache empty. We don't know what happened to it
+// otherwise, but neither does a new run, which would redo every file.
+
+bool MediaIndexer::up_to_date() const
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (running_ || saved_state_ != State::complete || saved_config_ != config_)
+        {
+            return false;
+        }
+    }
+    return thumbnailer_.stats().thumbnail_stats.size_in_bytes() != 0;
+}
+
+map<string, int64_t> MediaIndexer::counters() const
+{
+    lock_guard<mutex> lock(mutex_);
+    auto const busy_ms = chrono::duration_cast<chrono::milliseconds>(busy_time_).count();
+    auto per_minute = [busy_ms](int64_t n)
+    {
+        return busy_ms == 0 ? int64_t(0) : n * 60000 / busy_ms;
+    };
+    return map<string, int64_t>
+    {
+        { "index.running", running_ },
+        { "index.paused", paused_ },
+        { "index.cache_full", cache_full_ },
+        { "index.files_total", files_total_ },
+        { "index.files_done", files_done_ },
+        { "index.coverage_percent", files_total_ == 0 ? 0 : files_done_ * 100 / files_total_ },
+        { "index.thumbnails", thumbnails_ },
+        { "index.files_per_minute", per_minute(files_indexed_) },
+        { "index.thumbnails_per_minute", per_minute(thumbnails_) }
+    };
+}
+
+void MediaIndexer::run()
+{
+    lower_thread_priority();
+
+    string cursor;
+    {
+        lock_guard<mutex> lock(mutex_);
+        cursor = cursor_;
+    }
+    save_state(State::running);
+
+    // The root that the cursor is in. The roots before it are done. If the cursor
+    // is in none of them, the roots have changed since, and we start afresh.
+    size_t cursor_root = 0;
+    while (cursor_root < roots_.size() && !is_below(cursor, roots_[cursor_root]))
+    {
+        ++cursor_root;
+    }
+    if (cursor_root == roots_.size())
+    {
+        cursor.clear();
+        cursor_root = 0;
+    }
+
+    // Count the files, so we can tell how far along we are.
+    int64_t total = 0;
+    int64_t done = 0;
+    for (size_t i = 0; i < roots_.size() && !stop_; ++i)
+    {
+        walk(roots_[i], "", [&](string const& path)
+        {
+            ++total;
+            if (i < cursor_root || (i == cursor_root && !cursor.empty() && fs::path(path) <= fs::path(cursor)))
+            {
+                ++done;
+            }
+            return !stop_;
+        });
+    }
+    {
+        lock_guard<mutex> lock(mutex_);
+        files_total_ = total;
+        files_done_ = done;
+    }
+
+    int since_save = 0;
+    auto index_file = [&](string const& path)
+    {
+        if (!wait_until_idle())
+        {
+            return false;
+        }
+        auto const cache_stats = thumbnailer_.stats().thumbnail_stats;
+        if (cache_stats.size_in_bytes() >= MAX_CACHE_FILL * cache_stats.max_size_in_bytes())
+        {
+            lock_guard<mutex> lock(mutex_);
+            cache_full_ = true;
+            return false;
+        }
+
+        auto const start_time = chrono::steady_clock::now();
+        int const made = thumbnailer_.generate_thumbnails(path, sizes_, stop_);
+        if (stop_)
+        {
+            return false;  // The file may not be complete, so we do it again next time.
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            busy_time_ += chrono::steady_clock::now() - start_time;
+            cursor_ = path;
+            ++files_done_;
+            ++files_indexed_;
+            thumbnails_ += made;
+        }
+        if (++since_save == SAVE_INTERVAL)
+        {
+            since_save = 0;
+            save_state(State::running);
+        }
+        return true;
+    };
+
+    bool completed = true;
+    for (size_t i = cursor_root; i < roots_.size() && completed; ++i)
+    {
+        completed = walk(roots_[i], i == cursor_root ? cursor : "", index_file);
+    }
+
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (stop_)
+        {
+            return;  // stop() or the destructor saves the state.
+        }
+        running_ = false;
+        paused_ = false;
+    }
+    // If the cache is full, we keep our place, so we can continue once there is room.
+    save_state(completed ? State::complete : State::stopped);
+    if (finished_)
+    {
+        finished_();
+    }
+}
+
+// Waits while the device runs on battery. Returns false if we are told to stop.
+
+bool MediaIndexer::wait_until_idle()
+{
+    unique_lock<mutex> lock(mutex_);
+    for (;;)
+    {
+        if (stop_)
+        {
+            return false;
+        }
+        auto const now = chrono::steady_clock::now();
+        if (now >= next_power_check_)
+        {
+            lock.unlock();
+            bool const battery = on_battery_power();
+            lock.lock();
+            bool const changed = paused_ != battery;
+            paused_ = battery;
+            next_power_check_ = now + POWER_CHECK_INTERVAL;
+            if (changed && pause_changed_)
+            {
+                lock.unlock();
+                pause_changed_();
+                lock.lock();
+                continue;  // We may have been told to stop in the mean time.
+            }
+        }
+        if (!paused_)
+        {
+            return true;
+        }
+        cond_.wait_until(lock, next_power_check_, [this]{ return bool(stop_); });
+    }
+}
+
+void MediaIndexer::save_state(State state)
+{
+    string contents = STATE_HEADER;
+    {
+        lock_guard<mutex> lock(mutex_);
+        saved_state_ = state;
+        saved_config_ = config_;
+        contents += state == State::running ? "running" : state == State::complete ? "complete" : "stopped";
+        contents += '\n';
+        contents += config_;
+        contents += '\n';
+        contents += cursor_;
+    }
+    try
+    {
+        write_file(state_path_, contents);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "MediaIndexer::save_state(): cannot save state:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/media_watcher.h>
+
+#include <internal/safe_strerror.h>
+
+#include <boost/filesystem.hpp>
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
+#include <QDebug>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// A file is complete once it is closed after writing, or once it is moved
+// into place, which is how most applications save and copy files.
+uint32_t const WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR;
+
+// Each watch costs kernel memory, and the per-user limit on watches is shared
+// with the file information cache, so we don't watch huge trees completely.
+int const MAX_WATCHED_DIRS = 1000;
+
+bool is_hidden(boost::filesystem::path const& path)
+{
+    auto const name = path.filename().native();
+    return !name.empty() && name[0] == '.';
+}
+
+}  // namespace
+
+MediaWatcher::MediaWatcher(vector<string> const& dirs, NewFileFunc const& new_file)
+    : new_file_(new_file)
+    , watch_count_(0)
+    , inotify_fd_(::close)
+    , stop_read_fd_(::close)
+    , stop_write_fd_(::close)
+{
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (fd == -1)
+    {
+        // LCOV_EXCL_START
+        qWarning().nospace() << "MediaWatcher(): cannot initialize inotify: "
+                             << QString::fromStdString(safe_strerror(errno)) << " (not watching for new media)";
+        return;
+        // LCOV_EXCL_STOP
+    }
+    inotify_fd_.reset(fd);
+
+    int pipe_fd[2];
+    if (pipe2(pipe_fd, O_CLOEXEC) == -1)
+    {
+        // LCOV_EXCL_START
+        qWarning().nospace() << "MediaWatcher(): cannot create pipe: "
+                             << QString::fromStdString(safe_strerror(errno)) << " (not watching for new media)";
+        inotify_fd_.dealloc();
+        return;
+        // LCOV_EXCL_STOP
+    }
+    stop_read_fd_.reset(pipe_fd[0]);
+    stop_write_fd_.reset(pipe_fd[1]);
+
+    // The files that exist already are not new.
+    for (auto const& dir : dirs)
+    {
+        watch_tree(dir, false);
+    }
+    reader_ = thread(&MediaWatcher::read_events, this);
+}
+
+MediaWatcher::~MediaWatcher()
+{
+    if (reader_.joinable())
+    {
+        stop_write_fd_.dealloc();  // read_events() sees EOF on the pipe and returns.
+        reader_.join();
+    }
+}
+
+vector<string> MediaWatcher::default_directories()
+{
+    vector<string> dirs;
+    for (auto type : { G_USER_DIRECTORY_PICTURES, G_USER_DIRECTORY_VIDEOS, G_USER_DIRECTORY_MUSIC })
+    {
+        char const* dir = g_get_user_special_dir(type);
+        if (dir)
+        {
+            dirs.push_back(dir);
+        }
+    }
+    dirs.push_back(string(g_get_home_dir()) + "/DCIM");
+    return dirs;
+}
+
+int MediaWatcher::watched_directories() const
+{
+    return watch_count_;
+}
+
+// Watches dir and the directories below it. If report_files is set, the files
+// in the tree are reported, because they were created before we were watching.
+
+void MediaWatcher::watch_tree(string const& dir, bool report_files)
+{
+    namespace fs = boost::filesystem;
+
+    auto watch = [this](string const& d)
+    {
+        if (int(watched_dirs_.size()) >= MAX_WATCHED_DIRS)
+        {
+            return false;
+        }
+        int wd = inotify_add_watch(inotify_fd_.get(), d.c_str(), WATCH_MASK);
+        if (wd == -1)
+        {
+            return false;  // Directory doesn't exist or we have run out of watches.
+        }
+        watched_dirs_[wd] = d;
+        watch_count_ = watched_dirs_.size();
+        return true;
+    };
+
+    if (!watch(dir))
+    {
+        return;
+    }
+    boost::system::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        auto const status = it->symlink_status(ec);
+        if (ec || is_hidden(it->path()))
+        {
+            if (fs::is_directory(status))
+            {
+                it.no_push();
+            }
+            ec.clear();
+            continue;
+        }
+        if (fs::is_directory(status))
+        {
+            if (!watch(it->path().native()))
+            {
+                it.no_push();
+            }
+        }
+        else if (report_files && fs::is_regular_file(status))
+        {
+            new_file_(it->path().native());
+        }
+    }
+}
+
+void MediaWatcher::read_events()
+{
+    pollfd fds[2] = { { inotify_fd_.get(), POLLIN, 0 }, { stop_read_fd_.get(), POLLIN, 0 } };
+    alignas(inotify_event) char buf[16 * 1024];
+    for (;;)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;  // LCOV_EXCL_LINE
+            }
+            // LCOV_EXCL_START
+            qWarning().nospace() << "MediaWatcher::read_events(): poll failed: "
+                                 << QString::fromStdString(safe_strerror(errno));
+            return;
+            // LCOV_EXCL_STOP
+        }
+        if (fds[1].revents != 0)
+        {
+            return;  // Destructor closed the write end of the pipe.
+        }
+
+        ssize_t len;
+        while ((len = read(inotify_fd_.get(), buf, sizeof(buf))) > 0)
+        {
+            for (char* p = buf; p < buf + len; )
+            {
+                auto const event = reinterpret_cast<inotify_event const*>(p);
+                p += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    // LCOV_EXCL_START
+                    qWarning() << "MediaWatcher::read_events(): inotify queue overflow, some new files were missed";
+                    continue;
+                    // LCOV_EXCL_STOP
+                }
+                auto it = watched_dirs_.find(event->wd);
+                if (it == watched_dirs_.end())
+                {
+                    continue;  // LCOV_EXCL_LINE
+                }
+                if (event->mask & IN_IGNORED)
+                {
+                    watched_dirs_.erase(it);  // Directory was removed.
+                    watch_count_ = watched_dirs_.size();
+                    continue;
+                }
+                if (event->len == 0 || event->name[0] == '.')
+                {
+                    continue;
+                }
+                string const path = it->second + "/" + event->name;
+                if (event->mask & IN_ISDIR)
+                {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    {
+                        watch_tree(path, true);
+                    }
+                }
+                else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                {
+                    new_file_(path);
+                }
+            }
+        }
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
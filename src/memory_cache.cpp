@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/memory_cache.h>
+
+#include <cassert>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Rough cost of the list node, the hash table node, and the QByteArray header for each entry.
+int64_t const ENTRY_OVERHEAD = 128;
+
+int64_t entry_size(string const& key, QByteArray const& value)
+{
+    // The key is stored twice, once in the list and once in the index.
+    return 2 * int64_t(key.size()) + value.size() + ENTRY_OVERHEAD;
+}
+
+}  // namespace
+
+struct MemoryCache::Shard
+{
+    typedef list<pair<string, QByteArray>> EntryList;  // Most-recently used entry at the front.
+
+    mutex mutex_;
+    EntryList entries;
+    unordered_map<string, EntryList::iterator> index;
+    int64_t max_size_in_bytes = 0;
+    int64_t size_in_bytes = 0;
+    int64_t hits = 0;
+    int64_t misses = 0;
+    int64_t evictions = 0;
+};
+
+MemoryCache::MemoryCache(int64_t max_size_in_bytes, int num_shards)
+    : max_size_in_bytes_(max_size_in_bytes)
+{
+    assert(max_size_in_bytes >= 0);
+    assert(num_shards > 0);
+
+    for (int i = 0; i < num_shards; ++i)
+    {
+        unique_ptr<Shard> s(new Shard);
+        s->max_size_in_bytes = max_size_in_bytes / num_shards;
+        shards_.push_back(move(s));
+    }
+}
+
+MemoryCache::~MemoryCache() = default;
+
+QByteArray MemoryCache::get(string const& key)
+{
+    auto& s = shard_for(key);
+    lock_guard<mutex> lock(s.mutex_);
+
+    auto it = s.index.find(key);
+    if (it == s.index.end())
+    {
+        ++s.misses;
+        return QByteArray();
+    }
+    ++s.hits;
+    s.entries.splice(s.entries.begin(), s.entries, it->second);
+    return it->second->second;
+}
+
+void MemoryCache::put(string const& key, QByteArray const& value)
+{
+    auto& s = shard_for(key);
+    auto const size = entry_size(key, value);
+    if (size > s.max_size_in_bytes)
+    {
+        return;
+    }
+
+    lock_guard<mutex> lock(s.mutex_);
+
+    auto it = s.index.find(key);
+    if (it != s.index.end())
+    {
+        s.size_in_bytes -= entry_size(key, it->second->second);
+        s.entries.erase(it->second);
+        s.index.erase(it);
+    }
+    while (s.size_in_bytes + size > s.max_size_in_bytes)
+    {
+        assert(!s.entries.empty());
+        auto const& victim = s.entries.back();
+        s.size_in_bytes -= entry_size(victim.first, victim.second);
+        s.index.erase(victim.first);
+        s.entries.pop_back();
+        ++s.evictions;
+    }
+    s.entries.emplace_front(key, value);
+    s.index.emplace(key, s.entries.begin());
+    s.size_in_bytes += size;
+}
+
+bool MemoryCache::preload(string const& key, QByteArray const& value)
+{
+    auto& s = shard_for(key);
+    auto const size = entry_size(key, value);
+
+    lock_guard<mutex> lock(s.mutex_);
+
+    if (s.size_in_bytes + size > s.max_size_in_bytes || s.index.find(key) != s.index.end())
+    {
+        return false;
+    }
+    s.entries.emplace_back(key, value);
+    s.index.emplace(key, prev(s.entries.end()));
+    s.size_in_bytes += size;
+    return true;
+}
+
+vector<string> MemoryCache::hot_keys(size_t max_keys) const
+{
+    // We don't track recency across shards, so we take the most recently used
+    // entry of each shard in turn. Keys are spread evenly over the shards,
+    // so this is close to the true order.
+    vector<vector<string>> shard_keys;
+    for (auto const& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex_);
+        vector<string> keys;
+        for (auto it = s->entries.begin(); it != s->entries.end() && keys.size() < max_keys; ++it)
+        {
+            keys.push_back(it->first);
+        }
+        shard_keys.push_back(move(keys));
+    }
+
+    vector<string> keys;
+    for (size_t i = 0; keys.size() < max_keys; ++i)
+    {
+        bool found = false;
+        for (auto& sk : shard_keys)
+        {
+            if (i < sk.size() && keys.size() < max_keys)
+            {
+                keys.push_back(move(sk[i]));
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            break;
+        }
+    }
+    return keys;
+}
+
+void MemoryCache::invalidate()
+{
+    for (auto& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex_);
+        s->index.clear();
+        s->entries.clear();
+        s->size_in_bytes = 0;
+    }
+}
+
+MemoryCache::Stats MemoryCache::stats() const
+{
+    Stats st{0, 0, max_size_in_bytes_, 0, 0, 0};
+    for (auto const& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex_);
+        st.size += s->index.size();
+        st.size_in_bytes += s->size_in_bytes;
+        st.hits += s->hits;
+        st.misses += s->misses;
+        st.evictions += s->evictions;
+    }
+    return st;
+}
+
+void MemoryCache::clear_stats()
+{
+    for (auto& s : shards_)
+    {
+        lock_guard<mutex> lock(s->mutex_);
+        s->hits = 0;
+        s->misses = 0;
+        s->evictions = 0;
+    }
+}
+
+MemoryCache::Shard& MemoryCache::shard_for(string const& key) const
+{
+    return *shards_[hash<string>()(key) % shards_.size()];
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
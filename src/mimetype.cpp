@@ -19,6 +19,7 @@
 #include <internal/mimetype.h>
 
 #include <internal/gobj_memory.h>
+#include <internal/raii.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -27,6 +28,9 @@
 #pragma GCC diagnostic pop
 
 #include <cassert>
+#include <cstring>
+
+#include <fcntl.h>
 
 using namespace std;
 
@@ -39,8 +43,240 @@ namespace thumbnailer
 namespace internal
 {
 
+namespace
+{
+
+bool has(string const& head, size_t offset, char const* signature, size_t len)
+{
+    return head.size() >= offset + len && memcmp(head.data() + offset, signature, len) == 0;
+}
+
+template<size_t N>
+bool has(string const& head, size_t offset, char const (&signature)[N])
+{
+    return has(head, offset, signature, N - 1);
+}
+
+unsigned char byte(string const& head, size_t offset)
+{
+    return static_cast<unsigned char>(head[offset]);
+}
+
+// MPEG audio without an ID3 tag starts with the header of the first frame.
+
+bool is_mpeg_audio_frame(string const& head)
+{
+    if (head.size() < 4 || byte(head, 0) != 0xFF || (byte(head, 1) & 0xE0) != 0xE0)
+    {
+        return false;
+    }
+    int const version = (byte(head, 1) >> 3) & 0x3;
+    int const layer = (byte(head, 1) >> 1) & 0x3;
+    int const bitrate = byte(head, 2) >> 4;
+    int const sample_rate = (byte(head, 2) >> 2) & 0x3;
+    // Layer 0 is AAC in an ADTS stream, which GIO calls something else.
+    return version != 1 && layer != 0 && bitrate != 0xF && sample_rate != 0x3;
+}
+
+// Ogg streams start with the header packet of the first logical stream,
+// which tells us the codec.
+
+string sniff_ogg(string const& head)
+{
+    size_t const packet = 28;
+    if (has(head, packet, "\x01vorbis"))
+    {
+        return "audio/x-vorbis+ogg";
+    }
+    if (has(head, packet, "OpusHead"))
+    {
+        return "audio/x-opus+ogg";
+    }
+    if (has(head, packet, "Speex   "))
+    {
+        return "audio/x-speex+ogg";
+    }
+    if (has(head, packet, "\x7f" "FLAC"))
+    {
+        return "audio/x-flac+ogg";
+    }
+    if (has(head, packet, "\x80theora"))
+    {
+        return "video/x-theora+ogg";
+    }
+    return "";  // Skeleton or other streams first; only GIO knows.
+}
+
+// ISO base media files (MP4, QuickTime, 3GPP) start with an ftyp box. The
+// generic brands don't say whether the file holds audio or video, and GIO
+// goes by the file name extension for those, so we leave them to GIO. The
+// same goes for M4V, which some encoders also use for audio-only files.
+
+string sniff_iso_media(string const& head)
+{
+    static struct { char const* brand; char const* type; } const brands[] =
+    {
+        { "M4A ", "audio/mp4" },
+        { "M4B ", "audio/mp4" },
+        { "qt  ", "video/quicktime" },
+        { "3gp4", "video/3gpp" },
+        { "3gp5", "video/3gpp" },
+        { "3gp6", "video/3gpp" },
+        { "3g2a", "video/3gpp2" },
+        { "crx ", "image/x-canon-cr3" },
+    };
+    for (auto const& b : brands)
+    {
+        if (has(head, 8, b.brand, 4))
+        {
+            return b.type;
+        }
+    }
+    return "";
+}
+
+string sniff_matroska(string const& head)
+{
+    // The DocType is near the start of the EBML header.
+    auto const header = head.substr(0, 64);
+    if (header.find("webm") != string::npos)
+    {
+        return "video/webm";
+    }
+    if (header.find("matroska") != string::npos)
+    {
+        return "video/x-matroska";
+    }
+    return "";
+}
+
+// Reads the first SNIFF_SIZE bytes of filename. Returns the empty
+// string if the file can't be read, so GIO reports the error.
+
+string read_head(string const& filename)
+{
+    FdPtr fd(open(filename.c_str(), O_RDONLY | O_CLOEXEC), do_close);
+    if (fd.get() == -1)
+    {
+        return "";
+    }
+    string head(SNIFF_SIZE, '\0');
+    ssize_t len;
+    do
+    {
+        len = read(fd.get(), &head[0], head.size());
+    }
+    while (len == -1 && errno == EINTR);
+    head.resize(len > 0 ? len : 0);
+    return head;
+}
+
+}  // namespace
+
+string sniff_mimetype(string const& head)
+{
+    // Images
+    if (has(head, 0, "\xff\xd8\xff"))
+    {
+        return "image/jpeg";
+    }
+    if (has(head, 0, "\x89PNG\r\n\x1a\n"))
+    {
+        return "image/png";
+    }
+    if (has(head, 0, "GIF87a") || has(head, 0, "GIF89a"))
+    {
+        return "image/gif";
+    }
+    if (has(head, 0, "RIFF") && has(head, 8, "WEBP"))
+    {
+        return "image/webp";
+    }
+    if (has(head, 0, "II*\0") && has(head, 8, "CR\x02"))
+    {
+        return "image/x-canon-cr2";
+    }
+    if (has(head, 0, "II*\0") || has(head, 0, "MM\0*"))
+    {
+        return "image/tiff";  // Also NEF, DNG, ARW, PEF, and others.
+    }
+    if (has(head, 0, "IIRO") || has(head, 0, "IIRS") || has(head, 0, "MMOR"))
+    {
+        return "image/x-olympus-orf";
+    }
+    if (has(head, 0, "IIU\0"))
+    {
+        return "image/x-panasonic-rw2";
+    }
+    if (has(head, 0, "FUJIFILMCCD-RAW"))
+    {
+        return "image/x-fuji-raf";
+    }
+
+    // Audio
+    if (has(head, 0, "ID3") || is_mpeg_audio_frame(head))
+    {
+        return "audio/mpeg";
+    }
+    if (has(head, 0, "fLaC"))
+    {
+        return "audio/flac";
+    }
+    if (has(head, 0, "OggS"))
+    {
+        return sniff_ogg(head);
+    }
+    if (has(head, 0, "RIFF") && has(head, 8, "WAVE"))
+    {
+        return "audio/x-wav";
+    }
+    if (has(head, 0, "FORM") && has(head, 8, "AIFF"))
+    {
+        return "audio/x-aiff";
+    }
+    if (has(head, 0, "FORM") && has(head, 8, "AIFC"))
+    {
+        return "audio/x-aifc";
+    }
+
+    // Video
+    if (has(head, 4, "ftyp"))
+    {
+        return sniff_iso_media(head);
+    }
+    if (has(head, 0, "\x1a\x45\xdf\xa3"))
+    {
+        return sniff_matroska(head);
+    }
+    if (has(head, 0, "RIFF") && has(head, 8, "AVI "))
+    {
+        return "video/x-msvideo";
+    }
+    if (has(head, 0, "FLV\x01"))
+    {
+        return "video/x-flv";
+    }
+    if (has(head, 0, "\0\0\x01\xba"))
+    {
+        return "video/mpeg";
+    }
+    if (head.size() > 2 * 188 && head[0] == 0x47 && head[188] == 0x47 && head[2 * 188] == 0x47)
+    {
+        return "video/mp2t";
+    }
+    return "";
+}
+
 string get_mimetype(string const& filename)
 {
+    // Asking GIO means loading the shared-mime-info database and a sniffing
+    // read of its own, which is slow compared to checking a few signatures.
+    auto const sniffed = sniff_mimetype(read_head(filename));
+    if (!sniffed.empty())
+    {
+        return sniffed;
+    }
+
     string content_type = "application/octet-stream";
 
     gobj_ptr<GFile> file(g_file_new_for_path(filename.c_str()));
@@ -44,63 +44,66 @@ RateLimiter::~RateLimiter()
     // assert(running_ == 0);
 }
 
-RateLimiter::CancelFunc RateLimiter::schedule(function<void()> job)
+RateLimiter::CancelFunc RateLimiter::schedule(function<void()> job, int weight)
 {
     assert(job);
+    assert(weight > 0);
     assert (running_ >= 0);
 
-    if (running_ < concurrency_)
+    if (list_.empty() && (running_ == 0 || running_ + weight <= concurrency_))
     {
-        return schedule_now(job);
+        return schedule_now(job, weight);
     }
 
-    list_.emplace_back(make_shared<function<void()>>(move(job)));
+    list_.emplace_back(make_shared<Job>(Job{move(job), weight}));
 
     // Returned function clears the job when called, provided the job is still in the queue.
     // done() removes any cleared jobs from the queue without calling them.
-    weak_ptr<function<void()>> weak_p(list_.back());
+    weak_ptr<Job> weak_p(list_.back());
     return [this, weak_p]() noexcept
     {
         auto job_p = weak_p.lock();
         if (job_p)
         {
-            *job_p = nullptr;
+            job_p->func = nullptr;
         }
         return job_p != nullptr;
     };
 }
 
-RateLimiter::CancelFunc RateLimiter::schedule_now(function<void()> job)
+RateLimiter::CancelFunc RateLimiter::schedule_now(function<void()> job, int weight)
 {
     assert(job);
+    assert(weight > 0);
 
-    ++running_;
+    running_ += weight;
     job();
     return []{ return false; };  // Wasn't queued, so cancel does nothing.
 }
 
-void RateLimiter::done()
+void RateLimiter::done(int weight)
 {
-    assert(running_ > 0);
-    --running_;
+    assert(running_ >= weight);
+    running_ -= weight;
 
-    // Find the next job, discarding any cancelled jobs.
-    shared_ptr<function<void()>> job_p;
+    // Start as many jobs as fit, discarding any cancelled jobs. If the next job
+    // does not fit, we wait for more jobs to complete instead of starting lighter
+    // jobs out of order.
     while (!list_.empty())
     {
-        job_p = list_.back();
+        auto job_p = list_.back();
         assert(job_p);
-        list_.pop_back();
-        if (*job_p != nullptr)
+        if (!job_p->func)
+        {
+            list_.pop_back();
+            continue;
+        }
+        if (running_ != 0 && running_ + job_p->weight > concurrency_)
         {
             break;
         }
-    }
-
-    // If we found an uncancelled job, call it.
-    if (job_p && *job_p)
-    {
-        schedule_now(*job_p);
+        list_.pop_back();
+        schedule_now(job_p->func, job_p->weight);
     }
 }
 
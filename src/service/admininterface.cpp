@@ -18,8 +18,14 @@
 
 #include "admininterface.h"
 
+#include <internal/media_watcher.h>
+#include <internal/settings.h>
 #include <internal/thumbnailer.h>
 
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <glib.h>
+#pragma GCC diagnostic pop
 #include <QCoreApplication>
 
 using namespace std;
@@ -105,11 +111,82 @@ private:
 
 }  // namespace
 
+Thumbnailer& AdminInterface::thumbnailer()
+{
+    return *thumbnailer_.get();
+}
+
+MediaIndexer& AdminInterface::indexer()
+{
+    if (!indexer_)
+    {
+        Settings settings;
+        auto roots = settings.new_media_directories();
+        if (roots.empty())
+        {
+            roots = MediaWatcher::default_directories();
+        }
+        vector<QSize> sizes;
+        for (int size : settings.new_media_sizes())
+        {
+            sizes.emplace_back(size, size);
+        }
+        string const state_path = string(g_get_user_cache_dir()) + "/unity-thumbnailer/index-state";
+        // The indexer calls us from its own thread, so we take the calls to the main thread.
+        auto changed = [this]
+        {
+            QMetaObject::invokeMethod(this, "indexing_changed", Qt::QueuedConnection);
+        };
+        indexer_.reset(new MediaIndexer(thumbnailer(), roots, sizes, state_path, changed, changed));
+    }
+    return *indexer_;
+}
+
+// A completed run is not repeated each time the service starts, only once
+// the roots or sizes change or the thumbnail cache was emptied.
+
+void AdminInterface::resume_indexing()
+{
+    if (indexer().interrupted() || (Settings().index_media() && !indexer().up_to_date()))
+    {
+        start_indexing();
+    }
+}
+
+void AdminInterface::start_indexing()
+{
+    indexer().start();
+    indexing_changed();
+}
+
+// While the indexer runs, we count it as a request that is in progress,
+// so the service does not shut down for being idle. While it waits for the
+// device to be charging, it doesn't count, so the service can exit. The
+// next instance continues the run.
+
+void AdminInterface::indexing_changed()
+{
+    bool const active = indexer().running() && !indexer().paused();
+    if (active == indexing_)
+    {
+        return;
+    }
+    indexing_ = active;
+    if (active)
+    {
+        inactivity_handler_->request_started();
+    }
+    else
+    {
+        inactivity_handler_->request_completed();
+    }
+}
+
 unity::thumbnailer::service::AllStats AdminInterface::Stats()
 {
     ActivityNotifier notifier(*inactivity_handler_);
 
-    auto const st = thumbnailer_->stats();
+    auto const st = thumbnailer().stats();
     AllStats all;
     all.full_size_stats = to_cache_stats(st.full_size_stats);
     all.thumbnail_stats = to_cache_stats(st.thumbnail_stats);
@@ -117,6 +194,45 @@ unity::thumbnailer::service::AllStats AdminInterface::Stats()
     return all;
 }
 
+CounterMap AdminInterface::Counters()
+{
+    ActivityNotifier notifier(*inactivity_handler_);
+
+    CounterMap counters;
+    for (auto const& c : thumbnailer().counters())
+    {
+        counters.insert(QString::fromStdString(c.first), c.second);
+    }
+    for (auto const& c : pipeline_->counters())
+    {
+        counters.insert(QString::fromStdString(c.first), c.second);
+    }
+    for (auto const& c : server_.counters())
+    {
+        counters.insert(QString::fromStdString(c.first), c.second);
+    }
+
+    // Clients that have requests waiting or running, keyed by AppArmor label or bus name.
+    counters.insert(QStringLiteral("scheduler.active"), scheduler_->active());
+    counters.insert(QStringLiteral("scheduler.queued"), scheduler_->queued());
+    for (auto const& c : scheduler_->client_stats())
+    {
+        auto const prefix = QStringLiteral("scheduler.client.") + QString::fromStdString(c.first) + ".";
+        counters.insert(prefix + "queued", c.second.queued);
+        counters.insert(prefix + "max_queued", c.second.max_queued);
+        counters.insert(prefix + "active", c.second.active);
+        counters.insert(prefix + "completed", c.second.completed);
+        counters.insert(prefix + "boosted", c.second.boosted);
+    }
+    counters.insert(QStringLiteral("idle.timeout_ms"), inactivity_handler_->timeout().count());
+    counters.insert(QStringLiteral("idle.cold_starts_avoided"), inactivity_handler_->cold_starts_avoided());
+    for (auto const& c : indexer().counters())
+    {
+        counters.insert(QString::fromStdString(c.first), c.second);
+    }
+    return counters;
+}
+
 void AdminInterface::ClearStats(int cache_id)
 {
     ActivityNotifier notifier(*inactivity_handler_);
@@ -127,7 +243,7 @@ void AdminInterface::ClearStats(int cache_id)
         return;
     }
     auto selector = static_cast<Thumbnailer::CacheSelector>(cache_id);
-    thumbnailer_->clear_stats(selector);
+    thumbnailer().clear_stats(selector);
 }
 
 void AdminInterface::Clear(int cache_id)
@@ -140,7 +256,11 @@ void AdminInterface::Clear(int cache_id)
         return;
     }
     auto selector = static_cast<Thumbnailer::CacheSelector>(cache_id);
-    thumbnailer_->clear(selector);
+    thumbnailer().clear(selector);
+    if (Settings().index_media() && !indexer().up_to_date())
+    {
+        start_indexing();  // Fill the cache again.
+    }
 }
 
 void AdminInterface::Compact(int cache_id)
@@ -153,7 +273,7 @@ void AdminInterface::Compact(int cache_id)
         return;
     }
     auto selector = static_cast<Thumbnailer::CacheSelector>(cache_id);
-    thumbnailer_->compact(selector);
+    thumbnailer().compact(selector);
 }
 
 void AdminInterface::Shutdown()
@@ -161,6 +281,21 @@ void AdminInterface::Shutdown()
     QCoreApplication::instance()->quit();
 }
 
+void AdminInterface::StartIndexing()
+{
+    ActivityNotifier notifier(*inactivity_handler_);
+
+    start_indexing();
+}
+
+void AdminInterface::StopIndexing()
+{
+    ActivityNotifier notifier(*inactivity_handler_);
+
+    indexer().stop();
+    indexing_changed();
+}
+
 }  // namespace service
 
 }  // namespace thumbnailer
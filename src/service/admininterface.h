@@ -18,12 +18,19 @@
 
 #pragma once
 
+#include <internal/fair_scheduler.h>
+#include <internal/media_indexer.h>
 #include <internal/thumbnailer.h>
+#include "dbusinterface.h"
 #include "inactivityhandler.h"
+#include "pipeline.h"
 #include "stats.h"
 
 #include <QDBusContext>
 
+#include <future>
+#include <memory>
+
 namespace unity
 {
 
@@ -37,12 +44,19 @@ class AdminInterface : public QObject, protected QDBusContext
 {
     Q_OBJECT
 public:
-    AdminInterface(std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const& thumbnailer,
+    AdminInterface(std::shared_future<std::shared_ptr<unity::thumbnailer::internal::Thumbnailer>> const& thumbnailer,
                    std::shared_ptr<InactivityHandler> const& inactivity_handler,
+                   std::shared_ptr<Pipeline> const& pipeline,
+                   std::shared_ptr<unity::thumbnailer::internal::FairScheduler> const& scheduler,
+                   DBusInterface const& server,
                    QObject* parent = nullptr)
         : QObject(parent)
         , thumbnailer_(thumbnailer)
         , inactivity_handler_(inactivity_handler)
+        , pipeline_(pipeline)
+        , scheduler_(scheduler)
+        , server_(server)
+        , indexing_(false)
     {
     }
     ~AdminInterface() = default;  // LCOV_EXCL_LINE  // False negative from gcovr.
@@ -50,16 +64,36 @@ public:
     AdminInterface(AdminInterface const&) = delete;
     AdminInterface& operator=(AdminInterface&) = delete;
 
+    // Starts the media indexer if the previous instance of the service was
+    // stopped before indexing completed, or if the index-media setting is on
+    // and the previous run is out of date.
+    void resume_indexing();
+
 public Q_SLOTS:
     AllStats Stats();
+    CounterMap Counters();
     void ClearStats(int cache_id);
     void Clear(int cache_id);
     void Compact(int cache_id);
     void Shutdown();
+    void StartIndexing();
+    void StopIndexing();
+
+private Q_SLOTS:
+    void indexing_changed();
 
 private:
-    std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const& thumbnailer_;
+    unity::thumbnailer::internal::Thumbnailer& thumbnailer();
+    unity::thumbnailer::internal::MediaIndexer& indexer();
+    void start_indexing();
+
+    std::shared_future<std::shared_ptr<unity::thumbnailer::internal::Thumbnailer>> const thumbnailer_;
     std::shared_ptr<InactivityHandler> inactivity_handler_;
+    std::shared_ptr<Pipeline> pipeline_;
+    std::shared_ptr<unity::thumbnailer::internal::FairScheduler> scheduler_;
+    DBusInterface const& server_;
+    std::unique_ptr<unity::thumbnailer::internal::MediaIndexer> indexer_;
+    bool indexing_;  // The service stays alive while this is set, that is, while indexing isn't paused.
 };
 
 }  // namespace service
@@ -23,6 +23,7 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/regex.hpp>
 
+#include <cassert>
 #include <thread>
 
 using namespace std;
@@ -45,6 +46,16 @@ namespace service
 namespace
 {
 
+// An application that asks for this many thumbnails of the same size in one
+// directory, each soon after the one before, is most likely browsing it.
+int const PREFETCH_THRESHOLD = 3;
+chrono::milliseconds const PREFETCH_WINDOW(2000);
+
+// How many of the files that follow we prefetch, and how many more requests
+// for the same directory it takes before we look further ahead.
+int const PREFETCH_COUNT = 32;
+int const PREFETCH_STRIDE = 16;
+
 // TODO: Hack to work around gstreamer problems.
 //       See https://bugs.launchpad.net/thumbnailer/+bug/1466273
 
@@ -64,14 +75,16 @@ int adjusted_limit(int limit)
 
 }
 
-DBusInterface::DBusInterface(shared_ptr<Thumbnailer> const& thumbnailer,
+DBusInterface::DBusInterface(shared_future<shared_ptr<Thumbnailer>> const& thumbnailer,
                              shared_ptr<InactivityHandler> const& inactivity_handler,
+                             shared_ptr<Pipeline> const& pipeline,
+                             shared_ptr<FairScheduler> const& scheduler,
                              QObject* parent)
     : QObject(parent)
     , thumbnailer_(thumbnailer)
     , inactivity_handler_(inactivity_handler)
-    , check_thread_pool_(make_shared<QThreadPool>())
-    , create_thread_pool_(make_shared<QThreadPool>())
+    , pipeline_(pipeline)
+    , scheduler_(scheduler)
     , download_limiter_(make_shared<RateLimiter>(settings_.max_downloads()))
 {
     auto limit = settings_.max_extractions();
@@ -91,11 +104,19 @@ DBusInterface::DBusInterface(shared_ptr<Thumbnailer> const& thumbnailer,
         }
     }
 
-    extraction_limiter_ = make_shared<RateLimiter>(limit);
+    // Video extractions and in-process decodes share the limit. Each request is weighted by
+    // its cost, and an extraction costs a whole core, so the limit on the number of concurrent
+    // extractions stays the same.
+    cpu_limiter_ = make_shared<RateLimiter>(limit * ThumbnailRequest::COST_PER_CORE);
 
     log_level_ = settings_.log_level();
     config_values_.trace_client = settings_.trace_client();
     config_values_.max_backlog = settings_.max_backlog();
+
+    if (settings_.prefetch_siblings())
+    {
+        predictor_.reset(new LocalityPredictor(PREFETCH_THRESHOLD, PREFETCH_WINDOW, PREFETCH_STRIDE));
+    }
 }
 
 DBusInterface::~DBusInterface()
@@ -111,106 +132,139 @@ CredentialsCache& DBusInterface::credentials()
     return *credentials_.get();
 }
 
+// The requests are created by the pipeline, because creating a thumbnail
+// request has to look at the file, which can take a long time on a network
+// file system or a device that is asleep, and we must not hold up the event
+// loop for that. Errors from creating a request come back in the reply.
+
 QByteArray DBusInterface::GetAlbumArt(QString const& artist,
                                       QString const& album,
-                                      QSize const& requestedSize)
+                                      QSize const& requestedSize,
+                                      QString const& request_id)
 {
-    try
-    {
-        QString details;
-        QTextStream s(&details);
-        s << "album: " << artist << "/" << album << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
-        auto request = thumbnailer_->get_album_art(artist.toStdString(), album.toStdString(), requestedSize);
-        queueRequest(new Handler(connection(), message(),
-                                 check_thread_pool_, create_thread_pool_,
-                                 download_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
-    }
-    // LCOV_EXCL_START
-    catch (exception const& e)
-    {
-        QString msg = "DBusInterface::GetAlbumArt(): " + artist + "/" + album + ": " + e.what();
-        qWarning() << msg;
-        sendErrorReply(ART_ERROR, e.what());
-    }
-    // LCOV_EXCL_STOP
+    QString details;
+    QTextStream s(&details);
+    s << "album: " << artist << "/" << album << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
+    auto const thumbnailer = thumbnailer_;
+    auto const artist_str = artist.toStdString();
+    auto const album_str = album.toStdString();
+    queueRequest(new Handler(connection(), message(),
+                             pipeline_, scheduler_,
+                             download_limiter_, cpu_limiter_, credentials(), *inactivity_handler_,
+                             [thumbnailer, artist_str, album_str, requestedSize]
+                             {
+                                 return thumbnailer.get()->get_album_art(artist_str, album_str, requestedSize);
+                             },
+                             details,
+                             request_id));
     return QByteArray();
 }
 
 QByteArray DBusInterface::GetArtistArt(QString const& artist,
                                        QString const& album,
-                                       QSize const& requestedSize)
+                                       QSize const& requestedSize,
+                                       QString const& request_id)
 {
-    try
-    {
-        QString details;
-        QTextStream s(&details);
-        s << "artist: " << artist << "/" << album << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
-        auto request = thumbnailer_->get_artist_art(artist.toStdString(), album.toStdString(), requestedSize);
-        queueRequest(new Handler(connection(), message(),
-                                 check_thread_pool_, create_thread_pool_,
-                                 download_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
-    }
-    // LCOV_EXCL_START
-    catch (exception const& e)
-    {
-        QString msg = "DBusInterface::GetArtistArt(): " + artist + "/" + album + ": " + e.what();
-        qWarning() << msg;
-        sendErrorReply(ART_ERROR, msg);
-    }
-    // LCOV_EXCL_STOP
+    QString details;
+    QTextStream s(&details);
+    s << "artist: " << artist << "/" << album << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
+    auto const thumbnailer = thumbnailer_;
+    auto const artist_str = artist.toStdString();
+    auto const album_str = album.toStdString();
+    queueRequest(new Handler(connection(), message(),
+                             pipeline_, scheduler_,
+                             download_limiter_, cpu_limiter_, credentials(), *inactivity_handler_,
+                             [thumbnailer, artist_str, album_str, requestedSize]
+                             {
+                                 return thumbnailer.get()->get_artist_art(artist_str, album_str, requestedSize);
+                             },
+                             details,
+                             request_id));
     return QByteArray();
 }
 
-QByteArray DBusInterface::GetThumbnail(QString const& filename, QSize const& requestedSize)
+QByteArray DBusInterface::GetThumbnail(QString const& filename,
+                                       QSize const& requestedSize,
+                                       QString const& request_id)
 {
-    std::unique_ptr<ThumbnailRequest> request;
-
-    try
-    {
-        QString details;
-        QTextStream s(&details);
-        s << "thumbnail: " << filename << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
-
-        auto request = thumbnailer_->get_thumbnail(filename.toStdString(), requestedSize);
-        queueRequest(new Handler(connection(), message(),
-                                 check_thread_pool_, create_thread_pool_,
-                                 extraction_limiter_, credentials(), *inactivity_handler_,
-                                 std::move(request), details));
-    }
-    catch (exception const& e)
-    {
-        QString msg = "DBusInterface::GetThumbnail(): " + filename + ": " + e.what();
-        qWarning() << msg;
-        sendErrorReply(ART_ERROR, msg);
-    }
+    QString details;
+    QTextStream s(&details);
+    s << "thumbnail: " << filename << " (" << requestedSize.width() << "," << requestedSize.height() << ")";
+    auto const thumbnailer = thumbnailer_;
+    auto const filename_str = filename.toStdString();
+    bool const prefetch = predictor_ && predictor_->predict(filename_str, requestedSize);
+    queueRequest(new Handler(connection(), message(),
+                             pipeline_, scheduler_,
+                             cpu_limiter_, cpu_limiter_, credentials(), *inactivity_handler_,
+                             [thumbnailer, filename_str, requestedSize, prefetch]
+                             {
+                                 auto request = thumbnailer.get()->get_thumbnail(filename_str, requestedSize);
+                                 if (prefetch)
+                                 {
+                                     // Only once we know that the file exists.
+                                     thumbnailer.get()->prefetch_siblings(filename_str, requestedSize, PREFETCH_COUNT);
+                                 }
+                                 return request;
+                             },
+                             details,
+                             request_id));
     return QByteArray();
 }
 
 void DBusInterface::queueRequest(Handler* handler)
 {
     requests_.emplace(handler, std::unique_ptr<Handler>(handler));
+    connect(handler, &Handler::resolved, this, &DBusInterface::requestResolved);
     connect(handler, &Handler::finished, this, &DBusInterface::requestFinished);
     setDelayedReply(true);
 
+    // Watch the client while it has requests, so we can stop working for it if it goes away.
+    if (!peer_watcher_)
+    {
+        peer_watcher_.reset(new QDBusServiceWatcher);
+        peer_watcher_->setConnection(connection());
+        peer_watcher_->setWatchMode(QDBusServiceWatcher::WatchForUnregistration);
+        connect(peer_watcher_.get(), &QDBusServiceWatcher::serviceUnregistered, this, &DBusInterface::peerGone);
+    }
+    if (++peer_requests_[handler->sender()] == 1)
+    {
+        peer_watcher_->addWatchedService(handler->sender());
+    }
+
+    handler->resolve();
+}
+
+void DBusInterface::requestResolved()
+{
+    Handler* handler = static_cast<Handler*>(sender());
+
     std::vector<Handler*> &requests_for_key = request_keys_[handler->key()];
-    if (requests_for_key.size() == 0)
+    requests_for_key.push_back(handler);
+    if (requests_for_key.size() == 1)
     {
         /* There are no other concurrent requests for this item, so
-         * begin immediately. */
+         * begin immediately. The handler is already in the list
+         * because begin() can finish the request synchronously if
+         * the thumbnail is in the in-memory cache. */
         handler->begin();
     }
     else
     {
-        /* There are other requests for this item, so chain this
-         * request to wait for them to complete first.  This way we
-         * can take advantage of any cached downloads or failures. */
+        /* There are other requests for this item, so make this
+         * request wait for the first of them to complete.  This way
+         * we can take advantage of any cached downloads or failures.
+         * All requests that wait for the same leader start together
+         * and share the source image: the image that the leader
+         * decoded, or, if the leader found its thumbnail in a cache,
+         * the image that the first of them decodes while the others
+         * wait. So requests for different sizes of the same item
+         * don't decode the source more than once. */
         // TODO: should record time spent in queue
-        connect(requests_for_key.back(), &Handler::finished,
+        Handler* leader = requests_for_key.front();
+        handler->coalesce_with(*leader);
+        connect(leader, &Handler::finished,
                 handler, &Handler::begin);
     }
-    requests_for_key.push_back(handler);
 }
 
 namespace
@@ -270,18 +324,34 @@ void DBusInterface::requestFinished()
     // LCOV_EXCL_STOP
 
     // Remove ourselves from the chain of requests
-    std::vector<Handler*> &requests_for_key = request_keys_[handler->key()];
-    requests_for_key.erase(
-        std::remove(requests_for_key.begin(), requests_for_key.end(), handler),
-        requests_for_key.end());
-    if (requests_for_key.size() == 0)
+    if (handler->is_resolved())
+    {
+        std::vector<Handler*> &requests_for_key = request_keys_[handler->key()];
+        requests_for_key.erase(
+            std::remove(requests_for_key.begin(), requests_for_key.end(), handler),
+            requests_for_key.end());
+        if (requests_for_key.size() == 0)
+        {
+            request_keys_.erase(handler->key());
+        }
+    }
+
+    auto peer = peer_requests_.find(handler->sender());
+    assert(peer != peer_requests_.end());
+    if (--peer->second == 0)
     {
-        request_keys_.erase(handler->key());
+        peer_watcher_->removeWatchedService(peer->first);
+        peer_requests_.erase(peer);
     }
 
     // Queue deletion of handler when we re-enter the event loop.
     handler->deleteLater();
 
+    if (!handler->is_resolved())
+    {
+        return;  // The request could not be created, or was cancelled first; Handler logged any error.
+    }
+
     // Emit log message, depending on log_level_.
     auto status = handler->status();
     if (log_level_ == 2 || status == ThumbnailRequest::FetchStatus::hard_error)
@@ -310,6 +380,74 @@ ConfigValues DBusInterface::ClientConfig()
     return config_values_;
 }
 
+void DBusInterface::Cancel(QString const& request_id)
+{
+    if (request_id.isEmpty())
+    {
+        return;  // The caller didn't give the request an id.
+    }
+    auto const peer = message().service();
+    for (auto const& r : requests_)
+    {
+        Handler* h = r.first;
+        if (h->sender() == peer && h->request_id() == request_id)
+        {
+            cancel(h, cancelled_by_client_);
+            return;
+        }
+    }
+}
+
+void DBusInterface::peerGone(QString const& peer)
+{
+    // Cancelling can finish a request, which removes it from requests_,
+    // so we collect the requests first.
+    vector<Handler*> handlers;
+    for (auto const& r : requests_)
+    {
+        if (r.first->sender() == peer)
+        {
+            handlers.push_back(r.first);
+        }
+    }
+    for (auto h : handlers)
+    {
+        if (requests_.find(h) != requests_.end())
+        {
+            cancel(h, cancelled_by_disconnect_);
+        }
+    }
+}
+
+void DBusInterface::cancel(Handler* handler, int64_t& counter)
+{
+    auto outcome = handler->cancel();
+    if (!outcome.found)
+    {
+        return;  // Cancelled before, and still winding down.
+    }
+    ++counter;
+    if (outcome.dequeued)
+    {
+        ++cancel_dequeued_;
+    }
+    if (outcome.killed)
+    {
+        ++cancel_killed_;
+    }
+}
+
+map<string, int64_t> DBusInterface::counters() const
+{
+    return
+    {
+        { "cancel.by_client", cancelled_by_client_ },
+        { "cancel.by_disconnect", cancelled_by_disconnect_ },
+        { "cancel.dequeued", cancel_dequeued_ },
+        { "cancel.extractions_killed", cancel_killed_ },
+    };
+}
+
 }  // namespace service
 
 }  // namespace thumbnailer
@@ -21,12 +21,15 @@
 #include "credentialscache.h"
 #include "handler.h"
 
+#include <internal/locality_predictor.h>
 #include <internal/settings.h>
 #include <ratelimiter.h>
 #include <service/client_config.h>
 
 #include <QDBusContext>
-#include <QThreadPool>
+#include <QDBusServiceWatcher>
+
+#include <future>
 
 namespace unity
 {
@@ -41,8 +44,10 @@ class DBusInterface : public QObject, protected QDBusContext
 {
     Q_OBJECT
 public:
-    DBusInterface(std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const& thumbnailer,
+    DBusInterface(std::shared_future<std::shared_ptr<unity::thumbnailer::internal::Thumbnailer>> const& thumbnailer,
                   std::shared_ptr<InactivityHandler> const& inactivity_handler,
+                  std::shared_ptr<Pipeline> const& pipeline,
+                  std::shared_ptr<unity::thumbnailer::internal::FairScheduler> const& scheduler,
                   QObject* parent = nullptr);
     ~DBusInterface();
 
@@ -50,36 +55,61 @@ public:
     DBusInterface& operator=(DBusInterface&) = delete;
 
 public Q_SLOTS:
-    QByteArray GetAlbumArt(QString const& artist, QString const& album, QSize const& requestedSize);
-    QByteArray GetArtistArt(QString const& artist, QString const& album, QSize const& requestedSize);
-    QByteArray GetThumbnail(QString const& filename, QSize const& requestedSize);
+    // request_id is chosen by the caller to identify the request in Cancel().
+    QByteArray GetAlbumArt(QString const& artist,
+                           QString const& album,
+                           QSize const& requestedSize,
+                           QString const& request_id);
+    QByteArray GetArtistArt(QString const& artist,
+                            QString const& album,
+                            QSize const& requestedSize,
+                            QString const& request_id);
+    QByteArray GetThumbnail(QString const& filename, QSize const& requestedSize, QString const& request_id);
 
     // This method returns the values of gsettings keys relevant to the client. We retrieve these on the server
     // side because the client-side API runs under confinement, which disallows access to gsettings.
     ConfigValues ClientConfig();
 
+    // Cancels the caller's request with the given id, because the caller no
+    // longer wants the reply. Unknown ids are ignored, because the request may
+    // have completed in the mean time.
+    void Cancel(QString const& request_id);
+
+    // Counts of the requests that were cancelled and of the work that this avoided.
+    std::map<std::string, int64_t> counters() const;
+
 private:
     void queueRequest(Handler* handler);
+    void cancel(Handler* handler, int64_t& counter);
 
 private Q_SLOTS:
+    void requestResolved();
     void requestFinished();
+    void peerGone(QString const& peer);
 
 Q_SIGNALS:
     void startedRequest();
     void stoppedRequest();
 
 private:
-    std::shared_ptr<unity::thumbnailer::internal::Thumbnailer> const thumbnailer_;
+    std::shared_future<std::shared_ptr<unity::thumbnailer::internal::Thumbnailer>> const thumbnailer_;
     std::unique_ptr<CredentialsCache> credentials_;
     CredentialsCache& credentials();
     std::shared_ptr<InactivityHandler> inactivity_handler_;
-    std::shared_ptr<QThreadPool> check_thread_pool_;
-    std::shared_ptr<QThreadPool> create_thread_pool_;
+    std::shared_ptr<Pipeline> pipeline_;
+    std::shared_ptr<unity::thumbnailer::internal::FairScheduler> scheduler_;
     std::map<Handler*, std::unique_ptr<Handler>> requests_;
     std::map<std::string, std::vector<Handler*>> request_keys_;
+    std::map<QString, int> peer_requests_;               // Number of requests for each client bus name.
+    std::unique_ptr<QDBusServiceWatcher> peer_watcher_;  // Tells us when a client in peer_requests_ goes away.
+    int64_t cancelled_by_client_ = 0;                    // Requests cancelled with Cancel().
+    int64_t cancelled_by_disconnect_ = 0;                // Requests cancelled because the client went away.
+    int64_t cancel_dequeued_ = 0;                        // Cancelled requests that had work waiting to start.
+    int64_t cancel_killed_ = 0;                          // Cancelled requests that had an extraction running.
     unity::thumbnailer::internal::Settings settings_;
+    std::unique_ptr<unity::thumbnailer::internal::LocalityPredictor> predictor_;  // Null unless prefetch-siblings is set.
     std::shared_ptr<RateLimiter> download_limiter_;
-    std::shared_ptr<RateLimiter> extraction_limiter_;
+    std::shared_ptr<RateLimiter> cpu_limiter_;  // Limits extractions and decodes.
     int log_level_;
     ConfigValues config_values_;
 };
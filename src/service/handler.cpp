@@ -23,8 +23,7 @@
 
 #include <QFuture>
 #include <QFutureWatcher>
-#include <QtConcurrent>
-#include <QThreadPool>
+#include <QThread>
 
 #include <atomic>
 
@@ -46,6 +45,28 @@ struct ByteArrayOrError
     QString error;
 };
 
+// Runs func in the pool for stage and reports its result, or the
+// exception it threw, to watcher.
+
+template<typename F>
+void run_stage(unity::thumbnailer::service::Pipeline& pipeline,
+               unity::thumbnailer::service::Pipeline::Stage stage,
+               QFutureWatcher<ByteArrayOrError>& watcher,
+               F func)
+{
+    watcher.setFuture(pipeline.run(stage, [func]() -> ByteArrayOrError
+    {
+        try
+        {
+            return ByteArrayOrError{func(), nullptr};
+        }
+        catch (std::exception const& e)
+        {
+            return ByteArrayOrError{QByteArray(), e.what()};
+        }
+    }));
+}
+
 }
 
 namespace unity
@@ -61,44 +82,70 @@ struct HandlerPrivate
 {
     QDBusConnection const bus;
     QDBusMessage const message;
-    shared_ptr<QThreadPool> const check_pool;
-    shared_ptr<QThreadPool> const create_pool;
+    shared_ptr<Pipeline> const pipeline;
+    shared_ptr<FairScheduler> const scheduler;
     shared_ptr<RateLimiter> const limiter;
+    shared_ptr<RateLimiter> const cpu_limiter;
     CredentialsCache& creds;
     InactivityHandler& inactivity_handler;
-    shared_ptr<ThumbnailRequest> request;
+    Handler::RequestFactory const make_request;
+    shared_ptr<ThumbnailRequest> request;                   // Set by the resolve stage.
+    bool resolved = false;                                  // True once request is set.
+    string key;                                             // Key of request when it was resolved.
+
     chrono::system_clock::time_point const start_time;      // Overall start time
     chrono::system_clock::time_point finish_time;           // Overall finish time
     chrono::system_clock::time_point schedule_start_time;   // Time at which download/extract is scheduled.
     chrono::system_clock::time_point download_start_time;   // Time at which download/extract is started.
     chrono::system_clock::time_point download_finish_time;  // Time at which download/extract has completed.
     QString const details;
+    QString const request_id;
     QString const status;
     RateLimiter::CancelFunc cancel_func;
+    RateLimiter::CancelFunc cpu_cancel_func;
+    RateLimiter::CancelFunc stream_cancel_func;
+    FairScheduler::CancelFunc scheduler_cancel_func;
+    string client;                                          // Who we take turns with others as.
+    bool admitted = false;                                  // True while scheduler counts us as running.
+    int download_weight = 0;                                // Weight of the download with limiter.
+    int cpu_weight = 0;                                     // Weight of the running decode with cpu_limiter.
+    int stream_weight = 0;                                  // Weight of the running decode of downloaded data.
+    bool busy = false;                                      // True while we wait for credentials, a stage or a download.
+    bool streaming = false;                                 // True while downloaded data waits for or is in the decode stage.
+    bool more_data = false;                                 // True if more data arrived while streaming.
+    bool downloaded = false;                                // True if the download finished while streaming.
 
     atomic_bool cancelled;                                  // Must be atomic because destructor asynchronously writes to it.
+    QFutureWatcher<ByteArrayOrError> resolveWatcher;
+    QFutureWatcher<ByteArrayOrError> probeWatcher;
+    QFutureWatcher<ByteArrayOrError> readWatcher;
     QFutureWatcher<ByteArrayOrError> checkWatcher;
     QFutureWatcher<ByteArrayOrError> createWatcher;
+    QFutureWatcher<ByteArrayOrError> streamWatcher;
 
     HandlerPrivate(QDBusConnection const& bus,
                    QDBusMessage const& message,
-                   shared_ptr<QThreadPool> const& check_pool,
-                   shared_ptr<QThreadPool> const& create_pool,
+                   shared_ptr<Pipeline> const& pipeline,
+                   shared_ptr<FairScheduler> const& scheduler,
                    shared_ptr<RateLimiter> const& limiter,
+                   shared_ptr<RateLimiter> const& cpu_limiter,
                    CredentialsCache& creds,
                    InactivityHandler& inactivity_handler,
-                   unique_ptr<ThumbnailRequest>&& request,
-                   QString const& details)
+                   Handler::RequestFactory const& make_request,
+                   QString const& details,
+                   QString const& request_id)
         : bus(bus)
         , message(message)
-        , check_pool(check_pool)
-        , create_pool(create_pool)
+        , pipeline(pipeline)
+        , scheduler(scheduler)
         , limiter(limiter)
+        , cpu_limiter(cpu_limiter)
         , creds(creds)
         , inactivity_handler(inactivity_handler)
-        , request(move(request))
+        , make_request(make_request)
         , start_time(chrono::system_clock::now())
         , details(details)
+        , request_id(request_id)
         , cancelled(false)
     {
     }
@@ -106,21 +153,26 @@ struct HandlerPrivate
 
 Handler::Handler(QDBusConnection const& bus,
                  QDBusMessage const& message,
-                 shared_ptr<QThreadPool> const& check_pool,
-                 shared_ptr<QThreadPool> const& create_pool,
+                 shared_ptr<Pipeline> const& pipeline,
+                 shared_ptr<FairScheduler> const& scheduler,
                  shared_ptr<RateLimiter> const& limiter,
+                 shared_ptr<RateLimiter> const& cpu_limiter,
                  CredentialsCache& creds,
                  InactivityHandler& inactivity_handler,
-                 unique_ptr<ThumbnailRequest>&& request,
-                 QString const& details)
+                 RequestFactory const& make_request,
+                 QString const& details,
+                 QString const& request_id)
     : p(new HandlerPrivate(bus, message,
-                           check_pool, create_pool,
-                           limiter, creds, inactivity_handler,
-                           move(request), details))
+                           pipeline, scheduler,
+                           limiter, cpu_limiter, creds, inactivity_handler,
+                           make_request, details, request_id))
 {
+    connect(&p->resolveWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::resolveFinished);
+    connect(&p->probeWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::probeFinished);
+    connect(&p->readWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::readSourceFinished);
     connect(&p->checkWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::checkFinished);
-    connect(p->request.get(), &ThumbnailRequest::downloadFinished, this, &Handler::downloadFinished);
     connect(&p->createWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::createFinished);
+    connect(&p->streamWatcher, &QFutureWatcher<ByteArrayOrError>::finished, this, &Handler::streamFinished);
     p->inactivity_handler.request_started();
 }
 
@@ -131,20 +183,141 @@ Handler::~Handler()
     {
         p->cancel_func();
     }
-    // ensure that jobs occurring in the thread pool complete.
+    if (p->cpu_cancel_func)
+    {
+        p->cpu_cancel_func();
+    }
+    if (p->stream_cancel_func)
+    {
+        p->stream_cancel_func();
+    }
+    if (p->scheduler_cancel_func)
+    {
+        p->scheduler_cancel_func();
+    }
+    // ensure that jobs occurring in the thread pools complete.
+    p->resolveWatcher.waitForFinished();
+    p->probeWatcher.waitForFinished();
+    p->readWatcher.waitForFinished();
     p->checkWatcher.waitForFinished();
     p->createWatcher.waitForFinished();
+    p->streamWatcher.waitForFinished();
     p->inactivity_handler.request_completed();
     p->request.reset();
 }
 
+void Handler::resolve()
+{
+    p->busy = true;
+    QThread* const thread = this->thread();
+    run_stage(*p->pipeline, Pipeline::Stage::resolve, p->resolveWatcher, [this, thread]
+    {
+        if (!p->cancelled)
+        {
+            // The request belongs to the event loop thread, like we do.
+            auto request = p->make_request();
+            request->moveToThread(thread);
+            p->request = move(request);
+        }
+        return QByteArray();
+    });
+}
+
+void Handler::resolveFinished()
+{
+    p->busy = false;
+    if (p->cancelled)
+    {
+        sendCancelled();
+        return;
+    }
+
+    auto ba_error = p->resolveWatcher.result();
+    if (!ba_error.error.isNull())
+    {
+        sendError("Handler::resolveFinished(): " + details() + ": " + ba_error.error);
+        return;
+    }
+
+    p->resolved = true;
+    p->key = p->request->key();
+    connect(p->request.get(), &ThumbnailRequest::downloadFinished, this, &Handler::downloadFinished);
+    connect(p->request.get(), &ThumbnailRequest::downloadDataReceived, this, &Handler::downloadDataReceived);
+    Q_EMIT resolved();
+}
+
+bool Handler::is_resolved() const
+{
+    return p->resolved;
+}
+
 string const& Handler::key() const
 {
-    return p->request->key();
+    return p->key;
+}
+
+void Handler::coalesce_with(Handler const& leader)
+{
+    p->request->coalesce_with(*leader.p->request);
+}
+
+Handler::CancelOutcome Handler::cancel()
+{
+    CancelOutcome outcome;
+    if (p->cancelled)
+    {
+        return outcome;
+    }
+    p->cancelled = true;
+    outcome.found = true;
+
+    // Whatever is still waiting for its turn never runs. A job that was
+    // dropped does not hold a slot, so there is nothing to give back.
+    if (p->scheduler_cancel_func && p->scheduler_cancel_func())
+    {
+        outcome.dequeued = true;
+    }
+    if (p->cpu_cancel_func && p->cpu_cancel_func())
+    {
+        outcome.dequeued = true;
+    }
+    if (p->cancel_func && p->cancel_func())
+    {
+        outcome.dequeued = true;
+    }
+    if (p->stream_cancel_func && p->stream_cancel_func())
+    {
+        // The download may have finished already, and is waiting for this decode.
+        outcome.dequeued = true;
+        p->stream_cancel_func = nullptr;
+        p->streaming = false;
+        if (p->downloaded)
+        {
+            p->downloaded = false;
+            p->busy = false;
+        }
+    }
+
+    // A stage that is running in a thread pool cannot be interrupted, but it
+    // returns early when it sees that we are cancelled. An extraction is stopped,
+    // so its slot with the limiter frees up right away. Either way, we finish
+    // when the stage or the extraction reports back.
+    if (p->busy)
+    {
+        outcome.killed = p->resolved && p->request->cancel_download();
+        return outcome;
+    }
+    sendCancelled();
+    return outcome;
 }
 
 void Handler::begin()
 {
+    if (p->cancelled)
+    {
+        return;  // Cancelled while we were waiting for another request for the same source.
+    }
+    p->busy = true;
     p->creds.get(p->message.service(),
                  [this](CredentialsCache::Credentials const& credentials)
                  {
@@ -154,10 +327,11 @@ void Handler::begin()
 
 void Handler::gotCredentials(CredentialsCache::Credentials const& credentials)
 {
+    p->busy = false;
     if (p->cancelled)
     {
         // LCOV_EXCL_START  // Too small a window to hit with a test.
-        Q_EMIT finished();
+        sendCancelled();
         return;
         // LCOV_EXCL_STOP
     }
@@ -182,27 +356,146 @@ void Handler::gotCredentials(CredentialsCache::Credentials const& credentials)
     }
     // LCOV_EXCL_STOP
 
-    auto do_check = [this]() -> ByteArrayOrError
+    // Hot thumbnails are held in memory, so we can reply right away
+    // without the round trip through the thread pools.
+    auto ba = p->request->cached_thumbnail();
+    if (ba.size() != 0)
     {
-        try
+        sendThumbnail(ba);
+        return;
+    }
+
+    // Requests from different clients take turns, so a client with a large
+    // backlog cannot hold up the others. Confined apps are told apart by their
+    // AppArmor label, and unconfined ones by their bus connection.
+    p->client = credentials.label.empty() || credentials.label == "unconfined"
+                    ? p->message.service().toStdString()
+                    : credentials.label;
+    p->scheduler_cancel_func = p->scheduler->schedule(p->client, [this]
+    {
+        p->admitted = true;
+        p->busy = true;
+        run_stage(*p->pipeline, Pipeline::Stage::probe, p->probeWatcher, [this]{ return probe(); });
+    });
+}
+
+// probe() looks for the thumbnail, or a failure, in the persistent
+// caches. It is called synchronously in the probe thread pool.
+
+QByteArray Handler::probe()
+{
+    if (p->cancelled)
+    {
+        return QByteArray();  // LCOV_EXCL_LINE  // Too small a window to hit with a test.
+    }
+    return p->request->probe_caches();
+}
+
+void Handler::probeFinished()
+{
+    p->busy = false;
+    if (p->cancelled)
+    {
+        sendCancelled();
+        return;
+    }
+
+    auto ba_error = p->probeWatcher.result();
+    if (!ba_error.error.isNull())
+    {
+        // LCOV_EXCL_START
+        sendError("Handler::probeFinished(): result error: " + details() + ": " + ba_error.error);
+        return;
+        // LCOV_EXCL_STOP
+    }
+    if (ba_error.ba.size() != 0)
+    {
+        sendThumbnail(ba_error.ba);
+        return;
+    }
+    if (p->request->status() == ThumbnailRequest::FetchStatus::cached_failure)
+    {
+        sendError("Handler::probeFinished(): no artwork for " + details() + ": " + status_as_string());
+        return;
+    }
+
+    p->busy = true;
+    run_stage(*p->pipeline, Pipeline::Stage::read, p->readWatcher, [this]{ return readSource(); });
+}
+
+// readSource() reads a local source file, so the decode stage
+// does not have to wait for the disk. It is called synchronously
+// in the read thread pool.
+
+QByteArray Handler::readSource()
+{
+    if (!p->cancelled)
+    {
+        p->request->read_source();
+    }
+    return QByteArray();
+}
+
+void Handler::readSourceFinished()
+{
+    p->busy = false;
+    if (p->cancelled)
+    {
+        sendCancelled();
+        return;
+    }
+
+    auto ba_error = p->readWatcher.result();
+    if (!ba_error.error.isNull())
+    {
+        // LCOV_EXCL_START
+        sendError("Handler::readSourceFinished(): result error: " + details() + ": " + ba_error.error);
+        return;
+        // LCOV_EXCL_STOP
+    }
+
+    scheduleDecode(false);
+}
+
+// scheduleDecode() runs check(), or create() after a download, in the decode
+// thread pool once the CPU limiter admits the request. The limiter covers
+// extractions as well as decodes, and weighs each request by its expected cost,
+// so the decodes and extractions that run at the same time fit the number of cores.
+
+void Handler::scheduleDecode(bool after_download)
+{
+    p->cpu_weight = p->request->decode_cost();
+    p->cpu_cancel_func = p->cpu_limiter->schedule([this, after_download]
+    {
+        if (p->cancelled)
         {
-            return ByteArrayOrError{check(), nullptr};
+            return;  // LCOV_EXCL_LINE  // Too small a window to hit with a test.
         }
-        // LCOV_EXCL_START
-        catch (std::exception const& e)
+        p->busy = true;
+        if (after_download)
         {
-            return ByteArrayOrError{QByteArray(), e.what()};
+            run_stage(*p->pipeline, Pipeline::Stage::decode, p->createWatcher, [this]{ return create(); });
         }
-        // LCOV_EXCL_STOP
-    };
-    p->checkWatcher.setFuture(QtConcurrent::run(p->check_pool.get(), do_check));
+        else
+        {
+            run_stage(*p->pipeline, Pipeline::Stage::decode, p->checkWatcher, [this]{ return check(); });
+        }
+    }, p->cpu_weight);
+}
+
+void Handler::decodeFinished()
+{
+    p->busy = false;
+    p->cpu_cancel_func = nullptr;
+    p->cpu_limiter->done(p->cpu_weight);
+    p->cpu_weight = 0;
 }
 
-// check() determines whether the requested thumbnail exists in
-// the cache.  It is called synchronously in the thread pool.
+// check() creates the thumbnail from the source, if the source is
+// available without a download. It is called synchronously in the
+// decode thread pool.
 //
-// If the thumbnail is available, it is returned as a file descriptor,
-// which will be returned to the user.
+// If the thumbnail could be created, it is returned to the user.
 //
 // If not, we continue to the asynchronous download stage.
 
@@ -217,8 +510,10 @@ QByteArray Handler::check()
 
 void Handler::checkFinished()
 {
+    decodeFinished();
     if (p->cancelled)
     {
+        sendCancelled();
         return;
     }
 
@@ -255,14 +550,16 @@ void Handler::checkFinished()
         try
         {
             // otherwise move on to the download phase.
+            p->download_weight = p->request->download_cost();
             p->cancel_func = p->limiter->schedule([&]
             {
                 if (!p->cancelled)
                 {
+                    p->busy = true;
                     p->download_start_time = chrono::system_clock::now();
                     p->request->download();
                 }
-            });
+            }, p->download_weight);
         }
         // LCOV_EXCL_START
         catch (std::exception const& e)
@@ -279,31 +576,90 @@ void Handler::checkFinished()
 void Handler::downloadFinished()
 {
     p->download_finish_time = chrono::system_clock::now();
-    p->limiter->done();
+    p->limiter->done(p->download_weight);
+
+    if (p->streaming)
+    {
+        p->downloaded = true;  // streamFinished() continues once the data that arrived last is decoded.
+        return;
+    }
+    finishDownload();
+}
 
+void Handler::finishDownload()
+{
+    p->busy = false;
     if (p->cancelled)
     {
+        sendCancelled();
         return;
     }
 
-    auto do_create = [this]() -> ByteArrayOrError
+    scheduleDecode(true);
+}
+
+// While a download is in progress, the data that has arrived is decoded
+// in the decode thread pool, once the CPU limiter admits it, so decoding
+// overlaps with the transfer without running on the event loop. We have
+// at most one decode of downloaded data waiting or running at a time; it
+// picks up everything that has arrived by the time it runs.
+
+void Handler::downloadDataReceived()
+{
+    if (p->cancelled)
     {
-        try
-        {
-            return ByteArrayOrError{create(), nullptr};
-        }
-        catch (std::exception const& e)
+        return;
+    }
+    if (p->streaming)
+    {
+        p->more_data = true;
+        return;
+    }
+    scheduleStream();
+}
+
+void Handler::scheduleStream()
+{
+    p->streaming = true;
+    p->more_data = false;
+    p->stream_weight = p->request->decode_cost();
+    p->stream_cancel_func = p->cpu_limiter->schedule([this]
+    {
+        run_stage(*p->pipeline, Pipeline::Stage::decode, p->streamWatcher, [this]
         {
-            return ByteArrayOrError{QByteArray(), e.what()};
-        }
-    };
-    p->createWatcher.setFuture(QtConcurrent::run(p->create_pool.get(), do_create));
+            if (!p->cancelled)
+            {
+                p->request->decode_received();
+            }
+            return QByteArray();
+        });
+    }, p->stream_weight);
+}
+
+void Handler::streamFinished()
+{
+    p->stream_cancel_func = nullptr;
+    p->cpu_limiter->done(p->stream_weight);
+    p->stream_weight = 0;
+    p->streaming = false;
+
+    // decode_received() never throws, so there is no error to check for.
+    if (p->more_data && !p->cancelled)
+    {
+        scheduleStream();
+        return;
+    }
+    if (p->downloaded)
+    {
+        p->downloaded = false;
+        finishDownload();
+    }
 }
 
 // create() picks up after the asynchronous download stage completes.
 // It effectively repeats the check() stage, except that thumbnailing
-// failures are now errors.  It is called synchronously in the thread
-// pool.
+// failures are now errors.  It is called synchronously in the decode
+// thread pool.
 
 QByteArray Handler::create()
 {
@@ -323,8 +679,10 @@ QByteArray Handler::create()
 
 void Handler::createFinished()
 {
+    decodeFinished();
     if (p->cancelled)
     {
+        sendCancelled();
         return;
     }
 
@@ -348,8 +706,27 @@ void Handler::createFinished()
     sendThumbnail(ba_error.ba);
 }
 
+void Handler::schedulerDone()
+{
+    p->scheduler_cancel_func = nullptr;
+    if (p->admitted)
+    {
+        p->admitted = false;
+        p->scheduler->done(p->client);
+    }
+}
+
+void Handler::sendCancelled()
+{
+    schedulerDone();
+    p->bus.send(p->message.createErrorReply(ART_ERROR, "Handler: " + details() + ": request cancelled"));
+    p->finish_time = chrono::system_clock::now();
+    Q_EMIT finished();
+}
+
 void Handler::sendThumbnail(QByteArray const& ba)
 {
+    schedulerDone();
     p->bus.send(p->message.createReply(QVariant(ba)));
     p->finish_time = chrono::system_clock::now();
     Q_EMIT finished();
@@ -357,11 +734,13 @@ void Handler::sendThumbnail(QByteArray const& ba)
 
 void Handler::sendError(QString const& error)
 {
-    if (p->request->status() == ThumbnailRequest::FetchStatus::hard_error ||
+    if (!p->resolved ||
+        p->request->status() == ThumbnailRequest::FetchStatus::hard_error ||
         p->request->status() == ThumbnailRequest::FetchStatus::temporary_error)
     {
         qWarning() << error;
     }
+    schedulerDone();
     p->bus.send(p->message.createErrorReply(ART_ERROR, error));
     p->finish_time = chrono::system_clock::now();
     Q_EMIT finished();
@@ -395,6 +774,16 @@ QString Handler::details() const
     return p->details;
 }
 
+QString const& Handler::request_id() const
+{
+    return p->request_id;
+}
+
+QString Handler::sender() const
+{
+    return p->message.service();
+}
+
 ThumbnailRequest::FetchStatus Handler::status() const
 {
     return p->request->status();
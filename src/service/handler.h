@@ -20,9 +20,12 @@
 
 #include "credentialscache.h"
 #include "inactivityhandler.h"
+#include "pipeline.h"
+#include <internal/fair_scheduler.h>
 #include <internal/thumbnailer.h>
 #include <ratelimiter.h>
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -31,8 +34,6 @@
 #include <QDBusMessage>
 #include <QSize>
 
-class QThreadPool;
-
 namespace unity
 {
 
@@ -48,43 +49,89 @@ class Handler : public QObject
 {
     Q_OBJECT
 public:
+    typedef std::function<std::unique_ptr<internal::ThumbnailRequest>()> RequestFactory;
+
     Handler(QDBusConnection const& bus,
             QDBusMessage const& message,
-            std::shared_ptr<QThreadPool> const& check_pool,
-            std::shared_ptr<QThreadPool> const& create_pool,
+            std::shared_ptr<Pipeline> const& pipeline,
+            std::shared_ptr<internal::FairScheduler> const& scheduler,
             std::shared_ptr<RateLimiter> const& limiter,
+            std::shared_ptr<RateLimiter> const& cpu_limiter,
             CredentialsCache& creds,
             InactivityHandler& inactivity_handler,
-            std::unique_ptr<internal::ThumbnailRequest>&& request,
-            QString const& details);
+            RequestFactory const& make_request,
+            QString const& details,
+            QString const& request_id);
     ~Handler();
 
     Handler(Handler const&) = delete;
     Handler& operator=(Handler&) = delete;
 
+    // Creates the request in the resolve stage of the pipeline, because
+    // that may have to wait for the file system. Emits resolved() once the
+    // request exists, and replies with an error and emits finished() if it
+    // could not be created.
+    void resolve();
+    bool is_resolved() const;
+
+    // key(), coalesce_with(), status() and status_as_string() require is_resolved().
+    // key() is the key that the request had when it was resolved, even if the
+    // request changes its key once it sees the client's credentials.
     std::string const& key() const;
+    void coalesce_with(Handler const& leader);  // leader must have the same key().
     std::chrono::microseconds completion_time() const;  // End-to-end time taken.
     std::chrono::microseconds queued_time() const;      // Time spent waiting in download/extract queue.
     std::chrono::microseconds download_time() const;    // Time of that for download/extract, incl. queueing time.
     QString details() const;
+    QString const& request_id() const;  // Id that the client gave the request, for Cancel().
+    QString sender() const;             // Bus name of the client.
     QString status_as_string() const;
     unity::thumbnailer::internal::ThumbnailRequest::FetchStatus status() const;
 
+    // What cancel() saved us from doing.
+    struct CancelOutcome
+    {
+        bool found = false;       // False if the request had been cancelled already.
+        bool dequeued = false;    // A job that was waiting for the scheduler or a limiter was dropped.
+        bool killed = false;      // A running extraction was stopped.
+    };
+
+    // Cancels the request because the client no longer wants the reply.
+    // Work that has not started is dropped, and an extraction that is running
+    // is stopped. The client gets an error reply, and finished() is emitted,
+    // as soon as nothing is running for the request any more, which may be
+    // before cancel() returns.
+    CancelOutcome cancel();
+
 public Q_SLOTS:
     void begin();
 
 private Q_SLOTS:
+    void resolveFinished();
+    void probeFinished();
+    void readSourceFinished();
     void checkFinished();
     void downloadFinished();
+    void downloadDataReceived();
+    void streamFinished();
     void createFinished();
 
 Q_SIGNALS:
+    void resolved();
     void finished();
 
 private:
+    void schedulerDone();
+    void sendCancelled();
     void sendThumbnail(QByteArray const& ba);
     void sendError(QString const& error);
     void gotCredentials(CredentialsCache::Credentials const& credentials);
+    QByteArray probe();
+    QByteArray readSource();
+    void scheduleDecode(bool after_download);
+    void scheduleStream();
+    void finishDownload();
+    void decodeFinished();
     QByteArray check();
     QByteArray create();
 
@@ -20,6 +20,7 @@
 #include "inactivityhandler.h"
 
 #include <internal/env_vars.h>
+#include <internal/settings.h>
 
 #include <QCoreApplication>
 #include <QDebug>
@@ -28,7 +29,8 @@
 #include <sstream>
 #include <string>
 
-const int MAX_INACTIVITY_TIME = 30000;  // max inactivity time before exiting the app, in milliseconds
+const int MAX_INACTIVITY_TIME = 30000;  // default inactivity time before exiting the app, in milliseconds
+const int MIN_INACTIVITY_TIME = 10000;  // lower limit for the adaptive inactivity time, in milliseconds
 
 namespace
 {
@@ -75,19 +77,66 @@ namespace thumbnailer
 namespace service
 {
 
-InactivityHandler::InactivityHandler(std::function<void()> const& timer_func)
+InactivityHandler::InactivityHandler(std::function<void()> const& timer_func, std::string const& history_path)
     : timer_func_(timer_func)
     , num_active_requests_(0)
+    , last_activity_(std::chrono::system_clock::now())
+    , seen_request_(false)
 {
+    using namespace std::chrono;
+    using namespace unity::thumbnailer::internal;
+
     assert(timer_func);
     connect(&timer_, &QTimer::timeout, this, &InactivityHandler::timer_expired);
-    timer_.setInterval(get_env_inactivity_time(MAX_INACTIVITY_TIME));
+
+    // THUMBNAILER_MAX_IDLE sets a fixed timeout, so the tests can rely on it.
+    int const env_time = get_env_inactivity_time(0);
+    if (env_time != 0)
+    {
+        policy_.reset(new IdlePolicy(milliseconds(env_time), milliseconds(env_time), milliseconds(env_time)));
+    }
+    else
+    {
+        Settings settings;
+        policy_.reset(new IdlePolicy(milliseconds(MIN_INACTIVITY_TIME),
+                                     milliseconds(MAX_INACTIVITY_TIME),
+                                     seconds(settings.max_idle_time())));
+        history_path_ = history_path;
+    }
+    if (!history_path_.empty())
+    {
+        try
+        {
+            policy_->load(history_path_);
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "InactivityHandler(): cannot load idle history:" << e.what();
+        }
+        // LCOV_EXCL_STOP
+    }
+    timer_.setInterval(policy_->timeout().count());
 }
 
 InactivityHandler::~InactivityHandler()
 {
     assert(num_active_requests_ == 0);
     timer_.stop();
+
+    if (!history_path_.empty())
+    {
+        try
+        {
+            policy_->save(history_path_, last_activity_);
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "~InactivityHandler(): cannot save idle history:" << e.what();
+        }
+        // LCOV_EXCL_STOP
+    }
 }
 
 void InactivityHandler::request_started()
@@ -97,6 +146,12 @@ void InactivityHandler::request_started()
     if (num_active_requests_++ == 0)
     {
         timer_.stop();
+        if (seen_request_)
+        {
+            auto const gap = std::chrono::steady_clock::now() - idle_since_;
+            policy_->add_gap(std::chrono::duration_cast<std::chrono::milliseconds>(gap));
+        }
+        seen_request_ = true;
     }
 }
 
@@ -106,12 +161,27 @@ void InactivityHandler::request_completed()
 
     if (--num_active_requests_ == 0)
     {
+        idle_since_ = std::chrono::steady_clock::now();
+        last_activity_ = std::chrono::system_clock::now();
+        timer_.setInterval(policy_->timeout().count());
         timer_.start();
     }
 }
 
+std::chrono::milliseconds InactivityHandler::timeout() const
+{
+    return policy_->timeout();
+}
+
+int64_t InactivityHandler::cold_starts_avoided() const
+{
+    return policy_->cold_starts_avoided();
+}
+
 void InactivityHandler::timer_expired()
 {
+    qDebug().nospace() << "Idle timeout of " << timer_.interval() / 1000.0 << " sec reached ("
+                       << policy_->cold_starts_avoided() << " cold starts avoided).";
     try
     {
         timer_func_();
@@ -18,10 +18,14 @@
 
 #pragma once
 
+#include <internal/idle_policy.h>
+
 #include <QObject>
 #include <QTimer>
 
 #include <functional>
+#include <memory>
+#include <string>
 
 namespace unity
 {
@@ -36,12 +40,18 @@ class InactivityHandler : public QObject
 {
     Q_OBJECT
 public:
-    InactivityHandler(std::function<void()> const& timer_func);
+    // If history_path is not empty, the idle gaps we observe are saved there, so
+    // the next instance of the service can adapt its idle timeout to them.
+    InactivityHandler(std::function<void()> const& timer_func,
+                      std::string const& history_path = std::string());
     ~InactivityHandler();
 
     void request_started();
     void request_completed();
 
+    std::chrono::milliseconds timeout() const;
+    int64_t cold_starts_avoided() const;
+
 public Q_SLOTS:
     void timer_expired();
 
@@ -49,6 +59,11 @@ private:
     std::function<void()> timer_func_;
     int num_active_requests_;
     QTimer timer_;
+    std::unique_ptr<unity::thumbnailer::internal::IdlePolicy> policy_;
+    std::string history_path_;
+    std::chrono::steady_clock::time_point idle_since_;
+    std::chrono::system_clock::time_point last_activity_;
+    bool seen_request_;
 };
 
 }  // namespace service
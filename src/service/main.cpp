@@ -23,12 +23,18 @@
 #include "dbusinterfaceadaptor.h"
 #include "inactivityhandler.h"
 #include <internal/file_lock.h>
+#include <internal/media_watcher.h>
+#include <internal/settings.h>
 #include <internal/trace.h>
 #include <service/dbus_names.h>
 
 #include <QCoreApplication>
+#include <QTimer>
 
+#include <algorithm>
 #include <cstdio>
+#include <future>
+#include <thread>
 #include <sys/stat.h>
 
 using namespace std;
@@ -67,6 +73,33 @@ void show_stats(shared_ptr<Thumbnailer> const& thumbnailer)
     qDebug() << qUtf8Printable("failure cache:   " + get_summary(stats.failure_stats));
 }
 
+// Returns a watcher that has the thumbnailer make thumbnails for new media files
+// in the background, or null if that is disabled.
+
+unique_ptr<MediaWatcher> make_media_watcher(Settings const& settings, shared_ptr<Thumbnailer> const& thumbnailer)
+{
+    if (!settings.watch_new_media())
+    {
+        return nullptr;
+    }
+    auto dirs = settings.new_media_directories();
+    if (dirs.empty())
+    {
+        dirs = MediaWatcher::default_directories();
+    }
+    vector<QSize> sizes;
+    for (int size : settings.new_media_sizes())
+    {
+        sizes.emplace_back(size, size);
+    }
+    unique_ptr<MediaWatcher> watcher(new MediaWatcher(dirs, [thumbnailer, sizes](string const& path)
+    {
+        thumbnailer->generate_in_background(path, sizes);
+    }));
+    qDebug() << "Watching" << watcher->watched_directories() << "directories for new media";
+    return watcher;
+}
+
 }  // namespace
 
 int main(int argc, char** argv)
@@ -91,16 +124,33 @@ int main(int argc, char** argv)
             throw runtime_error("Could not acquire file lock within 10 seconds");
         }
 
+        // Opening the caches is the slowest part of start-up, so we do that in the background
+        // while we connect to the bus and acquire our name. Requests that arrive in the mean
+        // time wait in the connection's queue until we enter the event loop.
+        shared_future<shared_ptr<Thumbnailer>> thumbnailer = async(launch::async, []
+        {
+            return make_shared<Thumbnailer>();
+        }).share();
+
         QCoreApplication app(argc, argv);
 
-        auto inactivity_handler = make_shared<InactivityHandler>([&]{ qDebug() << "Idle timeout reached."; app.quit(); });
+        auto inactivity_handler = make_shared<InactivityHandler>([&]{ app.quit(); },
+                                                                 cache_dir + "/unity-thumbnailer/idle-history");
+
+        auto pipeline = make_shared<unity::thumbnailer::service::Pipeline>();
 
-        auto thumbnailer = make_shared<Thumbnailer>();
+        // Enough requests run at a time to keep the downloads and all stages of the pipeline
+        // busy. Beyond that, clients take turns.
+        Settings settings;
+        int const cores = max(int(thread::hardware_concurrency()), 1);
+        auto scheduler = make_shared<FairScheduler>(settings.max_downloads() + 2 * cores,
+                                                    settings.boosted_clients());
 
-        unity::thumbnailer::service::DBusInterface server(thumbnailer, inactivity_handler);
+        unity::thumbnailer::service::DBusInterface server(thumbnailer, inactivity_handler, pipeline, scheduler);
         new ThumbnailerAdaptor(&server);
 
-        unity::thumbnailer::service::AdminInterface admin_server(move(thumbnailer), move(inactivity_handler));
+        unity::thumbnailer::service::AdminInterface admin_server(thumbnailer, move(inactivity_handler), move(pipeline),
+                                                                 move(scheduler), server);
         new ThumbnailerAdminAdaptor(&admin_server);
 
         auto bus = QDBusConnection::sessionBus();
@@ -108,6 +158,7 @@ int main(int argc, char** argv)
         bus.registerObject(ADMIN_BUS_PATH, &admin_server);
 
         qDBusRegisterMetaType<unity::thumbnailer::service::AllStats>();
+        qDBusRegisterMetaType<unity::thumbnailer::service::CounterMap>();
         qDBusRegisterMetaType<unity::thumbnailer::service::ConfigValues>();
 
         if (!bus.registerService(BUS_NAME))
@@ -115,8 +166,18 @@ int main(int argc, char** argv)
             throw runtime_error(string("thumbnailer-service: Could not acquire DBus name ") + BUS_NAME);
         }
 
+        thumbnailer.get();  // Throws if we could not open the caches.
+
+        // Reading the hot set can wait until the event loop is running.
+        QTimer::singleShot(0, &app, [thumbnailer]{ thumbnailer.get()->preload_hot_set(); });
+
+        auto media_watcher = make_media_watcher(settings, thumbnailer.get());
+        admin_server.resume_indexing();
+
         // Print basic cache stats on start-up. This is useful when examining log entries.
-        show_stats(thumbnailer);
+        // Walking the stats takes a while for large caches, so we don't hold up the
+        // first request for that.
+        auto stats_shown = async(launch::async, [thumbnailer]{ show_stats(thumbnailer.get()); });
 
         rc = app.exec();
 
@@ -127,6 +188,10 @@ int main(int argc, char** argv)
             throw runtime_error(string("thumbnailer-service: Could not release DBus name ") + BUS_NAME);  // LCOV_EXCL_LINE
         }
 
+        // Drop our reference, so the thumbnailer (and the network manager of its
+        // downloader) is destroyed with the interfaces, while the application still exists.
+        thumbnailer = shared_future<shared_ptr<Thumbnailer>>();
+
         qDebug() << "Exiting";
     }
     catch (std::exception const& e)
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.h"
+
+#include <QThread>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+namespace
+{
+
+char const* const STAGE_NAMES[] = { "resolve", "probe", "read", "decode" };
+
+}  // namespace
+
+Pipeline::Pipeline()
+{
+    static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == size_t(Stage::LAST__), "missing stage name");
+
+    // The I/O stages spend most of their time waiting, so they get more
+    // threads than there are cores. The decode stage is CPU-bound, so more
+    // threads than cores would only add contention.
+    int const cores = max(QThread::idealThreadCount(), 1);
+    stages_[int(Stage::resolve)].pool.setMaxThreadCount(2 * cores);
+    stages_[int(Stage::probe)].pool.setMaxThreadCount(2 * cores);
+    stages_[int(Stage::read)].pool.setMaxThreadCount(2 * cores);
+    stages_[int(Stage::decode)].pool.setMaxThreadCount(cores);
+}
+
+Pipeline::~Pipeline()
+{
+    for (auto& s : stages_)
+    {
+        s.pool.waitForDone();
+    }
+}
+
+map<string, int64_t> Pipeline::counters() const
+{
+    map<string, int64_t> counters;
+    for (int i = 0; i < int(Stage::LAST__); ++i)
+    {
+        auto const& s = stages_[i];
+        string const prefix = string("pipeline.") + STAGE_NAMES[i] + ".";
+        counters[prefix + "threads"] = s.pool.maxThreadCount();
+        counters[prefix + "queued"] = s.queued;
+        counters[prefix + "max_queued"] = s.max_queued;
+        counters[prefix + "active"] = s.active;
+        counters[prefix + "completed"] = s.completed;
+    }
+    return counters;
+}
+
+void Pipeline::enqueue(StageData& s)
+{
+    int const queued = ++s.queued;
+    int max_queued = s.max_queued;
+    while (queued > max_queued && !s.max_queued.compare_exchange_weak(max_queued, queued))
+    {
+    }
+}
+
+Pipeline::Job::Job(StageData& s)
+    : s_(s)
+{
+    --s_.queued;
+    ++s_.active;
+}
+
+Pipeline::Job::~Job()
+{
+    --s_.active;
+    ++s_.completed;
+}
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QFuture>
+#include <QtConcurrent>
+#include <QThreadPool>
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <type_traits>
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace service
+{
+
+// The thread pools that requests run in. Each stage of a request has a pool
+// of its own, so requests that wait for the disk cannot hold up requests that
+// need the CPU, and vice versa:
+//
+// - resolve: canonicalising and stat()ing local file names (waits for the
+//            file system, which can be slow for network or sleeping media).
+// - probe:  look-ups in the persistent caches (waits for leveldb).
+// - read:   sniffing the content type and reading local source files.
+// - decode: decoding, scaling, and encoding images.
+//
+// Downloads and extractions are limited separately by a RateLimiter, and
+// writes to the persistent caches are done behind the reply by the caches
+// themselves.
+
+class Pipeline final
+{
+public:
+    enum class Stage { resolve, probe, read, decode, LAST__ };
+
+    Pipeline();
+    ~Pipeline();
+
+    Pipeline(Pipeline const&) = delete;
+    Pipeline& operator=(Pipeline const&) = delete;
+
+    // Runs func in the pool for stage.
+    template<typename F>
+    QFuture<typename std::result_of<F()>::type> run(Stage stage, F func);
+
+    // Number of queued, running, and completed jobs for each stage,
+    // keyed by names such as "pipeline.probe.queued".
+    std::map<std::string, int64_t> counters() const;
+
+private:
+    struct StageData
+    {
+        QThreadPool pool;
+        std::atomic<int> queued{0};
+        std::atomic<int> active{0};
+        std::atomic<int> max_queued{0};
+        std::atomic<int64_t> completed{0};
+    };
+
+    // Moves a job from queued to active while it runs.
+    class Job final
+    {
+    public:
+        Job(StageData& s);
+        ~Job();
+
+    private:
+        StageData& s_;
+    };
+
+    void enqueue(StageData& s);
+
+    StageData stages_[int(Stage::LAST__)];
+};
+
+template<typename F>
+QFuture<typename std::result_of<F()>::type> Pipeline::run(Stage stage, F func)
+{
+    auto& s = stages_[int(stage)];
+    enqueue(s);
+    return QtConcurrent::run(&s.pool, [&s, func]() -> typename std::result_of<F()>::type
+    {
+        Job job(s);
+        return func();
+    });
+}
+
+}  // namespace service
+
+}  // namespace thumbnailer
+
+}  // namespace unity
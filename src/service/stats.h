@@ -19,6 +19,7 @@
 #pragma once
 
 #include <QDBusArgument>
+#include <QMap>
 
 #include <chrono>
 
@@ -62,6 +63,10 @@ struct AllStats
     CacheStats failure_stats;
 };
 
+// Counters that are not part of the cache stats, keyed by a dotted
+// name, such as "coalescing.hits".
+typedef QMap<QString, qint64> CounterMap;
+
 }  // namespace service
 
 }  // namespace thumbnailer
@@ -30,6 +30,7 @@
 
 #include <chrono>
 #include <memory>
+#include <sstream>
 
 using namespace std;
 
@@ -42,6 +43,29 @@ namespace thumbnailer
 namespace internal
 {
 
+namespace
+{
+
+// Splits a list into its elements, dropping leading and trailing white space and empty elements.
+
+vector<string> split_list(string const& list, char separator)
+{
+    vector<string> elements;
+    istringstream s(list);
+    string element;
+    while (getline(s, element, separator))
+    {
+        auto const begin = element.find_first_not_of(" \t");
+        if (begin != string::npos)
+        {
+            elements.push_back(element.substr(begin, element.find_last_not_of(" \t") - begin + 1));
+        }
+    }
+    return elements;
+}
+
+}  // namespace
+
 Settings::Settings()
     : Settings("com.canonical.Unity.Thumbnailer")
 {
@@ -85,6 +109,11 @@ int Settings::failure_cache_size() const
     return get_positive_int("failure-cache-size", FAILURE_CACHE_SIZE_DEFAULT);
 }
 
+int Settings::memory_cache_size() const
+{
+    return get_positive_or_zero_int("memory-cache-size", MEMORY_CACHE_SIZE_DEFAULT);
+}
+
 int Settings::max_thumbnail_size() const
 {
     return get_positive_int("max-thumbnail-size", MAX_THUMBNAIL_SIZE_DEFAULT);
@@ -114,6 +143,11 @@ int Settings::max_downloads() const
     return get_positive_int("max-downloads", MAX_DOWNLOADS_DEFAULT);
 }
 
+int Settings::max_download_size() const
+{
+    return get_positive_int("max-download-size", MAX_DOWNLOAD_SIZE_DEFAULT);
+}
+
 int Settings::max_extractions() const
 {
     return get_positive_or_zero_int("max-extractions", MAX_EXTRACTIONS_DEFAULT);
@@ -124,6 +158,16 @@ int Settings::extraction_timeout() const
     return get_positive_int("extraction-timeout", EXTRACTION_TIMEOUT_DEFAULT);
 }
 
+int Settings::max_idle_time() const
+{
+    return get_positive_int("max-idle-time", MAX_IDLE_TIME_DEFAULT);
+}
+
+vector<string> Settings::boosted_clients() const
+{
+    return split_list(get_string("boosted-clients", BOOSTED_CLIENTS_DEFAULT), ',');
+}
+
 int Settings::max_backlog() const
 {
     return get_positive_int("max-backlog", MAX_BACKLOG_DEFAULT);
@@ -164,6 +208,75 @@ int Settings::log_level() const
     return log_level;
 }
 
+bool Settings::watch_new_media() const
+{
+    return get_bool("watch-new-media", WATCH_NEW_MEDIA_DEFAULT);
+}
+
+vector<string> Settings::new_media_directories() const
+{
+    return split_list(get_string("new-media-directories", NEW_MEDIA_DIRECTORIES_DEFAULT), ':');
+}
+
+vector<int> Settings::new_media_sizes() const
+{
+    vector<int> sizes;
+    for (auto const& size : split_list(get_string("new-media-sizes", NEW_MEDIA_SIZES_DEFAULT), ','))
+    {
+        size_t end = 0;
+        int i = 0;
+        try
+        {
+            i = stoi(size, &end);
+        }
+        catch (std::exception const&)
+        {
+        }
+        if (i <= 0 || end != size.size())
+        {
+            throw domain_error("Settings::new_media_sizes(): invalid size for new-media-sizes: \"" + size
+                               + "\" in schema " + schema_name_);
+        }
+        sizes.push_back(i);
+    }
+    return sizes;
+}
+
+bool Settings::index_media() const
+{
+    return get_bool("index-media", INDEX_MEDIA_DEFAULT);
+}
+
+bool Settings::prefetch_siblings() const
+{
+    return get_bool("prefetch-siblings", PREFETCH_SIBLINGS_DEFAULT);
+}
+
+bool Settings::read_desktop_thumbnails() const
+{
+    return get_bool("read-desktop-thumbnails", READ_DESKTOP_THUMBNAILS_DEFAULT);
+}
+
+bool Settings::write_desktop_thumbnails() const
+{
+    return get_bool("write-desktop-thumbnails", WRITE_DESKTOP_THUMBNAILS_DEFAULT);
+}
+
+bool Settings::volume_caches() const
+{
+    return get_bool("volume-caches", VOLUME_CACHES_DEFAULT);
+}
+
+int Settings::volume_cache_size() const
+{
+    return get_positive_int("volume-cache-size", VOLUME_CACHE_SIZE_DEFAULT);
+}
+
+int Settings::volume_cache_total_size() const
+{
+    return get_positive_int("volume-cache-total-size", VOLUME_CACHE_TOTAL_SIZE_DEFAULT);
+}
+
 string Settings::get_string(char const* key, string const& default_value) const
 {
     if (!settings_ || !g_settings_schema_has_key(schema_.get(), key))
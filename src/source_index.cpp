@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/source_index.h>
+
+#include <internal/cache_key.h>
+#include <internal/file_io.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+string const HEADER = "thumbnailer-source-index 1\n";
+
+bool is_empty(SourceIndex::Record const& r)
+{
+    return r.thumbnail_sizes.empty() && !r.has_full_size && !r.failed;
+}
+
+}  // namespace
+
+bool SourceIndex::Lookup::may_have_thumbnail(QSize const& size) const
+{
+    auto const& sizes = record.thumbnail_sizes;
+    return !complete[int(Tier::thumbnail)] || find(sizes.begin(), sizes.end(), size) != sizes.end();
+}
+
+bool SourceIndex::Lookup::may_have_full_size() const
+{
+    return !complete[int(Tier::full_size)] || record.has_full_size;
+}
+
+bool SourceIndex::Lookup::may_have_failure() const
+{
+    if (!complete[int(Tier::failure)])
+    {
+        return true;
+    }
+    if (!record.failed)
+    {
+        return false;
+    }
+    return record.failure_expiry == chrono::system_clock::time_point()
+           || record.failure_expiry > chrono::system_clock::now();
+}
+
+SourceIndex::SourceIndex()
+{
+    fill(begin(complete_), end(complete_), false);
+}
+
+SourceIndex::~SourceIndex() = default;
+
+SourceIndex::Lookup SourceIndex::lookup(string const& key) const
+{
+    lock_guard<mutex> lock(mutex_);
+
+    Lookup l;
+    copy(begin(complete_), end(complete_), begin(l.complete));
+    auto it = records_.find(key);
+    if (it != records_.end())
+    {
+        l.record = it->second;
+    }
+    return l;
+}
+
+void SourceIndex::add_thumbnail(string const& key, QSize const& size)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto& sizes = records_[key].thumbnail_sizes;
+    if (find(sizes.begin(), sizes.end(), size) == sizes.end())
+    {
+        sizes.push_back(size);
+    }
+}
+
+void SourceIndex::remove_thumbnail(string const& key, QSize const& size)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = records_.find(key);
+    if (it != records_.end())
+    {
+        auto& sizes = it->second.thumbnail_sizes;
+        sizes.erase(remove(sizes.begin(), sizes.end(), size), sizes.end());
+        drop_if_empty(it);
+    }
+}
+
+void SourceIndex::set_full_size(string const& key, bool present)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    if (present)
+    {
+        records_[key].has_full_size = true;
+        return;
+    }
+    auto it = records_.find(key);
+    if (it != records_.end())
+    {
+        it->second.has_full_size = false;
+        drop_if_empty(it);
+    }
+}
+
+void SourceIndex::set_failure(string const& key, chrono::system_clock::time_point expiry)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto& r = records_[key];
+    r.failed = true;
+    r.failure_expiry = expiry;
+}
+
+void SourceIndex::remove_failure(string const& key)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto it = records_.find(key);
+    if (it != records_.end())
+    {
+        it->second.failed = false;
+        it->second.failure_expiry = chrono::system_clock::time_point();
+        drop_if_empty(it);
+    }
+}
+
+void SourceIndex::set_source_info(string const& key, QSize const& source_size, string const& content_type)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    auto& r = records_[key];
+    if (source_size.isValid())
+    {
+        r.source_size = source_size;
+    }
+    if (!content_type.empty())
+    {
+        r.content_type = content_type;
+    }
+}
+
+void SourceIndex::cache_event(Tier tier, string const& key, bool added)
+{
+    if (key.empty())
+    {
+        assert(!added);
+        clear(tier, true);
+        return;
+    }
+    switch (tier)
+    {
+        case Tier::full_size:
+            set_full_size(key, added);
+            break;
+        case Tier::thumbnail:
+        {
+            string source_key;
+            QSize size;
+            if (!split_sized_cache_key(key, source_key, size))
+            {
+                break;  // LCOV_EXCL_LINE
+            }
+            if (added)
+            {
+                add_thumbnail(source_key, size);
+            }
+            else
+            {
+                remove_thumbnail(source_key, size);
+            }
+            break;
+        }
+        case Tier::failure:
+            if (added)
+            {
+                // The caller sets the expiry time with set_failure(), which may happen
+                // before the event for a delayed write arrives, so we leave it alone here.
+                lock_guard<mutex> lock(mutex_);
+                records_[key].failed = true;
+            }
+            else
+            {
+                remove_failure(key);
+            }
+            break;
+        default:
+            abort();  // LCOV_EXCL_LINE  // Impossible
+    }
+}
+
+void SourceIndex::clear(Tier tier, bool complete)
+{
+    lock_guard<mutex> lock(mutex_);
+
+    clear_tier(tier);
+    complete_[int(tier)] = complete;
+}
+
+void SourceIndex::set_complete(Tier tier, bool complete)
+{
+    lock_guard<mutex> lock(mutex_);
+    complete_[int(tier)] = complete;
+}
+
+bool SourceIndex::complete(Tier tier) const
+{
+    lock_guard<mutex> lock(mutex_);
+    return complete_[int(tier)];
+}
+
+int64_t SourceIndex::size() const
+{
+    lock_guard<mutex> lock(mutex_);
+    return records_.size();
+}
+
+void SourceIndex::save(string const& path, vector<string> const& tokens) const
+{
+    assert(tokens.size() == size_t(Tier::LAST__));
+
+    lock_guard<mutex> lock(mutex_);
+
+    ostringstream s;
+    s << HEADER;
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        assert(!tokens[i].empty() && tokens[i].find('\n') == string::npos);
+        s << (complete_[i] ? tokens[i] : "") << '\n';  // An empty token never matches.
+    }
+
+    for (auto const& entry : records_)
+    {
+        auto const& r = entry.second;
+        if (is_empty(r))
+        {
+            continue;  // Nothing cached for this source.
+        }
+        auto expiry = chrono::duration_cast<chrono::seconds>(r.failure_expiry.time_since_epoch()).count();
+        s << entry.first.size() << ' ' << r.has_full_size << ' ' << r.failed << ' ' << expiry << ' '
+          << r.source_size.width() << ' ' << r.source_size.height() << ' ' << r.content_type.size() << ' '
+          << r.thumbnail_sizes.size();
+        for (auto const& size : r.thumbnail_sizes)
+        {
+            s << ' ' << size.width() << ' ' << size.height();
+        }
+        s << '\n' << entry.first << r.content_type << '\n';
+    }
+    write_file(path, s.str());
+}
+
+bool SourceIndex::load(string const& path, vector<string> const& tokens)
+{
+    assert(tokens.size() == size_t(Tier::LAST__));
+
+    if (!boost::filesystem::exists(path))
+    {
+        return false;
+    }
+    string contents = read_file(path);
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+
+    if (contents.compare(0, HEADER.size(), HEADER) != 0)
+    {
+        return false;
+    }
+    istringstream s(contents.substr(HEADER.size()));
+
+    bool matches[int(Tier::LAST__)];
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        string saved_token;
+        if (!getline(s, saved_token))
+        {
+            return false;
+        }
+        matches[i] = saved_token == tokens[i];
+    }
+
+    unordered_map<string, Record> records;
+    size_t key_len;
+    while (s >> key_len)
+    {
+        Record r;
+        int64_t expiry;
+        int w, h;
+        size_t type_len, num_sizes;
+        if (!(s >> r.has_full_size >> r.failed >> expiry >> w >> h >> type_len >> num_sizes))
+        {
+            return false;
+        }
+        r.failure_expiry = chrono::system_clock::time_point(chrono::seconds(expiry));
+        r.source_size = QSize(w, h);
+        for (size_t i = 0; i < num_sizes; ++i)
+        {
+            if (!(s >> w >> h))
+            {
+                return false;
+            }
+            r.thumbnail_sizes.push_back(QSize(w, h));
+        }
+        string key(key_len, '\0');
+        r.content_type.resize(type_len);
+        if (s.get() != '\n' || !s.read(&key[0], key_len) || !s.read(&r.content_type[0], type_len)
+            || s.get() != '\n')
+        {
+            return false;
+        }
+
+        // Entries for a cache that changed since the index was saved may be stale.
+        if (!matches[int(Tier::full_size)])
+        {
+            r.has_full_size = false;
+        }
+        if (!matches[int(Tier::thumbnail)])
+        {
+            r.thumbnail_sizes.clear();
+        }
+        if (!matches[int(Tier::failure)])
+        {
+            r.failed = false;
+        }
+        if (!is_empty(r))
+        {
+            records.emplace(move(key), move(r));
+        }
+    }
+    if (!s.eof())
+    {
+        return false;  // LCOV_EXCL_LINE
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    records_ = move(records);
+    copy(begin(matches), end(matches), begin(complete_));
+    return true;
+}
+
+void SourceIndex::clear_tier(Tier tier)
+{
+    for (auto it = records_.begin(); it != records_.end(); )
+    {
+        auto& r = it->second;
+        switch (tier)
+        {
+            case Tier::full_size:
+                r.has_full_size = false;
+                break;
+            case Tier::thumbnail:
+                r.thumbnail_sizes.clear();
+                break;
+            case Tier::failure:
+                r.failed = false;
+                r.failure_expiry = chrono::system_clock::time_point();
+                break;
+            default:
+                abort();  // LCOV_EXCL_LINE  // Impossible
+        }
+        it = is_empty(r) ? records_.erase(it) : next(it);
+    }
+}
+
+void SourceIndex::drop_if_empty(unordered_map<string, Record>::iterator it)
+{
+    if (is_empty(it->second))
+    {
+        records_.erase(it);
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
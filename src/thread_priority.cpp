@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/thread_priority.h>
+
+#include <internal/safe_strerror.h>
+
+#include <QDebug>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// From linux/ioprio.h, which glibc doesn't provide.
+int const IOPRIO_WHO_PROCESS = 1;
+int const IOPRIO_CLASS_IDLE = 3;
+int const IOPRIO_CLASS_SHIFT = 13;
+
+}  // namespace
+
+void lower_thread_priority()
+{
+    pid_t const tid = syscall(SYS_gettid);
+
+    // If SCHED_IDLE is not available, the lowest nice value comes close.
+    sched_param param = {};
+    if (sched_setscheduler(tid, SCHED_IDLE, &param) == -1)
+    {
+        // LCOV_EXCL_START
+        qWarning() << "lower_thread_priority(): cannot set SCHED_IDLE:" << safe_strerror(errno).c_str();
+        if (setpriority(PRIO_PROCESS, tid, 19) == -1)
+        {
+            qWarning() << "lower_thread_priority(): cannot set nice value:" << safe_strerror(errno).c_str();
+        }
+        // LCOV_EXCL_STOP
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+    {
+        qWarning() << "lower_thread_priority(): cannot set I/O priority:" << safe_strerror(errno).c_str();  // LCOV_EXCL_LINE
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
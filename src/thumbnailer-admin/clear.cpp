@@ -48,7 +48,7 @@ Clear::Clear(QCommandLineParser& parser)
     {
         parser.addPositionalArgument(QStringLiteral("compact"), QStringLiteral("Compact caches"), QStringLiteral("compact"));
     }
-    parser.addPositionalArgument(QStringLiteral("cache_id"), QStringLiteral("Select cache (i=image, t=thumbnail, f=failure)"), QStringLiteral("[cache_id]"));
+    parser.addPositionalArgument(QStringLiteral("cache_id"), QStringLiteral("Select cache (i=image, t=thumbnail, f=failure, m=memory)"), QStringLiteral("[cache_id]"));
 
     if (!parser.parse(QCoreApplication::arguments()))
     {
@@ -67,7 +67,7 @@ Clear::Clear(QCommandLineParser& parser)
 
     if (args.size() == 2)
     {
-        QStringList valid_args{ "", "i", "t", "f" };  // Must stay in sync with CacheSelector enum in thumbnailer.h!
+        QStringList valid_args{ "", "i", "t", "f", "m" };  // Must stay in sync with CacheSelector enum in thumbnailer.h!
         auto arg = args[1];
         for (int i = 0; i < valid_args.size(); ++i)
         {
@@ -114,7 +114,7 @@ void GetLocalThumbnail::run(DBusConnection& conn)
 {
     try
     {
-        auto reply = conn.thumbnailer().GetThumbnail(input_path_, size_);
+        auto reply = conn.thumbnailer().GetThumbnail(input_path_, size_, QString());  // Never cancelled.
         reply.waitForFinished();
         if (!reply.isValid())
         {
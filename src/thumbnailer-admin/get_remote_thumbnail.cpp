@@ -99,7 +99,7 @@ void GetRemoteThumbnail::run(DBusConnection& conn)
         auto method = command_ == QLatin1String("get-artist")
                         ? &ThumbnailerInterface::GetArtistArt
                         : &ThumbnailerInterface::GetAlbumArt;
-        auto reply = (conn.thumbnailer().*method)(artist_, album_, size_);
+        auto reply = (conn.thumbnailer().*method)(artist_, album_, size_, QString());  // Never cancelled.
         reply.waitForFinished();
         if (!reply.isValid())
         {
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "index.h"
+
+#include <cassert>
+#include <cstdio>
+#include <inttypes.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace tools
+{
+
+Index::Index(QCommandLineParser& parser)
+    : Action(parser)
+{
+    assert(command_ == "index");
+    parser.addPositionalArgument(QStringLiteral("index"), QStringLiteral("Index media files"), QStringLiteral("index"));
+    parser.addPositionalArgument(QStringLiteral("operation"), QStringLiteral("start or stop indexing (default: show progress)"), QStringLiteral("[start|stop]"));
+
+    if (!parser.parse(QCoreApplication::arguments()))
+    {
+        throw parser.errorText() + "\n\n" + parser.helpText();
+    }
+    if (parser.isSet(help_option_))
+    {
+        throw parser.helpText();
+    }
+
+    auto args = parser.positionalArguments();
+    if (args.size() > 2)
+    {
+        throw QStringLiteral("too many arguments for ") + command_ + " command" + parser.errorText() + "\n\n" + parser.helpText();
+    }
+    if (args.size() == 2)
+    {
+        operation_ = args[1];
+        if (operation_ != QLatin1String("start") && operation_ != QLatin1String("stop"))
+        {
+            throw QStringLiteral("invalid operation: ") + operation_ + "\n" + parser.helpText();
+        }
+    }
+}
+
+Index::~Index()
+{
+}
+
+void Index::run(DBusConnection& conn)
+{
+    if (!operation_.isEmpty())
+    {
+        auto reply = operation_ == QLatin1String("start") ? conn.admin().StartIndexing() : conn.admin().StopIndexing();
+        reply.waitForFinished();
+        if (!reply.isValid())
+        {
+            throw reply.error().message();  // LCOV_EXCL_LINE
+        }
+    }
+
+    auto reply = conn.admin().Counters();
+    reply.waitForFinished();
+    if (!reply.isValid())
+    {
+        throw reply.error().message();  // LCOV_EXCL_LINE
+    }
+    auto counters = reply.value();
+    for (auto it = counters.cbegin(); it != counters.cend(); ++it)
+    {
+        if (it.key().startsWith(QLatin1String("index.")))
+        {
+            printf("%-27s%" PRId64 "\n", qPrintable(it.key().mid(6) + ":"), int64_t(it.value()));
+        }
+    }
+}
+
+}  // namespace tools
+
+}  // namespace thumbnailer
+
+}  // namespace unity
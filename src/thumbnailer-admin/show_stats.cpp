@@ -74,18 +74,21 @@ ShowStats::ShowStats(QCommandLineParser& parser)
             show_image_stats_ = true;
             show_thumbnail_stats_ = false;
             show_failure_stats_ = false;
+            show_counters_ = false;
         }
         else if (arg == QLatin1String("t"))
         {
             show_image_stats_ = false;
             show_thumbnail_stats_ = true;
             show_failure_stats_ = false;
+            show_counters_ = false;
         }
         else if (arg == QLatin1String("f"))
         {
             show_image_stats_ = false;
             show_thumbnail_stats_ = false;
             show_failure_stats_ = true;
+            show_counters_ = false;
         }
         else
         {
@@ -216,6 +219,23 @@ void ShowStats::run(DBusConnection& conn)
         printf("%s\n", "Failure cache:");
         show_stats(st.failure_stats);
     }
+    if (show_counters_)
+    {
+        qDBusRegisterMetaType<unity::thumbnailer::service::CounterMap>();
+
+        auto counters_reply = conn.admin().Counters();
+        counters_reply.waitForFinished();
+        if (!counters_reply.isValid())
+        {
+            throw counters_reply.error().message();  // LCOV_EXCL_LINE
+        }
+        auto counters = counters_reply.value();
+        printf("%s\n", "Counters:");
+        for (auto it = counters.cbegin(); it != counters.cend(); ++it)
+        {
+            printf("    %-23s%" PRId64 "\n", qPrintable(it.key() + ":"), int64_t(it.value()));
+        }
+    }
 }
 
 }  // namespace tools
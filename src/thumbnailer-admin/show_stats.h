@@ -46,6 +46,7 @@ private:
     bool show_image_stats_ = true;
     bool show_thumbnail_stats_ = true;
     bool show_failure_stats_ = true;
+    bool show_counters_ = true;
 };
 
 }  // namespace tools
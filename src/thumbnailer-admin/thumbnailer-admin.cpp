@@ -20,6 +20,7 @@
 #include "dbus_connection.h"
 #include "get_local_thumbnail.h"
 #include "get_remote_thumbnail.h"
+#include "index.h"
 #include "show_stats.h"
 #include "shutdown.h"
 
@@ -61,6 +62,7 @@ ActionMap const valid_actions =
     { "get-album",   { &create_action<GetRemoteThumbnail>, "Get album thumbnail" } },
     { "clear",       { &create_action<Clear>,              "Clear caches" } },
     { "compact",     { &create_action<Clear>,              "Compact caches" } },
+    { "index",       { &create_action<Index>,              "Start or stop indexing media files" } },
     { "shutdown",    { &create_action<Shutdown>,           "Shut down thumbnailer service" } }
 };
 
@@ -21,8 +21,11 @@
 #include <internal/thumbnailer.h>
 
 #include <internal/artreply.h>
+#include <internal/cache_key.h>
 #include <internal/cachehelper.h>
 #include <internal/check_access.h>
+#include <internal/content_index.h>
+#include <internal/file_io.h>
 #include <internal/image.h>
 #include <internal/imageextractor.h>
 #include <internal/local_album_art.h>
@@ -31,15 +34,24 @@
 #include <internal/raii.h>
 #include <internal/safe_strerror.h>
 #include <internal/settings.h>
+#include <internal/thread_priority.h>
 #include <internal/ubuntuserverdownloader.h>
 #include <internal/version.h>
 
 #include <boost/filesystem.hpp>
+#include <QEventLoop>
+#include <QTimer>
 #include <unity/UnityExceptions.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <sstream>
+
 using namespace std;
 
 namespace unity
@@ -60,6 +72,34 @@ enum class Location
     remote
 };
 
+// Largest image file that read_source() reads into memory.
+off_t const MAX_READ_SOURCE_SIZE = 32 * 1024 * 1024;
+
+// Decoding this many bytes of an image costs a quarter of a core (see ThumbnailRequest::decode_cost()).
+size_t const BYTES_PER_COST = 2 * 1024 * 1024;
+
+// Thumbnails up to this size can usually be made from the thumbnail embedded in a photo's EXIF data.
+int const EXIF_THUMBNAIL_SIZE = 160;
+
+// Number of local files whose metadata we remember.
+int const FILE_INFO_CACHE_ENTRIES = 2000;
+
+// Number of content hashes we remember for each of the thumbnail and full-size caches.
+int const CONTENT_INDEX_ENTRIES = 10000;
+
+// Number of albums for which we remember a local file with embedded art.
+int const ALBUM_INDEX_ENTRIES = 20000;
+
+// A reference can refer to an entry that was stored as a reference itself
+// (if that entry was evicted and made again), but not indefinitely.
+int const MAX_REFERENCE_DEPTH = 4;
+
+// Key for downloaded album art, which all clients share.
+string album_key(string const& artist, string const& album)
+{
+    return artist + '\0' + album + '\0' + "album";
+}
+
 }  // namespace
 
 class RequestBase : public ThumbnailRequest
@@ -73,10 +113,37 @@ class RequestBase : public ThumbnailRequest
 #pragma clang diagnostic pop
 #endif
 public:
-    virtual ~RequestBase() = default;
+    virtual ~RequestBase();
     QByteArray thumbnail() override;
+    QByteArray cached_thumbnail() override;
+    QByteArray probe_caches() override;
     FetchStatus status() const override;
 
+    void read_source() override
+    {
+    }
+
+    void decode_received() override
+    {
+    }
+
+    bool cancel_download() override
+    {
+        return false;
+    }
+
+    // Remote artwork is a single image of modest size, and downloading
+    // it costs no CPU to speak of.
+    int decode_cost() const override
+    {
+        return 1;
+    }
+
+    int download_cost() const override
+    {
+        return 1;
+    }
+
     string const& key() const override
     {
         return key_;
@@ -86,6 +153,8 @@ public:
     {
     }
 
+    void coalesce_with(ThumbnailRequest& leader) override;
+
     enum class CachePolicy
     {
         cache_fullsize,
@@ -119,6 +188,13 @@ public:
         ImageData& operator=(ImageData&&) = default;
     };
 
+    // Marks a request that nobody is waiting for. Its thumbnail goes into
+    // the in-memory cache only if that doesn't evict anything.
+    void set_background()
+    {
+        background_ = true;
+    }
+
     void set_error_message(string const& msg)
     {
         error_message_ = msg;
@@ -136,29 +212,83 @@ protected:
                 chrono::milliseconds timeout);
     virtual ImageData fetch(QSize const& size_hint) noexcept = 0;
 
+    // Sets image to a thumbnail of the source, decoded to fit target_size,
+    // that another application made. Returns false if there is none.
+    virtual bool find_desktop_thumbnail(QSize const& /* target_size */, Image& /* image */)
+    {
+        return false;
+    }
+
+    // Offers image, which was just decoded from the source, to other
+    // applications. Returns true if it was stored.
+    virtual bool store_desktop_thumbnail(Image const& /* image */)
+    {
+        return false;
+    }
+
+    // Returns the cache of the removable volume that the source is on, and sets
+    // key to the key of the source in that cache. Returns null if the source
+    // isn't on a removable volume.
+    virtual PersistentCacheHelper* volume_cache(string& /* key */) const
+    {
+        return nullptr;
+    }
+
+    // Returns the requested size, clamped to the maximum thumbnail size.
+    QSize target_size() const;
+
+    // Gives the request a different key before it runs. The request leaves
+    // the group it was coalesced with, because the other members have the
+    // old key and so a different source.
+    void change_key(string const& key);
+
     ArtDownloader* downloader() const
     {
-        return thumbnailer_->downloader_.get();
+        return thumbnailer_->downloader();
+    }
+
+    FileInfoCache& file_info_cache() const
+    {
+        return *thumbnailer_->file_info_cache_;
+    }
+
+    bool migrate_legacy_keys() const
+    {
+        return thumbnailer_->migrate_legacy_keys_;
+    }
+
+    // Returns null if the settings tell us not to read or write desktop thumbnails.
+    DesktopThumbnails const* readable_desktop_thumbnails() const
+    {
+        return thumbnailer_->read_desktop_thumbnails_ ? thumbnailer_->desktop_thumbnails_.get() : nullptr;
+    }
+
+    DesktopThumbnails const* writable_desktop_thumbnails() const
+    {
+        return thumbnailer_->write_desktop_thumbnails_ ? thumbnailer_->desktop_thumbnails_.get() : nullptr;
+    }
+
+    // Returns null if the settings tell us not to use volume caches.
+    VolumeCaches* volume_caches() const
+    {
+        return thumbnailer_->volume_caches_.get();
     }
 
+    AlbumIndex& album_index() const
+    {
+        return *thumbnailer_->album_index_;
+    }
+
+    bool find_local_album_art(string const& artist,
+                              string const& album,
+                              string const& path,
+                              QSize const& size_hint,
+                              Image& image);
+
     // LCOV_EXCL_START
     string printable_key() const
     {
-        // Substitute "\\0" for all occurrences of '\0' in key_.
-        string new_key;
-        string::size_type start_pos = 0;
-        string::size_type end_pos;
-        while ((end_pos = key_.find('\0', start_pos)) != string::npos)
-        {
-            new_key += key_.substr(start_pos, end_pos - start_pos);
-            new_key += "\\0";
-            start_pos = end_pos + 1;
-        }
-        if (start_pos != string::npos)
-        {
-            new_key += key_.substr(start_pos, end_pos);
-        }
-        return new_key;
+        return printable_cache_key(key_);
     }
     // LCOV_EXCL_STOP
 
@@ -167,9 +297,50 @@ protected:
     QSize const requested_size_;
     string error_message_;
     chrono::milliseconds timeout_;
+    string content_type_;  // Set by fetch() if the subclass knows it.
+    string legacy_key_;    // Key used by cache version 2, while entries are being migrated.
+    string source_hash_;   // Hash of the encoded source, set by read_source() if the subclass has it.
 
 private:
+    // State shared by concurrent requests for the same source (see coalesce_with()).
+    // The decoded source stays here until the last member is destroyed.
+    struct SourceGroup
+    {
+        mutex mutex_;
+        condition_variable decoded;  // Notified when a member stops decoding.
+        bool shared = false;  // True once a second request has joined the group.
+        QSize decode_size;    // Smallest size that covers the target sizes of all members.
+        bool decoding = false;
+        QSize decoding_bound; // Size that the member that is decoding decodes the source to fit.
+        bool has_image = false;
+        Image image;          // Source image, once a member has decoded it.
+        QSize image_bound;    // Size that image was decoded to fit.
+    };
+
+    string sized_key(QSize const& target_size) const;
+    QSize decode_size(QSize const& target_size) const;
+    void publish_source(Image const& image, QSize const& bound);
+    bool scale_from_group(QSize const& target_size, Image& scaled_image);
+    void finish_decoding();
+    QByteArray store_thumbnail(QSize const& target_size, string const& sized_key, Image& scaled_image);
+    string source_content_key(QSize const& target_size) const;
+    QByteArray find_shared_thumbnail(QSize const& target_size, string const& sized_key);
+    QByteArray find_volume_thumbnail(QSize const& target_size, string const& sized_key);
+    bool store_volume_thumbnail(QSize const& target_size, string const& data);
+    QByteArray find_thumbnail(QSize const& target_size,
+                              string const& sized_key,
+                              SourceIndex::Lookup const& lookup);
+    QByteArray find_legacy_thumbnail(QSize const& target_size, string const& sized_key);
+    bool find_failure(SourceIndex::Lookup const& lookup);
+    core::Optional<string> migrate_entry(PersistentCacheHelper& cache, string const& legacy_key, string const& key);
+    void put_in_memory_cache(string const& sized_key, QByteArray const& thumbnail);
+
     FetchStatus status_;
+    bool background_ = false;
+    bool memory_cache_checked_;
+    bool caches_probed_;
+    shared_ptr<SourceGroup> group_;
+    bool decoding_ = false;  // True while this request decodes the source for its group.
 };
 
 namespace
@@ -191,14 +362,31 @@ public:
                           QSize const& requested_size,
                           chrono::milliseconds timeout);
     void check_client_credentials(uid_t user, std::string const& label) override;
+    void read_source() override;
+    int decode_cost() const override;
+    int download_cost() const override;
+    bool cancel_download() override;
 
 protected:
     ImageData fetch(QSize const& size_hint) noexcept override;
     void download(std::chrono::milliseconds timeout) override;
+    bool find_desktop_thumbnail(QSize const& target_size, Image& image) override;
+    bool store_desktop_thumbnail(Image const& image) override;
+    PersistentCacheHelper* volume_cache(string& key) const override;
 
 private:
+    string content_type() const;
+    string extract_album_art() const;
+
     string filename_;
+    off_t file_size_;
+    time_t mtime_;
+    bool readable_;
     unique_ptr<ImageExtractor> image_extractor_;
+    bool source_read_ = false;
+    string source_data_;  // Contents of an image file or embedded cover art, set by read_source().
+    shared_ptr<PersistentCacheHelper> volume_cache_;  // Set if the file is on a removable volume.
+    string volume_key_;   // Key of the file in volume_cache_.
 };
 
 class AlbumRequest : public RequestBase
@@ -218,6 +406,10 @@ public:
                  QSize const& requested_size,
                  chrono::milliseconds timeout);
 
+    void check_client_credentials(uid_t user, std::string const& label) override;
+
+    void decode_received() override;
+
 protected:
     ImageData fetch(QSize const& size_hint) noexcept override;
     void download(std::chrono::milliseconds timeout) override;
@@ -225,6 +417,7 @@ protected:
 private:
     string artist_;
     string album_;
+    string local_art_path_;  // Set if the album index has a file with art for the album.
     shared_ptr<ArtReply> artreply_;
 };
 
@@ -245,6 +438,8 @@ public:
                   QSize const& requested_size,
                   chrono::milliseconds timeout);
 
+    void decode_received() override;
+
 protected:
     ImageData fetch(QSize const& size_hint) noexcept override;
     void download(std::chrono::milliseconds timeout) override;
@@ -257,6 +452,8 @@ private:
 
 }  // namespace
 
+int const ThumbnailRequest::COST_PER_CORE;
+
 RequestBase::RequestBase(Thumbnailer* thumbnailer,
                          string const& key,
                          QSize const& requested_size,
@@ -266,20 +463,313 @@ RequestBase::RequestBase(Thumbnailer* thumbnailer,
     , requested_size_(requested_size)
     , timeout_(timeout)
     , status_(FetchStatus::needs_download)
+    , memory_cache_checked_(false)
+    , caches_probed_(false)
+    , group_(make_shared<SourceGroup>())
+{
+    ++thumbnailer_->live_requests_;
+}
+
+RequestBase::~RequestBase()
+{
+    --thumbnailer_->live_requests_;
+}
+
+QSize RequestBase::target_size() const
+{
+    auto target_size = QSize(thumbnailer_->max_size_, thumbnailer_->max_size_);
+    if (requested_size_.width() != 0)
+    {
+        target_size.setWidth(min(requested_size_.width(), thumbnailer_->max_size_));
+    }
+    if (requested_size_.height() != 0)
+    {
+        target_size.setHeight(min(requested_size_.height(), thumbnailer_->max_size_));
+    }
+    return target_size;
+}
+
+void RequestBase::change_key(string const& key)
+{
+    key_ = key;
+    group_ = make_shared<SourceGroup>();
+}
+
+string RequestBase::sized_key(QSize const& target_size) const
+{
+    return sized_cache_key(key_, target_size);
+}
+
+void RequestBase::coalesce_with(ThumbnailRequest& leader)
+{
+    auto leader_base = dynamic_cast<RequestBase*>(&leader);
+    assert(leader_base);
+    assert(leader_base->key_ == key_);
+
+    // The group is only ever replaced before this request starts running,
+    // so no other thread can be looking at group_ at this point.
+    group_ = leader_base->group_;
+    lock_guard<mutex> lock(group_->mutex_);
+    group_->shared = true;
+    group_->decode_size = group_->decode_size.expandedTo(leader_base->target_size()).expandedTo(target_size());
+    ++thumbnailer_->coalesced_requests_;
+}
+
+// Returns the size to decode the source at. If other requests are waiting for
+// the same source, that is a size that is large enough for all of them.
+
+QSize RequestBase::decode_size(QSize const& target_size) const
+{
+    lock_guard<mutex> lock(group_->mutex_);
+    return group_->shared ? target_size.expandedTo(group_->decode_size) : target_size;
+}
+
+// Leaves the decoded source image (which fits within bound) for the other
+// members of the group, including those that join the group later, unless
+// the group has a larger one already.
+
+void RequestBase::publish_source(Image const& image, QSize const& bound)
+{
+    {
+        lock_guard<mutex> lock(group_->mutex_);
+        if (!group_->has_image || bound.expandedTo(group_->image_bound) == bound)
+        {
+            group_->has_image = true;
+            group_->image = image;
+            group_->image_bound = bound;
+        }
+    }
+    finish_decoding();
+}
+
+namespace
+{
+
+bool fits(QSize const& size, QSize const& bound)
+{
+    return size.width() <= bound.width() && size.height() <= bound.height();
+}
+
+}  // namespace
+
+// Scales the source image left by another member of the group, provided
+// it was decoded at a size that is large enough for this request. If another
+// member is decoding the source at such a size, we wait for it rather than
+// decode the source a second time. Otherwise, if no member is decoding,
+// this request becomes the one that does, and the caller decodes the source.
+
+bool RequestBase::scale_from_group(QSize const& target_size, Image& scaled_image)
+{
+    Image source;
+    {
+        unique_lock<mutex> lock(group_->mutex_);
+        group_->decoded.wait(lock, [this, &target_size]
+        {
+            return !group_->decoding || !fits(target_size, group_->decoding_bound);
+        });
+        if (!group_->has_image || !fits(target_size, group_->image_bound))
+        {
+            if (!group_->decoding)
+            {
+                group_->decoding = true;
+                group_->decoding_bound = group_->shared ? target_size.expandedTo(group_->decode_size) : target_size;
+                decoding_ = true;
+            }
+            return false;
+        }
+        source = group_->image;
+    }
+    scaled_image = source.scale(target_size);
+    return true;
+}
+
+// Lets the members that wait for this request to decode the source go ahead,
+// whether or not we got the source.
+
+void RequestBase::finish_decoding()
 {
+    if (!decoding_)
+    {
+        return;
+    }
+    decoding_ = false;
+    {
+        lock_guard<mutex> lock(group_->mutex_);
+        group_->decoding = false;
+    }
+    group_->decoded.notify_all();
+}
+
+QByteArray RequestBase::store_thumbnail(QSize const& target_size, string const& sized_key, Image& scaled_image)
+{
+    string data = scaled_image.jpeg_or_png_data();
+    scaled_image = Image();
+    // Thumbnails of files on removable volumes don't take up room in our own cache.
+    if (!store_volume_thumbnail(target_size, data))
+    {
+        thumbnailer_->put_entry(*thumbnailer_->thumbnail_cache_, *thumbnailer_->thumbnail_content_, sized_key, data);
+        if (!source_hash_.empty())
+        {
+            thumbnailer_->thumbnail_content_->set_owner(source_content_key(target_size), sized_key);
+        }
+    }
+    auto thumbnail = QByteArray::fromStdString(data);
+    put_in_memory_cache(sized_key, thumbnail);
+    return thumbnail;
+}
+
+void RequestBase::put_in_memory_cache(string const& sized_key, QByteArray const& thumbnail)
+{
+    if (background_)
+    {
+        thumbnailer_->memory_cache_->preload(sized_key, thumbnail);
+        return;
+    }
+    thumbnailer_->memory_cache_->put(sized_key, thumbnail);
+}
+
+// Identifies the thumbnails of the given size that are made from sources
+// with the contents of this source, whatever their key.
+
+string RequestBase::source_content_key(QSize const& target_size) const
+{
+    return "s" + source_hash_ + to_string(target_size.width()) + "x" + to_string(target_size.height());
+}
+
+// Returns the thumbnail that we made at this size from another source with
+// the same contents, such as the cover art embedded in another track of the
+// same album, after storing a reference to it for sized_key. This saves
+// decoding and scaling the source again.
+
+QByteArray RequestBase::find_shared_thumbnail(QSize const& target_size, string const& sized_key)
+{
+    if (source_hash_.empty())
+    {
+        return QByteArray();
+    }
+    auto const owner = thumbnailer_->thumbnail_content_->owner(source_content_key(target_size));
+    if (owner.empty() || owner == sized_key)
+    {
+        return QByteArray();
+    }
+    auto thumbnail = thumbnailer_->get_entry(*thumbnailer_->thumbnail_cache_, owner);
+    if (!thumbnail)
+    {
+        return QByteArray();
+    }
+    thumbnailer_->thumbnail_cache_->put(sized_key, reference_value(owner));
+    ++thumbnailer_->shared_entries_;
+    ++thumbnailer_->skipped_decodes_;
+    status_ = FetchStatus::cache_hit;
+    auto data = QByteArray::fromStdString(*thumbnail);
+    put_in_memory_cache(sized_key, data);
+    return data;
+}
+
+// Returns the thumbnail from the cache of the removable volume that the
+// source is on, if it has one.
+
+QByteArray RequestBase::find_volume_thumbnail(QSize const& target_size, string const& sized_key)
+{
+    string key;
+    auto cache = volume_cache(key);
+    if (!cache)
+    {
+        return QByteArray();
+    }
+    core::Optional<string> thumbnail;
+    try
+    {
+        thumbnail = cache->get(sized_cache_key(key, target_size));
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        // The volume may have been removed while we were using it.
+        qWarning() << "RequestBase::find_volume_thumbnail(): cannot read volume cache:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+    if (!thumbnail)
+    {
+        return QByteArray();
+    }
+    status_ = FetchStatus::cache_hit;
+    ++thumbnailer_->volume_hits_;
+    auto data = QByteArray::fromStdString(*thumbnail);
+    put_in_memory_cache(sized_key, data);
+    return data;
+}
+
+// Stores the thumbnail in the cache of the removable volume that the source
+// is on. Returns false if the source isn't on one or the write fails.
+
+bool RequestBase::store_volume_thumbnail(QSize const& target_size, string const& data)
+{
+    string key;
+    auto cache = volume_cache(key);
+    if (!cache)
+    {
+        return false;
+    }
+    try
+    {
+        cache->put(sized_cache_key(key, target_size), data);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "RequestBase::store_volume_thumbnail(): cannot write volume cache:" << e.what();
+        return false;
+    }
+    // LCOV_EXCL_STOP
+    ++thumbnailer_->volume_stores_;
+    return true;
+}
+
+// Sets image to the art that is embedded in path, which the album index
+// has as the file for the album. Returns false if the file no longer has
+// the art, in which case we forget about it.
+
+bool RequestBase::find_local_album_art(string const& artist,
+                                       string const& album,
+                                       string const& path,
+                                       QSize const& size_hint,
+                                       Image& image)
+{
+    try
+    {
+        auto const art = extract_local_album_art(path);
+        if (!art.empty())
+        {
+            image = Image(art, size_hint);
+            ++thumbnailer_->local_album_hits_;
+            return true;
+        }
+    }
+    catch (std::exception const& e)
+    {
+        qDebug() << "RequestBase::find_local_album_art(): cannot use" << QString::fromStdString(path) << ":" << e.what();
+    }
+    album_index().remove(artist, album, path);
+    return false;
 }
 
 // Main look-up logic for thumbnails.
 //
 // key_ is set by the subclass to uniquely identify what is being
 // thumbnailed.  For online art, this includes the artist and album.
-// For local thumbnails, this includes the path name, inode, mtime,
-// and ctime.
+// For local thumbnails, it is made from the path name, inode, mtime,
+// and file size (see local_cache_key()).
 //
-// We first look in the cache to see if we have a thumbnail already
-// for the provided key and size.  If not, we check whether a
-// full-size image was downloaded previously and is still hanging
-// around. If no image is available in the full size cache, we call
+// We first look in the in-memory cache and then in the thumbnail cache
+// to see if we have a thumbnail already for the provided key and size.
+// Files on removable volumes have theirs in the cache of the volume
+// instead (see VolumeCaches).  If not, we check whether another
+// request for the same source (at a different size) has just decoded
+// the image, and whether a full-size image was downloaded previously
+// and is still hanging around. The source index tells us which of the
+// persistent caches can hold anything for the key, so we skip reading the
+// others. If no image is available in the full size cache, we call
 // the fetch() routine (implemented by the subclass), which will
 // either (a) report that the data needs to be downloaded, (b) return
 // the full size image ready for scaling, or (c) report an error.
@@ -310,55 +800,110 @@ QByteArray RequestBase::thumbnail()
         }
 
         // Enforce size limitation.
-        auto target_size = QSize(thumbnailer_->max_size_, thumbnailer_->max_size_);
-        if (requested_size_.width() != 0)
+        auto const target_size = this->target_size();
+        auto const sized_key = this->sized_key(target_size);
+
+        // Check if we have the thumbnail in memory or in the cache already,
+        // unless probe_caches() has done that for us.
+        assert(thumbnailer_);
+        assert(thumbnailer_->thumbnail_cache_);
+        auto& index = *thumbnailer_->source_index_;
+        auto const lookup = index.lookup(key_);
+        if (!caches_probed_)
         {
-            target_size.setWidth(min(requested_size_.width(), thumbnailer_->max_size_));
+            auto thumbnail = find_thumbnail(target_size, sized_key, lookup);
+            if (!thumbnail.isEmpty())
+            {
+                return thumbnail;
+            }
         }
-        if (requested_size_.height() != 0)
+        auto volume_thumbnail = find_volume_thumbnail(target_size, sized_key);
+        if (!volume_thumbnail.isEmpty())
         {
-            target_size.setHeight(min(requested_size_.height(), thumbnailer_->max_size_));
+            return volume_thumbnail;
         }
 
-        string sized_key = key_;
-        sized_key += '\0';
-        sized_key += to_string(target_size.width());
-        sized_key += '\0';
-        sized_key += to_string(target_size.height());
-
-        // Check if we have the thumbnail in the cache already.
-        assert(thumbnailer_);
-        assert(thumbnailer_->thumbnail_cache_);
-        auto thumbnail = thumbnailer_->thumbnail_cache_->get(sized_key);
-        if (thumbnail)
+        // Don't have the thumbnail yet, see if a concurrent request for
+        // a different size has the image in memory.
+        struct DecodeGuard
         {
-            status_ = FetchStatus::cache_hit;
-            return QByteArray::fromStdString(*thumbnail);
+            RequestBase* request;
+            ~DecodeGuard()
+            {
+                request->finish_decoding();
+            }
+        } decode_guard{this};
+        Image scaled_image;
+        if (scale_from_group(target_size, scaled_image))
+        {
+            status_ = ThumbnailRequest::FetchStatus::scaled_from_fullsize;
+            ++thumbnailer_->coalesced_hits_;
+            return store_thumbnail(target_size, sized_key, scaled_image);
         }
 
-        // Don't have the thumbnail yet, see if we have the original image around.
-        auto full_size = thumbnailer_->full_size_cache_->get(key_);
-        Image scaled_image;
+        // See if we have the original image around.
+        core::Optional<string> full_size;
+        if (lookup.may_have_full_size())
+        {
+            full_size = thumbnailer_->get_entry(*thumbnailer_->full_size_cache_, key_);
+            if (!full_size && lookup.record.has_full_size)
+            {
+                index.set_full_size(key_, false);  // The index was wrong.
+            }
+        }
+        else
+        {
+            ++thumbnailer_->index_skipped_reads_;
+        }
+        if (!full_size && !legacy_key_.empty() && index.lookup(legacy_key_).may_have_full_size())
+        {
+            full_size = migrate_entry(*thumbnailer_->full_size_cache_, legacy_key_, key_);
+        }
         if (full_size)
         {
             status_ = ThumbnailRequest::FetchStatus::scaled_from_fullsize;
-            scaled_image = Image(*full_size, target_size);
+            auto bound = decode_size(target_size);
+            Image source(*full_size, bound);
             full_size = "";  // Release memory
+            publish_source(source, bound);
+            scaled_image = source.scale(target_size);
         }
         else
         {
             // Try and download or read the artwork, provided that we don't
-            // have this image in the failure cache. We use get()
-            // here instead of contains_key(), so the stats for the
-            // failure cache are updated.
-            if (thumbnailer_->failure_cache_->get(key_))
+            // have this image in the failure cache.
+            if (!caches_probed_ && find_failure(lookup))
             {
-                status_ = ThumbnailRequest::FetchStatus::cached_failure;
                 return "";
             }
 
-            ImageData image_data = fetch(target_size);
+            auto thumbnail = find_shared_thumbnail(target_size, sized_key);
+            if (!thumbnail.isEmpty())
+            {
+                return thumbnail;
+            }
+
+            // Another application may have made a thumbnail that is large enough.
+            Image desktop_thumbnail;
+            if (find_desktop_thumbnail(target_size, desktop_thumbnail))
+            {
+                status_ = FetchStatus::scaled_from_fullsize;
+                ++thumbnailer_->desktop_hits_;
+                scaled_image = desktop_thumbnail.scale(target_size);
+                return store_thumbnail(target_size, sized_key, scaled_image);
+            }
+
+            auto bound = decode_size(target_size);
+            ImageData image_data = fetch(bound);
             status_ = image_data.status;
+            if (status_ == FetchStatus::downloaded)
+            {
+                index.set_source_info(key_, image_data.image.source_size(), content_type_);
+            }
+            else if (!content_type_.empty())
+            {
+                index.set_source_info(key_, QSize(), content_type_);
+            }
             switch (status_)
             {
                 case FetchStatus::downloaded:      // Success, we'll return the thumbnail below.
@@ -392,6 +937,7 @@ QByteArray RequestBase::thumbnail()
                         later = chrono::system_clock::now() + chrono::hours(thumbnailer_->retry_not_found_hours_);
                     }
                     thumbnailer_->failure_cache_->put(key_, "", later);
+                    index.set_failure(key_, later);
                     if (image_data.location == Location::remote)
                     {
                         // Even though we didn't get an image, the request itself worked.
@@ -403,6 +949,7 @@ QByteArray RequestBase::thumbnail()
                 {
                     // No chance of recovery, the problem is with the request data.
                     thumbnailer_->failure_cache_->put(key_, "");
+                    index.set_failure(key_, chrono::system_clock::time_point());
                     if (image_data.location == Location::remote)
                     {
                         // Even though we didn't get an image, the request itself worked.
@@ -459,18 +1006,24 @@ QByteArray RequestBase::thumbnail()
                     image_data.image = image_data.image.scale(QSize(max_size, max_size));
                 }
                 // Keep high-quality image.
-                thumbnailer_->full_size_cache_->put(key_, image_data.image.jpeg_or_png_data(90));
+                thumbnailer_->put_entry(*thumbnailer_->full_size_cache_,
+                                        *thumbnailer_->full_size_content_,
+                                        key_,
+                                        image_data.image.jpeg_or_png_data(90));
+            }
+            publish_source(image_data.image, bound);
+            if (store_desktop_thumbnail(image_data.image))
+            {
+                ++thumbnailer_->desktop_stores_;
             }
+
             // If the image is already within the target dimensions, this
             // will be a no-op.
             scaled_image = image_data.image.scale(target_size);
             image_data.image = Image();
         }
 
-        string data = scaled_image.jpeg_or_png_data();
-        scaled_image = Image();
-        thumbnailer_->thumbnail_cache_->put(sized_key, data);
-        return QByteArray::fromStdString(data);
+        return store_thumbnail(target_size, sized_key, scaled_image);
     }
     // LCOV_EXCL_START
     catch (std::exception const& e)
@@ -483,57 +1036,211 @@ QByteArray RequestBase::thumbnail()
     // LCOV_EXCL_STOP
 }
 
-ThumbnailRequest::FetchStatus RequestBase::status() const
-{
-    return status_;
-}
-
-LocalThumbnailRequest::LocalThumbnailRequest(Thumbnailer* thumbnailer,
-                                             string const& filename,
-                                             QSize const& requested_size,
-                                             chrono::milliseconds timeout)
-    : RequestBase(thumbnailer, "", requested_size, timeout)
-    , filename_(filename)
+QByteArray RequestBase::probe_caches()
 {
-    if (!boost::filesystem::path(filename).is_absolute())
+    if (!requested_size_.isValid())
     {
-        throw runtime_error("LocalThumbnailRequest(): " + filename_ + ": file name must be an absolute path");
+        return QByteArray();  // thumbnail() reports the error.
     }
-
-    // We canonicalise the path name both to avoid caching the file
-    // multiple times, and to ensure our access checks are against the
-    // real file rather than a symlink.
-    filename_ = boost::filesystem::canonical(filename).native();
-
-    struct stat st;
-    if (stat(filename_.c_str(), &st) < 0)
+    try
     {
-        // LCOV_EXCL_START
-        throw runtime_error("LocalThumbnailRequest(): Could not stat " + filename_ + ": " + safe_strerror(errno));
-        // LCOV_EXCL_STOP
+        auto const target_size = this->target_size();
+        auto const lookup = thumbnailer_->source_index_->lookup(key_);
+        caches_probed_ = true;
+        auto thumbnail = find_thumbnail(target_size, sized_key(target_size), lookup);
+        if (thumbnail.isEmpty())
+        {
+            find_failure(lookup);
+        }
+        return thumbnail;
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        string msg = "RequestBase::probe_caches(): key = " + printable_key() + ": " + e.what();
+        qCritical() << QString::fromStdString(msg);
+        throw unity::ResourceException(msg);
+    }
+    // LCOV_EXCL_STOP
+}
+
+// Returns the thumbnail from the in-memory cache or the thumbnail cache,
+// or an empty QByteArray if neither has it.
+
+QByteArray RequestBase::find_thumbnail(QSize const& target_size,
+                                       string const& sized_key,
+                                       SourceIndex::Lookup const& lookup)
+{
+    if (!memory_cache_checked_)
+    {
+        memory_cache_checked_ = true;
+        auto thumbnail = thumbnailer_->memory_cache_->get(sized_key);
+        if (!thumbnail.isNull())
+        {
+            status_ = FetchStatus::cache_hit;
+            return thumbnail;
+        }
+    }
+    if (!lookup.may_have_thumbnail(target_size))
+    {
+        ++thumbnailer_->index_skipped_reads_;
+        return find_legacy_thumbnail(target_size, sized_key);
+    }
+    auto thumbnail = thumbnailer_->get_entry(*thumbnailer_->thumbnail_cache_, sized_key);
+    if (thumbnail)
+    {
+        status_ = FetchStatus::cache_hit;
+        auto data = QByteArray::fromStdString(*thumbnail);
+        put_in_memory_cache(sized_key, data);
+        return data;
+    }
+    if (lookup.complete[int(SourceIndex::Tier::thumbnail)])
+    {
+        thumbnailer_->source_index_->remove_thumbnail(key_, target_size);  // The index was wrong.
+    }
+    return find_legacy_thumbnail(target_size, sized_key);
+}
+
+// Returns the thumbnail stored under the key of cache version 2, if the
+// source has one, after copying it to sized_key.
+
+QByteArray RequestBase::find_legacy_thumbnail(QSize const& target_size, string const& sized_key)
+{
+    if (legacy_key_.empty() || !thumbnailer_->source_index_->lookup(legacy_key_).may_have_thumbnail(target_size))
+    {
+        return QByteArray();
     }
+    auto thumbnail = migrate_entry(*thumbnailer_->thumbnail_cache_,
+                                   legacy_sized_cache_key(legacy_key_, target_size),
+                                   sized_key);
+    if (!thumbnail)
+    {
+        return QByteArray();
+    }
+    status_ = FetchStatus::cache_hit;
+    auto data = QByteArray::fromStdString(*thumbnail);
+    put_in_memory_cache(sized_key, data);
+    return data;
+}
+
+// Returns true and sets the status to cached_failure if the failure cache
+// has an entry for the source. We use get() here instead of contains_key(),
+// so the stats for the failure cache are updated.
 
-    if (!S_ISREG(st.st_mode))
+bool RequestBase::find_failure(SourceIndex::Lookup const& lookup)
+{
+    if (!lookup.may_have_failure())
+    {
+        ++thumbnailer_->index_skipped_reads_;
+    }
+    else if (thumbnailer_->failure_cache_->get(key_))
+    {
+        status_ = FetchStatus::cached_failure;
+        return true;
+    }
+    else if (lookup.record.failed)
+    {
+        thumbnailer_->source_index_->remove_failure(key_);  // The index was wrong.
+    }
+    if (!legacy_key_.empty() && thumbnailer_->source_index_->lookup(legacy_key_).may_have_failure()
+        && migrate_entry(*thumbnailer_->failure_cache_, legacy_key_, key_))
+    {
+        status_ = FetchStatus::cached_failure;
+        return true;
+    }
+    return false;
+}
+
+// Copies the entry for legacy_key to key. Only local keys changed, and failures
+// for local files never expire, so the copy doesn't need an expiry time. We leave
+// the old entry for the cache to evict; nothing looks for it after this.
+
+core::Optional<string> RequestBase::migrate_entry(PersistentCacheHelper& cache,
+                                                  string const& legacy_key,
+                                                  string const& key)
+{
+    auto value = cache.get(legacy_key);
+    if (value)
+    {
+        cache.put(key, *value);
+        ++thumbnailer_->migrated_entries_;
+    }
+    return value;
+}
+
+QByteArray RequestBase::cached_thumbnail()
+{
+    if (!requested_size_.isValid())
+    {
+        return QByteArray();  // thumbnail() reports the error.
+    }
+    memory_cache_checked_ = true;
+    auto thumbnail = thumbnailer_->memory_cache_->get(sized_key(target_size()));
+    if (!thumbnail.isNull())
+    {
+        status_ = FetchStatus::cache_hit;
+    }
+    return thumbnail;
+}
+
+ThumbnailRequest::FetchStatus RequestBase::status() const
+{
+    return status_;
+}
+
+LocalThumbnailRequest::LocalThumbnailRequest(Thumbnailer* thumbnailer,
+                                             string const& filename,
+                                             QSize const& requested_size,
+                                             chrono::milliseconds timeout)
+    : RequestBase(thumbnailer, "", requested_size, timeout)
+    , filename_(filename)
+{
+    if (!boost::filesystem::path(filename).is_absolute())
+    {
+        throw runtime_error("LocalThumbnailRequest(): " + filename_ + ": file name must be an absolute path");
+    }
+
+    // We canonicalise the path name both to avoid caching the file
+    // multiple times, and to ensure our access checks are against the
+    // real file rather than a symlink. Clients often ask for the same
+    // file more than once, so the cache usually knows the answer.
+    auto const info = file_info_cache().get(filename);
+    filename_ = info.canonical_path;
+    file_size_ = info.size;
+    mtime_ = info.mtime.tv_sec;
+    readable_ = info.readable;
+
+    if (!S_ISREG(info.mode))
     {
         throw runtime_error("LocalThumbnailRequest(): '" + filename_ + "' is not a regular file");
     }
 
-    // The full cache key for the file is the concatenation of path
-    // name, inode, modification time, and inode modification time
-    // (because permissions may change).  If the file exists with the
-    // same path on different removable media, or the file was
-    // modified since we last cached it, the key will be
-    // different. There is no point in trying to remove such stale
-    // entries from the cache. Instead, we just let the normal
-    // eviction mechanism take care of them (because stale thumbnails
-    // due to file removal or file update are rare).
-    key_ = filename_;
-    key_ += '\0';
-    key_ += to_string(st.st_ino);
-    key_ += '\0';
-    key_ += to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
-    key_ += '\0';
-    key_ += to_string(st.st_ctim.tv_sec) + "." + to_string(st.st_ctim.tv_nsec);
+    // The cache key for the file is made from the path name, inode,
+    // modification time, and size. If the file exists with the same path
+    // on different removable media, or the file was modified since we
+    // last cached it, the key will be different. There is no point in
+    // trying to remove such stale entries from the cache. Instead, we
+    // just let the normal eviction mechanism take care of them (because
+    // stale thumbnails due to file removal or file update are rare).
+    key_ = local_cache_key(filename_, info.ino, info.mtime, info.size);
+    if (migrate_legacy_keys())
+    {
+        legacy_key_ = legacy_local_cache_key(filename_, info.ino, info.mtime, info.ctime);
+    }
+
+    // On removable media, the thumbnails go into the cache of the volume. The path
+    // relative to the volume stays the same wherever the volume is mounted, and
+    // the inode number is left out because some file systems, such as FAT, don't
+    // keep inode numbers on disk.
+    if (volume_caches())
+    {
+        string relative_path;
+        volume_cache_ = volume_caches()->find(filename_, relative_path);
+        if (volume_cache_)
+        {
+            volume_key_ = local_cache_key(relative_path, 0, info.mtime, info.size);
+        }
+    }
 }
 
 void LocalThumbnailRequest::check_client_credentials(uid_t user,
@@ -543,6 +1250,12 @@ void LocalThumbnailRequest::check_client_credentials(uid_t user,
     {
         throw runtime_error("LocalThumbnailRequest::fetch(): Request comes from a different user ID");
     }
+    // The key doesn't change with the permissions of the file, so we
+    // may have a thumbnail for a file that can no longer be read.
+    if (!readable_)
+    {
+        throw runtime_error("LocalThumbnailRequest::fetch(): No read access to " + filename_);
+    }
     if (!apparmor_can_read(label, filename_)) {
         // LCOV_EXCL_START
         qDebug() << "Apparmor label" << QString::fromStdString(label) << "has no access to" << QString::fromStdString(filename_);
@@ -552,6 +1265,77 @@ void LocalThumbnailRequest::check_client_credentials(uid_t user,
 
 }
 
+void LocalThumbnailRequest::read_source()
+{
+    if (image_extractor_ || source_read_)
+    {
+        return;
+    }
+    try
+    {
+        content_type_ = content_type();
+        if (content_type_.find("image/") == 0)
+        {
+            // Very large images are decoded straight from the file, so we
+            // don't hold the encoded and the decoded image in memory at once.
+            if (file_size_ <= MAX_READ_SOURCE_SIZE)
+            {
+                source_data_ = read_file(filename_);
+                source_read_ = true;
+            }
+        }
+        else if (content_type_.find("audio/") == 0)
+        {
+            source_data_ = extract_album_art();
+            source_read_ = true;
+        }
+        if (!source_data_.empty())
+        {
+            source_hash_ = content_hash(source_data_);
+        }
+    }
+    catch (std::exception const&)
+    {
+        // fetch() tries again and reports the error.
+        content_type_.clear();
+        source_data_.clear();
+        source_read_ = false;
+        source_hash_.clear();
+    }
+}
+
+int LocalThumbnailRequest::decode_cost() const
+{
+    int const max_cost = COST_PER_CORE;
+    if (image_extractor_)
+    {
+        return 2;  // A single frame or cover image written by vs-thumb.
+    }
+    if (content_type_.find("audio/") == 0)
+    {
+        return 1;  // Embedded cover art is small.
+    }
+    if (content_type_.find("image/") != 0)
+    {
+        return 2;  // Not sniffed yet, or needs an extraction first.
+    }
+    auto const target_size = this->target_size();
+    if (content_type_ == "image/jpeg" && max(target_size.width(), target_size.height()) <= EXIF_THUMBNAIL_SIZE)
+    {
+        return 1;
+    }
+    if (!source_read_)
+    {
+        return max_cost;  // Too large to read into memory.
+    }
+    return min(1 + int(source_data_.size() / BYTES_PER_COST), max_cost);
+}
+
+int LocalThumbnailRequest::download_cost() const
+{
+    return COST_PER_CORE;  // vs-thumb keeps a core busy while it decodes the media.
+}
+
 RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noexcept
 {
     // Default in case something below throws.
@@ -565,7 +1349,11 @@ RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noex
             return ImageData(Image(image_extractor_->read()), CachePolicy::cache_fullsize, Location::local);
         }
 
-        string content_type = get_mimetype(filename_);
+        if (content_type_.empty())
+        {
+            content_type_ = content_type();
+        }
+        string const content_type = content_type_;
         assert(!content_type.empty());
 
         // Call the appropriate image extractor and return the image data as JPEG (not scaled).
@@ -574,6 +1362,13 @@ RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noex
 
         if (content_type.find("image/") == 0)
         {
+            if (source_read_)
+            {
+                string data;
+                data.swap(source_data_);  // Release memory once decoded.
+                source_read_ = false;
+                return ImageData(Image(data, size_hint), CachePolicy::dont_cache_fullsize, Location::local);
+            }
             FdPtr fd(open(filename_.c_str(), O_RDONLY | O_CLOEXEC), do_close);
             if (fd.get() < 0)
             {
@@ -586,7 +1381,16 @@ RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noex
         }
         else if (content_type.find("audio/") == 0)
         {
-            string art = extract_local_album_art(filename_);
+            string art;
+            if (source_read_)
+            {
+                art.swap(source_data_);
+                source_read_ = false;
+            }
+            else
+            {
+                art = extract_album_art();
+            }
             if (!art.empty())
             {
                 return ImageData(Image(art), CachePolicy::dont_cache_fullsize, Location::local);
@@ -606,6 +1410,43 @@ RequestBase::ImageData LocalThumbnailRequest::fetch(QSize const& size_hint) noex
     return ImageData(FetchStatus::not_found, image_data.cache_policy, Location::local);
 }
 
+bool LocalThumbnailRequest::find_desktop_thumbnail(QSize const& target_size, Image& image)
+{
+    auto const desktop = readable_desktop_thumbnails();
+    if (!desktop)
+    {
+        return false;
+    }
+    auto const data = desktop->find(filename_, mtime_, max(target_size.width(), target_size.height()));
+    if (data.empty())
+    {
+        return false;
+    }
+    try
+    {
+        image = Image(data, target_size);
+        return true;
+    }
+    catch (std::exception const& e)
+    {
+        qDebug() << "LocalThumbnailRequest::find_desktop_thumbnail(): cannot decode thumbnail for"
+                 << filename_.c_str() << ":" << e.what();
+        return false;
+    }
+}
+
+bool LocalThumbnailRequest::store_desktop_thumbnail(Image const& image)
+{
+    auto const desktop = writable_desktop_thumbnails();
+    return desktop && desktop->store(filename_, mtime_, file_size_, content_type_, image);
+}
+
+PersistentCacheHelper* LocalThumbnailRequest::volume_cache(string& key) const
+{
+    key = volume_key_;
+    return volume_cache_.get();
+}
+
 void LocalThumbnailRequest::download(chrono::milliseconds timeout)
 {
     if (timeout.count() == 0)
@@ -618,22 +1459,91 @@ void LocalThumbnailRequest::download(chrono::milliseconds timeout)
     image_extractor_->extract();
 }
 
+bool LocalThumbnailRequest::cancel_download()
+{
+    return image_extractor_ && image_extractor_->cancel();
+}
+
+string LocalThumbnailRequest::content_type() const
+{
+    auto type = file_info_cache().content_type(filename_);
+    if (type.empty())
+    {
+        type = get_mimetype(filename_);
+        file_info_cache().set_content_type(filename_, type);
+    }
+    return type;
+}
+
+// Returns the art embedded in the file, and remembers the file as
+// a source of art for its album (see AlbumRequest::fetch()).
+
+string LocalThumbnailRequest::extract_album_art() const
+{
+    string artist;
+    string album;
+    auto art = extract_local_album_art(filename_, artist, album);
+    if (!art.empty())
+    {
+        album_index().add(artist, album, filename_);
+    }
+    return art;
+}
+
 AlbumRequest::AlbumRequest(Thumbnailer* thumbnailer,
                            string const& artist,
                            string const& album,
                            QSize const& requested_size,
                            chrono::milliseconds timeout)
-    : RequestBase(thumbnailer, artist + '\0' + album + '\0' + "album", requested_size, timeout)
+    : RequestBase(thumbnailer, album_key(artist, album), requested_size, timeout)
     , artist_(artist)
     , album_(album)
 {
+    // Art from the user's own files is only for clients that may read those
+    // files (see check_client_credentials()). So it is cached under a key that
+    // is made from the file, not under the key for the album that all clients
+    // share. Changes to the file change the key, as for local thumbnails.
+    auto const path = album_index().find(artist, album);
+    if (path.empty())
+    {
+        return;
+    }
+    try
+    {
+        auto const info = file_info_cache().get(path);
+        key_ = local_cache_key(info.canonical_path, info.ino, info.mtime, info.size) + '\0' + "album";
+        local_art_path_ = info.canonical_path;
+    }
+    catch (std::exception const& e)
+    {
+        qDebug() << "AlbumRequest(): cannot use" << QString::fromStdString(path) << ":" << e.what();
+        album_index().remove(artist, album, path);
+    }
+}
+
+void AlbumRequest::check_client_credentials(uid_t user, string const& label)
+{
+    if (local_art_path_.empty())
+    {
+        return;  // Downloaded art is for everyone.
+    }
+    if (user == geteuid() && apparmor_can_read(label, local_art_path_))
+    {
+        return;
+    }
+    // The client can't read the file, so it gets the art that we download for
+    // all clients, as it would if the album index knew of no file.
+    qDebug() << "AlbumRequest::check_client_credentials(): client with label" << QString::fromStdString(label)
+             << "has no access to" << QString::fromStdString(local_art_path_) << "(using downloaded art)";
+    local_art_path_.clear();
+    change_key(album_key(artist_, album_));
 }
 
 namespace
 {
 
-// Logic for AlbumRequest::fetch() and ArtistRequest::fetch() is the same,
-// so we use this helper function for both.
+// Logic for handling the download in AlbumRequest::fetch() and ArtistRequest::fetch()
+// is the same, so we use this helper function for both.
 
 RequestBase::ImageData common_fetch(RequestBase* request, shared_ptr<ArtReply> const& artreply) noexcept
 {
@@ -653,8 +1563,8 @@ RequestBase::ImageData common_fetch(RequestBase* request, shared_ptr<ArtReply> c
         {
             try
             {
-                auto raw_data = artreply->data();
-                Image full_size(string(raw_data.constData(), raw_data.size()));
+                // Most of the image was decoded while it downloaded.
+                Image full_size = artreply->image();
                 return RequestBase::ImageData(full_size, RequestBase::CachePolicy::cache_fullsize, Location::remote);
             }
             catch (std::exception const& e)
@@ -688,8 +1598,16 @@ RequestBase::ImageData common_fetch(RequestBase* request, shared_ptr<ArtReply> c
 
 }  // namespace
 
-RequestBase::ImageData AlbumRequest::fetch(QSize const& /*size_hint*/) noexcept
+RequestBase::ImageData AlbumRequest::fetch(QSize const& size_hint) noexcept
 {
+    // The user's own music often has the art for the album embedded,
+    // which works offline and is much quicker than a download.
+    Image art;
+    if (!artreply_ && !local_art_path_.empty() &&
+        find_local_album_art(artist_, album_, local_art_path_, size_hint, art))
+    {
+        return ImageData(art, CachePolicy::dont_cache_fullsize, Location::local);
+    }
     return common_fetch(this, artreply_);
 }
 
@@ -700,9 +1618,18 @@ void AlbumRequest::download(chrono::milliseconds timeout)
         timeout = timeout_;
     }
     artreply_ = downloader()->download_album(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
+    connect(artreply_.get(), &ArtReply::dataReceived, this, &AlbumRequest::downloadDataReceived, Qt::DirectConnection);
     connect(artreply_.get(), &ArtReply::finished, this, &AlbumRequest::downloadFinished, Qt::DirectConnection);
 }
 
+void AlbumRequest::decode_received()
+{
+    if (artreply_)
+    {
+        artreply_->decode_received();
+    }
+}
+
 ArtistRequest::ArtistRequest(Thumbnailer* thumbnailer,
                              string const& artist,
                              string const& album,
@@ -726,9 +1653,18 @@ void ArtistRequest::download(chrono::milliseconds timeout)
         timeout = timeout_;
     }
     artreply_ = downloader()->download_artist(QString::fromStdString(artist_), QString::fromStdString(album_), timeout);
+    connect(artreply_.get(), &ArtReply::dataReceived, this, &ArtistRequest::downloadDataReceived, Qt::DirectConnection);
     connect(artreply_.get(), &ArtReply::finished, this, &ArtistRequest::downloadFinished, Qt::DirectConnection);
 }
 
+void ArtistRequest::decode_received()
+{
+    if (artreply_)
+    {
+        artreply_->decode_received();
+    }
+}
+
 namespace
 {
 
@@ -739,10 +1675,137 @@ namespace
 string const LAST_NETWORK_FAIL_TIME_KEY = "/*** LAST_NETWORK_FAIL_TIME ***/";
 string const BACKOFF_PERIOD_KEY = "/*** BACKOFF_PERIOD ***/";
 
+// Rough average entry sizes, used to size the Bloom filters for the caches.
+// Evicted keys drop out of a filter, but entries can be smaller than the
+// average, so each filter has room for twice as many keys as we expect.
+int64_t const FULL_SIZE_ENTRY_SIZE = 64 * 1024;
+int64_t const THUMBNAIL_ENTRY_SIZE = 4 * 1024;
+int64_t const FAILURE_ENTRY_SIZE = 256;
+int64_t const BLOOM_FILTER_HEADROOM = 2;
+
+int64_t filter_entries(int64_t cache_size, int64_t entry_size)
+{
+    return cache_size / entry_size * BLOOM_FILTER_HEADROOM;
+}
+
+// Upper limit on the keys and values waiting to be written to each cache.
+int64_t const WRITE_BEHIND_MAX_BYTES = 8 * 1024 * 1024;
+
+// The hot set is the list of keys in the in-memory cache, saved at shutdown
+// as a length-prefixed list, most recently used first.
+string const HOT_SET_HEADER = "thumbnailer-hot-set 2\n";
+size_t const MAX_HOT_KEYS = 2000;
+
+// How long the preload waits before checking again whether requests are still in progress.
+chrono::milliseconds const PRELOAD_PAUSE(20);
+
+// Files that wait for generate_queued(). Beyond this, new files are dropped,
+// so copying a huge collection doesn't make us hold on to every path.
+size_t const MAX_BACKGROUND_QUEUE = 1000;
+
+// How many prefetched thumbnails we remember, to tell whether they are asked for.
+size_t const MAX_PREFETCHED = 1000;
+
+string prefetch_key(string const& path, QSize const& size)
+{
+    return path + '\n' + to_string(size.width()) + 'x' + to_string(size.height());
+}
+
+// Returns up to count regular files that follow path in its directory,
+// in name order. Hidden files are skipped.
+
+vector<string> following_files(string const& path, int count)
+{
+    namespace fs = boost::filesystem;
+
+    fs::path const file(path);
+    auto const name = file.filename().native();
+    vector<string> names;
+    boost::system::error_code ec;
+    for (fs::directory_iterator it(file.parent_path(), ec), end; !ec && it != end; it.increment(ec))
+    {
+        auto entry = it->path().filename().native();
+        if (entry > name && entry[0] != '.')
+        {
+            names.push_back(move(entry));
+        }
+    }
+    sort(names.begin(), names.end());
+
+    vector<string> files;
+    for (auto const& n : names)
+    {
+        if (int(files.size()) == count)
+        {
+            break;
+        }
+        auto const sibling = (file.parent_path() / n).native();
+        if (fs::is_regular_file(sibling, ec))
+        {
+            files.push_back(sibling);
+        }
+    }
+    return files;
+}
+
+// Returns the keys in the hot set file at path and removes the file,
+// so we never preload from a stale file.
+vector<string> load_hot_set(string const& path)
+{
+    vector<string> keys;
+    if (!boost::filesystem::exists(path))
+    {
+        return keys;
+    }
+    string const contents = read_file(path);
+    boost::system::error_code ec;
+    boost::filesystem::remove(path, ec);
+
+    if (contents.compare(0, HOT_SET_HEADER.size(), HOT_SET_HEADER) != 0)
+    {
+        return keys;
+    }
+    istringstream s(contents.substr(HOT_SET_HEADER.size()));
+    size_t len;
+    while (keys.size() < MAX_HOT_KEYS && s >> len && s.get() == '\n')
+    {
+        string key(len, '\0');
+        if (!s.read(&key[0], len))
+        {
+            break;  // Truncated file, use what we have.
+        }
+        keys.push_back(move(key));
+    }
+    return keys;
+}
+
 }
 
 Thumbnailer::Thumbnailer()
-    : downloader_(new UbuntuServerDownloader())
+    : read_desktop_thumbnails_(false)
+    , write_desktop_thumbnails_(false)
+    , desktop_hits_(0)
+    , desktop_stores_(0)
+    , volume_hits_(0)
+    , volume_stores_(0)
+    , local_album_hits_(0)
+    , coalesced_requests_(0)
+    , coalesced_hits_(0)
+    , index_skipped_reads_(0)
+    , stop_preload_(false)
+    , live_requests_(0)
+    , preloaded_(0)
+    , migrate_legacy_keys_(false)
+    , migrated_entries_(0)
+    , shared_entries_(0)
+    , skipped_decodes_(0)
+    , stop_background_(false)
+    , background_thumbnails_(0)
+    , prefetch_count_(0)
+    , prefetch_calls_(0)
+    , prefetch_thumbnails_(0)
+    , prefetch_hits_(0)
+    , prefetch_wasted_(0)
 {
     string xdg_base = g_get_user_cache_dir();  // Always returns something, even HOME and XDG_CACHE_HOME are not set.
     string cache_dir = xdg_base + "/unity-thumbnailer";
@@ -751,15 +1814,69 @@ Thumbnailer::Thumbnailer()
     try
     {
         Settings settings;
-        full_size_cache_ = PersistentCacheHelper::open(cache_dir + "/images",
-                                                       settings.full_size_cache_size() * 1024 * 1024,
-                                                       core::CacheDiscardPolicy::lru_only);
-        thumbnail_cache_ = PersistentCacheHelper::open(cache_dir + "/thumbnails",
-                                                       settings.thumbnail_cache_size() * 1024 * 1024,
-                                                       core::CacheDiscardPolicy::lru_only);
-        failure_cache_ = PersistentCacheHelper::open(cache_dir + "/failures",
-                                                     settings.failure_cache_size() * 1024 * 1024,
-                                                     core::CacheDiscardPolicy::lru_ttl);
+
+        // Opening a cache dominates start-up time, and the caches are independent
+        // of each other, so we open them in parallel.
+        auto open_cache = [](string const& path, int64_t size, core::CacheDiscardPolicy policy)
+        {
+            return async(launch::async, [path, size, policy]
+            {
+                return PersistentCacheHelper::open(path, size, policy);
+            });
+        };
+        auto full_size_future = open_cache(cache_dir + "/images",
+                                           int64_t(settings.full_size_cache_size()) * 1024 * 1024,
+                                           core::CacheDiscardPolicy::lru_only);
+        auto thumbnail_future = open_cache(cache_dir + "/thumbnails",
+                                           int64_t(settings.thumbnail_cache_size()) * 1024 * 1024,
+                                           core::CacheDiscardPolicy::lru_only);
+        auto failure_future = open_cache(cache_dir + "/failures",
+                                         int64_t(settings.failure_cache_size()) * 1024 * 1024,
+                                         core::CacheDiscardPolicy::lru_ttl);
+        full_size_cache_ = full_size_future.get();
+        thumbnail_cache_ = thumbnail_future.get();
+        failure_cache_ = failure_future.get();
+        full_size_cache_->enable_bloom_filter(cache_dir + "/images.bloom",
+                                              filter_entries(int64_t(settings.full_size_cache_size()) * 1024 * 1024,
+                                                             FULL_SIZE_ENTRY_SIZE));
+        thumbnail_cache_->enable_bloom_filter(cache_dir + "/thumbnails.bloom",
+                                              filter_entries(int64_t(settings.thumbnail_cache_size()) * 1024 * 1024,
+                                                             THUMBNAIL_ENTRY_SIZE));
+        failure_cache_->enable_bloom_filter(cache_dir + "/failures.bloom",
+                                            filter_entries(int64_t(settings.failure_cache_size()) * 1024 * 1024,
+                                                           FAILURE_ENTRY_SIZE));
+        // Requests return as soon as their images are queued, instead of waiting for the DB.
+        // Failures are rare and their entries are tiny, so we write those directly.
+        full_size_cache_->enable_write_behind(WRITE_BEHIND_MAX_BYTES);
+        thumbnail_cache_->enable_write_behind(WRITE_BEHIND_MAX_BYTES);
+        memory_cache_.reset(new MemoryCache(int64_t(settings.memory_cache_size()) * 1024 * 1024));
+        file_info_cache_.reset(new FileInfoCache(FILE_INFO_CACHE_ENTRIES));
+        thumbnail_content_.reset(new ContentIndex(CONTENT_INDEX_ENTRIES));
+        full_size_content_.reset(new ContentIndex(CONTENT_INDEX_ENTRIES));
+        desktop_thumbnails_.reset(new DesktopThumbnails(xdg_base + "/thumbnails"));
+        read_desktop_thumbnails_ = settings.read_desktop_thumbnails();
+        write_desktop_thumbnails_ = settings.write_desktop_thumbnails();
+        if (settings.volume_caches())
+        {
+            volume_caches_.reset(new VolumeCaches(cache_dir + "/volumes",
+                                                  int64_t(settings.volume_cache_size()) * 1024 * 1024,
+                                                  int64_t(settings.volume_cache_total_size()) * 1024 * 1024));
+        }
+        source_index_path_ = cache_dir + "/sources.index";
+        init_source_index();
+        album_index_.reset(new AlbumIndex(ALBUM_INDEX_ENTRIES));
+        album_index_path_ = cache_dir + "/albums.index";
+        try
+        {
+            album_index_->load(album_index_path_);
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "Thumbnailer(): cannot load album index:" << e.what();
+        }
+        // LCOV_EXCL_STOP
+        hot_set_path_ = cache_dir + "/hot.keys";
         max_size_ = settings.max_thumbnail_size();
         retry_not_found_hours_ = settings.retry_not_found_hours();
         extraction_timeout_ = chrono::milliseconds(settings.extraction_timeout() * 1000);
@@ -793,6 +1910,41 @@ Thumbnailer::Thumbnailer()
 
 Thumbnailer::~Thumbnailer()
 {
+    stop_preload_ = true;
+    if (preload_thread_.joinable())
+    {
+        preload_thread_.join();
+    }
+    {
+        lock_guard<mutex> lock(background_mutex_);
+        stop_background_ = true;
+    }
+    background_cond_.notify_all();
+    if (background_thread_.joinable())
+    {
+        background_thread_.join();
+    }
+    try
+    {
+        save_hot_set();
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "~Thumbnailer(): cannot save hot set:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+    try
+    {
+        album_index_->save(album_index_path_);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "~Thumbnailer(): cannot save album index:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+
     try
     {
         auto seconds = chrono::duration_cast<chrono::seconds>(backoff_.last_fail_time().time_since_epoch()).count();
@@ -810,12 +1962,448 @@ Thumbnailer::~Thumbnailer()
         qDebug() << "~Thumbnailer(): cannot update network failure time: unknown exception";
     }
     // LCOV_EXCL_STOP
+
+    // Save the Bloom filters and the source index last, so they include the keys written above.
+    // The content tokens they are saved with must reflect all queued writes.
+    for (auto c : select_caches(CacheSelector::all))
+    {
+        c->flush();
+        c->save_bloom_filter();
+    }
+    try
+    {
+        source_index_->save(source_index_path_, source_index_tokens());
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "~Thumbnailer(): cannot save source index:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+}
+
+void Thumbnailer::save_hot_set() const
+{
+    string contents = HOT_SET_HEADER;
+    for (auto const& key : memory_cache_->hot_keys(MAX_HOT_KEYS))
+    {
+        contents += to_string(key.size()) + '\n' + key;
+    }
+    write_file(hot_set_path_, contents);
+}
+
+// The downloader's network manager belongs to the thread that creates it.
+// The constructor can run on a thread that exits once the caches are open,
+// so we create the downloader when the first download is started, which
+// happens on the thread that runs the event loop.
+
+ArtDownloader* Thumbnailer::downloader()
+{
+    if (!downloader_)
+    {
+        downloader_.reset(new UbuntuServerDownloader());
+    }
+    return downloader_.get();
+}
+
+void Thumbnailer::preload_hot_set()
+{
+    assert(!preload_thread_.joinable());
+
+    vector<string> keys;
+    try
+    {
+        keys = load_hot_set(hot_set_path_);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "Thumbnailer::preload_hot_set(): cannot load hot set:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+    if (!keys.empty())
+    {
+        preload_thread_ = thread([this, keys]{ preload(keys); });
+    }
+}
+
+// Returns the data stored for key, following references to the entries
+// that hold the data. If an entry that is referred to was evicted, we
+// report a miss.
+
+core::Optional<string> Thumbnailer::get_entry(PersistentCacheHelper& cache, string const& key)
+{
+    auto value = cache.get(key);
+    string owner;
+    for (int depth = 0; value && is_reference_value(*value, owner); ++depth)
+    {
+        if (depth == MAX_REFERENCE_DEPTH)
+        {
+            return core::Optional<string>();  // LCOV_EXCL_LINE
+        }
+        value = cache.get(owner);
+    }
+    return value;
+}
+
+// Stores value for key. If another entry holds the same data, we store
+// a reference to that entry instead.
+
+void Thumbnailer::put_entry(PersistentCacheHelper& cache,
+                            ContentIndex& content,
+                            string const& key,
+                            string const& value)
+{
+    auto const hash = content_hash(value);
+    auto const owner = content.owner(hash);
+    if (!owner.empty() && owner != key && cache.contains_key(owner))
+    {
+        cache.put(key, reference_value(owner));
+        ++shared_entries_;
+        return;
+    }
+    cache.put(key, value);
+    content.set_owner(hash, key);
+}
+
+// Reading the entries also pulls them into the OS page cache, and the reads
+// count as hits in the thumbnail cache stats.
+
+void Thumbnailer::preload(vector<string> const& keys)
+{
+    for (auto const& key : keys)
+    {
+        // Give way to requests, so preloading never delays them.
+        while (live_requests_ > 0 && !stop_preload_)
+        {
+            this_thread::sleep_for(PRELOAD_PAUSE);
+        }
+        if (stop_preload_)
+        {
+            return;
+        }
+        try
+        {
+            auto thumbnail = get_entry(*thumbnail_cache_, key);
+            if (thumbnail && memory_cache_->preload(key, QByteArray::fromStdString(*thumbnail)))
+            {
+                ++preloaded_;
+            }
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "Thumbnailer::preload(): cannot read thumbnail:" << e.what();
+            return;
+        }
+        // LCOV_EXCL_STOP
+    }
+}
+
+void Thumbnailer::generate_in_background(string const& path, vector<QSize> const& sizes)
+{
+    {
+        lock_guard<mutex> lock(background_mutex_);
+        if (background_queue_.size() >= MAX_BACKGROUND_QUEUE)
+        {
+            return;
+        }
+        background_queue_.emplace_back(path, sizes);
+        if (!background_thread_.joinable())
+        {
+            background_thread_ = thread(&Thumbnailer::generate_queued, this);
+        }
+    }
+    background_cond_.notify_one();
+}
+
+void Thumbnailer::prefetch_siblings(string const& path, QSize const& size, int count)
+{
+    {
+        lock_guard<mutex> lock(background_mutex_);
+        prefetch_from_ = path;
+        prefetch_size_ = size;
+        prefetch_count_ = count;
+        prefetch_queue_.clear();
+        ++prefetch_calls_;
+        if (!background_thread_.joinable())
+        {
+            background_thread_ = thread(&Thumbnailer::generate_queued, this);
+        }
+    }
+    background_cond_.notify_one();
+}
+
+// Files from generate_in_background() come first. After those, we list the
+// siblings for prefetch_siblings() and make their thumbnails one by one.
+
+void Thumbnailer::generate_queued()
+{
+    lower_thread_priority();
+    for (;;)
+    {
+        pair<string, vector<QSize>> job;
+        string list_from;
+        string prefetch_path;
+        QSize prefetch_size;
+        int prefetch_count;
+        {
+            unique_lock<mutex> lock(background_mutex_);
+            background_cond_.wait(lock, [this]
+            {
+                return stop_background_ || !background_queue_.empty()
+                       || !prefetch_from_.empty() || !prefetch_queue_.empty();
+            });
+            if (stop_background_)
+            {
+                return;
+            }
+            prefetch_size = prefetch_size_;
+            prefetch_count = prefetch_count_;
+            if (!background_queue_.empty())
+            {
+                job = move(background_queue_.front());
+                background_queue_.pop_front();
+            }
+            else if (!prefetch_from_.empty())
+            {
+                list_from = move(prefetch_from_);
+                prefetch_from_.clear();
+            }
+            else
+            {
+                prefetch_path = move(prefetch_queue_.front());
+                prefetch_queue_.pop_front();
+            }
+        }
+        if (!list_from.empty())
+        {
+            auto const files = following_files(list_from, prefetch_count);
+            lock_guard<mutex> lock(background_mutex_);
+            if (prefetch_from_.empty())  // Otherwise, there was another call while we were listing.
+            {
+                prefetch_queue_.assign(files.begin(), files.end());
+            }
+        }
+        else if (!prefetch_path.empty())
+        {
+            prefetch(prefetch_path, prefetch_size);
+        }
+        else
+        {
+            background_thumbnails_ += generate_thumbnails(job.first, job.second, stop_background_);
+        }
+    }
+}
+
+// Makes the thumbnail of path at size and remembers that we did, so
+// note_request() can tell whether it was worth making.
+
+void Thumbnailer::prefetch(string const& path, QSize const& size)
+{
+    if (generate_thumbnails(path, { size }, stop_background_) == 0)
+    {
+        return;
+    }
+    lock_guard<mutex> lock(background_mutex_);
+    ++prefetch_thumbnails_;
+    auto key = prefetch_key(path, size);
+    if (prefetched_.insert(key).second)
+    {
+        prefetched_order_.push_back(move(key));
+    }
+    while (prefetched_order_.size() > MAX_PREFETCHED)
+    {
+        // Entries that were asked for are gone from prefetched_ already.
+        if (prefetched_.erase(prefetched_order_.front()) != 0)
+        {
+            ++prefetch_wasted_;
+        }
+        prefetched_order_.pop_front();
+    }
+}
+
+void Thumbnailer::note_request(string const& path, QSize const& size)
+{
+    lock_guard<mutex> lock(background_mutex_);
+    if (!prefetched_.empty() && prefetched_.erase(prefetch_key(path, size)) != 0)
+    {
+        ++prefetch_hits_;
+    }
+}
+
+int Thumbnailer::generate_thumbnails(string const& path, vector<QSize> const& sizes, atomic<bool> const& stop)
+{
+    try
+    {
+        auto const type = get_mimetype(path);
+        if (type.compare(0, 6, "image/") != 0 && type.compare(0, 6, "video/") != 0
+            && type.compare(0, 6, "audio/") != 0)
+        {
+            return 0;
+        }
+    }
+    catch (std::exception const&)
+    {
+        return 0;  // File is gone already.
+    }
+    int made = 0;
+    for (auto const& size : sizes)
+    {
+        // Give way to requests, so we never delay them. The request we are about
+        // to make counts as well, so we wait before making it.
+        while (live_requests_ > 0 && !stop)
+        {
+            this_thread::sleep_for(PRELOAD_PAUSE);
+        }
+        if (stop)
+        {
+            break;
+        }
+        int const result = generate(path, size, stop);
+        if (result < 0)
+        {
+            break;  // No point trying the other sizes.
+        }
+        made += result;
+    }
+    return made;
+}
+
+// Makes the thumbnail of the given size for path. Returns 1 if we made it,
+// 0 if it was cached already, and -1 if there is no thumbnail to be had.
+
+int Thumbnailer::generate(string const& path, QSize const& size, atomic<bool> const& stop)
+{
+    try
+    {
+        unique_ptr<LocalThumbnailRequest> request(new LocalThumbnailRequest(this, path, size, extraction_timeout_));
+        request->set_background();
+        request->thumbnail();
+        if (request->status() == ThumbnailRequest::FetchStatus::needs_download)
+        {
+            if (!wait_for_download(*request, stop))
+            {
+                return -1;
+            }
+            request->thumbnail();
+        }
+        switch (request->status())
+        {
+            case ThumbnailRequest::FetchStatus::cache_hit:
+                return 0;
+            case ThumbnailRequest::FetchStatus::scaled_from_fullsize:
+            case ThumbnailRequest::FetchStatus::downloaded:
+                return 1;
+            default:
+                return -1;
+        }
+    }
+    catch (std::exception const& e)
+    {
+        qDebug() << "Thumbnailer::generate(): cannot make thumbnail for" << path.c_str() << ":" << e.what();
+        return -1;
+    }
+}
+
+// Runs an event loop until the extraction for request is complete, so the
+// extractor's signals are delivered to this thread. Returns false if we were
+// told to stop in the mean time.
+
+bool Thumbnailer::wait_for_download(ThumbnailRequest& request, atomic<bool> const& stop)
+{
+    QEventLoop loop;
+    bool finished = false;
+    QObject::connect(&request, &ThumbnailRequest::downloadFinished, &loop, [&]
+    {
+        finished = true;
+        loop.quit();
+    });
+    QTimer stop_timer;
+    QObject::connect(&stop_timer, &QTimer::timeout, &loop, [&]
+    {
+        if (stop)
+        {
+            loop.quit();
+        }
+    });
+    stop_timer.start(int(PRELOAD_PAUSE.count()));
+    request.download();
+    if (!finished)
+    {
+        loop.exec();
+    }
+    if (!finished)
+    {
+        request.cancel_download();
+        return false;
+    }
+    return true;
+}
+
+// The source index is restored from the file written by the destructor,
+// if the caches have not changed since. A tier that cannot be restored
+// is incomplete unless its cache is empty. The index is loaded before the
+// event handlers are installed, so loading cannot discard an update.
+
+void Thumbnailer::init_source_index()
+{
+    source_index_.reset(new SourceIndex);
+    try
+    {
+        source_index_->load(source_index_path_, source_index_tokens());
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "Thumbnailer(): cannot load source index:" << e.what();
+    }
+    // LCOV_EXCL_STOP
+
+    vector<pair<PersistentCacheHelper*, SourceIndex::Tier>> const tiers =
+    {
+        { full_size_cache_.get(), SourceIndex::Tier::full_size },
+        { thumbnail_cache_.get(), SourceIndex::Tier::thumbnail },
+        { failure_cache_.get(), SourceIndex::Tier::failure }
+    };
+    auto const events = core::CacheEvent::put | core::CacheEvent::invalidate
+                        | core::CacheEvent::evict_lru | core::CacheEvent::evict_ttl;
+    auto index = source_index_.get();
+    for (auto const& t : tiers)
+    {
+        auto tier = t.second;
+        t.first->set_event_handler(events, [index, tier](string const& key, core::CacheEvent ev)
+        {
+            index->cache_event(tier, key, ev == core::CacheEvent::put);
+        });
+        if (!index->complete(tier) && t.first->stats().size() == 0)
+        {
+            index->set_complete(tier, true);
+        }
+    }
+}
+
+vector<string> Thumbnailer::source_index_tokens() const
+{
+    // In the same order as SourceIndex::Tier.
+    return { full_size_cache_->content_token(), thumbnail_cache_->content_token(), failure_cache_->content_token() };
 }
 
 void Thumbnailer::apply_upgrade_actions(string const& cache_dir)
 {
     Version v(cache_dir);
-    if (v.prev_cache_version() != v.cache_version)
+    legacy_keys_path_ = cache_dir + "/legacy-keys";
+    if (v.prev_cache_version() == 2 && v.cache_version == 3)
+    {
+        // Version 3 changed only the keys for local files. Instead of wiping
+        // the caches, we look for the old key whenever the new key misses and
+        // copy what we find. The marker file remembers to do that across
+        // restarts, until the caches are cleared.
+        qDebug() << "cache version update from" << v.prev_cache_version() << "to" << v.cache_version
+                 << "(migrating keys on demand)";
+        write_file(legacy_keys_path_, string());
+    }
+    else if (v.prev_cache_version() != v.cache_version)
     {
         // Whenever the version changes, we wipe all three caches.
         // That's useful to, for example, get rid of old unknown
@@ -826,6 +2414,7 @@ void Thumbnailer::apply_upgrade_actions(string const& cache_dir)
         qDebug() << "cache version update from" << v.prev_cache_version() << "to" << v.cache_version;
         clear(Thumbnailer::CacheSelector::all);
     }
+    migrate_legacy_keys_ = boost::filesystem::exists(legacy_keys_path_);
 }
 
 unique_ptr<ThumbnailRequest> Thumbnailer::get_thumbnail(string const& filename,
@@ -836,6 +2425,7 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_thumbnail(string const& filename,
         throw unity::InvalidArgumentException("Thumbnailer::get_thumbnail(): filename is empty");
     }
 
+    note_request(filename, requested_size);
     try
     {
         return unique_ptr<ThumbnailRequest>(
@@ -891,7 +2481,77 @@ unique_ptr<ThumbnailRequest> Thumbnailer::get_artist_art(string const& artist,
 
 Thumbnailer::AllStats Thumbnailer::stats() const
 {
-    return AllStats{full_size_cache_->stats(), thumbnail_cache_->stats(), failure_cache_->stats()};
+    return AllStats{full_size_cache_->stats(), thumbnail_cache_->stats(), failure_cache_->stats(),
+                    memory_cache_->stats()};
+}
+
+Thumbnailer::CounterMap Thumbnailer::counters() const
+{
+    auto const mst = memory_cache_->stats();
+    auto const ast = apparmor_cache_stats();
+    auto const fst = file_info_cache_->stats();
+    auto const vst = volume_caches_ ? volume_caches_->stats() : VolumeCaches::Stats{ 0, 0 };
+    size_t background_pending;
+    CounterMap prefetch_counters;
+    {
+        lock_guard<mutex> lock(background_mutex_);
+        background_pending = background_queue_.size();
+        auto const decided = prefetch_hits_ + prefetch_wasted_;
+        prefetch_counters =
+        {
+            { "prefetch.predictions", prefetch_calls_ },
+            { "prefetch.pending", int64_t(prefetch_queue_.size()) },
+            { "prefetch.thumbnails", prefetch_thumbnails_ },
+            { "prefetch.hits", prefetch_hits_ },
+            { "prefetch.wasted", prefetch_wasted_ },
+            { "prefetch.accuracy_percent", decided == 0 ? 0 : prefetch_hits_ * 100 / decided }
+        };
+    }
+    CounterMap counters
+    {
+        { "albums.entries", album_index_->size() },
+        { "albums.local_hits", local_album_hits_.load() },
+        { "apparmor.hits", ast.hits },
+        { "apparmor.misses", ast.misses },
+        { "apparmor.invalidations", ast.invalidations },
+        { "background.pending", int64_t(background_pending) },
+        { "background.thumbnails", background_thumbnails_.load() },
+        { "coalescing.requests", coalesced_requests_.load() },
+        { "coalescing.hits", coalesced_hits_.load() },
+        { "dedup.references", shared_entries_.load() },
+        { "dedup.skipped_decodes", skipped_decodes_.load() },
+        { "desktop.hits", desktop_hits_.load() },
+        { "desktop.stores", desktop_stores_.load() },
+        { "files.entries", fst.entries },
+        { "files.hits", fst.hits },
+        { "files.misses", fst.misses },
+        { "files.invalidations", fst.invalidations },
+        { "filter.images", full_size_cache_->filtered_misses() },
+        { "filter.thumbnails", thumbnail_cache_->filtered_misses() },
+        { "filter.failures", failure_cache_->filtered_misses() },
+        { "index.sources", source_index_->size() },
+        { "index.skipped_reads", index_skipped_reads_.load() },
+        { "keys.migrated", migrated_entries_.load() },
+        { "memory.entries", mst.size },
+        { "memory.bytes", mst.size_in_bytes },
+        { "memory.max_bytes", mst.max_size_in_bytes },
+        { "memory.hits", mst.hits },
+        { "memory.misses", mst.misses },
+        { "memory.evictions", mst.evictions },
+        { "memory.preloaded", preloaded_.load() },
+        { "volume.hits", volume_hits_.load() },
+        { "volume.stores", volume_stores_.load() },
+        { "volume.open_caches", volume_caches_ ? volume_caches_->open_caches() : 0 },
+        { "volume.caches", vst.caches },
+        { "volume.bytes", vst.disk_size }
+    };
+    counters.insert(prefetch_counters.begin(), prefetch_counters.end());
+    return counters;
+}
+
+SourceIndex::Record Thumbnailer::source_record(ThumbnailRequest const& request) const
+{
+    return source_index_->lookup(request.key()).record;
 }
 
 Thumbnailer::CacheVec Thumbnailer::select_caches(CacheSelector selector) const
@@ -908,6 +2568,8 @@ Thumbnailer::CacheVec Thumbnailer::select_caches(CacheSelector selector) const
         case Thumbnailer::CacheSelector::failure_cache:
             v.push_back(failure_cache_.get());
             break;
+        case Thumbnailer::CacheSelector::memory_cache:
+            break;  // Not persistent, handled separately.
         default:
             v.push_back(full_size_cache_.get());
             v.push_back(thumbnail_cache_.get());
@@ -930,6 +2592,8 @@ char const* cache_name(Thumbnailer::CacheSelector selector)
             return "thumbnail cache";
         case Thumbnailer::CacheSelector::failure_cache:
             return "failure cache";
+        case Thumbnailer::CacheSelector::memory_cache:
+            return "memory cache";
         default:
             return "all caches";
     }
@@ -943,15 +2607,45 @@ void Thumbnailer::clear_stats(CacheSelector selector)
     {
         c->clear_stats();
     }
+    if (selector == Thumbnailer::CacheSelector::memory_cache ||
+        selector == Thumbnailer::CacheSelector::all)
+    {
+        memory_cache_->clear_stats();
+    }
+    if (selector == Thumbnailer::CacheSelector::all)
+    {
+        coalesced_requests_ = 0;
+        coalesced_hits_ = 0;
+        index_skipped_reads_ = 0;
+    }
     qDebug() << "reset statistics for" << cache_name(selector);
 }
 
 void Thumbnailer::clear(CacheSelector selector)
 {
+    // Let queued writes complete first, so look-ups after clearing the in-memory
+    // cache go to the DB, and show up in its stats, even for recent entries.
+    for (auto c : select_caches(CacheSelector::all))
+    {
+        c->flush();
+    }
     for (auto c : select_caches(selector))
     {
         c->invalidate();
     }
+    if (selector == Thumbnailer::CacheSelector::thumbnail_cache ||
+        selector == Thumbnailer::CacheSelector::memory_cache ||
+        selector == Thumbnailer::CacheSelector::all)
+    {
+        // The in-memory cache holds a subset of the thumbnail cache.
+        memory_cache_->invalidate();
+    }
+    if ((selector == Thumbnailer::CacheSelector::thumbnail_cache ||
+         selector == Thumbnailer::CacheSelector::all) && volume_caches_)
+    {
+        // The thumbnails of files on removable volumes live in the volume caches.
+        volume_caches_->clear();
+    }
     if (selector == Thumbnailer::CacheSelector::failure_cache ||
         selector == Thumbnailer::CacheSelector::all)
     {
@@ -960,6 +2654,13 @@ void Thumbnailer::clear(CacheSelector selector)
         backoff_.set_last_fail_time(chrono::system_clock::time_point())
                 .set_backoff_period(chrono::seconds(0));
     }
+    if (selector == Thumbnailer::CacheSelector::all)
+    {
+        // Nothing is left to migrate.
+        migrate_legacy_keys_ = false;
+        boost::system::error_code ec;
+        boost::filesystem::remove(legacy_keys_path_, ec);
+    }
     qDebug() << "cleared" << cache_name(selector);
 }
 
@@ -970,6 +2671,11 @@ void Thumbnailer::compact(CacheSelector selector)
     {
         c->compact();
     }
+    if ((selector == Thumbnailer::CacheSelector::thumbnail_cache ||
+         selector == Thumbnailer::CacheSelector::all) && volume_caches_)
+    {
+        volume_caches_->compact();
+    }
     qDebug() << "completed compacting" << cache_name(selector);
 }
 
@@ -29,6 +29,9 @@
 #include <QUrlQuery>
 
 #include <cassert>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 #include <netdb.h>
 #include <unistd.h>
@@ -145,15 +148,21 @@ public:
 
     UbuntuServerArtReply(QString const& url,
                          QNetworkReply* reply,
-                         chrono::milliseconds timeout)
+                         chrono::milliseconds timeout,
+                         int decode_size,
+                         qint64 max_size)
         : ArtReply(nullptr)
         , url_string_(url)
         , status_(ArtReply::not_finished)
         , reply_(reply)
+        , max_size_(max_size)
+        , decoder_(new Image::Decoder(QSize(decode_size, decode_size)))
+        , decode_size_(decode_size)
     {
         assert(!url.isEmpty());
         assert(reply_);
 
+        connect(reply_, &QNetworkReply::readyRead, this, &UbuntuServerArtReply::read_body);
         connect(&timer_, &QTimer::timeout, this, &UbuntuServerArtReply::timeout);
         timer_.setSingleShot(true);
         timer_.start(timeout.count());
@@ -181,6 +190,77 @@ public:
         return url_string_;
     }
 
+    void decode_received() override
+    {
+        QByteArray chunk;
+        {
+            lock_guard<mutex> lock(mutex_);
+            chunk.swap(undecoded_);
+        }
+        if (!decoder_ || chunk.isEmpty())
+        {
+            return;
+        }
+        try
+        {
+            decoder_->write(chunk.constData(), chunk.size());
+        }
+        catch (std::exception const& e)
+        {
+            if (decoder_->prepared())
+            {
+                decode_error_ = e.what();  // Damaged image.
+            }
+            decoder_.reset();  // Otherwise, the data is not an image, and data_ holds all of it.
+            return;
+        }
+        if (decoder_->prepared())
+        {
+            lock_guard<mutex> lock(mutex_);
+            keep_data_ = false;
+            data_ = QByteArray();
+        }
+    }
+
+    Image image() override
+    {
+        assert(status_ == ArtReply::Status::success);
+
+        if (has_image_)
+        {
+            return image_;
+        }
+        decode_received();
+        if (!decode_error_.empty())
+        {
+            throw runtime_error(decode_error_);
+        }
+        if (decoder_)
+        {
+            try
+            {
+                image_ = decoder_->finish();
+                has_image_ = true;
+                decoder_.reset();
+                return image_;
+            }
+            catch (std::exception const&)
+            {
+                if (decoder_->prepared())
+                {
+                    throw;
+                }
+                decoder_.reset();
+            }
+        }
+        // The decoder did not recognize the data, so we give it to the
+        // decoders that need all of the data at once. This throws if the
+        // data is not an image.
+        image_ = Image(data_, QSize(decode_size_, decode_size_));
+        has_image_ = true;
+        return image_;
+    }
+
     void set_status()
     {
         // Set the defaults, in case none of the tests below match.
@@ -200,6 +280,11 @@ public:
                 status_ = ArtReply::Status::not_found;
                 return;
             case QNetworkReply::OperationCanceledError:
+                if (too_large_)
+                {
+                    set_too_large();
+                    return;
+                }
                 // Happens if we call reply_->abort() after a timeout.
                 // We need to overwrite the "operation cancelled" message that
                 // is set by this, otherwise the log doesn't tell the real story.
@@ -251,7 +336,11 @@ public Q_SLOTS:
         set_status();
         if (status_ == ArtReply::Status::success)
         {
-            data_ = reply_->readAll();
+            read_body();
+            if (too_large_)
+            {
+                set_too_large();
+            }
         }
         Q_EMIT finished();
     }
@@ -262,13 +351,85 @@ public Q_SLOTS:
         reply_->abort();
     }
 
+    // Queues the data that has arrived so far for decode_received(). Until the
+    // decoder has recognized an image, we also keep the data itself, in case
+    // it turns out not to be an image. Once the data exceeds the maximum size,
+    // we give up.
+    void read_body()
+    {
+        if (too_large_)
+        {
+            return;
+        }
+        auto const announced_size = reply_->header(QNetworkRequest::ContentLengthHeader);
+        if (announced_size.isValid() && announced_size.toLongLong() > max_size_)
+        {
+            abort_too_large();
+            return;
+        }
+        QByteArray const chunk = reply_->readAll();
+        received_ += chunk.size();
+        if (received_ > max_size_)
+        {
+            abort_too_large();
+            return;
+        }
+        if (chunk.isEmpty())
+        {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(mutex_);
+            undecoded_.append(chunk);
+            if (keep_data_)
+            {
+                data_.append(chunk);
+            }
+        }
+        Q_EMIT dataReceived();
+    }
+
 private:
+    void abort_too_large()
+    {
+        too_large_ = true;
+        {
+            lock_guard<mutex> lock(mutex_);
+            undecoded_.clear();
+            data_.clear();
+        }
+        if (reply_->isRunning())
+        {
+            reply_->abort();  // Calls download_finished().
+        }
+    }
+
+    void set_too_large()
+    {
+        status_ = ArtReply::Status::hard_error;
+        error_string_ = QStringLiteral("Response exceeds maximum download size of %1 bytes").arg(max_size_);
+        qDebug() << error_string_ << "for" << url_string_;
+    }
+
     QString const url_string_;
     QString error_string_;
-    QByteArray data_;
     ArtReply::Status status_;
     QNetworkReply* reply_;
     QTimer timer_;
+    qint64 const max_size_ = 0;  // In bytes
+    qint64 received_ = 0;
+    bool too_large_ = false;
+
+    mutex mutex_;                         // Protects the members below, up to decoder_.
+    QByteArray undecoded_;                // Received, but not yet passed to the decoder.
+    QByteArray data_;                     // Everything received, while keep_data_ is true.
+    bool keep_data_ = true;               // False once the decoder has recognized an image.
+
+    unique_ptr<Image::Decoder> decoder_;  // Null once decoding has finished or failed.
+    int const decode_size_ = 0;
+    string decode_error_;
+    Image image_;
+    bool has_image_ = false;
 };
 
 UbuntuServerDownloader::UbuntuServerDownloader(QObject* parent)
@@ -276,6 +437,11 @@ UbuntuServerDownloader::UbuntuServerDownloader(QObject* parent)
     , api_key_(api_key())
     , network_manager_(make_shared<QNetworkAccessManager>(this))
 {
+    // There is no point in decoding images at more than the size of the largest
+    // thumbnail, because the thumbnailer scales them down to that anyway.
+    Settings settings;
+    decode_size_ = settings.max_thumbnail_size();
+    max_download_size_ = qint64(settings.max_download_size()) * 1024;
 }
 
 shared_ptr<ArtReply> UbuntuServerDownloader::download_album(QString const& artist,
@@ -304,7 +470,8 @@ shared_ptr<ArtReply> UbuntuServerDownloader::download_url(QUrl const& url, chron
     if (network_is_connected(domain_name))
     {
         QNetworkReply* reply = network_manager_->get(QNetworkRequest(url));
-        art_reply = make_shared<UbuntuServerArtReply>(url.toString(), reply, timeout);
+        art_reply = make_shared<UbuntuServerArtReply>(url.toString(), reply, timeout,
+                                                      decode_size_, max_download_size_);
         connect(reply, &QNetworkReply::finished, art_reply.get(), &UbuntuServerArtReply::download_finished);
     }
     else
@@ -0,0 +1,464 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/volume_caches.h>
+
+#include <internal/make_directories.h>
+
+#include <boost/filesystem.hpp>
+#include <QDebug>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+using namespace std;
+
+namespace unity
+{
+
+namespace thumbnailer
+{
+
+namespace internal
+{
+
+namespace
+{
+
+// Volumes are mounted and unmounted rarely, so we don't read the mount table for every request.
+chrono::seconds const REFRESH_INTERVAL(2);
+
+bool is_below(string const& path, string const& dir)
+{
+    return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 && path[dir.size()] == '/';
+}
+
+// The mount table escapes space, tab, newline, and backslash as octal.
+
+string unescape(string const& field)
+{
+    string s;
+    for (size_t i = 0; i < field.size(); ++i)
+    {
+        if (field[i] == '\\' && i + 3 < field.size() && field[i + 1] >= '0' && field[i + 1] <= '7')
+        {
+            s += char(stoi(field.substr(i + 1, 3), nullptr, 8));
+            i += 3;
+        }
+        else
+        {
+            s += field[i];
+        }
+    }
+    return s;
+}
+
+// Returns the UUID of the file system on device, or the empty string if it has none.
+
+string file_system_uuid(string const& uuid_dir, dev_t device)
+{
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(uuid_dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        struct stat st;
+        if (stat(it->path().c_str(), &st) == 0 && S_ISBLK(st.st_mode) && st.st_rdev == device)
+        {
+            return it->path().filename().native();
+        }
+    }
+    return "";
+}
+
+struct CacheDir
+{
+    string path;
+    time_t last_opened;
+    int64_t size;
+};
+
+// Returns the caches in dir, with the size of each on disk.
+
+vector<CacheDir> cache_dirs(string const& dir)
+{
+    vector<CacheDir> dirs;
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        boost::system::error_code file_ec;
+        if (!boost::filesystem::is_directory(it->path(), file_ec))
+        {
+            continue;  // LCOV_EXCL_LINE
+        }
+        CacheDir d{ dir + "/" + it->path().filename().native(), boost::filesystem::last_write_time(it->path(), file_ec), 0 };
+        for (boost::filesystem::recursive_directory_iterator f(it->path(), file_ec), fend;
+             !file_ec && f != fend;
+             f.increment(file_ec))
+        {
+            boost::system::error_code size_ec;
+            auto const size = boost::filesystem::file_size(f->path(), size_ec);
+            if (!size_ec)
+            {
+                d.size += int64_t(size);
+            }
+        }
+        dirs.push_back(d);
+    }
+    return dirs;
+}
+
+}  // namespace
+
+VolumeCaches::VolumeCaches(string const& cache_dir,
+                           int64_t max_cache_size,
+                           int64_t max_total_size,
+                           vector<string> const& roots,
+                           string const& mount_info,
+                           string const& uuid_dir,
+                           chrono::milliseconds idle_time)
+    : cache_dir_(cache_dir)
+    , max_cache_size_(max_cache_size)
+    , max_total_size_(max_total_size)
+    , roots_(roots)
+    , mount_info_(mount_info)
+    , uuid_dir_(uuid_dir)
+    , idle_time_(idle_time)
+{
+    {
+        // The limit may have been lowered since the caches were made.
+        lock_guard<mutex> lock(mutex_);
+        trim();
+    }
+    closer_ = thread([this]{ close_idle_caches(); });
+}
+
+VolumeCaches::~VolumeCaches()
+{
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cache_opened_.notify_one();
+    closer_.join();
+}
+
+shared_ptr<PersistentCacheHelper> VolumeCaches::find(string const& path, string& relative_path)
+{
+    lock_guard<mutex> lock(mutex_);
+    auto const now = chrono::steady_clock::now();
+    if (now >= next_refresh_)
+    {
+        refresh_mounts();
+        next_refresh_ = now + REFRESH_INTERVAL;
+    }
+
+    // If volumes are nested, the innermost one holds the file.
+    Volume* volume = nullptr;
+    for (auto& v : volumes_)
+    {
+        if (is_below(path, v.first) && (!volume || v.first.size() > volume->mount_point.size()))
+        {
+            volume = &v.second;
+        }
+    }
+    if (!volume || volume->failed)
+    {
+        return nullptr;
+    }
+    if (!volume->cache)
+    {
+        volume->cache = open_cache(*volume);
+        volume->failed = !volume->cache;
+        cache_opened_.notify_one();
+    }
+    if (volume->cache)
+    {
+        relative_path = path.substr(volume->mount_point.size() + 1);
+        volume->last_used = now;
+    }
+    return volume->cache;
+}
+
+int VolumeCaches::open_caches() const
+{
+    lock_guard<mutex> lock(mutex_);
+    int n = 0;
+    for (auto const& v : volumes_)
+    {
+        n += v.second.cache ? 1 : 0;
+    }
+    return n;
+}
+
+// Requests may still write to the caches that are in use, so we empty those
+// instead of removing them.
+
+void VolumeCaches::clear()
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto const& d : cache_dirs(cache_dir_))
+    {
+        try
+        {
+            auto cache = in_use(d.path);
+            if (cache)
+            {
+                cache->invalidate();
+            }
+            else
+            {
+                boost::filesystem::remove_all(d.path);
+            }
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "VolumeCaches::clear(): cannot clear" << d.path.c_str() << ":" << e.what();
+        }
+        // LCOV_EXCL_STOP
+    }
+}
+
+// The caches that are not in use are opened just for compacting them. We hold
+// the lock throughout, so find() cannot open one of them at the same time.
+
+void VolumeCaches::compact()
+{
+    lock_guard<mutex> lock(mutex_);
+    for (auto const& d : cache_dirs(cache_dir_))
+    {
+        try
+        {
+            auto cache = in_use(d.path);
+            if (cache)
+            {
+                cache->compact();
+            }
+            else
+            {
+                PersistentCacheHelper::open(d.path, max_cache_size_, core::CacheDiscardPolicy::lru_only)->compact();
+            }
+        }
+        // LCOV_EXCL_START
+        catch (std::exception const& e)
+        {
+            qWarning() << "VolumeCaches::compact(): cannot compact" << d.path.c_str() << ":" << e.what();
+        }
+        // LCOV_EXCL_STOP
+    }
+}
+
+VolumeCaches::Stats VolumeCaches::stats() const
+{
+    lock_guard<mutex> lock(mutex_);
+    Stats st{ 0, 0 };
+    for (auto const& d : cache_dirs(cache_dir_))
+    {
+        ++st.caches;
+        st.disk_size += d.size;
+    }
+    return st;
+}
+
+// Reads the mount table. Caches stay open for the volumes that are still mounted
+// at the same place. The others are closed once the requests using them are done.
+
+void VolumeCaches::refresh_mounts()
+{
+    map<string, Volume> mounted;
+    ifstream in(mount_info_);
+    string line;
+    while (getline(in, line))
+    {
+        // Fields: ID, parent ID, major:minor, root, mount point, options,
+        // optional fields, "-", file system type, source, super options.
+        istringstream fields(line);
+        string id, parent, device, root, mount_point;
+        if (!(fields >> id >> parent >> device >> root >> mount_point) || root != "/")
+        {
+            continue;  // Bind mounts of directories are not volumes.
+        }
+        mount_point = unescape(mount_point);
+        bool removable = false;
+        for (auto const& r : roots_)
+        {
+            removable = removable || is_below(mount_point, r);
+        }
+        unsigned major_num, minor_num;
+        char colon;
+        istringstream dev(device);
+        if (!removable || !(dev >> major_num >> colon >> minor_num))
+        {
+            continue;
+        }
+
+        Volume volume;
+        volume.mount_point = mount_point;
+        volume.device = makedev(major_num, minor_num);
+        auto it = volumes_.find(mount_point);
+        if (it != volumes_.end() && it->second.device == volume.device)
+        {
+            volume = it->second;
+        }
+        mounted[mount_point] = volume;
+    }
+    volumes_.swap(mounted);
+}
+
+// Volumes keep their thumbnails with us, identified by the file system.
+
+shared_ptr<PersistentCacheHelper> VolumeCaches::open_cache(Volume const& volume)
+{
+    auto const uuid = file_system_uuid(uuid_dir_, volume.device);
+    if (uuid.empty())
+    {
+        return nullptr;
+    }
+    auto const path = cache_dir_ + "/" + uuid;
+
+    // The database can be opened only once, so we reuse a closed cache that is still in use.
+    shared_ptr<PersistentCacheHelper> cache = in_use(path);
+    if (cache)
+    {
+        return cache;
+    }
+    try
+    {
+        make_directories(cache_dir_, 0700);
+        cache = PersistentCacheHelper::open(path, max_cache_size_, core::CacheDiscardPolicy::lru_only);
+    }
+    // LCOV_EXCL_START
+    catch (std::exception const& e)
+    {
+        qWarning() << "VolumeCaches: cannot open cache for" << volume.mount_point.c_str() << ":" << e.what();
+        return nullptr;
+    }
+    // LCOV_EXCL_STOP
+    opened_[path] = cache;
+
+    // The modification time of the directory tells trim() when the cache was last opened.
+    boost::system::error_code ec;
+    boost::filesystem::last_write_time(path, time(nullptr), ec);
+    trim();
+    return cache;
+}
+
+// Returns the cache in cache_path if it is open, or if a request still uses it.
+
+shared_ptr<PersistentCacheHelper> VolumeCaches::in_use(string const& cache_path) const
+{
+    auto it = opened_.find(cache_path);
+    return it == opened_.end() ? nullptr : it->second.lock();
+}
+
+// Removes the caches that were opened least recently, except those in use,
+// until all of them together fit into max_total_size_. Called with mutex_
+// locked, so find() cannot open a cache while we remove it.
+
+void VolumeCaches::trim()
+{
+    for (auto it = opened_.begin(); it != opened_.end();)
+    {
+        it = it->second.expired() ? opened_.erase(it) : next(it);
+    }
+
+    auto dirs = cache_dirs(cache_dir_);
+    int64_t total = 0;
+    for (auto const& d : dirs)
+    {
+        total += d.size;
+    }
+    sort(dirs.begin(), dirs.end(), [](CacheDir const& a, CacheDir const& b)
+    {
+        return a.last_opened < b.last_opened;
+    });
+    for (auto const& d : dirs)
+    {
+        if (total <= max_total_size_)
+        {
+            break;
+        }
+        if (in_use(d.path))
+        {
+            continue;
+        }
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(d.path, ec);
+        if (ec)
+        {
+            // LCOV_EXCL_START
+            qWarning() << "VolumeCaches: cannot remove" << d.path.c_str() << ":" << ec.message().c_str();
+            continue;
+            // LCOV_EXCL_STOP
+        }
+        total -= d.size;
+    }
+}
+
+// Runs in closer_. Sleeps until the least recently used cache has been idle
+// for idle_time_ and closes it, or until a cache is opened if none is open.
+// Requests that still use a closed cache keep it open until they are done.
+
+void VolumeCaches::close_idle_caches()
+{
+    unique_lock<mutex> lock(mutex_);
+    while (!stop_)
+    {
+        bool any_open = false;
+        chrono::steady_clock::time_point oldest;
+        for (auto const& v : volumes_)
+        {
+            if (v.second.cache && (!any_open || v.second.last_used < oldest))
+            {
+                oldest = v.second.last_used;
+                any_open = true;
+            }
+        }
+        if (!any_open)
+        {
+            cache_opened_.wait(lock);
+            continue;
+        }
+        if (cache_opened_.wait_until(lock, oldest + idle_time_) == cv_status::no_timeout)
+        {
+            continue;
+        }
+
+        vector<shared_ptr<PersistentCacheHelper>> idle;
+        auto const now = chrono::steady_clock::now();
+        for (auto& v : volumes_)
+        {
+            if (v.second.cache && v.second.last_used + idle_time_ <= now)
+            {
+                idle.push_back(move(v.second.cache));
+            }
+        }
+        // Closing a database takes a while, so we don't hold up find() for that.
+        lock.unlock();
+        idle.clear();
+        lock.lock();
+    }
+}
+
+}  // namespace internal
+
+}  // namespace thumbnailer
+
+}  // namespace unity
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/album_index.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/album_index_test.dir"
+#define INDEX_FILE TEST_DIR "/albums.index"
+
+namespace
+{
+
+class AlbumIndexTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::create_directories(TEST_DIR);
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+    }
+};
+
+TEST_F(AlbumIndexTest, basic)
+{
+    AlbumIndex index(10);
+    EXPECT_EQ(0, index.size());
+    EXPECT_EQ("", index.find("artist", "album"));
+
+    index.add("artist", "album", "/music/a.mp3");
+    EXPECT_EQ("/music/a.mp3", index.find("artist", "album"));
+    EXPECT_EQ("", index.find("artist", "other album"));
+    EXPECT_EQ("", index.find("other artist", "album"));
+
+    // The first file of an album stays.
+    index.add("artist", "album", "/music/b.mp3");
+    EXPECT_EQ("/music/a.mp3", index.find("artist", "album"));
+    EXPECT_EQ(1, index.size());
+
+    // Missing tags don't identify an album.
+    index.add("", "album", "/music/c.mp3");
+    index.add("artist", "", "/music/c.mp3");
+    EXPECT_EQ(1, index.size());
+
+    // Only the file we have is removed.
+    index.remove("artist", "album", "/music/b.mp3");
+    EXPECT_EQ("/music/a.mp3", index.find("artist", "album"));
+    index.remove("artist", "album", "/music/a.mp3");
+    EXPECT_EQ("", index.find("artist", "album"));
+    EXPECT_EQ(0, index.size());
+
+    index.add("artist", "album", "/music/b.mp3");
+    EXPECT_EQ("/music/b.mp3", index.find("artist", "album"));
+}
+
+TEST_F(AlbumIndexTest, full)
+{
+    AlbumIndex index(2);
+    index.add("artist", "album 1", "/music/1.mp3");
+    index.add("artist", "album 2", "/music/2.mp3");
+    index.add("artist", "album 3", "/music/3.mp3");
+    EXPECT_EQ(2, index.size());
+    EXPECT_EQ("", index.find("artist", "album 3"));
+
+    index.remove("artist", "album 1", "/music/1.mp3");
+    index.add("artist", "album 3", "/music/3.mp3");
+    EXPECT_EQ("/music/3.mp3", index.find("artist", "album 3"));
+}
+
+TEST_F(AlbumIndexTest, save_and_load)
+{
+    {
+        AlbumIndex index(10);
+        EXPECT_FALSE(index.load(INDEX_FILE));
+        index.add("artist", "album", "/music/a.mp3");
+        index.add("Sigur Rós", "( )", "/music/untitled\n1.ogg");
+        index.save(INDEX_FILE);
+    }
+    {
+        AlbumIndex index(10);
+        EXPECT_TRUE(index.load(INDEX_FILE));
+        EXPECT_EQ(2, index.size());
+        EXPECT_EQ("/music/a.mp3", index.find("artist", "album"));
+        EXPECT_EQ("/music/untitled\n1.ogg", index.find("Sigur Rós", "( )"));
+
+        // Nothing changed, so nothing is written.
+        boost::filesystem::remove(INDEX_FILE);
+        index.save(INDEX_FILE);
+        EXPECT_FALSE(boost::filesystem::exists(INDEX_FILE));
+    }
+    {
+        // Only as many entries as fit are loaded.
+        AlbumIndex index(2);
+        index.add("artist", "album", "/music/a.mp3");
+        index.add("artist", "other album", "/music/b.mp3");
+        index.save(INDEX_FILE);
+        AlbumIndex small(1);
+        EXPECT_TRUE(small.load(INDEX_FILE));
+        EXPECT_EQ(1, small.size());
+    }
+}
+
+TEST_F(AlbumIndexTest, bad_file)
+{
+    AlbumIndex index(10);
+    index.add("artist", "album", "/music/a.mp3");
+
+    write_file(INDEX_FILE, string("something else\n"));
+    EXPECT_FALSE(index.load(INDEX_FILE));
+    EXPECT_EQ(1, index.size());
+
+    // A truncated file gives us the entries up to the damage.
+    write_file(INDEX_FILE, string("thumbnailer-albums 1\n1\na1\nb6\n/a.mp31\nc1\nd20\n/b"));
+    EXPECT_TRUE(index.load(INDEX_FILE));
+    EXPECT_EQ(1, index.size());
+    EXPECT_EQ("/a.mp3", index.find("a", "b"));
+}
+
+}  // namespace
@@ -0,0 +1,220 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/bloom_filter.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define FILTER_FILE TESTBINDIR "/filter.bloom"
+
+TEST(BloomFilter, basic)
+{
+    BloomFilter f(100);
+    EXPECT_LE(1000, f.num_counters());
+
+    EXPECT_FALSE(f.may_contain("foo"));
+    f.add("foo");
+    EXPECT_TRUE(f.may_contain("foo"));
+    EXPECT_FALSE(f.may_contain("bar"));
+
+    f.add("");
+    EXPECT_TRUE(f.may_contain(""));
+    f.add(string("a\0b", 3));
+    EXPECT_TRUE(f.may_contain(string("a\0b", 3)));
+
+    f.clear();
+    EXPECT_FALSE(f.may_contain("foo"));
+    EXPECT_FALSE(f.may_contain(""));
+}
+
+TEST(BloomFilter, false_positive_rate)
+{
+    int const N = 10000;
+    BloomFilter f(N);
+
+    for (int i = 0; i < N; ++i)
+    {
+        f.add("key" + to_string(i));
+    }
+    for (int i = 0; i < N; ++i)
+    {
+        ASSERT_TRUE(f.may_contain("key" + to_string(i))) << i;  // No false negatives, ever.
+    }
+
+    int false_positives = 0;
+    for (int i = N; i < 2 * N; ++i)
+    {
+        if (f.may_contain("key" + to_string(i)))
+        {
+            ++false_positives;
+        }
+    }
+    EXPECT_LT(false_positives, N * 3 / 100) << false_positives;
+}
+
+TEST(BloomFilter, save_and_load)
+{
+    boost::filesystem::remove(FILTER_FILE);
+
+    BloomFilter f(100);
+    EXPECT_FALSE(f.load(FILTER_FILE, "token"));  // No file.
+
+    f.add("foo");
+    f.save(FILTER_FILE, "token");
+
+    {
+        BloomFilter g(100);
+        EXPECT_TRUE(g.load(FILTER_FILE, "token"));
+        EXPECT_TRUE(g.may_contain("foo"));
+        EXPECT_FALSE(g.may_contain("bar"));
+
+        // Loading removes the file.
+        EXPECT_FALSE(boost::filesystem::exists(FILTER_FILE));
+        EXPECT_FALSE(g.load(FILTER_FILE, "token"));
+    }
+
+    {
+        // Wrong token.
+        f.save(FILTER_FILE, "token");
+        BloomFilter g(100);
+        EXPECT_FALSE(g.load(FILTER_FILE, "other token"));
+        EXPECT_FALSE(g.may_contain("foo"));
+        EXPECT_FALSE(boost::filesystem::exists(FILTER_FILE));
+    }
+
+    {
+        // Different size.
+        f.save(FILTER_FILE, "token");
+        BloomFilter g(1000);
+        EXPECT_FALSE(g.load(FILTER_FILE, "token"));
+        EXPECT_FALSE(g.may_contain("foo"));
+    }
+
+    {
+        // Truncated file.
+        f.save(FILTER_FILE, "token");
+        auto contents = read_file(FILTER_FILE);
+        write_file(FILTER_FILE, contents.substr(0, contents.size() - 1));
+        BloomFilter g(100);
+        EXPECT_FALSE(g.load(FILTER_FILE, "token"));
+        EXPECT_FALSE(g.may_contain("foo"));
+    }
+}
+
+TEST(BloomFilter, remove)
+{
+    boost::filesystem::remove(FILTER_FILE);
+
+    BloomFilter f(100);
+    f.add("a");
+    f.add("b");
+    f.add("c");
+    EXPECT_EQ(3, f.num_added());
+
+    f.remove("b");
+    EXPECT_EQ(2, f.num_added());
+    EXPECT_TRUE(f.may_contain("a"));
+    EXPECT_FALSE(f.may_contain("b"));
+    EXPECT_TRUE(f.may_contain("c"));
+
+    // Adding a key twice needs two removals.
+    f.add("a");
+    f.remove("a");
+    EXPECT_TRUE(f.may_contain("a"));
+    f.remove("a");
+    EXPECT_FALSE(f.may_contain("a"));
+    EXPECT_TRUE(f.may_contain("c"));
+    f.save(FILTER_FILE, "token");
+
+    f.clear();
+    EXPECT_EQ(0, f.num_added());
+
+    // The counters and the count are saved with the filter.
+    BloomFilter g(100);
+    ASSERT_TRUE(g.load(FILTER_FILE, "token"));
+    EXPECT_EQ(1, g.num_added());
+    EXPECT_TRUE(g.may_contain("c"));
+    g.remove("c");
+    EXPECT_FALSE(g.may_contain("c"));
+}
+
+TEST(BloomFilter, no_saturation)
+{
+    // Churning through many times more keys than the filter is sized
+    // for leaves no trace once the keys are removed again.
+    int const N = 1000;
+    BloomFilter f(N);
+    for (int round = 0; round < 20; ++round)
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            f.add("key" + to_string(round * N + i));
+        }
+        for (int i = 0; i < N; ++i)
+        {
+            ASSERT_TRUE(f.may_contain("key" + to_string(round * N + i))) << round << " " << i;
+        }
+        for (int i = 0; i < N; ++i)
+        {
+            f.remove("key" + to_string(round * N + i));
+        }
+    }
+    EXPECT_EQ(0, f.num_added());
+    for (int i = 0; i < N; ++i)
+    {
+        ASSERT_FALSE(f.may_contain("key" + to_string(i))) << i;
+    }
+}
+
+TEST(BloomFilter, overflow)
+{
+    // A counter that overflows sticks, so the key stays in the filter.
+    BloomFilter f(1);
+    for (int i = 0; i < 20; ++i)
+    {
+        f.add("foo");
+    }
+    for (int i = 0; i < 20; ++i)
+    {
+        f.remove("foo");
+    }
+    EXPECT_TRUE(f.may_contain("foo"));
+}
+
+TEST(BloomFilter, stable_bits)
+{
+    boost::filesystem::remove(FILTER_FILE);
+
+    // The counter positions must not depend on the standard library, because
+    // they are saved and loaded again by a later version of the service.
+    BloomFilter f(1);
+    ASSERT_EQ(16, f.num_counters());
+    f.add("foo");
+    f.save(FILTER_FILE, "token");
+    auto const contents = read_file(FILTER_FILE);
+    uint64_t word;
+    memcpy(&word, &contents[contents.size() - sizeof(word)], sizeof(word));
+    EXPECT_EQ(uint64_t(0x0100101010100101), word);
+}
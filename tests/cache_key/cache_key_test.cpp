@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/cache_key.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+timespec const MTIME = { 1460000000, 123456789 };
+string const PATH = "/home/user/Pictures/2016/Holidays/very/deeply/nested/directory/IMG_0001.JPG";
+
+}  // namespace
+
+TEST(CacheKey, local)
+{
+    auto const key = local_cache_key(PATH, 42, MTIME, 1000);
+    EXPECT_EQ(size_t(LOCAL_KEY_SIZE), key.size());
+    EXPECT_TRUE(is_local_cache_key(key));
+    EXPECT_EQ(key, local_cache_key(PATH, 42, MTIME, 1000));
+    EXPECT_EQ(size_t(LOCAL_KEY_SIZE), local_cache_key("/a", 1, MTIME, 0).size());
+
+    // Anything that identifies the contents changes the key.
+    EXPECT_NE(key, local_cache_key(PATH + "2", 42, MTIME, 1000));
+    EXPECT_NE(key, local_cache_key(PATH, 43, MTIME, 1000));
+    EXPECT_NE(key, local_cache_key(PATH, 42, timespec{ MTIME.tv_sec, MTIME.tv_nsec + 1 }, 1000));
+    EXPECT_NE(key, local_cache_key(PATH, 42, MTIME, 1001));
+
+    EXPECT_FALSE(is_local_cache_key(string("artist\0album\0album", 18)));
+    EXPECT_FALSE(is_local_cache_key(legacy_local_cache_key(PATH, 42, MTIME, MTIME)));
+}
+
+TEST(CacheKey, sized)
+{
+    auto const key = local_cache_key(PATH, 42, MTIME, 1000);
+    auto const sized_key = sized_cache_key(key, QSize(1920, 70000));
+    EXPECT_EQ(size_t(LOCAL_KEY_SIZE + 8), sized_key.size());
+    EXPECT_EQ(0, sized_key.compare(0, key.size(), key));
+    EXPECT_NE(sized_key, sized_cache_key(key, QSize(70000, 1920)));
+
+    string k;
+    QSize size;
+    ASSERT_TRUE(split_sized_cache_key(sized_key, k, size));
+    EXPECT_EQ(key, k);
+    EXPECT_EQ(QSize(1920, 70000), size);
+
+    // Remote keys and version 2 keys keep their sizes as text.
+    string const remote_key("artist\0album\0album", 18);
+    EXPECT_EQ(remote_key + string("\0" "48\0" "64", 6), sized_cache_key(remote_key, QSize(48, 64)));
+    ASSERT_TRUE(split_sized_cache_key(sized_cache_key(remote_key, QSize(48, 64)), k, size));
+    EXPECT_EQ(remote_key, k);
+    EXPECT_EQ(QSize(48, 64), size);
+
+    auto const legacy_key = legacy_local_cache_key(PATH, 42, MTIME, MTIME);
+    ASSERT_TRUE(split_sized_cache_key(legacy_sized_cache_key(legacy_key, QSize(128, 96)), k, size));
+    EXPECT_EQ(legacy_key, k);
+    EXPECT_EQ(QSize(128, 96), size);
+
+    EXPECT_FALSE(split_sized_cache_key("", k, size));
+    EXPECT_FALSE(split_sized_cache_key(string("a\0b", 3), k, size));
+    EXPECT_FALSE(split_sized_cache_key(string("a\0b\0c", 5), k, size));
+}
+
+TEST(CacheKey, legacy)
+{
+    timespec const ctime = { 1460000001, 5 };
+    EXPECT_EQ(PATH + string("\0" "42\0" "1460000000.123456789\0" "1460000001.5", 37),
+              legacy_local_cache_key(PATH, 42, MTIME, ctime));
+}
+
+TEST(CacheKey, printable)
+{
+    EXPECT_EQ("artist\\0album\\0album", printable_cache_key(string("artist\0album\0album", 18)));
+
+    auto const printable = printable_cache_key(local_cache_key(PATH, 42, MTIME, 1000));
+    EXPECT_EQ(0, printable.compare(0, 6, "local:"));
+    EXPECT_EQ(size_t(6 + 2 * (LOCAL_KEY_SIZE - 1)), printable.size());
+    EXPECT_EQ("000000000000002a", printable.substr(6 + 32, 16));  // The inode.
+}
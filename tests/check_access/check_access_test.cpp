@@ -21,9 +21,13 @@
 #include <gtest/gtest.h>
 #include <testsetup.h>
 
+#include <condition_variable>
 #include <cstdio>
 #include <errno.h>
+#include <future>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 #include <sys/apparmor.h>
 
 using namespace std;
@@ -57,6 +61,133 @@ TEST(check_access, DISABLED_confined) {
     }
 }
 
+TEST(check_access, cache)
+{
+    vector<string> queries;
+    auto query = [&](string const& label, string const& path)
+    {
+        queries.push_back(path);
+        return label == "app" && path.compare(0, 6, "/open/") == 0 && path != "/open/mixed/secret";
+    };
+    string revision = "1";
+    AccessCache cache(query, [&]{ return revision; }, chrono::seconds(60), 100);
+
+    // Each path is queried once.
+    EXPECT_TRUE(cache.can_read("app", "/open/a"));
+    EXPECT_EQ(vector<string>({"/open/a"}), queries);
+    EXPECT_TRUE(cache.can_read("app", "/open/a"));
+    EXPECT_EQ(1u, queries.size());
+
+    // Answers are per label and per path, even within a directory.
+    EXPECT_TRUE(cache.can_read("app", "/open/b"));
+    EXPECT_FALSE(cache.can_read("other", "/open/a"));
+    EXPECT_TRUE(cache.can_read("app", "/open/sub/c"));
+    EXPECT_EQ(4u, queries.size());
+
+    // Refusals are remembered too.
+    EXPECT_FALSE(cache.can_read("app", "/closed/a"));
+    EXPECT_FALSE(cache.can_read("app", "/closed/a"));
+    EXPECT_EQ(5u, queries.size());
+
+    // A file that is readable says nothing about the other files
+    // in its directory, which the policy may refuse one by one.
+    EXPECT_TRUE(cache.can_read("app", "/open/mixed/a"));
+    EXPECT_FALSE(cache.can_read("app", "/open/mixed/secret"));
+    EXPECT_EQ(vector<string>({"/open/mixed/a", "/open/mixed/secret"}),
+              vector<string>(queries.end() - 2, queries.end()));
+
+    auto stats = cache.stats();
+    EXPECT_EQ(2, stats.hits);
+    EXPECT_EQ(7, stats.misses);
+    EXPECT_EQ(0, stats.invalidations);
+
+    // A policy reload empties the cache.
+    revision = "2";
+    EXPECT_TRUE(cache.can_read("app", "/open/a"));
+    EXPECT_EQ(8u, queries.size());
+    EXPECT_EQ(1, cache.stats().invalidations);
+}
+
+TEST(check_access, cache_expiry)
+{
+    int queries = 0;
+    auto query = [&](string const&, string const&) { ++queries; return true; };
+    AccessCache cache(query, []{ return string(); }, chrono::milliseconds(50), 4);
+
+    EXPECT_TRUE(cache.can_read("app", "/a/x"));
+    EXPECT_TRUE(cache.can_read("app", "/a/y"));
+    EXPECT_EQ(2, queries);
+
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_TRUE(cache.can_read("app", "/a/y"));
+    EXPECT_EQ(3, queries);
+
+    // Filling the cache does not lose answers; they are just asked for again.
+    for (int i = 0; i < 10; ++i)
+    {
+        EXPECT_TRUE(cache.can_read("app", "/dir" + to_string(i) + "/x"));
+    }
+    EXPECT_EQ(13, queries);
+    EXPECT_EQ(0, cache.stats().hits);
+}
+
+TEST(check_access, cache_concurrent_queries)
+{
+    // Each query waits until the other one has started, which only
+    // works if the cache doesn't hold its lock while querying.
+    mutex m;
+    condition_variable cond;
+    int running = 0;
+    string revision = "1";
+    auto query = [&](string const&, string const&)
+    {
+        unique_lock<mutex> lock(m);
+        ++running;
+        cond.notify_all();
+        return cond.wait_for(lock, chrono::seconds(5), [&]{ return running == 2; });
+    };
+    AccessCache cache(query, [&]{ lock_guard<mutex> lock(m); return revision; }, chrono::seconds(60), 100);
+
+    auto a = async(launch::async, [&]{ return cache.can_read("app", "/a"); });
+    auto b = async(launch::async, [&]{ return cache.can_read("app", "/b"); });
+    EXPECT_TRUE(a.get());
+    EXPECT_TRUE(b.get());
+    EXPECT_EQ(2, cache.stats().misses);
+
+    EXPECT_TRUE(cache.can_read("app", "/a"));
+    EXPECT_EQ(1, cache.stats().hits);
+}
+
+TEST(check_access, cache_reload_during_query)
+{
+    // An answer that arrives after the policy was reloaded is returned,
+    // but not remembered.
+    AccessCache* cache_ptr = nullptr;
+    string revision = "1";
+    int queries = 0;
+    auto query = [&](string const& label, string const&)
+    {
+        ++queries;
+        if (queries == 1)
+        {
+            revision = "2";
+            cache_ptr->can_read(label, "/other");  // Notices the new revision.
+        }
+        return true;
+    };
+    AccessCache cache(query, [&]{ return revision; }, chrono::seconds(60), 100);
+    cache_ptr = &cache;
+
+    EXPECT_TRUE(cache.can_read("app", "/a"));
+    EXPECT_EQ(2, queries);
+    EXPECT_EQ(1, cache.stats().invalidations);
+
+    EXPECT_TRUE(cache.can_read("app", "/a"));
+    EXPECT_EQ(3, queries);
+    EXPECT_TRUE(cache.can_read("app", "/other"));
+    EXPECT_EQ(3, queries);
+}
+
 int main(int argc, char** argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/content_index.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(ContentIndex, hash)
+{
+    auto const h = content_hash("hello");
+    EXPECT_EQ(16u, h.size());
+    EXPECT_EQ(h, content_hash("hello"));
+    EXPECT_NE(h, content_hash("hellO"));
+    EXPECT_EQ(16u, content_hash("").size());
+}
+
+TEST(ContentIndex, reference)
+{
+    string const key("artist\0album\0album\0" "48\0" "48", 24);
+    auto const value = reference_value(key);
+    string k;
+    ASSERT_TRUE(is_reference_value(value, k));
+    EXPECT_EQ(key, k);
+
+    EXPECT_FALSE(is_reference_value("\xff\xd8\xff\xe0", k));
+    EXPECT_FALSE(is_reference_value("\x89PNG\r\n\x1a\n", k));
+    EXPECT_FALSE(is_reference_value("", k));
+    EXPECT_FALSE(is_reference_value(string("\0re", 3), k));
+}
+
+TEST(ContentIndex, owner)
+{
+    ContentIndex index(3);
+    EXPECT_EQ("", index.owner("h1"));
+
+    index.set_owner("h1", "k1");
+    index.set_owner("h2", "k2");
+    EXPECT_EQ("k1", index.owner("h1"));
+    EXPECT_EQ("k2", index.owner("h2"));
+    EXPECT_EQ(2, index.size());
+
+    index.set_owner("h1", "k3");
+    EXPECT_EQ("k3", index.owner("h1"));
+    EXPECT_EQ(2, index.size());
+
+    index.set_owner("h3", "k3");
+    EXPECT_EQ(3, index.size());
+
+    // Full, so we start again.
+    index.set_owner("h4", "k4");
+    EXPECT_EQ(1, index.size());
+    EXPECT_EQ("", index.owner("h1"));
+    EXPECT_EQ("k4", index.owner("h4"));
+
+    index.clear();
+    EXPECT_EQ(0, index.size());
+    EXPECT_EQ("", index.owner("h4"));
+}
@@ -18,6 +18,7 @@
  */
 
 #include <internal/env_vars.h>
+#include <internal/file_io.h>
 #include <internal/image.h>
 #include <internal/raii.h>
 #include "utils/artserver.h"
@@ -32,6 +33,7 @@
 
 #include <testsetup.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <fcntl.h>
 #include <memory>
@@ -103,7 +105,7 @@ protected:
 TEST_F(DBusTest, get_album_art)
 {
     QDBusReply<QByteArray> reply =
-        dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24));
+        dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24), QString());
     assert_no_error(reply);
     Image image(reply.value());
     EXPECT_EQ(24, image.width());
@@ -116,7 +118,7 @@ TEST_F(DBusTest, get_artist_art)
     for (int i = 0; i < 2; ++i)
     {
         QDBusReply<QByteArray> reply =
-            dbus_->thumbnailer_->GetArtistArt("metallica", "load", QSize(24, 24));
+            dbus_->thumbnailer_->GetArtistArt("metallica", "load", QSize(24, 24), QString());
         assert_no_error(reply);
         Image image(reply.value());
         EXPECT_EQ(24, image.width());
@@ -128,7 +130,7 @@ TEST_F(DBusTest, thumbnail_image)
 {
     const char* filename = TESTDATADIR "/testimage.jpg";
     QDBusReply<QByteArray> reply =
-        dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256));
+        dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), QString());
     assert_no_error(reply);
 
     Image image(reply.value());
@@ -143,7 +145,7 @@ TEST_F(DBusTest, song_image)
     {
         const char* filename = TESTDATADIR "/testsong.ogg";
         QDBusReply<QByteArray> reply =
-            dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256));
+            dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), QString());
         assert_no_error(reply);
 
         Image image(reply.value());
@@ -159,7 +161,7 @@ TEST_F(DBusTest, video_image)
     {
         const char* filename = TESTDATADIR "/testvideo.ogg";
         QDBusReply<QByteArray> reply =
-            dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256));
+            dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), QString());
         assert_no_error(reply);
 
         Image image(reply.value());
@@ -172,7 +174,7 @@ TEST_F(DBusTest, thumbnail_no_such_file)
 {
     const char* no_such_file = TESTDATADIR "/no-such-file.jpg";
     QDBusReply<QByteArray> reply =
-        dbus_->thumbnailer_->GetThumbnail(no_such_file, QSize(256, 256));
+        dbus_->thumbnailer_->GetThumbnail(no_such_file, QSize(256, 256), QString());
     EXPECT_FALSE(reply.isValid());
     auto message = reply.error().message().toStdString();
     EXPECT_TRUE(boost::contains(message, " No such file or directory: ")) << message;
@@ -182,7 +184,7 @@ TEST_F(DBusTest, server_error)
 {
     {
         QDBusReply<QDBusUnixFileDescriptor> reply =
-            dbus_->thumbnailer_->GetArtistArt("error", "500", QSize(256, 256));
+            dbus_->thumbnailer_->GetArtistArt("error", "500", QSize(256, 256), QString());
         EXPECT_FALSE(reply.isValid());
         auto message = reply.error().message().toStdString();
         EXPECT_EQ("Handler::createFinished(): could not get thumbnail for artist: error/500 (256,256): TEMPORARY ERROR",
@@ -192,7 +194,7 @@ TEST_F(DBusTest, server_error)
     // Again, so we cover the network retry limit case.
     {
         QDBusReply<QDBusUnixFileDescriptor> reply =
-            dbus_->thumbnailer_->GetArtistArt("error", "500", QSize(256, 256));
+            dbus_->thumbnailer_->GetArtistArt("error", "500", QSize(256, 256), QString());
         EXPECT_FALSE(reply.isValid());
         auto message = reply.error().message().toStdString();
         EXPECT_EQ("Handler::checkFinished(): no artwork for artist: error/500 (256,256): TEMPORARY ERROR",
@@ -210,19 +212,29 @@ TEST_F(DBusTest, duplicate_requests)
     {
         watchers[i].reset(
             new QDBusPendingCallWatcher(dbus_->thumbnailer_->GetAlbumArt(
-                "metallica", "load", QSize(i*10, i*10))));
+                "metallica", "load", QSize(i*10, i*10), QString())));
         QObject::connect(watchers[i].get(), &QDBusPendingCallWatcher::finished,
                          [i, &results]{ results.push_back(i); });
     }
 
-    // The results should all be returned in order
-    QSignalSpy spy(watchers[N_REQUESTS-1].get(), &QDBusPendingCallWatcher::finished);
-    ASSERT_TRUE(spy.wait());
+    // The first request completes first. The remaining ones wait for it
+    // and then run concurrently, so they can complete in any order.
+    for (int i = 0; i < N_REQUESTS; i++)
+    {
+        if (!watchers[i]->isFinished())
+        {
+            QSignalSpy spy(watchers[i].get(), &QDBusPendingCallWatcher::finished);
+            ASSERT_TRUE(spy.wait());
+        }
+    }
+    QCoreApplication::processEvents();
 
     for (int i = 0; i < N_REQUESTS; i++)
     {
         EXPECT_TRUE(watchers[i]->isFinished());
     }
+    EXPECT_EQ(0, results[0]);
+    sort(results.begin(), results.end());
     EXPECT_EQ(vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}), results);
 }
 
@@ -237,7 +249,7 @@ TEST_F(DBusTest, rate_limit_requests)
     for (int i = 0; i < N_REQUESTS; i++)
     {
         replies[i] = dbus_->thumbnailer_->GetAlbumArt(
-            "no such artist", QString::number(i), QSize(64, 64));
+            "no such artist", QString::number(i), QSize(64, 64), QString());
     }
 
     // Wait for all requests to complete.
@@ -250,6 +262,90 @@ TEST_F(DBusTest, rate_limit_requests)
     }
 }
 
+TEST_F(DBusTest, cancel)
+{
+    // Restart the service with a vs-thumb that takes 20 seconds.
+    EnvVarGuard ev_guard(UTIL_DIR, TESTSRCDIR "/slow-vs-thumb/slow");
+    dbus_.reset(new DBusServer());
+
+    // Two requests for the same thumbnail, which the client tells apart by their ids.
+    const char* filename = TESTDATADIR "/testvideo.ogg";
+    auto reply = dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), "1");
+    QDBusPendingCallWatcher watcher(reply);
+    auto other_reply = dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), "2");
+    QDBusPendingCallWatcher other_watcher(other_reply);
+
+    // Ids that don't match a request are ignored, and requests without an id can't be cancelled.
+    dbus_->thumbnailer_->Cancel("no such request").waitForFinished();
+    dbus_->thumbnailer_->Cancel("").waitForFinished();
+    EXPECT_FALSE(watcher.isFinished());
+
+    dbus_->thumbnailer_->Cancel("1").waitForFinished();
+
+    // The reply arrives long before vs-thumb would have completed or timed out.
+    if (!watcher.isFinished())
+    {
+        QSignalSpy spy(&watcher, &QDBusPendingCallWatcher::finished);
+        ASSERT_TRUE(spy.wait(5000));
+    }
+    EXPECT_FALSE(reply.isValid());
+    auto message = reply.error().message().toStdString();
+    EXPECT_TRUE(boost::contains(message, ": request cancelled")) << message;
+
+    QDBusReply<CounterMap> counters = dbus_->admin_->Counters();
+    ASSERT_TRUE(counters.isValid()) << counters.error().message().toStdString();
+    EXPECT_EQ(1, counters.value()["cancel.by_client"]);
+    EXPECT_EQ(0, counters.value()["cancel.by_disconnect"]);
+
+    // The other request for the same thumbnail carries on until it is cancelled itself.
+    EXPECT_FALSE(other_watcher.isFinished());
+    dbus_->thumbnailer_->Cancel("2").waitForFinished();
+    if (!other_watcher.isFinished())
+    {
+        QSignalSpy spy(&other_watcher, &QDBusPendingCallWatcher::finished);
+        ASSERT_TRUE(spy.wait(5000));
+    }
+    EXPECT_FALSE(other_reply.isValid());
+    counters = dbus_->admin_->Counters();
+    EXPECT_EQ(2, counters.value()["cancel.by_client"]);
+
+    // The cancelled extraction was not recorded as a failure, so the request
+    // is retried in full.
+    EXPECT_EQ(0, dbus_->admin_->Stats().value().failure_stats.size);
+}
+
+TEST_F(DBusTest, slow_file_system)
+{
+    // Restart the service with a file system on which every stat()
+    // in the slow directory takes a couple of seconds.
+    string const slow_dir = temp_dir() + "/slow";
+    ASSERT_EQ(0, mkdir(slow_dir.c_str(), 0700));
+    string const slow_file = slow_dir + "/testimage.jpg";
+    write_file(slow_file, read_file(TESTDATADIR "/testimage.jpg"));
+    EnvVarGuard dir_guard("SLOW_FS_DIR", slow_dir.c_str());
+    EnvVarGuard preload_guard("LD_PRELOAD", SLOW_FS_LIB);
+    dbus_.reset(new DBusServer());
+
+    auto slow_reply = dbus_->thumbnailer_->GetThumbnail(QString::fromStdString(slow_file), QSize(128, 128), QString());
+    QDBusPendingCallWatcher slow_watcher(slow_reply);
+
+    // A request for a file elsewhere completes while the
+    // service is still waiting for the slow file system.
+    QDBusReply<QByteArray> reply = dbus_->thumbnailer_->GetThumbnail(TESTDATADIR "/testimage.jpg", QSize(256, 256), QString());
+    assert_no_error(reply);
+    EXPECT_EQ(256, Image(reply.value()).width());
+    EXPECT_FALSE(slow_watcher.isFinished());
+
+    // The slow request still completes.
+    if (!slow_watcher.isFinished())
+    {
+        QSignalSpy spy(&slow_watcher, &QDBusPendingCallWatcher::finished);
+        ASSERT_TRUE(spy.wait(15000));
+    }
+    ASSERT_TRUE(slow_reply.isValid()) << slow_reply.error().message().toStdString();
+    EXPECT_EQ(128, Image(slow_reply.value()).width());
+}
+
 TEST_F(DBusTest, test_inactivity_exit)
 {
     // basic setup to the query
@@ -260,7 +356,7 @@ TEST_F(DBusTest, test_inactivity_exit)
 
     // start a query
     QDBusReply<QByteArray> reply =
-        dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256));
+        dbus_->thumbnailer_->GetThumbnail(filename, QSize(256, 256), QString());
     assert_no_error(reply);
 
     // wait for 5 seconds... (default)
@@ -389,7 +485,7 @@ TEST_F(DBusTest, bad_clear_or_compact_params)
     reply = dbus_->admin_->ClearStats(4);
     ASSERT_FALSE(reply.isValid());
     msg = reply.error().message().toStdString();
-    EXPECT_EQ("ClearStats(): invalid cache selector: 4", msg) << msg;
+    EXPECT_EQ("ClearStats(): invalid cache selector: 5", msg) << msg;
 
     reply = dbus_->admin_->Clear(-1);
     ASSERT_FALSE(reply.isValid());
@@ -399,7 +495,7 @@ TEST_F(DBusTest, bad_clear_or_compact_params)
     reply = dbus_->admin_->Clear(4);
     ASSERT_FALSE(reply.isValid());
     msg = reply.error().message().toStdString();
-    EXPECT_EQ("Clear(): invalid cache selector: 4", msg) << msg;
+    EXPECT_EQ("Clear(): invalid cache selector: 5", msg) << msg;
 
     reply = dbus_->admin_->Compact(-1);
     ASSERT_FALSE(reply.isValid());
@@ -409,7 +505,7 @@ TEST_F(DBusTest, bad_clear_or_compact_params)
     reply = dbus_->admin_->Compact(4);
     ASSERT_FALSE(reply.isValid());
     msg = reply.error().message().toStdString();
-    EXPECT_EQ("Compact(): invalid cache selector: 4", msg) << msg;
+    EXPECT_EQ("Compact(): invalid cache selector: 5", msg) << msg;
 }
 
 TEST_F(DBusTest, stats)
@@ -465,7 +561,7 @@ TEST_F(DBusTest, stats)
     // Get a remote image from the cache, so the stats change.
     {
         QDBusReply<QByteArray> reply =
-            dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24));
+            dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24), QString());
         assert_no_error(reply);
         Image image(reply.value());
         EXPECT_EQ(24, image.width());
@@ -475,24 +571,26 @@ TEST_F(DBusTest, stats)
     reply = dbus_->admin_->Stats();
     ASSERT_TRUE(reply.isValid()) << reply.error().message().toStdString();
 
+    // The caches started out empty, so the Bloom filters answer
+    // all the look-ups that miss, and the DB never records a miss.
     {
         CacheStats s = reply.value().full_size_stats;
         EXPECT_EQ(1, s.size);
         EXPECT_NE(0, s.size_in_bytes);
         EXPECT_EQ(0, s.hits);
-        EXPECT_EQ(2, s.misses);
+        EXPECT_EQ(0, s.misses);
         EXPECT_EQ(0, s.hits_since_last_miss);
-        EXPECT_EQ(2, s.misses_since_last_hit);
+        EXPECT_EQ(0, s.misses_since_last_hit);
         EXPECT_EQ(0, s.longest_hit_run);
-        EXPECT_EQ(2, s.longest_miss_run);
+        EXPECT_EQ(0, s.longest_miss_run);
         EXPECT_EQ(0.0, s.avg_hit_run_length);
-        EXPECT_EQ(2.0, s.avg_miss_run_length);
+        EXPECT_EQ(0.0, s.avg_miss_run_length);
         EXPECT_EQ(0, s.ttl_evictions);
         EXPECT_EQ(0, s.lru_evictions);
         EXPECT_EQ(0, duration_cast<milliseconds>(s.most_recent_hit_time.time_since_epoch()).count());
-        EXPECT_TRUE(near_current_time(s.most_recent_miss_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.most_recent_miss_time.time_since_epoch()).count());
         EXPECT_EQ(0, duration_cast<milliseconds>(s.longest_hit_run_time.time_since_epoch()).count());
-        EXPECT_TRUE(near_current_time(s.longest_miss_run_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.longest_miss_run_time.time_since_epoch()).count());
         auto list = s.histogram;
         // There must be exactly one bin with value 1 now.
         int count = 0;
@@ -511,25 +609,29 @@ TEST_F(DBusTest, stats)
         EXPECT_EQ(1, s.size);
         EXPECT_NE(0, s.size_in_bytes);
         EXPECT_EQ(0, s.hits);
-        EXPECT_EQ(2, s.misses);
+        EXPECT_EQ(0, s.misses);
         EXPECT_EQ(0, s.hits_since_last_miss);
-        EXPECT_EQ(2, s.misses_since_last_hit);
+        EXPECT_EQ(0, s.misses_since_last_hit);
         EXPECT_EQ(0, s.longest_hit_run);
-        EXPECT_EQ(2, s.longest_miss_run);
+        EXPECT_EQ(0, s.longest_miss_run);
         EXPECT_EQ(0.0, s.avg_hit_run_length);
-        EXPECT_EQ(2.0, s.avg_miss_run_length);
+        EXPECT_EQ(0.0, s.avg_miss_run_length);
         EXPECT_EQ(0, s.ttl_evictions);
         EXPECT_EQ(0, s.lru_evictions);
         EXPECT_EQ(0, duration_cast<milliseconds>(s.most_recent_hit_time.time_since_epoch()).count());
-        EXPECT_TRUE(near_current_time(s.most_recent_miss_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.most_recent_miss_time.time_since_epoch()).count());
         EXPECT_EQ(0, duration_cast<milliseconds>(s.longest_hit_run_time.time_since_epoch()).count());
-        EXPECT_TRUE(near_current_time(s.longest_miss_run_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.longest_miss_run_time.time_since_epoch()).count());
     }
 
-    // Get the same image again, so we get a hit.
+    // Get the same image again, so we get a hit. We clear the in-memory
+    // cache first, otherwise the hit would not reach the thumbnail cache.
     {
+        QDBusReply<void> clear_reply = dbus_->admin_->Clear(4);
+        ASSERT_TRUE(clear_reply.isValid()) << clear_reply.error().message().toStdString();
+
         QDBusReply<QByteArray> reply =
-            dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24));
+            dbus_->thumbnailer_->GetAlbumArt("metallica", "load", QSize(24, 24), QString());
         assert_no_error(reply);
         Image image(reply.value());
         EXPECT_EQ(24, image.width());
@@ -544,26 +646,26 @@ TEST_F(DBusTest, stats)
         EXPECT_EQ(1, s.size);
         EXPECT_NE(0, s.size_in_bytes);
         EXPECT_EQ(1, s.hits);
-        EXPECT_EQ(2, s.misses);
+        EXPECT_EQ(0, s.misses);
         EXPECT_EQ(1, s.hits_since_last_miss);
         EXPECT_EQ(0, s.misses_since_last_hit);
         EXPECT_EQ(1, s.longest_hit_run);
-        EXPECT_EQ(2, s.longest_miss_run);
+        EXPECT_EQ(0, s.longest_miss_run);
         EXPECT_EQ(1.0, s.avg_hit_run_length);
-        EXPECT_EQ(2.0, s.avg_miss_run_length);
+        EXPECT_EQ(0.0, s.avg_miss_run_length);
         EXPECT_EQ(0, s.ttl_evictions);
         EXPECT_EQ(0, s.lru_evictions);
         EXPECT_TRUE(near_current_time(s.most_recent_hit_time));
-        EXPECT_TRUE(near_current_time(s.most_recent_miss_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.most_recent_miss_time.time_since_epoch()).count());
         EXPECT_TRUE(near_current_time(s.longest_hit_run_time));
-        EXPECT_TRUE(near_current_time(s.longest_miss_run_time));
+        EXPECT_EQ(0, duration_cast<milliseconds>(s.longest_miss_run_time.time_since_epoch()).count());
     }
 
     // Get a non-existent remote image from the cache, so the failure stats change.
     {
         QDBusReply<QByteArray> reply =
             dbus_->thumbnailer_->GetAlbumArt(
-                "no_such_artist", "no_such_album", QSize(24, 24));
+                "no_such_artist", "no_such_album", QSize(24, 24), QString());
     }
 
     reply = dbus_->admin_->Stats();
@@ -573,14 +675,14 @@ TEST_F(DBusTest, stats)
         CacheStats s = reply.value().failure_stats;
         EXPECT_EQ(1, s.size);
         EXPECT_EQ(0, s.hits);
-        EXPECT_EQ(4, s.misses);
+        EXPECT_EQ(0, s.misses);
     }
 
     // Get the same non-existent remote image again, so we get a hit.
     {
         QDBusReply<QByteArray> reply =
             dbus_->thumbnailer_->GetAlbumArt(
-                "no_such_artist", "no_such_album", QSize(24, 24));
+                "no_such_artist", "no_such_album", QSize(24, 24), QString());
     }
 
     reply = dbus_->admin_->Stats();
@@ -590,7 +692,7 @@ TEST_F(DBusTest, stats)
         CacheStats s = reply.value().failure_stats;
         EXPECT_EQ(1, s.size);
         EXPECT_EQ(1, s.hits);
-        EXPECT_EQ(4, s.misses);
+        EXPECT_EQ(0, s.misses);
     }
 
     {
@@ -620,6 +722,7 @@ int main(int argc, char** argv)
     QCoreApplication app(argc, argv);
     qRegisterMetaType<QProcess::ExitStatus>("QProcess::ExitStatus");  // Avoid noise from signal spy.
     qDBusRegisterMetaType<unity::thumbnailer::service::AllStats>();
+    qDBusRegisterMetaType<unity::thumbnailer::service::CounterMap>();
 
     setenv("GSETTINGS_BACKEND", "memory", true);
     setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
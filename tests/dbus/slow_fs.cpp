@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Preloaded into the service to make looking at files in the directory
+// $SLOW_FS_DIR slow, the way it is on a network file system or a device
+// that has to wake up first. Only the stat() family is slowed down,
+// because that is what resolving a file name waits for.
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+struct statx;
+
+namespace
+{
+
+unsigned const DELAY_SECS = 2;
+
+void maybe_sleep(char const* path)
+{
+    char const* dir = getenv("SLOW_FS_DIR");
+    if (dir && *dir && path && strncmp(path, dir, strlen(dir)) == 0)
+    {
+        sleep(DELAY_SECS);
+    }
+}
+
+template<typename F>
+F next(char const* name)
+{
+    return reinterpret_cast<F>(dlsym(RTLD_NEXT, name));
+}
+
+}  // namespace
+
+extern "C"
+{
+
+int stat(char const* path, struct stat* buf)
+{
+    maybe_sleep(path);
+    return next<int (*)(char const*, struct stat*)>("stat")(path, buf);
+}
+
+int lstat(char const* path, struct stat* buf)
+{
+    maybe_sleep(path);
+    return next<int (*)(char const*, struct stat*)>("lstat")(path, buf);
+}
+
+// Older glibc versions implement stat() and lstat() inline with these.
+
+int __xstat(int ver, char const* path, struct stat* buf)
+{
+    maybe_sleep(path);
+    return next<int (*)(int, char const*, struct stat*)>("__xstat")(ver, path, buf);
+}
+
+int __lxstat(int ver, char const* path, struct stat* buf)
+{
+    maybe_sleep(path);
+    return next<int (*)(int, char const*, struct stat*)>("__lxstat")(ver, path, buf);
+}
+
+// Newer versions of boost::filesystem use statx().
+
+int statx(int dirfd, char const* path, int flags, unsigned int mask, struct statx* buf)
+{
+    maybe_sleep(path);
+    return next<int (*)(int, char const*, int, unsigned int, struct statx*)>("statx")(dirfd, path, flags, mask, buf);
+}
+
+}  // extern "C"
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/desktop_thumbnails.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/desktop_thumbnails_test.dir"
+#define CACHE_DIR TEST_DIR "/thumbnails"
+#define TEST_IMAGE TEST_DIR "/photo.jpg"
+
+namespace
+{
+
+class DesktopThumbnailsTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::create_directories(TEST_DIR);
+        boost::filesystem::copy_file(TESTDATADIR "/orientation-1.jpg", TEST_IMAGE);  // 640x480
+        struct stat st;
+        ASSERT_EQ(0, stat(TEST_IMAGE, &st));
+        mtime_ = st.st_mtime;
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+    }
+
+    time_t mtime_;
+};
+
+TEST_F(DesktopThumbnailsTest, store_and_find)
+{
+    DesktopThumbnails desktop(CACHE_DIR);
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_, 128));
+
+    // A 300-pixel image is stored in the 256-pixel flavor.
+    Image image(read_file(TEST_IMAGE), QSize(300, 300));
+    EXPECT_TRUE(desktop.store(TEST_IMAGE, mtime_, 1234, "image/jpeg", image));
+    EXPECT_FALSE(boost::filesystem::exists(desktop.thumbnail_path(TEST_IMAGE, 128)));
+    EXPECT_TRUE(boost::filesystem::exists(desktop.thumbnail_path(TEST_IMAGE, 256)));
+    EXPECT_EQ(boost::filesystem::owner_all, boost::filesystem::status(CACHE_DIR "/large").permissions());
+
+    auto const data = desktop.find(TEST_IMAGE, mtime_, 200);
+    ASSERT_NE("", data);
+    Image thumbnail(data);
+    EXPECT_EQ(256, thumbnail.width());
+    EXPECT_EQ(192, thumbnail.height());
+    EXPECT_NE(string::npos, data.find("Thumb::Image::Width")) << "missing text chunk";
+
+    // Too small for the request.
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_, 300));
+
+    // Stale.
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_ + 1, 200));
+
+    // Too small to store.
+    Image small(read_file(TEST_IMAGE), QSize(100, 100));
+    EXPECT_FALSE(desktop.store(TEST_IMAGE, mtime_, 1234, "image/jpeg", small));
+}
+
+TEST_F(DesktopThumbnailsTest, foreign_thumbnails)
+{
+    DesktopThumbnails desktop(CACHE_DIR);
+    boost::filesystem::create_directories(CACHE_DIR "/normal");
+    Image image(read_file(TEST_IMAGE), QSize(128, 128));
+
+    // A thumbnail that belongs to a different file, for example, because of a hash collision.
+    write_file(desktop.thumbnail_path(TEST_IMAGE, 128),
+               image.png_data({ { "Thumb::URI", "file:///somewhere/else.jpg" },
+                                { "Thumb::MTime", to_string(mtime_) } }));
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_, 128));
+
+    // A thumbnail without a modification time.
+    write_file(desktop.thumbnail_path(TEST_IMAGE, 128),
+               image.png_data({ { "Thumb::URI", "file://" TEST_IMAGE } }));
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_, 128));
+
+    // Not a PNG file.
+    write_file(desktop.thumbnail_path(TEST_IMAGE, 128), image.jpeg_data());
+    EXPECT_EQ("", desktop.find(TEST_IMAGE, mtime_, 128));
+
+    // As another application would write it.
+    write_file(desktop.thumbnail_path(TEST_IMAGE, 128),
+               image.png_data({ { "Thumb::URI", "file://" TEST_IMAGE },
+                                { "Thumb::MTime", to_string(mtime_) } }));
+    EXPECT_NE("", desktop.find(TEST_IMAGE, mtime_, 128));
+    EXPECT_NE("", desktop.find(TEST_IMAGE, mtime_, 64));
+}
+
+}  // namespace
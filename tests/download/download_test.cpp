@@ -19,9 +19,15 @@
 #include <internal/ubuntuserverdownloader.h>
 #include <internal/artreply.h>
 #include <internal/env_vars.h>
+#include <internal/gobj_memory.h>
 #include "utils/artserver.h"
 #include <testsetup.h>
 
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#include <gio/gio.h>
+#pragma GCC diagnostic pop
 #include <gtest/gtest.h>
 
 #include <QSignalSpy>
@@ -35,6 +41,37 @@
 
 using namespace unity::thumbnailer::internal;
 
+namespace
+{
+
+// Sets an integer key in the thumbnailer settings, and resets it
+// when it goes out of scope, so a failing test cannot leave it set.
+
+class SettingGuard
+{
+public:
+    SettingGuard(char const* key, int value)
+        : gsettings_(g_settings_new("com.canonical.Unity.Thumbnailer"))
+        , key_(key)
+    {
+        g_settings_set_int(gsettings_.get(), key_, value);
+    }
+
+    ~SettingGuard()
+    {
+        g_settings_reset(gsettings_.get(), key_);
+    }
+
+    SettingGuard(SettingGuard const&) = delete;
+    SettingGuard& operator=(SettingGuard const&) = delete;
+
+private:
+    gobj_ptr<GSettings> gsettings_;
+    char const* key_;
+};
+
+}  // namespace
+
 class TestDownloaderServer : public ::testing::Test
 {
 protected:
@@ -119,6 +156,82 @@ TEST_F(TestDownloaderServer, test_ok_artist)
 
     EXPECT_EQ(ArtReply::Status::success, reply->status());
     EXPECT_EQ(QString("SIA_FEAR_TEST_STRING_IMAGE"), QString(reply->data()));
+    EXPECT_THROW(reply->image(), std::exception);
+    EXPECT_EQ(QString("SIA_FEAR_TEST_STRING_IMAGE"), QString(reply->data()));
+}
+
+TEST_F(TestDownloaderServer, test_image_decoded_while_downloading)
+{
+    UbuntuServerDownloader downloader;
+
+    auto reply = downloader.download_artist("beck", "odelay", DOWNLOAD_TIMEOUT);
+    ASSERT_NE(reply, nullptr);
+
+    // Decode the data in a different thread as it arrives.
+    int chunks = 0;
+    QObject::connect(reply.get(), &ArtReply::dataReceived, [&]
+    {
+        ++chunks;
+        std::thread([&]{ reply->decode_received(); }).join();
+    });
+
+    QSignalSpy spy(reply.get(), &ArtReply::finished);
+    ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+    ASSERT_EQ(1, spy.count());
+    EXPECT_LT(0, chunks);
+
+    EXPECT_EQ(ArtReply::Status::success, reply->status());
+    EXPECT_TRUE(reply->data().isEmpty());  // Not kept once the data is known to be an image.
+    auto image = reply->image();
+    EXPECT_EQ(640, image.width());
+    EXPECT_EQ(480, image.height());
+    EXPECT_EQ(0xFE0000FF, image.pixel(0, 0));
+}
+
+TEST_F(TestDownloaderServer, test_image_scaled_while_decoding)
+{
+    SettingGuard guard("max-thumbnail-size", 512);
+
+    UbuntuServerDownloader downloader;
+
+    auto reply = downloader.download_artist("big", "image", DOWNLOAD_TIMEOUT);
+    ASSERT_NE(reply, nullptr);
+
+    QSignalSpy spy(reply.get(), &ArtReply::finished);
+    ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+    ASSERT_EQ(1, spy.count());
+
+    // Nothing was decoded yet, so image() decodes all of it.
+    EXPECT_EQ(ArtReply::Status::success, reply->status());
+    auto image = reply->image();
+    EXPECT_EQ(512, image.width());
+    EXPECT_EQ(384, image.height());
+    EXPECT_EQ(QSize(2731, 2048), image.source_size());
+}
+
+TEST_F(TestDownloaderServer, test_too_large)
+{
+    SettingGuard guard("max-download-size", 50);  // big_image.jpg is 109 kB.
+
+    UbuntuServerDownloader downloader;
+
+    auto reply = downloader.download_artist("big", "image", DOWNLOAD_TIMEOUT);
+    ASSERT_NE(reply, nullptr);
+
+    QSignalSpy spy(reply.get(), &ArtReply::finished);
+    ASSERT_TRUE(spy.wait(SIGNAL_WAIT_TIME));
+    ASSERT_EQ(1, spy.count());
+
+    EXPECT_EQ(ArtReply::Status::hard_error, reply->status());
+    EXPECT_EQ(QString("Response exceeds maximum download size of 51200 bytes"), reply->error_string());
+    EXPECT_TRUE(reply->data().isEmpty());
+
+    // Small replies still get through.
+    reply = downloader.download_artist("beck", "odelay", DOWNLOAD_TIMEOUT);
+    QSignalSpy spy2(reply.get(), &ArtReply::finished);
+    ASSERT_TRUE(spy2.wait(SIGNAL_WAIT_TIME));
+    EXPECT_EQ(ArtReply::Status::success, reply->status());
+    EXPECT_EQ(640, reply->image().width());
 }
 
 TEST_F(TestDownloaderServer, test_timeout)
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/fair_scheduler.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(FairScheduler, runs_immediately)
+{
+    FairScheduler s(2);
+    string started;
+
+    s.schedule("a", [&]{ started += "a"; });
+    s.schedule("b", [&]{ started += "b"; });
+    EXPECT_EQ("ab", started);
+    EXPECT_EQ(2, s.active());
+    EXPECT_EQ(0, s.queued());
+
+    s.done("a");
+    s.done("b");
+    EXPECT_EQ(0, s.active());
+    EXPECT_TRUE(s.client_stats().empty());  // Idle clients are forgotten.
+}
+
+TEST(FairScheduler, round_robin)
+{
+    FairScheduler s(1);
+    string started;
+
+    // A bulk client queues up lots of requests before an interactive client asks for one.
+    s.schedule("bulk", [&]{ started += "b"; });
+    for (int i = 0; i < 10; ++i)
+    {
+        s.schedule("bulk", [&]{ started += "b"; });
+    }
+    s.schedule("app", [&]{ started += "a"; });
+    s.schedule("app", [&]{ started += "a"; });
+    EXPECT_EQ("b", started);
+    EXPECT_EQ(12, s.queued());
+
+    auto stats = s.client_stats();
+    ASSERT_EQ(2u, stats.size());
+    EXPECT_EQ(10, stats["bulk"].queued);
+    EXPECT_EQ(1, stats["bulk"].active);
+    EXPECT_EQ(2, stats["app"].queued);
+    EXPECT_EQ(0, stats["app"].active);
+
+    // The interactive client does not wait for the whole backlog.
+    for (int i = 0; i < 4; ++i)
+    {
+        s.done(started.back() == 'a' ? "app" : "bulk");
+    }
+    EXPECT_EQ("bbaba", started);
+
+    stats = s.client_stats();
+    EXPECT_EQ(0, stats["app"].queued);
+    EXPECT_EQ(1, stats["app"].active);
+    EXPECT_EQ(1, stats["app"].completed);
+    EXPECT_EQ(2, stats["app"].max_queued);
+}
+
+TEST(FairScheduler, boost)
+{
+    FairScheduler s(1, { "com.ubuntu.gallery_" });
+    string started;
+
+    s.schedule("other", [&]{ started += "o"; });
+    for (int i = 0; i < 8; ++i)
+    {
+        s.schedule("other", [&]{ started += "o"; });
+        s.schedule("com.ubuntu.gallery_gallery_1.0", [&]{ started += "g"; });
+    }
+    EXPECT_TRUE(s.client_stats()["com.ubuntu.gallery_gallery_1.0"].boosted);
+    EXPECT_FALSE(s.client_stats()["other"].boosted);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        s.done(started.back() == 'g' ? "com.ubuntu.gallery_gallery_1.0" : "other");
+    }
+    EXPECT_EQ("ooggggogggg", started);
+}
+
+TEST(FairScheduler, cost)
+{
+    FairScheduler s(1);
+    string started;
+
+    s.schedule("a", [&]{ started += "a"; });
+    s.schedule("a", [&]{ started += "A"; }, 3);
+    s.schedule("b", [&]{ started += "b"; });
+    s.schedule("b", [&]{ started += "b"; });
+    s.schedule("b", [&]{ started += "b"; });
+
+    // The expensive job has to wait until its client has saved up enough credit.
+    for (int i = 0; i < 4; ++i)
+    {
+        s.done(started.back() == 'b' ? "b" : "a");
+    }
+    EXPECT_EQ("abbAb", started);
+    s.done("b");
+    EXPECT_EQ(0, s.active());
+}
+
+TEST(FairScheduler, cancel)
+{
+    FairScheduler s(1);
+    string started;
+
+    s.schedule("a", [&]{ started += "a"; });
+    auto cancel_b = s.schedule("b", [&]{ started += "b"; });
+    s.schedule("c", [&]{ started += "c"; });
+    EXPECT_EQ(2, s.queued());
+
+    EXPECT_TRUE(cancel_b());
+    EXPECT_FALSE(cancel_b());
+    EXPECT_EQ(1, s.queued());
+
+    s.done("a");
+    EXPECT_EQ("ac", started);
+    s.done("c");
+    EXPECT_EQ(0, s.active());
+    EXPECT_EQ(0, s.queued());
+    EXPECT_TRUE(s.client_stats().empty());
+
+    // Jobs that started immediately can't be cancelled.
+    auto cancel = s.schedule("a", [&]{ started += "a"; });
+    EXPECT_FALSE(cancel());
+    s.done("a");
+}
+
+TEST(FairScheduler, reentrant)
+{
+    FairScheduler s(1);
+    string started;
+
+    // A job that completes synchronously starts the next one.
+    s.schedule("a", [&]{ started += "a"; });
+    s.schedule("b", [&]{ started += "b"; s.done("b"); });
+    s.schedule("c", [&]{ started += "c"; });
+    s.done("a");
+    EXPECT_EQ("abc", started);
+    EXPECT_EQ(1, s.active());
+    s.done("c");
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/file_info_cache.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/file_info_cache_test.dir"
+
+namespace
+{
+
+class FileInfoCacheTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::create_directories(TEST_DIR "/sub");
+        write_file(TEST_DIR "/file", string("hello"));
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+    }
+};
+
+// The events arrive on a different thread, so we wait a little for them.
+
+bool wait_for_invalidations(FileInfoCache const& cache, int64_t expected)
+{
+    auto const deadline = chrono::steady_clock::now() + chrono::seconds(5);
+    while (cache.stats().invalidations < expected)
+    {
+        if (chrono::steady_clock::now() > deadline)
+        {
+            return false;
+        }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return true;
+}
+
+}  // namespace
+
+TEST_F(FileInfoCacheTest, basic)
+{
+    FileInfoCache cache(100);
+
+    auto info = cache.get(TEST_DIR "/file");
+    EXPECT_EQ(TEST_DIR "/file", info.canonical_path);
+    EXPECT_TRUE(S_ISREG(info.mode));
+    EXPECT_EQ(5, info.size);
+    EXPECT_EQ(0, cache.stats().hits);
+    EXPECT_EQ(1, cache.stats().misses);
+
+    auto again = cache.get(TEST_DIR "/file");
+    EXPECT_EQ(info.ino, again.ino);
+    EXPECT_EQ(1, cache.stats().hits);
+    EXPECT_EQ(1, cache.stats().misses);
+
+    EXPECT_EQ("", cache.content_type(info.canonical_path));
+    cache.set_content_type(info.canonical_path, "text/plain");
+    EXPECT_EQ("text/plain", cache.content_type(info.canonical_path));
+
+    // Unknown files don't get a content type.
+    cache.set_content_type(TEST_DIR "/no_such_file", "text/plain");
+    EXPECT_EQ("", cache.content_type(TEST_DIR "/no_such_file"));
+
+    try
+    {
+        cache.get(TEST_DIR "/no_such_file");
+        FAIL();
+    }
+    catch (std::exception const&)
+    {
+    }
+}
+
+TEST_F(FileInfoCacheTest, invalidation)
+{
+    FileInfoCache cache(100);
+
+    cache.get(TEST_DIR "/file");
+    cache.set_content_type(TEST_DIR "/file", "text/plain");
+
+    write_file(TEST_DIR "/file", string("hello again"));
+    ASSERT_TRUE(wait_for_invalidations(cache, 1));
+
+    EXPECT_EQ("", cache.content_type(TEST_DIR "/file"));
+    auto info = cache.get(TEST_DIR "/file");
+    EXPECT_EQ(11, info.size);
+    EXPECT_EQ(0, cache.stats().hits);
+    EXPECT_EQ(2, cache.stats().misses);
+
+    // Changes in other directories leave the entry alone.
+    write_file(TEST_DIR "/sub/other", string("x"));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    cache.get(TEST_DIR "/file");
+    EXPECT_EQ(1, cache.stats().hits);
+}
+
+TEST_F(FileInfoCacheTest, symlink)
+{
+    FileInfoCache cache(100);
+
+    ASSERT_EQ(0, symlink(TEST_DIR "/file", TEST_DIR "/sub/link"));
+    auto info = cache.get(TEST_DIR "/sub/link");
+    EXPECT_EQ(TEST_DIR "/file", info.canonical_path);
+    EXPECT_EQ(2, cache.stats().entries);  // Link and target.
+
+    // Changing the target invalidates the link, even though the
+    // link is in a different directory.
+    write_file(TEST_DIR "/file", string("changed"));
+    ASSERT_TRUE(wait_for_invalidations(cache, 1));
+    EXPECT_EQ(0, cache.stats().entries);
+    EXPECT_EQ(7, cache.get(TEST_DIR "/sub/link").size);
+
+    // So does re-pointing the link, even though nothing
+    // happened to the old target.
+    write_file(TEST_DIR "/sub/other", string("other file"));
+    ASSERT_EQ(0, unlink(TEST_DIR "/sub/link"));
+    ASSERT_EQ(0, symlink(TEST_DIR "/sub/other", TEST_DIR "/sub/link"));
+    ASSERT_TRUE(wait_for_invalidations(cache, 2));
+    info = cache.get(TEST_DIR "/sub/link");
+    EXPECT_EQ(TEST_DIR "/sub/other", info.canonical_path);
+    EXPECT_EQ(10, info.size);
+}
+
+TEST_F(FileInfoCacheTest, ancestor_renamed)
+{
+    FileInfoCache cache(100);
+
+    boost::filesystem::create_directories(TEST_DIR "/a/b");
+    write_file(TEST_DIR "/a/b/file", string("first"));
+    auto info = cache.get(TEST_DIR "/a/b/file");
+    EXPECT_EQ(TEST_DIR "/a/b/file", info.canonical_path);
+    EXPECT_EQ(info.ino, cache.get(TEST_DIR "/a/b/file").ino);
+    EXPECT_EQ(1, cache.stats().hits);
+
+    // Changes to other names in the directories on the way don't matter.
+    write_file(TEST_DIR "/unrelated", string("x"));
+    this_thread::sleep_for(chrono::milliseconds(100));
+    cache.get(TEST_DIR "/a/b/file");
+    EXPECT_EQ(2, cache.stats().hits);
+    EXPECT_EQ(0, cache.stats().invalidations);
+
+    // Nothing happens in a/b itself, but the same path now leads
+    // to a different directory and file.
+    boost::filesystem::rename(TEST_DIR "/a", TEST_DIR "/old_a");
+    ASSERT_TRUE(wait_for_invalidations(cache, 1));
+    boost::filesystem::create_directories(TEST_DIR "/a/b");
+    write_file(TEST_DIR "/a/b/file", string("second file"));
+
+    auto again = cache.get(TEST_DIR "/a/b/file");
+    EXPECT_EQ(11, again.size);
+    EXPECT_NE(info.ino, again.ino);
+    EXPECT_EQ(2, cache.stats().hits);
+    EXPECT_EQ(info.ino, cache.get(TEST_DIR "/old_a/b/file").ino);
+
+    // A path through a symbolic link to a directory depends on
+    // the link and on the directory.
+    ASSERT_EQ(0, symlink(TEST_DIR "/a", TEST_DIR "/link"));
+    EXPECT_EQ(again.ino, cache.get(TEST_DIR "/link/b/file").ino);
+    boost::filesystem::rename(TEST_DIR "/a", TEST_DIR "/moved_a");
+    ASSERT_TRUE(wait_for_invalidations(cache, 2));
+    ASSERT_EQ(0, unlink(TEST_DIR "/link"));
+    ASSERT_EQ(0, symlink(TEST_DIR "/moved_a", TEST_DIR "/link"));
+    EXPECT_EQ(TEST_DIR "/moved_a/b/file", cache.get(TEST_DIR "/link/b/file").canonical_path);
+
+    try
+    {
+        cache.get(TEST_DIR "/a/b/file");
+        FAIL();
+    }
+    catch (std::exception const&)
+    {
+    }
+}
+
+TEST_F(FileInfoCacheTest, least_recently_used)
+{
+    FileInfoCache cache(2);
+
+    write_file(TEST_DIR "/file2", string(""));
+    write_file(TEST_DIR "/file3", string(""));
+    cache.get(TEST_DIR "/file");
+    cache.get(TEST_DIR "/file2");
+    cache.get(TEST_DIR "/file");
+    EXPECT_EQ(2, cache.stats().entries);
+    EXPECT_EQ(1, cache.stats().hits);
+
+    // file2 is the least recently used, so it makes room for file3.
+    cache.get(TEST_DIR "/file3");
+    EXPECT_EQ(2, cache.stats().entries);
+    cache.get(TEST_DIR "/file");
+    EXPECT_EQ(2, cache.stats().hits);
+    cache.get(TEST_DIR "/file2");
+    EXPECT_EQ(2, cache.stats().hits);
+    EXPECT_EQ(4, cache.stats().misses);
+}
+
+TEST_F(FileInfoCacheTest, relative_path)
+{
+    FileInfoCache cache(100);
+
+    ASSERT_EQ(0, symlink("../file", TEST_DIR "/sub/rel_link"));
+    auto info = cache.get(TEST_DIR "/sub/../sub/./rel_link");
+    EXPECT_EQ(TEST_DIR "/file", info.canonical_path);
+    EXPECT_EQ(5, info.size);
+
+    EXPECT_THROW(cache.get("file"), std::invalid_argument);
+    EXPECT_THROW(cache.get(TEST_DIR "/file/x"), std::runtime_error);
+}
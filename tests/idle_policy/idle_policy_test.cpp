@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/idle_policy.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define HISTORY_FILE TESTBINDIR "/idle.history"
+
+namespace
+{
+
+chrono::milliseconds seconds(int s)
+{
+    return chrono::milliseconds(s * 1000);
+}
+
+}  // namespace
+
+TEST(IdlePolicy, default_timeout)
+{
+    IdlePolicy p(seconds(10), seconds(30), seconds(300));
+    EXPECT_EQ(seconds(30), p.timeout());
+    EXPECT_EQ(0, p.num_gaps());
+
+    // Too few gaps to go by.
+    p.add_gap(seconds(1));
+    p.add_gap(seconds(1));
+    p.add_gap(seconds(1));
+    EXPECT_EQ(seconds(30), p.timeout());
+    EXPECT_EQ(3, p.num_gaps());
+}
+
+TEST(IdlePolicy, adapts_to_gaps)
+{
+    IdlePolicy p(seconds(10), seconds(30), seconds(300));
+
+    // Pauses of 40 seconds: we stay alive for them, with some slack.
+    for (int i = 0; i < 5; ++i)
+    {
+        p.add_gap(seconds(40));
+    }
+    EXPECT_EQ(seconds(50), p.timeout());
+    EXPECT_EQ(5, p.cold_starts_avoided());
+
+    // Short gaps don't take us below the minimum.
+    for (int i = 0; i < 32; ++i)
+    {
+        p.add_gap(seconds(1));
+    }
+    EXPECT_EQ(seconds(10), p.timeout());
+    EXPECT_EQ(32, p.num_gaps());
+    EXPECT_EQ(5, p.cold_starts_avoided());
+
+    // A few long gaps among many short ones don't matter.
+    for (int i = 0; i < 6; ++i)
+    {
+        p.add_gap(seconds(200));
+    }
+    EXPECT_EQ(seconds(10), p.timeout());
+
+    // If most gaps are longer than the maximum, there is no point in staying alive.
+    for (int i = 0; i < 32; ++i)
+    {
+        p.add_gap(seconds(3600));
+    }
+    EXPECT_EQ(seconds(10), p.timeout());
+
+    // Long gaps that still fit below the maximum are covered.
+    for (int i = 0; i < 32; ++i)
+    {
+        p.add_gap(seconds(200));
+    }
+    EXPECT_EQ(seconds(250), p.timeout());
+}
+
+TEST(IdlePolicy, mixed_gaps)
+{
+    IdlePolicy p(seconds(10), seconds(30), seconds(300));
+
+    // Most gaps are short enough to cover, but too many are long for
+    // the percentile to fit below the maximum. We cover the short ones.
+    for (int i = 0; i < 14; ++i)
+    {
+        p.add_gap(seconds(40));
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        p.add_gap(seconds(600));
+    }
+    p.add_gap(seconds(1));
+    EXPECT_EQ(20, p.num_gaps());
+    EXPECT_EQ(seconds(50), p.timeout());
+
+    // Once the median no longer fits, we exit quickly.
+    for (int i = 0; i < 12; ++i)
+    {
+        p.add_gap(seconds(600));
+    }
+    EXPECT_EQ(32, p.num_gaps());
+    EXPECT_EQ(seconds(10), p.timeout());
+}
+
+TEST(IdlePolicy, limits)
+{
+    // The default timeout can't be outside the range.
+    IdlePolicy p1(seconds(10), seconds(30), seconds(20));
+    EXPECT_EQ(seconds(20), p1.timeout());
+
+    // A fixed timeout.
+    IdlePolicy p2(seconds(5), seconds(5), seconds(5));
+    for (int i = 0; i < 10; ++i)
+    {
+        p2.add_gap(seconds(4));
+    }
+    EXPECT_EQ(seconds(5), p2.timeout());
+    EXPECT_EQ(0, p2.cold_starts_avoided());
+}
+
+TEST(IdlePolicy, save_and_load)
+{
+    boost::filesystem::remove(HISTORY_FILE);
+
+    IdlePolicy p(seconds(10), seconds(30), seconds(300));
+    EXPECT_FALSE(p.load(HISTORY_FILE));  // No file.
+
+    for (int i = 0; i < 3; ++i)
+    {
+        p.add_gap(seconds(40));
+    }
+    p.save(HISTORY_FILE, chrono::system_clock::now() - chrono::seconds(60));
+
+    {
+        // The gap since the last activity counts as a gap, but not as an avoided cold start.
+        IdlePolicy q(seconds(10), seconds(30), seconds(300));
+        EXPECT_TRUE(q.load(HISTORY_FILE));
+        EXPECT_EQ(4, q.num_gaps());
+        EXPECT_EQ(3, q.cold_starts_avoided());
+        EXPECT_LE(seconds(75), q.timeout());
+        EXPECT_GE(seconds(80), q.timeout());
+    }
+
+    {
+        // Last activity in the future (clock was set back).
+        p.save(HISTORY_FILE, chrono::system_clock::now() + chrono::hours(1));
+        IdlePolicy q(seconds(10), seconds(30), seconds(300));
+        EXPECT_TRUE(q.load(HISTORY_FILE));
+        EXPECT_EQ(3, q.num_gaps());
+        EXPECT_EQ(seconds(30), q.timeout());
+    }
+
+    {
+        // Truncated file.
+        p.save(HISTORY_FILE, chrono::system_clock::now());
+        auto contents = read_file(HISTORY_FILE);
+        write_file(HISTORY_FILE, contents.substr(0, contents.rfind(' ')));
+        IdlePolicy q(seconds(10), seconds(30), seconds(300));
+        EXPECT_FALSE(q.load(HISTORY_FILE));
+        EXPECT_EQ(0, q.num_gaps());
+        EXPECT_EQ(seconds(30), q.timeout());
+    }
+
+    {
+        // Not a history file.
+        write_file(HISTORY_FILE, string("hello"));
+        IdlePolicy q(seconds(10), seconds(30), seconds(300));
+        EXPECT_FALSE(q.load(HISTORY_FILE));
+    }
+}
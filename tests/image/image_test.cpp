@@ -73,6 +73,7 @@ TEST(Image, basic)
             Image i(data, QSize(320, 320));
             EXPECT_EQ(320, i.width());
             EXPECT_EQ(240, i.height());
+            EXPECT_EQ(QSize(640, 480), i.source_size());
         }
 
         {
@@ -115,6 +116,7 @@ TEST(Image, scale)
     Image scaled = img.scale(QSize(400, 400));
     EXPECT_EQ(400, scaled.width());
     EXPECT_EQ(300, scaled.height());
+    EXPECT_EQ(QSize(640, 480), scaled.source_size());
 
     // Invalid size doesn't change the image
     scaled = img.scale(QSize());
@@ -265,6 +267,7 @@ TEST(Image, orientation)
         Image img(data);
         EXPECT_EQ(640, img.width());
         EXPECT_EQ(480, img.height());
+        EXPECT_EQ(QSize(640, 480), img.source_size());
         EXPECT_EQ(0xFE0000FF, img.pixel(0, 0));
         EXPECT_EQ(0xFFFF00FF, img.pixel(639, 0));
         EXPECT_EQ(0x00FF01FF, img.pixel(639, 479));
@@ -274,6 +277,7 @@ TEST(Image, orientation)
         img = Image(data, QSize(320, 240));
         EXPECT_EQ(320, img.width());
         EXPECT_EQ(240, img.height());
+        EXPECT_EQ(QSize(640, 480), img.source_size());
         EXPECT_EQ(0xFE0000FF, img.pixel(0, 0));
         EXPECT_EQ(0xFFFF00FF, img.pixel(319, 0));
         EXPECT_EQ(0x00FF01FF, img.pixel(319, 239));
@@ -478,3 +482,116 @@ TEST(Image, png_transparency)
     EXPECT_EQ(0xFF0000FF, img.pixel(100, 100));
     EXPECT_TRUE(img.has_alpha());
 }
+
+namespace
+{
+
+// Feeds data to the decoder in small pieces, as a download would.
+
+void write_in_pieces(Image::Decoder& decoder, string const& data)
+{
+    size_t const piece_size = 1000;
+    for (size_t pos = 0; pos < data.size(); pos += piece_size)
+    {
+        decoder.write(data.data() + pos, min(piece_size, data.size() - pos));
+    }
+}
+
+}  // namespace
+
+TEST(Image, decoder)
+{
+    for (int i = 1; i <= 8; i++)
+    {
+        auto filename = string(TESTDATADIR "/orientation-") + to_string(i) + ".jpg";
+        string data = read_file(filename);
+
+        Image::Decoder decoder(QSize(320, 240));
+        EXPECT_FALSE(decoder.prepared());
+        write_in_pieces(decoder, data);
+        EXPECT_TRUE(decoder.prepared());
+        Image img = decoder.finish();
+        EXPECT_EQ(320, img.width());
+        EXPECT_EQ(240, img.height());
+        EXPECT_EQ(QSize(640, 480), img.source_size());
+        EXPECT_EQ(0xFE0000FF, img.pixel(0, 0));
+        EXPECT_EQ(0xFFFF00FF, img.pixel(319, 0));
+        EXPECT_EQ(0x00FF01FF, img.pixel(319, 239));
+        EXPECT_EQ(0x0000FEFF, img.pixel(0, 239));
+        EXPECT_FALSE(img.has_alpha());
+    }
+
+    {
+        Image::Decoder decoder(QSize(512, 512));
+        write_in_pieces(decoder, read_file(BIGIMAGE));
+        Image img = decoder.finish();
+        EXPECT_EQ(512, img.width());
+        EXPECT_EQ(384, img.height());
+        EXPECT_EQ(QSize(2731, 2048), img.source_size());
+    }
+
+    {
+        Image::Decoder decoder;
+        write_in_pieces(decoder, read_file(PNG_TRANSPARENT_IMAGE));
+        Image img = decoder.finish();
+        EXPECT_EQ(200, img.width());
+        EXPECT_EQ(200, img.height());
+        EXPECT_EQ(0xFF0000FF, img.pixel(100, 100));
+        EXPECT_TRUE(img.has_alpha());
+    }
+}
+
+TEST(Image, decoder_exceptions)
+{
+    {
+        // Too short for the loader to tell that it is not an image before it is closed.
+        Image::Decoder decoder;
+        write_in_pieces(decoder, read_file(BADIMAGE));
+        EXPECT_FALSE(decoder.prepared());
+        try
+        {
+            decoder.finish();
+            FAIL();
+        }
+        catch (std::exception const& e)
+        {
+            string msg = e.what();
+            EXPECT_TRUE(boost::starts_with(msg, "Image::Decoder::finish(): cannot decode image: ")) << msg;
+        }
+        try
+        {
+            decoder.finish();
+            FAIL();
+        }
+        catch (std::exception const& e)
+        {
+            EXPECT_STREQ("Image::Decoder::finish(): decoder is closed", e.what());
+        }
+    }
+
+    {
+        // Long enough for the loader to give up while we write.
+        Image::Decoder decoder;
+        string const text(4096, 'x');
+        try
+        {
+            decoder.write(text.data(), text.size());
+            FAIL();
+        }
+        catch (std::exception const& e)
+        {
+            string msg = e.what();
+            EXPECT_TRUE(boost::starts_with(msg, "Image::Decoder::write(): cannot decode image: ")) << msg;
+        }
+        EXPECT_FALSE(decoder.prepared());
+        try
+        {
+            decoder.write(text.data(), text.size());
+            FAIL();
+        }
+        catch (std::exception const& e)
+        {
+            EXPECT_STREQ("Image::Decoder::write(): decoder is closed", e.what());
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/locality_predictor.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+TEST(LocalityPredictor, threshold_and_stride)
+{
+    LocalityPredictor p(3, chrono::seconds(10), 2);
+    QSize const size(256, 256);
+
+    EXPECT_FALSE(p.predict("/photos/IMG_0100.jpg", size));
+    EXPECT_FALSE(p.predict("/photos/IMG_0101.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/IMG_0102.jpg", size));
+    EXPECT_FALSE(p.predict("/photos/IMG_0103.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/IMG_0104.jpg", size));
+    EXPECT_FALSE(p.predict("/photos/IMG_0105.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/IMG_0106.jpg", size));
+}
+
+TEST(LocalityPredictor, run_breaks)
+{
+    LocalityPredictor p(2, chrono::seconds(10), 100);
+    QSize const size(256, 256);
+
+    // A different directory starts a new run.
+    EXPECT_FALSE(p.predict("/photos/a.jpg", size));
+    EXPECT_FALSE(p.predict("/photos/2016/b.jpg", size));
+    EXPECT_FALSE(p.predict("/photos/c.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/d.jpg", size));
+
+    // So does a different size.
+    EXPECT_FALSE(p.predict("/music/a.mp3", size));
+    EXPECT_FALSE(p.predict("/music/b.mp3", QSize(64, 64)));
+    EXPECT_TRUE(p.predict("/music/c.mp3", QSize(64, 64)));
+
+    // Files without a directory are all in the same one.
+    EXPECT_FALSE(p.predict("a.jpg", size));
+    EXPECT_TRUE(p.predict("b.jpg", size));
+}
+
+TEST(LocalityPredictor, window)
+{
+    LocalityPredictor p(2, chrono::milliseconds(100), 1);
+    QSize const size(256, 256);
+
+    EXPECT_FALSE(p.predict("/photos/a.jpg", size));
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_FALSE(p.predict("/photos/b.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/c.jpg", size));
+    EXPECT_TRUE(p.predict("/photos/d.jpg", size));
+}
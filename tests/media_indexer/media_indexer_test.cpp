@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/media_indexer.h>
+
+#include <internal/env_vars.h>
+#include <internal/file_io.h>
+#include <testsetup.h>
+#include "utils/env_var_guard.h"
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+#include <QCoreApplication>
+#include <QTemporaryDir>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/media_indexer_test.dir"
+#define MEDIA_DIR TEST_DIR "/Pictures"
+#define POWER_DIR TEST_DIR "/power_supply"
+#define STATE_FILE TEST_DIR "/index-state"
+
+// The thumbnailer uses g_get_user_cache_dir() to get the cache dir, and
+// glib remembers that value, so changing XDG_CACHE_HOME later has no effect.
+
+static auto set_tempdir = []()
+{
+    auto dir = new QTemporaryDir(TESTBINDIR "/test-dir.XXXXXX");
+    setenv("XDG_CACHE_HOME", dir->path().toUtf8().data(), true);
+    return dir;
+};
+static unique_ptr<QTemporaryDir> tempdir(set_tempdir());
+
+namespace
+{
+
+class MediaIndexerTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        namespace fs = boost::filesystem;
+
+        mkdir(tempdir->path().toUtf8().data(), 0700);
+        fs::remove_all(TEST_DIR);
+        fs::create_directories(MEDIA_DIR "/b");
+        fs::create_directories(MEDIA_DIR "/.hidden");
+        fs::create_directories(POWER_DIR);
+        fs::copy_file(TESTDATADIR "/orientation-1.jpg", MEDIA_DIR "/a.jpg");
+        fs::copy_file(TESTDATADIR "/orientation-2.jpg", MEDIA_DIR "/b/b1.jpg");
+        fs::copy_file(TESTDATADIR "/orientation-3.jpg", MEDIA_DIR "/b/b2.jpg");
+        fs::copy_file(TESTDATADIR "/RGB.png", MEDIA_DIR "/c.png");
+        fs::copy_file(TESTDATADIR "/orientation-4.jpg", MEDIA_DIR "/.hidden/hidden.jpg");
+        write_file(MEDIA_DIR "/notes.txt", string("not media"));
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::remove_all(tempdir->path().toStdString());
+    }
+
+    static void add_power_supply(string const& name, string const& type, string const& file, string const& value)
+    {
+        string const dir = string(POWER_DIR) + "/" + name;
+        boost::filesystem::create_directories(dir);
+        write_file(dir + "/type", type + "\n");
+        write_file(dir + "/" + file, value + "\n");
+    }
+};
+
+// The indexer calls its callbacks from its own thread.
+
+bool wait_for(atomic<bool> const& flag)
+{
+    for (int i = 0; i < 2000 && !flag; ++i)
+    {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    return flag;
+}
+
+TEST_F(MediaIndexerTest, power_supply)
+{
+    EnvVarGuard guard(POWER_SUPPLY_DIR, POWER_DIR);
+
+    // No battery at all.
+    EXPECT_FALSE(on_battery_power());
+
+    add_power_supply("BAT0", "Battery", "status", "Discharging");
+    EXPECT_TRUE(on_battery_power());
+
+    add_power_supply("AC", "Mains", "online", "0");
+    EXPECT_TRUE(on_battery_power());
+
+    add_power_supply("AC", "Mains", "online", "1");
+    EXPECT_FALSE(on_battery_power());
+
+    add_power_supply("AC", "Mains", "online", "0");
+    add_power_supply("BAT0", "Battery", "status", "Full");
+    EXPECT_FALSE(on_battery_power());
+}
+
+TEST_F(MediaIndexerTest, index_and_resume)
+{
+    Thumbnailer tn;
+    vector<QSize> const sizes{ QSize(64, 64), QSize(128, 128) };
+
+    {
+        atomic<bool> finished(false);
+        MediaIndexer indexer(tn, { MEDIA_DIR }, sizes, STATE_FILE, [&]{ finished = true; });
+        EXPECT_FALSE(indexer.interrupted());
+        EXPECT_EQ(0, indexer.counters()["index.files_total"]);
+
+        indexer.start();
+        ASSERT_TRUE(wait_for(finished));
+        EXPECT_FALSE(indexer.running());
+
+        auto counters = indexer.counters();
+        EXPECT_EQ(0, counters["index.running"]);
+        EXPECT_EQ(0, counters["index.cache_full"]);
+        EXPECT_EQ(5, counters["index.files_total"]);  // Includes notes.txt, which has no thumbnails.
+        EXPECT_EQ(5, counters["index.files_done"]);
+        EXPECT_EQ(100, counters["index.coverage_percent"]);
+        EXPECT_EQ(8, counters["index.thumbnails"]);
+    }
+
+    // The thumbnails are in the cache now.
+    auto request = tn.get_thumbnail(MEDIA_DIR "/b/b2.jpg", QSize(128, 128));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request = tn.get_thumbnail(MEDIA_DIR "/.hidden/hidden.jpg", QSize(128, 128));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_NE(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request.reset();
+
+    {
+        // Nothing to do for the same roots and sizes.
+        MediaIndexer indexer(tn, { MEDIA_DIR }, sizes, STATE_FILE);
+        EXPECT_TRUE(indexer.up_to_date());
+        MediaIndexer other_sizes(tn, { MEDIA_DIR }, { QSize(64, 64) }, STATE_FILE);
+        EXPECT_FALSE(other_sizes.up_to_date());
+        MediaIndexer other_roots(tn, { MEDIA_DIR "/b" }, sizes, STATE_FILE);
+        EXPECT_FALSE(other_roots.up_to_date());
+    }
+
+    // Pretend that the service was shut down after b1.jpg was done.
+    write_file(STATE_FILE, string("thumbnailer-index 2\nrunning\n64x64,128x128:" MEDIA_DIR "\n" MEDIA_DIR "/b/b1.jpg"));
+    tn.clear(Thumbnailer::CacheSelector::all);
+    {
+        atomic<bool> finished(false);
+        MediaIndexer indexer(tn, { MEDIA_DIR }, sizes, STATE_FILE, [&]{ finished = true; });
+        EXPECT_TRUE(indexer.interrupted());
+        EXPECT_FALSE(indexer.up_to_date());
+
+        indexer.start();
+        ASSERT_TRUE(wait_for(finished));
+        EXPECT_FALSE(indexer.interrupted());
+
+        // b2.jpg and c.png are done again.
+        auto counters = indexer.counters();
+        EXPECT_EQ(5, counters["index.files_total"]);
+        EXPECT_EQ(5, counters["index.files_done"]);
+        EXPECT_EQ(4, counters["index.thumbnails"]);
+    }
+    request = tn.get_thumbnail(MEDIA_DIR "/c.png", QSize(64, 64));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request.reset();
+
+    // After a complete run, the next run starts from the beginning,
+    // but doesn't make the thumbnails that are cached already.
+    {
+        atomic<bool> finished(false);
+        MediaIndexer indexer(tn, { MEDIA_DIR }, sizes, STATE_FILE, [&]{ finished = true; });
+        EXPECT_FALSE(indexer.interrupted());
+
+        indexer.start();
+        ASSERT_TRUE(wait_for(finished));
+        auto counters = indexer.counters();
+        EXPECT_EQ(5, counters["index.files_done"]);
+        EXPECT_EQ(4, counters["index.thumbnails"]);  // a.jpg and b1.jpg.
+        EXPECT_TRUE(indexer.up_to_date());
+    }
+
+    // Once the cache is emptied, the completed run is out of date.
+    tn.clear(Thumbnailer::CacheSelector::all);
+    MediaIndexer indexer(tn, { MEDIA_DIR }, sizes, STATE_FILE);
+    EXPECT_FALSE(indexer.up_to_date());
+}
+
+TEST_F(MediaIndexerTest, pause_on_battery)
+{
+    EnvVarGuard guard(POWER_SUPPLY_DIR, POWER_DIR);
+    add_power_supply("BAT0", "Battery", "status", "Discharging");
+
+    Thumbnailer tn;
+    {
+        atomic<bool> pause_changed(false);
+        MediaIndexer indexer(tn, { MEDIA_DIR }, { QSize(64, 64) }, STATE_FILE, nullptr, [&]{ pause_changed = true; });
+        indexer.start();
+        ASSERT_TRUE(wait_for(pause_changed));
+        EXPECT_TRUE(indexer.paused());
+        auto counters = indexer.counters();
+        EXPECT_EQ(1, counters["index.running"]);
+        EXPECT_EQ(1, counters["index.paused"]);
+        EXPECT_EQ(0, counters["index.files_done"]);
+
+        // Destroying a running indexer makes the next instance continue.
+    }
+    {
+        MediaIndexer indexer(tn, { MEDIA_DIR }, { QSize(64, 64) }, STATE_FILE);
+        EXPECT_TRUE(indexer.interrupted());
+        indexer.start();
+        EXPECT_TRUE(indexer.running());
+
+        // Stopping an indexer means it isn't resumed.
+        indexer.stop();
+        EXPECT_FALSE(indexer.running());
+        EXPECT_FALSE(indexer.interrupted());
+        EXPECT_EQ(0, indexer.counters()["index.running"]);
+    }
+    MediaIndexer indexer(tn, { MEDIA_DIR }, { QSize(64, 64) }, STATE_FILE);
+    EXPECT_FALSE(indexer.interrupted());
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    setenv("GSETTINGS_BACKEND", "memory", true);
+    setenv("GSETTINGS_SCHEMA_DIR", GSETTINGS_SCHEMA_DIR, true);
+    setenv(UTIL_DIR, TESTBINDIR "/../src/vs-thumb", true);
+    setenv(UBUNTU_SERVER_URL, "http://127.0.0.1", true);
+    setenv(POWER_SUPPLY_DIR, TEST_DIR "/no_power_supply", true);  // Not on battery.
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
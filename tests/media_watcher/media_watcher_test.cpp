@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/media_watcher.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <mutex>
+#include <set>
+
+#include <stdio.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/media_watcher_test.dir"
+
+namespace
+{
+
+class MediaWatcherTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::create_directories(TEST_DIR "/Pictures/camera");
+        boost::filesystem::create_directories(TEST_DIR "/Pictures/.hidden");
+        boost::filesystem::create_directories(TEST_DIR "/elsewhere/album");
+        write_file(TEST_DIR "/Pictures/old.jpg", string("old"));
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+    }
+
+    MediaWatcher::NewFileFunc recorder()
+    {
+        return [this](string const& path)
+        {
+            lock_guard<mutex> lock(mutex_);
+            files_.insert(path);
+        };
+    }
+
+    // The events arrive on a different thread, so we wait a little for them.
+
+    set<string> wait_for_files(size_t expected)
+    {
+        auto const deadline = chrono::steady_clock::now() + chrono::seconds(5);
+        for (;;)
+        {
+            {
+                lock_guard<mutex> lock(mutex_);
+                if (files_.size() >= expected || chrono::steady_clock::now() > deadline)
+                {
+                    return files_;
+                }
+            }
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+    }
+
+    mutex mutex_;
+    set<string> files_;
+};
+
+}  // namespace
+
+TEST_F(MediaWatcherTest, new_files)
+{
+    MediaWatcher watcher({ TEST_DIR "/Pictures", TEST_DIR "/no_such_dir" }, recorder());
+    EXPECT_EQ(2, watcher.watched_directories());  // The hidden directory is not watched.
+
+    write_file(TEST_DIR "/Pictures/camera/new.jpg", string("new"));
+    write_file(TEST_DIR "/elsewhere/moved.jpg", string("moved"));
+    ASSERT_EQ(0, rename(TEST_DIR "/elsewhere/moved.jpg", TEST_DIR "/Pictures/moved.jpg"));
+
+    // Ignored: hidden files, files in hidden directories, and files outside the tree.
+    write_file(TEST_DIR "/Pictures/.partial", string("x"));
+    write_file(TEST_DIR "/Pictures/.hidden/file.jpg", string("x"));
+    write_file(TEST_DIR "/elsewhere/other.jpg", string("x"));
+
+    // write_file() writes to a temporary file that it renames, so we may hear about that file as well.
+    wait_for_files(2);
+    this_thread::sleep_for(chrono::milliseconds(100));  // Make sure nothing else arrives.
+    auto files = wait_for_files(2);
+    EXPECT_EQ(1u, files.count(TEST_DIR "/Pictures/camera/new.jpg"));
+    EXPECT_EQ(1u, files.count(TEST_DIR "/Pictures/moved.jpg"));
+    for (auto const& f : files)
+    {
+        EXPECT_EQ(string::npos, f.find("old.jpg")) << f;
+        EXPECT_EQ(string::npos, f.find("/.")) << f;
+        EXPECT_EQ(string::npos, f.find("/elsewhere/")) << f;
+    }
+}
+
+TEST_F(MediaWatcherTest, new_directories)
+{
+    MediaWatcher watcher({ TEST_DIR "/Pictures" }, recorder());
+
+    // A directory that is moved in is watched, and the files it holds already are reported.
+    write_file(TEST_DIR "/elsewhere/album/cover.jpg", string("cover"));
+    ASSERT_EQ(0, rename(TEST_DIR "/elsewhere/album", TEST_DIR "/Pictures/album"));
+    auto files = wait_for_files(1);
+    EXPECT_EQ(1u, files.count(TEST_DIR "/Pictures/album/cover.jpg"));
+
+    boost::filesystem::create_directories(TEST_DIR "/Pictures/2016");
+    this_thread::sleep_for(chrono::milliseconds(100));
+    write_file(TEST_DIR "/Pictures/2016/new.jpg", string("new"));
+    write_file(TEST_DIR "/Pictures/album/track.jpg", string("track"));
+    files = wait_for_files(3);
+    EXPECT_EQ(1u, files.count(TEST_DIR "/Pictures/2016/new.jpg"));
+    EXPECT_EQ(1u, files.count(TEST_DIR "/Pictures/album/track.jpg"));
+    EXPECT_EQ(4, watcher.watched_directories());
+
+    boost::filesystem::remove_all(TEST_DIR "/Pictures/2016");
+    auto const deadline = chrono::steady_clock::now() + chrono::seconds(5);
+    while (watcher.watched_directories() != 3 && chrono::steady_clock::now() < deadline)
+    {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    EXPECT_EQ(3, watcher.watched_directories());
+}
+
+TEST(MediaWatcher, default_directories)
+{
+    auto dirs = MediaWatcher::default_directories();
+    ASSERT_FALSE(dirs.empty());
+    EXPECT_EQ("/DCIM", dirs.back().substr(dirs.back().size() - 5));
+}
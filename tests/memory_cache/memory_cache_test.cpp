@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/memory_cache.h>
+
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+// Each entry with a one-character key and this value costs a little over 1 kB,
+// so a single shard with a 4000-byte budget holds three of them.
+QByteArray const VALUE(1000, 'x');
+
+}  // namespace
+
+TEST(MemoryCache, basic)
+{
+    MemoryCache c(4000, 1);
+
+    EXPECT_TRUE(c.get("a").isNull());
+    c.put("a", VALUE);
+    EXPECT_EQ(VALUE, c.get("a"));
+
+    auto st = c.stats();
+    EXPECT_EQ(1, st.size);
+    EXPECT_LT(VALUE.size(), st.size_in_bytes);
+    EXPECT_EQ(4000, st.max_size_in_bytes);
+    EXPECT_EQ(1, st.hits);
+    EXPECT_EQ(1, st.misses);
+    EXPECT_EQ(0, st.evictions);
+
+    // Replacing an entry does not change the number of entries.
+    c.put("a", QByteArray("hello"));
+    EXPECT_EQ("hello", c.get("a"));
+    EXPECT_EQ(1, c.stats().size);
+
+    c.clear_stats();
+    st = c.stats();
+    EXPECT_EQ(1, st.size);
+    EXPECT_EQ(0, st.hits);
+    EXPECT_EQ(0, st.misses);
+
+    c.invalidate();
+    st = c.stats();
+    EXPECT_EQ(0, st.size);
+    EXPECT_EQ(0, st.size_in_bytes);
+    EXPECT_TRUE(c.get("a").isNull());
+}
+
+TEST(MemoryCache, preload_and_hot_keys)
+{
+    MemoryCache c(4000, 1);
+
+    EXPECT_TRUE(c.hot_keys(10).empty());
+
+    c.put("a", VALUE);
+    c.put("b", VALUE);
+    EXPECT_EQ((vector<string>{ "b", "a" }), c.hot_keys(10));
+    EXPECT_EQ((vector<string>{ "b" }), c.hot_keys(1));
+
+    // Preloaded entries are least-recently used, and don't replace or evict anything.
+    EXPECT_FALSE(c.preload("a", QByteArray("hello")));
+    EXPECT_EQ(VALUE, c.get("a"));
+    EXPECT_TRUE(c.preload("c", VALUE));
+    EXPECT_EQ((vector<string>{ "a", "b", "c" }), c.hot_keys(10));
+    EXPECT_FALSE(c.preload("d", VALUE));
+    EXPECT_EQ(3, c.stats().size);
+    EXPECT_EQ(0, c.stats().evictions);
+
+    MemoryCache sharded(1000000, 4);
+    for (int i = 0; i < 100; ++i)
+    {
+        sharded.put(to_string(i), VALUE);
+    }
+    auto keys = sharded.hot_keys(1000);
+    EXPECT_EQ(100u, keys.size());
+    EXPECT_EQ(50u, sharded.hot_keys(50).size());
+}
+
+TEST(MemoryCache, lru_eviction)
+{
+    MemoryCache c(4000, 1);
+
+    c.put("a", VALUE);
+    c.put("b", VALUE);
+    c.put("c", VALUE);
+    EXPECT_EQ(3, c.stats().size);
+
+    // Touch "a", so "b" is the least-recently used entry.
+    EXPECT_FALSE(c.get("a").isNull());
+    c.put("d", VALUE);
+
+    auto st = c.stats();
+    EXPECT_EQ(3, st.size);
+    EXPECT_EQ(1, st.evictions);
+    EXPECT_LE(st.size_in_bytes, st.max_size_in_bytes);
+    EXPECT_TRUE(c.get("b").isNull());
+    EXPECT_FALSE(c.get("a").isNull());
+    EXPECT_FALSE(c.get("c").isNull());
+    EXPECT_FALSE(c.get("d").isNull());
+}
+
+TEST(MemoryCache, too_large)
+{
+    MemoryCache c(4000, 4);
+
+    // Each shard has a budget of 1000 bytes, so the entry can never fit.
+    c.put("a", VALUE);
+    EXPECT_EQ(0, c.stats().size);
+    EXPECT_TRUE(c.get("a").isNull());
+}
+
+TEST(MemoryCache, disabled)
+{
+    MemoryCache c(0);
+
+    c.put("a", QByteArray("hello"));
+    EXPECT_TRUE(c.get("a").isNull());
+    EXPECT_EQ(0, c.stats().size);
+}
+
+TEST(MemoryCache, threads)
+{
+    MemoryCache c(1024 * 1024);
+
+    vector<thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&c, t]
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                auto key = to_string((t * 1000 + i) % 500);
+                c.put(key, QByteArray::fromStdString(key));
+                auto value = c.get(key);
+                EXPECT_TRUE(value.isNull() || value == QByteArray::fromStdString(key));
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    auto st = c.stats();
+    EXPECT_EQ(500, st.size);
+    EXPECT_EQ(0, st.evictions);
+    EXPECT_EQ(8000, st.hits + st.misses);
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/mimetype.h>
+
+#include <internal/file_io.h>
+#include <internal/gobj_memory.h>
+#include <testsetup.h>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#include <gio/gio.h>
+#pragma GCC diagnostic pop
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+namespace
+{
+
+string sniff_file(string const& filename)
+{
+    return sniff_mimetype(read_file(filename).substr(0, SNIFF_SIZE));
+}
+
+// What get_mimetype() did before it learned to sniff.
+
+string gio_mimetype(string const& filename)
+{
+    gobj_ptr<GFile> file(g_file_new_for_path(filename.c_str()));
+    gobj_ptr<GFileInfo> info(g_file_query_info(file.get(),
+                                               G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE,
+                                               G_FILE_QUERY_INFO_NONE,
+                                               nullptr,
+                                               nullptr));
+    return info ? g_file_info_get_attribute_string(info.get(), G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE) : "";
+}
+
+string family(string const& content_type)
+{
+    return content_type.substr(0, content_type.find('/'));
+}
+
+vector<string> media_files()
+{
+    vector<string> files;
+    for (boost::filesystem::directory_iterator it(TESTDATADIR), end; it != end; ++it)
+    {
+        if (boost::filesystem::is_regular_file(it->status()))
+        {
+            files.push_back(it->path().native());
+        }
+    }
+    return files;
+}
+
+}  // namespace
+
+TEST(Mimetype, media)
+{
+    EXPECT_EQ("image/jpeg", sniff_file(TESTDATADIR "/testimage.jpg"));
+    EXPECT_EQ("image/png", sniff_file(TESTDATADIR "/RGB.png"));
+    EXPECT_EQ("image/gif", sniff_file(TESTDATADIR "/animated.gif"));
+    EXPECT_EQ("audio/mpeg", sniff_file(TESTDATADIR "/testsong.mp3"));
+    EXPECT_EQ("audio/flac", sniff_file(TESTDATADIR "/testsong.flac"));
+    EXPECT_EQ("audio/x-vorbis+ogg", sniff_file(TESTDATADIR "/testsong.ogg"));
+    EXPECT_EQ("audio/x-opus+ogg", sniff_file(TESTDATADIR "/testsong.opus"));
+    EXPECT_EQ("audio/x-speex+ogg", sniff_file(TESTDATADIR "/testsong.spx"));
+    EXPECT_EQ("audio/x-flac+ogg", sniff_file(TESTDATADIR "/testsong.oga"));
+    EXPECT_EQ("audio/x-wav", sniff_file(TESTDATADIR "/testsong.wav"));
+    EXPECT_EQ("audio/x-aiff", sniff_file(TESTDATADIR "/testsong.aiff"));
+    EXPECT_EQ("video/x-theora+ogg", sniff_file(TESTDATADIR "/testvideo.ogg"));
+
+    // Generic MP4 brands, and files that aren't what their name says, are left to GIO.
+    EXPECT_EQ("", sniff_file(TESTDATADIR "/testvideo.mp4"));
+    EXPECT_EQ("", sniff_file(TESTDATADIR "/testsong.m4a"));
+    EXPECT_EQ("", sniff_file(TESTDATADIR "/bad.mp3"));
+    EXPECT_EQ("", sniff_file(TESTDATADIR "/empty"));
+    EXPECT_EQ("", sniff_file(TESTDATADIR "/transparent.svg"));
+}
+
+TEST(Mimetype, signatures)
+{
+    EXPECT_EQ("image/webp", sniff_mimetype(string("RIFF\x10\0\0\0WEBPVP8 ", 16)));
+    EXPECT_EQ("image/tiff", sniff_mimetype(string("MM\0*\0\0\0\x08", 8)));
+    EXPECT_EQ("image/tiff", sniff_mimetype(string("II*\0\x08\0\0\0", 8)));
+    EXPECT_EQ("image/x-canon-cr2", sniff_mimetype(string("II*\0\x10\0\0\0CR\x02\0", 12)));
+    EXPECT_EQ("image/x-olympus-orf", sniff_mimetype(string("IIRO\x08\0\0\0", 8)));
+    EXPECT_EQ("image/x-panasonic-rw2", sniff_mimetype(string("IIU\0\x08\0\0\0", 8)));
+    EXPECT_EQ("image/x-fuji-raf", sniff_mimetype("FUJIFILMCCD-RAW 0201"));
+    EXPECT_EQ("image/x-canon-cr3", sniff_mimetype(string("\0\0\0\x18" "ftypcrx \0\0\0\x01", 16)));
+    EXPECT_EQ("audio/mp4", sniff_mimetype(string("\0\0\0\x18" "ftypM4A \0\0\0\0", 16)));
+    EXPECT_EQ("video/quicktime", sniff_mimetype(string("\0\0\0\x14" "ftypqt  \0\0\0\0", 16)));
+    EXPECT_EQ("video/3gpp", sniff_mimetype(string("\0\0\0\x18" "ftyp3gp5\0\0\0\0", 16)));
+    EXPECT_EQ("video/webm", sniff_mimetype(string("\x1a\x45\xdf\xa3\x9f\x42\x86\x81\x01\x42\x82\x84webm", 16)));
+    EXPECT_EQ("video/x-matroska", sniff_mimetype(string("\x1a\x45\xdf\xa3\xa3\x42\x86\x81\x01\x42\x82\x88matroska", 20)));
+    EXPECT_EQ("video/x-msvideo", sniff_mimetype(string("RIFF\x10\0\0\0" "AVI LIST", 16)));
+    EXPECT_EQ("video/x-flv", sniff_mimetype(string("FLV\x01\x05\0\0\0\x09", 9)));
+    EXPECT_EQ("video/mpeg", sniff_mimetype(string("\0\0\x01\xba\x44\0\x04\0", 8)));
+
+    string ts(3 * 188, '\0');
+    ts[0] = ts[188] = ts[2 * 188] = 0x47;
+    EXPECT_EQ("video/mp2t", sniff_mimetype(ts));
+
+    // MPEG-1 layer 3 frame, 128 kbit/s, 44.1 kHz.
+    EXPECT_EQ("audio/mpeg", sniff_mimetype("\xff\xfb\x90\x64"));
+    // AAC in ADTS has layer 0, and a reserved sample rate is not a frame.
+    EXPECT_EQ("", sniff_mimetype("\xff\xf1\x50\x80"));
+    EXPECT_EQ("", sniff_mimetype("\xff\xfb\x9c\x64"));
+
+    EXPECT_EQ("", sniff_mimetype(""));
+    EXPECT_EQ("", sniff_mimetype("\xff\xd8"));
+    EXPECT_EQ("", sniff_mimetype(string("OggS\0\x02", 6)));
+}
+
+TEST(Mimetype, agrees_with_gio)
+{
+    for (auto const& f : media_files())
+    {
+        auto const type = get_mimetype(f);
+        auto const gio_type = gio_mimetype(f);
+        EXPECT_EQ(family(gio_type), family(type)) << f;
+        if (sniff_file(f).empty())
+        {
+            EXPECT_EQ(gio_type, type) << f;
+        }
+    }
+}
+
+TEST(Mimetype, no_such_file)
+{
+    try
+    {
+        get_mimetype(TESTDATADIR "/no_such_file");
+        FAIL();
+    }
+    catch (std::exception const&)
+    {
+    }
+}
+
+// Not a pass/fail test. Shows what a lookup costs for the media files,
+// with and without sniffing.
+
+TEST(Mimetype, benchmark)
+{
+    int const ROUNDS = 20;
+    auto const files = media_files();
+
+    auto time_per_file = [&](function<string(string const&)> const& lookup)
+    {
+        auto const start = chrono::steady_clock::now();
+        for (int i = 0; i < ROUNDS; ++i)
+        {
+            for (auto const& f : files)
+            {
+                lookup(f);
+            }
+        }
+        auto const elapsed = chrono::steady_clock::now() - start;
+        return chrono::duration_cast<chrono::microseconds>(elapsed).count() / double(ROUNDS * files.size());
+    };
+
+    gio_mimetype(files.front());  // Loads the shared-mime-info database.
+    double const gio_usecs = time_per_file(gio_mimetype);
+    double const usecs = time_per_file(get_mimetype);
+    cout << "Content type lookup for " << files.size() << " files: GIO " << gio_usecs
+         << " usec/file, get_mimetype() " << usecs << " usec/file" << endl;
+}
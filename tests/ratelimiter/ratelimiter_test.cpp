@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ratelimiter.h>
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+using namespace std;
+using namespace unity::thumbnailer;
+
+TEST(RateLimiter, basic)
+{
+    RateLimiter limiter(2);
+    vector<int> started;
+
+    limiter.schedule([&]{ started.push_back(1); });
+    limiter.schedule([&]{ started.push_back(2); });
+    limiter.schedule([&]{ started.push_back(3); });
+    auto cancel = limiter.schedule([&]{ started.push_back(4); });
+    EXPECT_EQ((vector<int>{1, 2}), started);
+
+    // A cancelled job never runs.
+    EXPECT_TRUE(cancel());
+    limiter.done();
+    EXPECT_EQ((vector<int>{1, 2, 3}), started);
+    limiter.done();
+    limiter.done();
+    EXPECT_EQ((vector<int>{1, 2, 3}), started);
+
+    // Once a job has started, it can't be cancelled.
+    cancel = limiter.schedule([&]{ started.push_back(5); });
+    EXPECT_FALSE(cancel());
+    limiter.done();
+}
+
+TEST(RateLimiter, weights)
+{
+    RateLimiter limiter(4);
+    vector<int> started;
+
+    limiter.schedule([&]{ started.push_back(1); }, 3);
+    limiter.schedule([&]{ started.push_back(2); }, 1);
+    limiter.schedule([&]{ started.push_back(3); }, 2);  // Doesn't fit.
+    limiter.schedule([&]{ started.push_back(4); }, 1);  // Waits behind job 3.
+    EXPECT_EQ((vector<int>{1, 2}), started);
+
+    // Job 4 was queued last, so it is first in line, and completing job 2
+    // makes room for it. Job 3 has to wait until job 1 completes.
+    limiter.done(1);
+    EXPECT_EQ((vector<int>{1, 2, 4}), started);
+    limiter.done(3);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3}), started);
+
+    // A job that weighs more than the limit runs on its own.
+    limiter.schedule([&]{ started.push_back(5); }, 8);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3}), started);
+    limiter.done(1);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3}), started);
+    limiter.done(2);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3, 5}), started);
+    limiter.schedule([&]{ started.push_back(6); }, 1);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3, 5}), started);
+    limiter.done(8);
+    EXPECT_EQ((vector<int>{1, 2, 4, 3, 5, 6}), started);
+    limiter.done(1);
+}
@@ -56,6 +56,8 @@ public:
 
     MOCK_METHOD1(resize, void(int64_t size_in_bytes));  // Needed so template will instantiate in caller.
 
+    MOCK_METHOD1(contains_key, bool(std::string const& key));  // Needed so template will instantiate in caller.
+
     // Methods below are not Google mocks because the recovery logic reinitializes
     // the cache, thereby replacing the original mock with a new one, and we can't
     // set expectations on that second instance.
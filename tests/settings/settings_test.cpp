@@ -43,13 +43,27 @@ TEST(Settings, defaults_from_schema)
     EXPECT_EQ(50, settings.full_size_cache_size());
     EXPECT_EQ(100, settings.thumbnail_cache_size());
     EXPECT_EQ(2, settings.failure_cache_size());
+    EXPECT_EQ(8, settings.memory_cache_size());
     EXPECT_EQ(7200, settings.retry_error_max_seconds());
     EXPECT_EQ(8, settings.max_downloads());
+    EXPECT_EQ(10240, settings.max_download_size());
     EXPECT_EQ(0, settings.max_extractions());
     EXPECT_EQ(10, settings.extraction_timeout());
+    EXPECT_EQ(300, settings.max_idle_time());
+    EXPECT_TRUE(settings.boosted_clients().empty());
     EXPECT_EQ(10, settings.max_backlog());
     EXPECT_FALSE(settings.trace_client());
     EXPECT_EQ(1, settings.log_level());
+    EXPECT_FALSE(settings.watch_new_media());
+    EXPECT_TRUE(settings.new_media_directories().empty());
+    EXPECT_EQ((std::vector<int>{ 128, 256, 512 }), settings.new_media_sizes());
+    EXPECT_FALSE(settings.index_media());
+    EXPECT_FALSE(settings.prefetch_siblings());
+    EXPECT_TRUE(settings.read_desktop_thumbnails());
+    EXPECT_FALSE(settings.write_desktop_thumbnails());
+    EXPECT_FALSE(settings.volume_caches());
+    EXPECT_EQ(50, settings.volume_cache_size());
+    EXPECT_EQ(200, settings.volume_cache_total_size());
 }
 
 TEST(Settings, missing_schema)
@@ -64,15 +78,29 @@ TEST(Settings, missing_schema)
     EXPECT_EQ(50, settings.full_size_cache_size());
     EXPECT_EQ(100, settings.thumbnail_cache_size());
     EXPECT_EQ(2, settings.failure_cache_size());
+    EXPECT_EQ(8, settings.memory_cache_size());
     EXPECT_EQ(1920, settings.max_thumbnail_size());
     EXPECT_EQ(168, settings.retry_not_found_hours());
     EXPECT_EQ(7200, settings.retry_error_max_seconds());
     EXPECT_EQ(8, settings.max_downloads());
+    EXPECT_EQ(10240, settings.max_download_size());
     EXPECT_EQ(0, settings.max_extractions());
     EXPECT_EQ(10, settings.extraction_timeout());
+    EXPECT_EQ(300, settings.max_idle_time());
+    EXPECT_TRUE(settings.boosted_clients().empty());
     EXPECT_EQ(10, settings.max_backlog());
     EXPECT_FALSE(settings.trace_client());
     EXPECT_EQ(1, settings.log_level());
+    EXPECT_FALSE(settings.watch_new_media());
+    EXPECT_TRUE(settings.new_media_directories().empty());
+    EXPECT_EQ((std::vector<int>{ 128, 256, 512 }), settings.new_media_sizes());
+    EXPECT_FALSE(settings.index_media());
+    EXPECT_FALSE(settings.prefetch_siblings());
+    EXPECT_TRUE(settings.read_desktop_thumbnails());
+    EXPECT_FALSE(settings.write_desktop_thumbnails());
+    EXPECT_FALSE(settings.volume_caches());
+    EXPECT_EQ(50, settings.volume_cache_size());
+    EXPECT_EQ(200, settings.volume_cache_total_size());
 }
 
 TEST(Settings, changed_settings)
@@ -82,38 +110,80 @@ TEST(Settings, changed_settings)
     g_settings_set_int(gsettings.get(), "full-size-cache-size", 41);
     g_settings_set_int(gsettings.get(), "thumbnail-cache-size", 42);
     g_settings_set_int(gsettings.get(), "failure-cache-size", 43);
+    g_settings_set_int(gsettings.get(), "memory-cache-size", 0);
     g_settings_set_int(gsettings.get(), "retry-error-hours", 1);
     g_settings_set_int(gsettings.get(), "max-downloads", 5);
+    g_settings_set_int(gsettings.get(), "max-download-size", 512);
     g_settings_set_int(gsettings.get(), "max-extractions", 7);
     g_settings_set_int(gsettings.get(), "extraction-timeout", 9);
+    g_settings_set_int(gsettings.get(), "max-idle-time", 60);
+    g_settings_set_string(gsettings.get(), "boosted-clients", "com.ubuntu.gallery_, ,com.ubuntu.music_ ");
     g_settings_set_int(gsettings.get(), "max-backlog", 30);
     g_settings_set_boolean(gsettings.get(), "trace-client", true);
     g_settings_set_int(gsettings.get(), "log-level", 2);
+    g_settings_set_boolean(gsettings.get(), "watch-new-media", true);
+    g_settings_set_string(gsettings.get(), "new-media-directories", "/tmp/Pictures: :/media/sd/DCIM");
+    g_settings_set_string(gsettings.get(), "new-media-sizes", "64, 1024");
+    g_settings_set_boolean(gsettings.get(), "index-media", true);
+    g_settings_set_boolean(gsettings.get(), "prefetch-siblings", true);
+    g_settings_set_boolean(gsettings.get(), "read-desktop-thumbnails", false);
+    g_settings_set_boolean(gsettings.get(), "write-desktop-thumbnails", true);
+    g_settings_set_boolean(gsettings.get(), "volume-caches", true);
+    g_settings_set_int(gsettings.get(), "volume-cache-size", 20);
+    g_settings_set_int(gsettings.get(), "volume-cache-total-size", 100);
 
     Settings settings;
     EXPECT_EQ("foo", settings.art_api_key());
     EXPECT_EQ(41, settings.full_size_cache_size());
     EXPECT_EQ(42, settings.thumbnail_cache_size());
     EXPECT_EQ(43, settings.failure_cache_size());
+    EXPECT_EQ(0, settings.memory_cache_size());
     EXPECT_EQ(3600, settings.retry_error_max_seconds());
     EXPECT_EQ(5, settings.max_downloads());
+    EXPECT_EQ(512, settings.max_download_size());
     EXPECT_EQ(7, settings.max_extractions());
     EXPECT_EQ(9, settings.extraction_timeout());
+    EXPECT_EQ(60, settings.max_idle_time());
+    EXPECT_EQ((std::vector<std::string>{ "com.ubuntu.gallery_", "com.ubuntu.music_" }), settings.boosted_clients());
     EXPECT_EQ(30, settings.max_backlog());
     EXPECT_TRUE(settings.trace_client());
     EXPECT_EQ(2, settings.log_level());
+    EXPECT_TRUE(settings.watch_new_media());
+    EXPECT_EQ((std::vector<std::string>{ "/tmp/Pictures", "/media/sd/DCIM" }), settings.new_media_directories());
+    EXPECT_EQ((std::vector<int>{ 64, 1024 }), settings.new_media_sizes());
+    EXPECT_TRUE(settings.index_media());
+    EXPECT_TRUE(settings.prefetch_siblings());
+    EXPECT_FALSE(settings.read_desktop_thumbnails());
+    EXPECT_TRUE(settings.write_desktop_thumbnails());
+    EXPECT_TRUE(settings.volume_caches());
+    EXPECT_EQ(20, settings.volume_cache_size());
+    EXPECT_EQ(100, settings.volume_cache_total_size());
 
     g_settings_reset(gsettings.get(), "dash-ubuntu-com-key");
     g_settings_reset(gsettings.get(), "full-size-cache-size");
     g_settings_reset(gsettings.get(), "thumbnail-cache-size");
     g_settings_reset(gsettings.get(), "failure-cache-size");
+    g_settings_reset(gsettings.get(), "memory-cache-size");
     g_settings_reset(gsettings.get(), "retry-error-hours");
     g_settings_reset(gsettings.get(), "max-downloads");
+    g_settings_reset(gsettings.get(), "max-download-size");
     g_settings_reset(gsettings.get(), "max-extractions");
     g_settings_reset(gsettings.get(), "extraction_timeout");
+    g_settings_reset(gsettings.get(), "max-idle-time");
+    g_settings_reset(gsettings.get(), "boosted-clients");
     g_settings_reset(gsettings.get(), "max-backlog");
     g_settings_reset(gsettings.get(), "trace-client");
     g_settings_reset(gsettings.get(), "log-level");
+    g_settings_reset(gsettings.get(), "watch-new-media");
+    g_settings_reset(gsettings.get(), "new-media-directories");
+    g_settings_reset(gsettings.get(), "new-media-sizes");
+    g_settings_reset(gsettings.get(), "index-media");
+    g_settings_reset(gsettings.get(), "prefetch-siblings");
+    g_settings_reset(gsettings.get(), "read-desktop-thumbnails");
+    g_settings_reset(gsettings.get(), "write-desktop-thumbnails");
+    g_settings_reset(gsettings.get(), "volume-caches");
+    g_settings_reset(gsettings.get(), "volume-cache-size");
+    g_settings_reset(gsettings.get(), "volume-cache-total-size");
 }
 
 TEST(Settings, adjusted_error_max_seconds)
@@ -186,6 +256,20 @@ TEST(Settings, negative_int)
     g_settings_reset(gsettings.get(), "max-extractions");
 }
 
+TEST(Settings, bad_new_media_sizes)
+{
+    gobj_ptr<GSettings> gsettings(g_settings_new("com.canonical.Unity.Thumbnailer"));
+
+    Settings settings;
+    for (auto sizes : { "128,0", "128,-5", "128,big", "128,64px" })
+    {
+        g_settings_set_string(gsettings.get(), "new-media-sizes", sizes);
+        EXPECT_THROW(settings.new_media_sizes(), std::domain_error) << sizes;
+    }
+
+    g_settings_reset(gsettings.get(), "new-media-sizes");
+}
+
 TEST(Settings, log_level_env_override)
 {
     EnvVarGuard ev_guard(LOG_LEVEL, "0");
@@ -0,0 +1,216 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/source_index.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define INDEX_FILE TESTBINDIR "/sources.index"
+
+namespace
+{
+
+typedef SourceIndex::Tier Tier;
+
+string const KEY = string("/some/file\0" "42\0" "1.5", 17);
+
+string sized_key(string const& key, int w, int h)
+{
+    return key + '\0' + to_string(w) + '\0' + to_string(h);
+}
+
+vector<string> const TOKENS = { "1 100", "2 200", "3 300" };
+
+}  // namespace
+
+TEST(SourceIndex, basic)
+{
+    SourceIndex index;
+
+    // Nothing is complete yet, so the caller must read every tier.
+    auto l = index.lookup(KEY);
+    EXPECT_TRUE(l.may_have_thumbnail(QSize(10, 10)));
+    EXPECT_TRUE(l.may_have_full_size());
+    EXPECT_TRUE(l.may_have_failure());
+
+    index.set_complete(Tier::thumbnail, true);
+    index.set_complete(Tier::full_size, true);
+    index.set_complete(Tier::failure, true);
+    l = index.lookup(KEY);
+    EXPECT_FALSE(l.may_have_thumbnail(QSize(10, 10)));
+    EXPECT_FALSE(l.may_have_full_size());
+    EXPECT_FALSE(l.may_have_failure());
+
+    index.add_thumbnail(KEY, QSize(10, 10));
+    index.add_thumbnail(KEY, QSize(10, 10));
+    index.set_full_size(KEY, true);
+    index.set_source_info(KEY, QSize(640, 480), "image/jpeg");
+    l = index.lookup(KEY);
+    EXPECT_EQ(1u, l.record.thumbnail_sizes.size());
+    EXPECT_TRUE(l.may_have_thumbnail(QSize(10, 10)));
+    EXPECT_FALSE(l.may_have_thumbnail(QSize(20, 20)));
+    EXPECT_TRUE(l.may_have_full_size());
+    EXPECT_EQ(QSize(640, 480), l.record.source_size);
+    EXPECT_EQ("image/jpeg", l.record.content_type);
+    EXPECT_EQ(1, index.size());
+
+    // Once nothing is cached for the source, the record goes away.
+    index.remove_thumbnail(KEY, QSize(10, 10));
+    index.set_full_size(KEY, false);
+    EXPECT_EQ(0, index.size());
+}
+
+TEST(SourceIndex, failure_expiry)
+{
+    SourceIndex index;
+    index.set_complete(Tier::failure, true);
+
+    index.set_failure(KEY, chrono::system_clock::time_point());
+    EXPECT_TRUE(index.lookup(KEY).may_have_failure());
+
+    index.set_failure(KEY, chrono::system_clock::now() + chrono::hours(1));
+    EXPECT_TRUE(index.lookup(KEY).may_have_failure());
+
+    index.set_failure(KEY, chrono::system_clock::now() - chrono::hours(1));
+    EXPECT_FALSE(index.lookup(KEY).may_have_failure());
+
+    index.remove_failure(KEY);
+    EXPECT_FALSE(index.lookup(KEY).record.failed);
+    EXPECT_EQ(0, index.size());
+}
+
+TEST(SourceIndex, cache_events)
+{
+    SourceIndex index;
+
+    index.cache_event(Tier::thumbnail, sized_key(KEY, 10, 20), true);
+    index.cache_event(Tier::thumbnail, sized_key(KEY, 30, 40), true);
+    index.cache_event(Tier::full_size, KEY, true);
+    index.cache_event(Tier::failure, "other", true);
+    auto r = index.lookup(KEY).record;
+    ASSERT_EQ(2u, r.thumbnail_sizes.size());
+    EXPECT_EQ(QSize(10, 20), r.thumbnail_sizes[0]);
+    EXPECT_EQ(QSize(30, 40), r.thumbnail_sizes[1]);
+    EXPECT_TRUE(r.has_full_size);
+    EXPECT_TRUE(index.lookup("other").record.failed);
+
+    // Evictions remove the entry for the evicted key only.
+    index.cache_event(Tier::thumbnail, sized_key(KEY, 10, 20), false);
+    r = index.lookup(KEY).record;
+    ASSERT_EQ(1u, r.thumbnail_sizes.size());
+    EXPECT_EQ(QSize(30, 40), r.thumbnail_sizes[0]);
+
+    // An empty key means that the cache was emptied, so the tier is complete.
+    EXPECT_FALSE(index.complete(Tier::thumbnail));
+    index.cache_event(Tier::thumbnail, "", false);
+    EXPECT_TRUE(index.complete(Tier::thumbnail));
+    r = index.lookup(KEY).record;
+    EXPECT_TRUE(r.thumbnail_sizes.empty());
+    EXPECT_TRUE(r.has_full_size);
+
+    index.clear(Tier::full_size, true);
+    index.clear(Tier::failure, true);
+    EXPECT_EQ(0, index.size());
+}
+
+TEST(SourceIndex, save_and_load)
+{
+    boost::filesystem::remove(INDEX_FILE);
+
+    SourceIndex index;
+    EXPECT_FALSE(index.load(INDEX_FILE, TOKENS));  // No file.
+
+    index.set_complete(Tier::thumbnail, true);
+    index.set_complete(Tier::full_size, true);
+    index.set_complete(Tier::failure, true);
+    index.add_thumbnail(KEY, QSize(10, 20));
+    index.set_full_size(KEY, true);
+    index.set_source_info(KEY, QSize(640, 480), "image/jpeg");
+    auto const expiry = chrono::system_clock::time_point(chrono::seconds(2000000000));
+    index.set_failure("other\nkey", expiry);
+    index.save(INDEX_FILE, TOKENS);
+
+    {
+        SourceIndex i;
+        EXPECT_TRUE(i.load(INDEX_FILE, TOKENS));
+        EXPECT_FALSE(boost::filesystem::exists(INDEX_FILE));  // Loading removes the file.
+        EXPECT_EQ(2, i.size());
+        EXPECT_TRUE(i.complete(Tier::thumbnail));
+        EXPECT_TRUE(i.complete(Tier::full_size));
+        EXPECT_TRUE(i.complete(Tier::failure));
+
+        auto r = i.lookup(KEY).record;
+        ASSERT_EQ(1u, r.thumbnail_sizes.size());
+        EXPECT_EQ(QSize(10, 20), r.thumbnail_sizes[0]);
+        EXPECT_TRUE(r.has_full_size);
+        EXPECT_FALSE(r.failed);
+        EXPECT_EQ(QSize(640, 480), r.source_size);
+        EXPECT_EQ("image/jpeg", r.content_type);
+
+        r = i.lookup("other\nkey").record;
+        EXPECT_TRUE(r.failed);
+        EXPECT_TRUE(expiry == r.failure_expiry);
+        EXPECT_TRUE(r.content_type.empty());
+    }
+
+    {
+        // A token that does not match discards the entries for that tier only.
+        index.save(INDEX_FILE, TOKENS);
+        SourceIndex i;
+        EXPECT_TRUE(i.load(INDEX_FILE, { "1 100", "changed", "3 300" }));
+        EXPECT_TRUE(i.complete(Tier::full_size));
+        EXPECT_FALSE(i.complete(Tier::thumbnail));
+        EXPECT_TRUE(i.complete(Tier::failure));
+        auto r = i.lookup(KEY).record;
+        EXPECT_TRUE(r.thumbnail_sizes.empty());
+        EXPECT_TRUE(r.has_full_size);
+    }
+
+    {
+        // An incomplete tier is saved without its token.
+        index.set_complete(Tier::failure, false);
+        index.save(INDEX_FILE, TOKENS);
+        SourceIndex i;
+        EXPECT_TRUE(i.load(INDEX_FILE, TOKENS));
+        EXPECT_FALSE(i.complete(Tier::failure));
+        EXPECT_EQ(1, i.size());
+    }
+
+    {
+        // Truncated file.
+        index.save(INDEX_FILE, TOKENS);
+        auto contents = read_file(INDEX_FILE);
+        write_file(INDEX_FILE, contents.substr(0, contents.size() - 5));
+        SourceIndex i;
+        EXPECT_FALSE(i.load(INDEX_FILE, TOKENS));
+        EXPECT_EQ(0, i.size());
+        EXPECT_FALSE(i.complete(Tier::thumbnail));
+    }
+
+    {
+        // Not an index.
+        write_file(INDEX_FILE, string("hello"));
+        SourceIndex i;
+        EXPECT_FALSE(i.load(INDEX_FILE, TOKENS));
+    }
+}
@@ -419,6 +419,45 @@ TEST_F(StressTest, hits)
     add_stats(N_REQUESTS, start, finish);
 }
 
+// Measures the time from starting the service until the first reply arrives.
+// The first start creates the caches; the remaining ones open populated caches.
+
+TEST_F(StressTest, startup)
+{
+    int const N_STARTS = 10;
+
+    // Put some entries into the caches, so we don't just measure opening empty DBs.
+    {
+        string target_dir = temp_dir() + "/Pictures";
+        make_links(string(TESTDATADIR) + "/Photo-with-exif.jpg", target_dir, 100);
+        run_requests(100, target_dir, "Photo-with-exif.jpg");
+    }
+
+    chrono::system_clock::duration total(0);
+    for (int i = 0; i < N_STARTS; ++i)
+    {
+        thumbnailer_.reset();
+        dbus_.reset();
+
+        auto start = chrono::system_clock::now();
+        dbus_.reset(new DBusServer());
+        thumbnailer_.reset(new unity::thumbnailer::qt::Thumbnailer(dbus_->connection()));
+        auto request = thumbnailer_->getThumbnail(TESTDATADIR "/Photo-with-exif.jpg", QSize(128, 128));
+        request->waitForFinished();
+        auto finish = chrono::system_clock::now();
+        ASSERT_TRUE(request->isValid()) << request->errorMessage().toStdString();
+        total += finish - start;
+    }
+
+    double secs = chrono::duration_cast<chrono::milliseconds>(total).count() / 1000.0;
+    stringstream s;
+    s.setf(ios::fixed, ios::floatfield);
+    s.precision(3);
+    s << "startup: " << N_STARTS << " starts in " << secs << " sec ("
+      << secs / N_STARTS << " sec to first reply)" << endl;
+    stats_ += s.str();
+}
+
 TEST_F(StressTest, wait_for_finished_in_queue)
 {
     if (!supports_decoder("audio/mpeg"))
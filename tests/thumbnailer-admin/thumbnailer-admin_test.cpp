@@ -114,6 +114,26 @@ TEST_F(AdminTest, no_args)
     EXPECT_TRUE(output.find("Image cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("Thumbnail cache:") != string::npos) << output;
     EXPECT_TRUE(output.find("Failure cache:") != string::npos) << output;
+    EXPECT_TRUE(output.find("Counters:") != string::npos) << output;
+    EXPECT_TRUE(output.find("coalescing.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("dedup.references:") != string::npos) << output;
+    EXPECT_TRUE(output.find("desktop.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("volume.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("volume.bytes:") != string::npos) << output;
+    EXPECT_TRUE(output.find("albums.local_hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("background.thumbnails:") != string::npos) << output;
+    EXPECT_TRUE(output.find("prefetch.accuracy_percent:") != string::npos) << output;
+    EXPECT_TRUE(output.find("index.coverage_percent:") != string::npos) << output;
+    EXPECT_TRUE(output.find("memory.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("apparmor.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("files.hits:") != string::npos) << output;
+    EXPECT_TRUE(output.find("keys.migrated:") != string::npos) << output;
+    EXPECT_TRUE(output.find("idle.cold_starts_avoided:") != string::npos) << output;
+    EXPECT_TRUE(output.find("pipeline.resolve.queued:") != string::npos) << output;
+    EXPECT_TRUE(output.find("pipeline.probe.queued:") != string::npos) << output;
+    EXPECT_TRUE(output.find("pipeline.decode.active:") != string::npos) << output;
+    EXPECT_TRUE(output.find("scheduler.queued:") != string::npos) << output;
+    EXPECT_TRUE(output.find("cancel.by_client:") != string::npos) << output;
     EXPECT_FALSE(output.find("Histogram:") != string::npos) << output;
 }
 
@@ -126,6 +146,7 @@ TEST_F(AdminTest, image_stats)
     EXPECT_TRUE(output.find("lru_only") != string::npos) << output;
     EXPECT_FALSE(output.find("Thumbnail cache:") != string::npos) << output;
     EXPECT_FALSE(output.find("Failure cache:") != string::npos) << output;
+    EXPECT_FALSE(output.find("Counters:") != string::npos) << output;
     EXPECT_FALSE(output.find("Histogram:") != string::npos) << output;
 }
 
@@ -297,13 +318,32 @@ TEST_F(AdminTest, shutdown_parsing)
     EXPECT_TRUE(starts_with(ar.stderr(), "thumbnailer-admin: Usage: ")) << ar.stderr();
 }
 
+TEST_F(AdminTest, index_parsing)
+{
+    AdminRunner ar;
+
+    // Too many args
+    EXPECT_EQ(1, ar.run(QStringList{"index", "start", "now"}));
+    EXPECT_TRUE(starts_with(ar.stderr(), "thumbnailer-admin: too many arguments")) << ar.stderr();
+
+    // Bad operation
+    EXPECT_EQ(1, ar.run(QStringList{"index", "restart"}));
+    EXPECT_TRUE(starts_with(ar.stderr(), "thumbnailer-admin: invalid operation: restart")) << ar.stderr();
+
+    // Help option
+    EXPECT_EQ(1, ar.run(QStringList{"index", "-h"}));
+    EXPECT_TRUE(starts_with(ar.stderr(), "thumbnailer-admin: Usage: ")) << ar.stderr();
+}
+
 TEST_F(AdminTest, clear_and_clear_stats)
 {
     AdminRunner ar;
 
     // Put something in the cache.
     EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/testvideo.ogg"}));
-    // Again, so we get a hit on thumbnail cache.
+    // Again, so we get a hit on thumbnail cache. We clear the in-memory
+    // cache first, otherwise the request would not reach the thumbnail cache.
+    EXPECT_EQ(0, ar.run(QStringList{"clear", "m"}));
     EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/testvideo.ogg"}));
     // Again, with different size, so we get a hit on full-size cache.
     EXPECT_EQ(0, ar.run(QStringList{"get", TESTDATADIR "/testvideo.ogg", "--size=20x20"}));
@@ -644,6 +684,12 @@ TEST_F(AdminTest, shutdown)
     // For coverage.
     EXPECT_EQ(0, ar.run(QStringList{"compact"})) << ar.stderr();
 
+    EXPECT_EQ(0, ar.run(QStringList{"index", "start"})) << ar.stderr();
+    EXPECT_TRUE(ar.stdout().find("coverage_percent:") != string::npos) << ar.stdout();
+    EXPECT_EQ(0, ar.run(QStringList{"index", "stop"})) << ar.stderr();
+    EXPECT_EQ(0, ar.run(QStringList{"index"})) << ar.stderr();
+    EXPECT_TRUE(ar.stdout().find("running:                   0") != string::npos) << ar.stdout();
+
     // For coverage. (Test output shows trace with "Exiting".)
     EXPECT_EQ(0, ar.run(QStringList{"shutdown"})) << ar.stderr();
 }
@@ -18,6 +18,8 @@
 
 #include <internal/thumbnailer.h>
 
+#include <internal/cache_key.h>
+#include <internal/desktop_thumbnails.h>
 #include <internal/env_vars.h>
 #include <internal/file_io.h>
 #include <internal/image.h>
@@ -29,6 +31,7 @@
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <core/persistent_string_cache.h>
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wold-style-cast"
 #pragma GCC diagnostic ignored "-Wcast-qual"
@@ -38,11 +41,16 @@
 #include <QCoreApplication>
 #include <QSignalSpy>
 #include <QTemporaryDir>
+#include <taglib/fileref.h>
+#include <taglib/tag.h>
 #include <unity/UnityExceptions.h>
 
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 
+#include <thread>
+
 #define TEST_IMAGE TESTDATADIR "/orientation-1.jpg"
 #define BAD_IMAGE TESTDATADIR "/bad_image.jpg"
 #define RGB_IMAGE TESTDATADIR "/RGB.png"
@@ -111,13 +119,25 @@ TEST_F(ThumbnailerTest, basic)
     EXPECT_EQ(old_stats.failure_stats.hits() + 1, new_stats.failure_stats.hits());
 
     request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
-    EXPECT_TRUE(boost::starts_with(request->key(), TEST_IMAGE)) << request->key();
+    EXPECT_TRUE(is_local_cache_key(request->key())) << printable_cache_key(request->key());
     thumb = request->thumbnail();
     img = Image(thumb);
     EXPECT_EQ(640, img.width());
     EXPECT_EQ(480, img.height());
 
-    // Again, for coverage. This time the thumbnail comes from the cache.
+    // Again, for coverage. This time the thumbnail comes from the in-memory cache.
+    old_stats = tn.stats();
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
+    thumb = request->thumbnail();
+    img = Image(thumb);
+    EXPECT_EQ(640, img.width());
+    EXPECT_EQ(480, img.height());
+    new_stats = tn.stats();
+    EXPECT_EQ(old_stats.memory_stats.hits + 1, new_stats.memory_stats.hits);
+    EXPECT_EQ(old_stats.thumbnail_stats.hits(), new_stats.thumbnail_stats.hits());
+
+    // And again, with the in-memory cache cleared, so it comes from the thumbnail cache.
+    tn.clear(Thumbnailer::CacheSelector::memory_cache);
     old_stats = tn.stats();
     request = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
     thumb = request->thumbnail();
@@ -223,6 +243,8 @@ TEST_F(ThumbnailerTest, clear)
 
         {
             // Load same song again at same size, so we get a hit on thumbnail cache.
+            // The thumbnail is in memory too, so clear the in-memory cache first.
+            tn.clear(Thumbnailer::CacheSelector::memory_cache);
             auto request = tn.get_thumbnail(TEST_SONG, QSize(20, 20));
             ASSERT_NE(nullptr, request.get());
             ASSERT_NE("", request->thumbnail());
@@ -279,6 +301,7 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(0, stats.full_size_stats.hits());
     EXPECT_EQ(1, stats.thumbnail_stats.hits());
     EXPECT_EQ(1, stats.failure_stats.hits());
+    EXPECT_EQ(2, stats.memory_stats.size);
 
     // Clear all caches and check that they are empty.
     tn.clear(Thumbnailer::CacheSelector::all);
@@ -286,6 +309,7 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(0, stats.full_size_stats.size());
     EXPECT_EQ(0, stats.thumbnail_stats.size());
     EXPECT_EQ(0, stats.failure_stats.size());
+    EXPECT_EQ(0, stats.memory_stats.size);
 
     // Clear full-size cache only.
     fill_cache();
@@ -294,6 +318,7 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(0, stats.full_size_stats.size());
     EXPECT_EQ(3, stats.thumbnail_stats.size());
     EXPECT_EQ(1, stats.failure_stats.size());
+    EXPECT_EQ(2, stats.memory_stats.size);
 
     // Clear thumbnail cache only.
     tn.clear(Thumbnailer::CacheSelector::all);
@@ -303,6 +328,17 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(0, stats.thumbnail_stats.size());
     EXPECT_EQ(1, stats.failure_stats.size());
+    EXPECT_EQ(0, stats.memory_stats.size);  // Holds a subset of the thumbnail cache.
+
+    // Clear in-memory cache only.
+    tn.clear(Thumbnailer::CacheSelector::all);
+    fill_cache();
+    tn.clear(Thumbnailer::CacheSelector::memory_cache);
+    stats = tn.stats();
+    EXPECT_EQ(1, stats.full_size_stats.size());
+    EXPECT_EQ(3, stats.thumbnail_stats.size());
+    EXPECT_EQ(1, stats.failure_stats.size());
+    EXPECT_EQ(0, stats.memory_stats.size);
 
     // Clear failure cache only.
     tn.clear(Thumbnailer::CacheSelector::all);
@@ -319,6 +355,7 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(0, stats.full_size_stats.hits());
     EXPECT_EQ(0, stats.thumbnail_stats.hits());
     EXPECT_EQ(0, stats.failure_stats.hits());
+    EXPECT_EQ(0, stats.memory_stats.misses);
 
     // Re-fill the cache and clear full-size stats only.
     tn.clear(Thumbnailer::CacheSelector::all);
@@ -349,6 +386,19 @@ TEST_F(ThumbnailerTest, clear)
     EXPECT_EQ(1, stats.full_size_stats.size());
     EXPECT_EQ(1, stats.thumbnail_stats.hits());
     EXPECT_EQ(0, stats.failure_stats.hits());
+
+    // Re-fill the cache and clear in-memory stats only.
+    tn.clear(Thumbnailer::CacheSelector::all);
+    tn.clear_stats(Thumbnailer::CacheSelector::all);
+    fill_cache();
+    EXPECT_NE(0, tn.stats().memory_stats.misses);
+    tn.clear_stats(Thumbnailer::CacheSelector::memory_cache);
+    stats = tn.stats();
+    EXPECT_EQ(1, stats.thumbnail_stats.hits());
+    EXPECT_EQ(1, stats.failure_stats.hits());
+    EXPECT_EQ(0, stats.memory_stats.hits);
+    EXPECT_EQ(0, stats.memory_stats.misses);
+    EXPECT_EQ(2, stats.memory_stats.size);
 }
 
 TEST_F(ThumbnailerTest, thumbnail_video)
@@ -375,7 +425,7 @@ TEST_F(ThumbnailerTest, thumbnail_video)
 
     {
         // Fetch the thumbnail again with the same size.
-        // That causes it to come from the thumbnail cache.
+        // That causes it to come from the in-memory cache.
         auto old_stats = tn.stats();
         auto request = tn.get_thumbnail(TEST_VIDEO, QSize(1920, 1920));
         QByteArray thumb = request->thumbnail();
@@ -384,7 +434,7 @@ TEST_F(ThumbnailerTest, thumbnail_video)
         EXPECT_EQ(1920, img.width());
         EXPECT_EQ(1080, img.height());
         auto new_stats = tn.stats();
-        EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, new_stats.thumbnail_stats.hits());
+        EXPECT_EQ(old_stats.memory_stats.hits + 1, new_stats.memory_stats.hits);
     }
 
     {
@@ -414,6 +464,650 @@ TEST_F(ThumbnailerTest, thumbnail_song)
     EXPECT_EQ(200, img.height());
 }
 
+TEST_F(ThumbnailerTest, coalesced_requests)
+{
+    Thumbnailer tn;
+
+    // The leader decodes the image at a size that is large enough for both requests.
+    auto leader = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    auto follower = tn.get_thumbnail(TEST_IMAGE, QSize(640, 640));
+    follower->coalesce_with(*leader);
+
+    Image img(leader->thumbnail());
+    EXPECT_EQ(160, img.width());
+    EXPECT_EQ(120, img.height());
+
+    img = Image(follower->thumbnail());
+    EXPECT_EQ(640, img.width());
+    EXPECT_EQ(480, img.height());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_fullsize, follower->status());
+
+    auto counters = tn.counters();
+    EXPECT_EQ(1, counters["coalescing.requests"]);
+    EXPECT_EQ(1, counters["coalescing.hits"]);
+
+    // A video is extracted once, and the followers are scaled from memory
+    // instead of from the full-size cache.
+    leader = tn.get_thumbnail(TEST_VIDEO, QSize(1920, 1920));
+    auto follower1 = tn.get_thumbnail(TEST_VIDEO, QSize(500, 500));
+    auto follower2 = tn.get_thumbnail(TEST_VIDEO, QSize(100, 100));
+    follower1->coalesce_with(*leader);
+    follower2->coalesce_with(*leader);
+
+    ASSERT_EQ("", leader->thumbnail());
+    QSignalSpy spy(leader.get(), &ThumbnailRequest::downloadFinished);
+    leader->download(chrono::milliseconds(15000));
+    ASSERT_TRUE(spy.wait(20000));
+    ASSERT_NE("", leader->thumbnail());
+
+    auto old_stats = tn.stats();
+    img = Image(follower1->thumbnail());
+    EXPECT_EQ(500, img.width());
+    EXPECT_EQ(281, img.height());
+    img = Image(follower2->thumbnail());
+    EXPECT_EQ(100, img.width());
+    EXPECT_EQ(56, img.height());
+    auto new_stats = tn.stats();
+    EXPECT_EQ(old_stats.full_size_stats.hits(), new_stats.full_size_stats.hits());
+
+    counters = tn.counters();
+    EXPECT_EQ(3, counters["coalescing.requests"]);
+    EXPECT_EQ(3, counters["coalescing.hits"]);
+
+    // A follower that joins after the leader decoded the source still gets it.
+    leader = tn.get_thumbnail(TEST_IMAGE, QSize(300, 300));
+    ASSERT_NE("", leader->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, leader->status());
+    follower = tn.get_thumbnail(TEST_IMAGE, QSize(200, 200));
+    follower->coalesce_with(*leader);
+    img = Image(follower->thumbnail());
+    EXPECT_EQ(200, img.width());
+    EXPECT_EQ(150, img.height());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_fullsize, follower->status());
+    EXPECT_EQ(4, tn.counters()["coalescing.hits"]);
+
+    // If the leader's thumbnail was cached, the first follower decodes
+    // the source at a size that covers the other followers as well.
+    leader = tn.get_thumbnail(TEST_IMAGE, QSize(300, 300));
+    ASSERT_NE("", leader->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, leader->status());
+    follower1 = tn.get_thumbnail(TEST_IMAGE, QSize(120, 120));
+    follower2 = tn.get_thumbnail(TEST_IMAGE, QSize(240, 240));
+    follower1->coalesce_with(*leader);
+    follower2->coalesce_with(*leader);
+    img = Image(follower1->thumbnail());
+    EXPECT_EQ(120, img.width());
+    EXPECT_NE(ThumbnailRequest::FetchStatus::scaled_from_fullsize, follower1->status());
+    img = Image(follower2->thumbnail());
+    EXPECT_EQ(240, img.width());
+    EXPECT_EQ(180, img.height());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_fullsize, follower2->status());
+    EXPECT_EQ(5, tn.counters()["coalescing.hits"]);
+
+    tn.clear_stats(Thumbnailer::CacheSelector::all);
+    EXPECT_EQ(0, tn.counters()["coalescing.hits"]);
+}
+
+TEST_F(ThumbnailerTest, memory_cache)
+{
+    Thumbnailer tn;
+
+    auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_TRUE(request->cached_thumbnail().isNull());
+    auto thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+
+    // A new request at the same size is answered from memory,
+    // without touching the thumbnail cache.
+    auto old_stats = tn.stats();
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_EQ(thumb, request->cached_thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    auto new_stats = tn.stats();
+    EXPECT_EQ(old_stats.memory_stats.hits + 1, new_stats.memory_stats.hits);
+    EXPECT_EQ(old_stats.thumbnail_stats.hits(), new_stats.thumbnail_stats.hits());
+    EXPECT_EQ(old_stats.thumbnail_stats.misses(), new_stats.thumbnail_stats.misses());
+    EXPECT_EQ(new_stats.memory_stats.hits, tn.counters()["memory.hits"]);
+
+    // A different size is not in memory yet. The miss is counted only once,
+    // even though thumbnail() runs after cached_thumbnail().
+    old_stats = tn.stats();
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(100, 100));
+    EXPECT_TRUE(request->cached_thumbnail().isNull());
+    ASSERT_NE("", request->thumbnail());
+    new_stats = tn.stats();
+    EXPECT_EQ(old_stats.memory_stats.misses + 1, new_stats.memory_stats.misses);
+    EXPECT_EQ(2, new_stats.memory_stats.size);
+
+    // Invalid sizes are left to thumbnail() to report.
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(-1, -1));
+    EXPECT_TRUE(request->cached_thumbnail().isNull());
+
+    // Clearing the thumbnail cache clears the in-memory cache as well.
+    tn.clear(Thumbnailer::CacheSelector::thumbnail_cache);
+    new_stats = tn.stats();
+    EXPECT_EQ(0, new_stats.memory_stats.size);
+    EXPECT_EQ(0, new_stats.memory_stats.size_in_bytes);
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_TRUE(request->cached_thumbnail().isNull());
+}
+
+TEST_F(ThumbnailerTest, stages)
+{
+    Thumbnailer tn;
+
+    // Nothing cached yet: the probe finds nothing, and the source
+    // is decoded from what read_source() read.
+    auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_EQ("", request->probe_caches());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::needs_download, request->status());
+    request->read_source();
+    auto thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    Image img(thumb);
+    EXPECT_EQ(160, img.width());
+    EXPECT_EQ(160, img.height());
+
+    // Same size again: the probe finds it, so there is nothing left to do.
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+    EXPECT_EQ(thumb, request->probe_caches());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+
+    // The probe reports a cached failure, and the cache reads are not
+    // repeated by thumbnail().
+    request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+    request->read_source();
+    EXPECT_EQ("", request->thumbnail());
+    auto old_stats = tn.stats();
+    request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+    EXPECT_EQ("", request->probe_caches());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
+    auto new_stats = tn.stats();
+    EXPECT_EQ(old_stats.failure_stats.hits() + 1, new_stats.failure_stats.hits());
+
+    // A small thumbnail of a photo is likely to come from the EXIF thumbnail,
+    // which is cheaper than decoding a whole image. A video extraction costs
+    // a whole core.
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(48, 48));
+    request->read_source();
+    EXPECT_EQ(1, request->decode_cost());
+    request = tn.get_thumbnail(TEST_VIDEO, QSize(48, 48));
+    request->read_source();
+    EXPECT_EQ(ThumbnailRequest::COST_PER_CORE, request->download_cost());
+    EXPECT_LT(request->decode_cost(), request->download_cost());
+
+    // Invalid sizes are left to thumbnail() to report.
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(-1, -1));
+    EXPECT_EQ("", request->probe_caches());
+    request->read_source();
+    EXPECT_THROW(request->thumbnail(), unity::ResourceException);
+}
+
+TEST_F(ThumbnailerTest, bloom_filter)
+{
+    string const filter_path = tempdir_path() + "/unity-thumbnailer/thumbnails.bloom";
+    string const index_path = tempdir_path() + "/unity-thumbnailer/sources.index";
+
+    {
+        Thumbnailer tn;
+
+        // The caches are empty, so a cold request does not go to the DB for any of them.
+        // The source index answers before the filter is consulted.
+        auto old_stats = tn.stats();
+        auto old_counters = tn.counters();
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        ASSERT_NE("", request->thumbnail());
+        auto new_stats = tn.stats();
+        auto new_counters = tn.counters();
+        EXPECT_EQ(old_stats.thumbnail_stats.misses(), new_stats.thumbnail_stats.misses());
+        EXPECT_EQ(old_stats.full_size_stats.misses(), new_stats.full_size_stats.misses());
+        EXPECT_EQ(old_stats.failure_stats.misses(), new_stats.failure_stats.misses());
+        EXPECT_EQ(old_counters["index.skipped_reads"] + 3, new_counters["index.skipped_reads"]);
+    }
+
+    // The filter was saved when the thumbnailer was destroyed. We remove
+    // the source index, so look-ups on the thumbnail cache use the filter.
+    EXPECT_TRUE(boost::filesystem::exists(filter_path));
+    ASSERT_TRUE(boost::filesystem::remove(index_path));
+
+    {
+        Thumbnailer tn;
+        EXPECT_FALSE(boost::filesystem::exists(filter_path));  // Removed once loaded.
+
+        // The thumbnail is still known to the filter.
+        auto old_stats = tn.stats();
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        auto new_stats = tn.stats();
+        EXPECT_EQ(old_stats.thumbnail_stats.hits() + 1, new_stats.thumbnail_stats.hits());
+
+        // A different size still is a definite miss.
+        auto old_counters = tn.counters();
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(100, 100));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(old_counters["filter.thumbnails"] + 1, tn.counters()["filter.thumbnails"]);
+        EXPECT_EQ(new_stats.thumbnail_stats.misses(), tn.stats().thumbnail_stats.misses());
+    }
+
+    // Without a saved filter, look-ups on a non-empty cache go to the DB.
+    ASSERT_TRUE(boost::filesystem::remove(filter_path));
+    ASSERT_TRUE(boost::filesystem::remove(index_path));
+
+    {
+        Thumbnailer tn;
+
+        auto old_stats = tn.stats();
+        auto old_counters = tn.counters();
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(200, 200));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(old_stats.thumbnail_stats.misses() + 1, tn.stats().thumbnail_stats.misses());
+        EXPECT_EQ(old_counters["filter.thumbnails"], tn.counters()["filter.thumbnails"]);
+
+        // Once the cache is cleared, the DB is no longer consulted for misses.
+        tn.clear(Thumbnailer::CacheSelector::thumbnail_cache);
+        old_stats = tn.stats();
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(200, 200));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(old_stats.thumbnail_stats.misses(), tn.stats().thumbnail_stats.misses());
+    }
+}
+
+TEST_F(ThumbnailerTest, bloom_filter_eviction)
+{
+    string const cache_path = tempdir_path() + "/bloom_filter_eviction";
+    string const filter_path = cache_path + ".bloom";
+    string const value(1024, 'x');
+
+    auto c = PersistentCacheHelper::open(cache_path, 64 * 1024, core::CacheDiscardPolicy::lru_only);
+    c->enable_bloom_filter(filter_path, 100);
+
+    // Writing the same key over and over counts it only once.
+    for (int i = 0; i < 100; ++i)
+    {
+        c->put("key", value);
+    }
+
+    // Filling the cache evicts the key, and it drops out of the filter.
+    for (int i = 0; i < 200; ++i)
+    {
+        c->put(to_string(i), value);
+    }
+    ASSERT_FALSE(c->cache().contains_key("key"));
+    auto misses = c->filtered_misses();
+    EXPECT_FALSE(c->get("key"));
+    EXPECT_EQ(misses + 1, c->filtered_misses());
+
+    // Entries that were not evicted are still found.
+    EXPECT_TRUE(c->get("199"));
+
+    // The filter can be trusted after a restart.
+    c->save_bloom_filter();
+    c.reset();
+    c = PersistentCacheHelper::open(cache_path, 64 * 1024, core::CacheDiscardPolicy::lru_only);
+    c->enable_bloom_filter(filter_path, 100);
+    misses = c->filtered_misses();
+    EXPECT_FALSE(c->get("key"));
+    EXPECT_FALSE(c->get("0"));
+    EXPECT_EQ(misses + 2, c->filtered_misses());
+    EXPECT_TRUE(c->get("199"));
+}
+
+TEST_F(ThumbnailerTest, source_index)
+{
+    string const index_path = tempdir_path() + "/unity-thumbnailer/sources.index";
+
+    {
+        Thumbnailer tn;
+
+        // We use a size that is larger than the EXIF thumbnail, so the image itself is decoded.
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(200, 200));
+        auto record = tn.source_record(*request);
+        EXPECT_TRUE(record.thumbnail_sizes.empty());
+        EXPECT_FALSE(record.source_size.isValid());
+
+        ASSERT_NE("", request->thumbnail());
+        record = tn.source_record(*request);
+        ASSERT_EQ(1u, record.thumbnail_sizes.size());
+        EXPECT_EQ(QSize(200, 200), record.thumbnail_sizes[0]);
+        EXPECT_FALSE(record.has_full_size);
+        EXPECT_FALSE(record.failed);
+        EXPECT_EQ(QSize(640, 480), record.source_size);
+        EXPECT_EQ("image/jpeg", record.content_type);
+
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(100, 100));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(2u, tn.source_record(*request).thumbnail_sizes.size());
+
+        // A failure is recorded as well.
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        record = tn.source_record(*request);
+        EXPECT_TRUE(record.failed);
+        EXPECT_TRUE(record.thumbnail_sizes.empty());
+
+        // The second request for the failure reads only the failure cache.
+        auto old_counters = tn.counters();
+        auto old_stats = tn.stats();
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cached_failure, request->status());
+        EXPECT_EQ(old_counters["index.skipped_reads"] + 2, tn.counters()["index.skipped_reads"]);
+        EXPECT_EQ(old_stats.failure_stats.hits() + 1, tn.stats().failure_stats.hits());
+        EXPECT_EQ(2, tn.counters()["index.sources"]);
+    }
+
+    // The index is saved on shutdown and restored on start-up.
+    EXPECT_TRUE(boost::filesystem::exists(index_path));
+
+    {
+        Thumbnailer tn;
+        EXPECT_FALSE(boost::filesystem::exists(index_path));
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(200, 200));
+        auto record = tn.source_record(*request);
+        EXPECT_EQ(2u, record.thumbnail_sizes.size());
+        EXPECT_EQ(QSize(640, 480), record.source_size);
+        EXPECT_EQ("image/jpeg", record.content_type);
+
+        // Clearing a cache removes its entries from the index.
+        tn.clear(Thumbnailer::CacheSelector::thumbnail_cache);
+        EXPECT_TRUE(tn.source_record(*request).thumbnail_sizes.empty());
+        request = tn.get_thumbnail(EMPTY_IMAGE, QSize(10, 10));
+        EXPECT_TRUE(tn.source_record(*request).failed);
+        tn.clear(Thumbnailer::CacheSelector::all);
+        EXPECT_FALSE(tn.source_record(*request).failed);
+    }
+}
+
+TEST_F(ThumbnailerTest, write_behind)
+{
+    auto c = PersistentCacheHelper::open(tempdir_path() + "/write_behind",
+                                         1024 * 1024,
+                                         core::CacheDiscardPolicy::lru_ttl);
+    c->enable_write_behind(4096);
+
+    // Queued entries are visible straight away.
+    string const value(100, 'x');
+    for (int i = 0; i < 200; ++i)
+    {
+        c->put(to_string(i), value);
+        ASSERT_TRUE(c->contains_key(to_string(i))) << i;
+        ASSERT_EQ(value, *c->get(to_string(i))) << i;
+    }
+    c->put("0", "new value");
+    EXPECT_EQ("new value", *c->get("0"));
+
+    // stats() waits for the queue to drain.
+    EXPECT_EQ(200, c->stats().size());
+    EXPECT_EQ("new value", *c->get("0"));
+
+    // An entry that has expired is not returned, even if it is still queued.
+    c->put("expired", "", chrono::system_clock::now() - chrono::seconds(1));
+    EXPECT_FALSE(c->get("expired"));
+
+    // Invalidating discards queued entries as well.
+    c->put("queued", "value");
+    c->invalidate();
+    EXPECT_FALSE(c->get("queued"));
+    EXPECT_EQ(0, c->stats().size());
+
+    // Destroying the helper writes out the queue.
+    c->put("last", "value");
+    c.reset();
+    c = PersistentCacheHelper::open(tempdir_path() + "/write_behind",
+                                    1024 * 1024,
+                                    core::CacheDiscardPolicy::lru_ttl);
+    EXPECT_EQ("value", *c->get("last"));
+}
+
+TEST_F(ThumbnailerTest, hot_set)
+{
+    string const hot_set_path = tempdir_path() + "/unity-thumbnailer/hot.keys";
+
+    auto wait_for_preload = [](Thumbnailer& tn)
+    {
+        for (int i = 0; i < 500 && tn.counters()["memory.preloaded"] == 0; ++i)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return tn.counters()["memory.preloaded"];
+    };
+
+    QByteArray thumb;
+    {
+        Thumbnailer tn;
+        tn.preload_hot_set();  // Nothing to preload yet.
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        thumb = request->thumbnail();
+        ASSERT_NE("", thumb);
+        EXPECT_EQ(0, tn.counters()["memory.preloaded"]);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(hot_set_path));
+
+    {
+        // The thumbnail is in memory before anyone asks for it.
+        Thumbnailer tn;
+        EXPECT_EQ(0, tn.stats().memory_stats.size);
+        tn.preload_hot_set();
+        EXPECT_FALSE(boost::filesystem::exists(hot_set_path));  // Loading removes the file.
+        EXPECT_EQ(1, wait_for_preload(tn));
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(160, 160));
+        EXPECT_EQ(thumb, request->cached_thumbnail());
+    }
+
+    {
+        // Preloading waits while there are requests.
+        Thumbnailer tn;
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(100, 100));
+        tn.preload_hot_set();
+        this_thread::sleep_for(chrono::milliseconds(200));
+        EXPECT_EQ(0, tn.counters()["memory.preloaded"]);
+        request.reset();
+        EXPECT_EQ(1, wait_for_preload(tn));
+    }
+
+    {
+        // Garbage in the file is ignored.
+        write_file(hot_set_path, string("hello"));
+        Thumbnailer tn;
+        tn.preload_hot_set();
+        EXPECT_FALSE(boost::filesystem::exists(hot_set_path));
+        EXPECT_EQ(0, tn.counters()["memory.preloaded"]);
+    }
+}
+
+TEST_F(ThumbnailerTest, background_generation)
+{
+    auto wait_for_thumbnails = [](Thumbnailer& tn, int64_t expected)
+    {
+        for (int i = 0; i < 2000 && tn.counters()["background.thumbnails"] < expected; ++i)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return tn.counters()["background.thumbnails"];
+    };
+
+    Thumbnailer tn;
+
+    // Generation waits while there are requests.
+    auto request = tn.get_thumbnail(RGB_IMAGE, QSize(32, 32));
+    tn.generate_in_background(TEST_IMAGE, { QSize(64, 64), QSize(128, 128) });
+    tn.generate_in_background(TEST_VIDEO, { QSize(64, 64) });
+    tn.generate_in_background(TESTDATADIR "/no_such_file", { QSize(64, 64) });
+    tn.generate_in_background(EMPTY_IMAGE, { QSize(64, 64) });  // Not media, ignored.
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_EQ(0, tn.counters()["background.thumbnails"]);
+    EXPECT_LE(3, tn.counters()["background.pending"]);
+    request.reset();
+    EXPECT_EQ(3, wait_for_thumbnails(tn, 3));
+    EXPECT_EQ(0, tn.counters()["background.pending"]);
+
+    // The thumbnails have the same keys as those made for a request.
+    request = tn.get_thumbnail(TEST_IMAGE, QSize(128, 128));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request = tn.get_thumbnail(TEST_VIDEO, QSize(64, 64));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request.reset();
+
+    // Thumbnails that exist already are not made again.
+    tn.generate_in_background(TEST_IMAGE, { QSize(64, 64) });
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_EQ(3, tn.counters()["background.thumbnails"]);
+}
+
+TEST_F(ThumbnailerTest, prefetch_siblings)
+{
+    auto wait_for_thumbnails = [](Thumbnailer& tn, int64_t expected)
+    {
+        for (int i = 0; i < 2000 && tn.counters()["prefetch.thumbnails"] < expected; ++i)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        return tn.counters()["prefetch.thumbnails"];
+    };
+
+    string const dir = tempdir_path() + "/photos";
+    mkdir(dir.c_str(), 0700);
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-1.jpg", dir + "/a.jpg");
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-2.jpg", dir + "/b.jpg");
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-3.jpg", dir + "/c.jpg");
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-4.jpg", dir + "/d.jpg");
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-5.jpg", dir + "/.hidden.jpg");
+
+    Thumbnailer tn;
+
+    // The two files after a.jpg, in name order.
+    tn.prefetch_siblings(dir + "/a.jpg", QSize(64, 64), 2);
+    EXPECT_EQ(2, wait_for_thumbnails(tn, 2));
+    EXPECT_EQ(1, tn.counters()["prefetch.predictions"]);
+    EXPECT_EQ(0, tn.counters()["prefetch.pending"]);
+
+    auto request = tn.get_thumbnail(dir + "/b.jpg", QSize(64, 64));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    request = tn.get_thumbnail(dir + "/d.jpg", QSize(64, 64));
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_NE(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+
+    // A request for the same file at a different size is not a hit.
+    request = tn.get_thumbnail(dir + "/c.jpg", QSize(32, 32));
+    request.reset();
+
+    auto counters = tn.counters();
+    EXPECT_EQ(1, counters["prefetch.hits"]);
+    EXPECT_EQ(0, counters["prefetch.wasted"]);
+    EXPECT_EQ(100, counters["prefetch.accuracy_percent"]);
+
+    // Thumbnails that are cached already are not made again.
+    tn.prefetch_siblings(dir + "/a.jpg", QSize(64, 64), 10);
+    this_thread::sleep_for(chrono::milliseconds(200));
+    EXPECT_EQ(2, tn.counters()["prefetch.thumbnails"]);
+}
+
+TEST_F(ThumbnailerTest, desktop_thumbnails)
+{
+    string const path = tempdir_path() + "/photo.jpg";
+    boost::filesystem::copy_file(TESTDATADIR "/orientation-1.jpg", path);  // 640x480
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+
+    // What a desktop application would have left behind. We make it from a different
+    // image, so we can tell that the thumbnail came from the shared cache.
+    DesktopThumbnails desktop(tempdir_path() + "/thumbnails");
+    Image other(read_file(TESTDATADIR "/testimage.jpg"), QSize(256, 256));  // 256x160
+    ASSERT_TRUE(desktop.store(path, st.st_mtime, st.st_size, "image/jpeg", other));
+
+    Thumbnailer tn;
+    auto request = tn.get_thumbnail(path, QSize(128, 128));
+    auto thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::scaled_from_fullsize, request->status());
+    Image img(thumb);
+    EXPECT_EQ(128, img.width());
+    EXPECT_EQ(80, img.height());
+    EXPECT_EQ(1, tn.counters()["desktop.hits"]);
+
+    // Too small for this request, so we decode the file.
+    request = tn.get_thumbnail(path, QSize(400, 400));
+    img = Image(request->thumbnail());
+    EXPECT_EQ(400, img.width());
+    EXPECT_EQ(300, img.height());
+    EXPECT_EQ(1, tn.counters()["desktop.hits"]);
+
+    // Writing to the shared cache is off by default.
+    EXPECT_EQ(0, tn.counters()["desktop.stores"]);
+    EXPECT_FALSE(boost::filesystem::exists(desktop.thumbnail_path(path, 128)));
+}
+
+TEST_F(ThumbnailerTest, local_album_art)
+{
+    string const song = tempdir_path() + "/song.mp3";
+    boost::filesystem::copy_file(TESTDATADIR "/testsong.mp3", song);
+    {
+        TagLib::FileRef file(song.c_str());
+        ASSERT_FALSE(file.isNull());
+        file.tag()->setArtist("Some Artist");
+        file.tag()->setAlbum("Some Album");
+        ASSERT_TRUE(file.save());
+    }
+
+    {
+        Thumbnailer tn;
+
+        // We don't know the album yet.
+        auto request = tn.get_album_art("Some Artist", "Some Album", QSize(48, 48));
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::needs_download, request->status());
+        string const shared_key = request->key();
+        request->check_client_credentials(geteuid() + 1, "unconfined");  // Downloaded art is for everyone.
+
+        // Extracting the art of the song adds it to the index.
+        request = tn.get_thumbnail(song, QSize(64, 64));
+        ASSERT_NE("", request->thumbnail());
+        EXPECT_EQ(1, tn.counters()["albums.entries"]);
+
+        // Local art is only for clients that may read the song, and is cached separately.
+        // Other clients get the downloaded art, as if we didn't know the song.
+        request = tn.get_album_art("Some Artist", "Some Album", QSize(48, 48));
+        EXPECT_NE(shared_key, request->key());
+        request->check_client_credentials(geteuid() + 1, "unconfined");
+        EXPECT_EQ(shared_key, request->key());
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::needs_download, request->status());
+        EXPECT_EQ(0, tn.counters()["albums.local_hits"]);
+
+        request = tn.get_album_art("Some Artist", "Some Album", QSize(48, 48));
+        request->check_client_credentials(geteuid(), "unconfined");
+        EXPECT_NE(shared_key, request->key());
+        auto thumb = request->thumbnail();
+        ASSERT_NE("", thumb);
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+        Image img(thumb);
+        EXPECT_EQ(48, img.width());
+        EXPECT_EQ(48, img.height());
+        EXPECT_EQ(1, tn.counters()["albums.local_hits"]);
+    }
+
+    {
+        // The index survives a restart.
+        Thumbnailer tn;
+        EXPECT_EQ(1, tn.counters()["albums.entries"]);
+
+        // Once the song is gone, we forget about it.
+        boost::filesystem::remove(song);
+        auto request = tn.get_album_art("Some Artist", "Some Album", QSize(32, 32));
+        EXPECT_EQ(0, tn.counters()["albums.entries"]);
+        EXPECT_EQ("", request->thumbnail());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::needs_download, request->status());
+        EXPECT_EQ(0, tn.counters()["albums.entries"]);
+        EXPECT_EQ(0, tn.counters()["albums.local_hits"]);
+    }
+}
+
 TEST_F(ThumbnailerTest, exceptions)
 {
     string const cache_dir = tempdir_path();
@@ -586,6 +1280,105 @@ TEST_F(ThumbnailerTest, check_client_access)
     }
 }
 
+TEST_F(ThumbnailerTest, permission_change)
+{
+    string const image = tempdir_path() + "/image.jpg";
+    boost::filesystem::copy_file(TEST_IMAGE, image);
+
+    Thumbnailer tn;
+
+    auto request = tn.get_thumbnail(image, QSize(40, 40));
+    EXPECT_FALSE(request->thumbnail().isEmpty());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    auto const key = request->key();
+
+    // Changing the permissions doesn't change the key, so we don't make the thumbnail again.
+    ASSERT_EQ(0, chmod(image.c_str(), 0400));
+    request = tn.get_thumbnail(image, QSize(40, 40));
+    EXPECT_EQ(key, request->key());
+    EXPECT_FALSE(request->thumbnail().isEmpty());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+
+    // But a client can no longer get the thumbnail once the file isn't readable.
+    // We wait for the file information to be refreshed.
+    ASSERT_EQ(0, chmod(image.c_str(), 0000));
+    bool denied = false;
+    for (int i = 0; i < 100 && !denied; ++i)
+    {
+        request = tn.get_thumbnail(image, QSize(40, 40));
+        try
+        {
+            request->check_client_credentials(geteuid(), "unconfined");
+            this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        catch (std::exception const& e)
+        {
+            EXPECT_TRUE(boost::contains(e.what(), "No read access to " + image)) << e.what();
+            denied = true;
+        }
+    }
+    EXPECT_TRUE(denied);
+    EXPECT_EQ(key, request->key());
+}
+
+TEST_F(ThumbnailerTest, shared_contents)
+{
+    // Two tracks of the same album, with the same cover art.
+    string const song1 = tempdir_path() + "/song1.ogg";
+    string const song2 = tempdir_path() + "/song2.ogg";
+    boost::filesystem::copy_file(TEST_SONG, song1);
+    boost::filesystem::copy_file(TEST_SONG, song2);
+
+    Thumbnailer tn;
+
+    auto request = tn.get_thumbnail(song1, QSize(64, 64));
+    request->read_source();
+    auto thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    EXPECT_EQ(0, tn.counters()["dedup.skipped_decodes"]);
+
+    // The cover art of the second track is not decoded again, and its
+    // entry refers to the entry for the first track.
+    request = tn.get_thumbnail(song2, QSize(64, 64));
+    request->read_source();
+    EXPECT_EQ(thumb, request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+    auto counters = tn.counters();
+    EXPECT_EQ(1, counters["dedup.skipped_decodes"]);
+    EXPECT_EQ(1, counters["dedup.references"]);
+
+    // The reference is followed when the thumbnail comes from the cache.
+    tn.clear(Thumbnailer::CacheSelector::memory_cache);
+    request = tn.get_thumbnail(song2, QSize(64, 64));
+    EXPECT_EQ(thumb, request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+
+    // Without read_source(), the source is decoded, but an identical
+    // thumbnail is still stored as a reference.
+    string const image1 = tempdir_path() + "/image1.jpg";
+    string const image2 = tempdir_path() + "/image2.jpg";
+    boost::filesystem::copy_file(TEST_IMAGE, image1);
+    boost::filesystem::copy_file(TEST_IMAGE, image2);
+    request = tn.get_thumbnail(image1, QSize(100, 100));
+    thumb = request->thumbnail();
+    ASSERT_NE("", thumb);
+    request = tn.get_thumbnail(image2, QSize(100, 100));
+    EXPECT_EQ(thumb, request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+    counters = tn.counters();
+    EXPECT_EQ(1, counters["dedup.skipped_decodes"]);
+    EXPECT_EQ(2, counters["dedup.references"]);
+
+    // If the entry that is referred to is gone, the reference is a miss.
+    tn.clear(Thumbnailer::CacheSelector::all);
+    request = tn.get_thumbnail(song2, QSize(64, 64));
+    EXPECT_EQ("", request->probe_caches());
+    request->read_source();
+    EXPECT_NE("", request->thumbnail());
+    EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+}
+
 TEST_F(ThumbnailerTest, invalid_size)
 {
     Thumbnailer tn;
@@ -689,6 +1482,56 @@ TEST_F(ThumbnailerTest, clear_if_old_cache_version)
     }
 }
 
+TEST_F(ThumbnailerTest, migrate_cache_version_2_keys)
+{
+    {
+        Thumbnailer tn;  // Creates the caches.
+    }
+
+    // Store a thumbnail under the key that version 2 used, and pretend
+    // that this cache is a version 2 cache.
+    auto const path = boost::filesystem::canonical(TEST_IMAGE).native();
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+    auto const legacy_key = legacy_local_cache_key(path, st.st_ino, st.st_mtim, st.st_ctim);
+    string const cache_dir = tempdir_path() + "/unity-thumbnailer";
+    {
+        auto cache = core::PersistentStringCache::open(cache_dir + "/thumbnails");
+        cache->put(legacy_sized_cache_key(legacy_key, QSize(40, 40)), "version 2 thumbnail");
+    }
+    system((string("echo 2 >") + cache_dir + "/thumbnailer-cache-version").c_str());
+
+    // The entry is found and copied to the new key.
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(40, 40));
+        EXPECT_EQ("version 2 thumbnail", request->thumbnail().toStdString());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::cache_hit, request->status());
+        EXPECT_EQ(1, tn.counters()["keys.migrated"]);
+
+        // Other sizes still need to be made.
+        request = tn.get_thumbnail(TEST_IMAGE, QSize(20, 20));
+        EXPECT_FALSE(request->thumbnail().isEmpty());
+        EXPECT_EQ(ThumbnailRequest::FetchStatus::downloaded, request->status());
+        EXPECT_EQ(1, tn.counters()["keys.migrated"]);
+    }
+    EXPECT_TRUE(boost::filesystem::exists(cache_dir + "/legacy-keys"));
+
+    // After a restart, the thumbnail is found under the new key.
+    {
+        Thumbnailer tn;
+
+        auto request = tn.get_thumbnail(TEST_IMAGE, QSize(40, 40));
+        EXPECT_EQ("version 2 thumbnail", request->thumbnail().toStdString());
+        EXPECT_EQ(0, tn.counters()["keys.migrated"]);
+
+        // Once the caches are cleared, there is nothing left to migrate.
+        tn.clear(Thumbnailer::CacheSelector::all);
+        EXPECT_FALSE(boost::filesystem::exists(cache_dir + "/legacy-keys"));
+    }
+}
+
 #pragma GCC diagnostic pop
 
 class RemoteServer : public ThumbnailerTest
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2016 Canonical Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <internal/volume_caches.h>
+
+#include <internal/file_io.h>
+#include <testsetup.h>
+
+#include <boost/filesystem.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <thread>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+using namespace std;
+using namespace unity::thumbnailer::internal;
+
+#define TEST_DIR TESTBINDIR "/volume_caches_test.dir"
+#define MEDIA_DIR TEST_DIR "/media"
+#define MOUNT_INFO TEST_DIR "/mountinfo"
+#define UUID "1234-ABCD"
+
+namespace
+{
+
+class VolumeCachesTest : public ::testing::Test
+{
+protected:
+    void SetUp() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+        boost::filesystem::create_directories(MEDIA_DIR "/user/CARD/DCIM");
+        boost::filesystem::create_directories(MEDIA_DIR "/user/bind");
+        boost::filesystem::create_directories(TEST_DIR "/by-uuid");
+    }
+
+    void TearDown() override
+    {
+        boost::filesystem::remove_all(TEST_DIR);
+    }
+
+    // Waits until VolumeCaches reads the mount table again.
+    static void wait_for_refresh()
+    {
+        this_thread::sleep_for(chrono::milliseconds(2100));
+    }
+
+    static unique_ptr<VolumeCaches> make_caches(chrono::milliseconds idle_time = chrono::seconds(10),
+                                                int64_t max_total_size = 10 * 1024 * 1024)
+    {
+        return unique_ptr<VolumeCaches>(new VolumeCaches(TEST_DIR "/volumes",
+                                                         1024 * 1024,
+                                                         max_total_size,
+                                                         { MEDIA_DIR },
+                                                         MOUNT_INFO,
+                                                         TEST_DIR "/by-uuid",
+                                                         idle_time));
+    }
+
+    // Volumes are identified by their file system UUID, which is the name of a
+    // link to the block device. We can't make device nodes, so we link to one
+    // that exists and return its number as it appears in the mount table.
+    static bool make_uuid_link(string& device)
+    {
+        boost::system::error_code ec;
+        for (boost::filesystem::directory_iterator it("/dev", ec), end; !ec && it != end; it.increment(ec))
+        {
+            struct stat st;
+            if (stat(it->path().c_str(), &st) == 0 && S_ISBLK(st.st_mode))
+            {
+                boost::filesystem::create_symlink(it->path(), TEST_DIR "/by-uuid/" UUID);
+                device = to_string(major(st.st_rdev)) + ":" + to_string(minor(st.st_rdev));
+                return true;
+            }
+        }
+        // LCOV_EXCL_START
+        cerr << "No block device found, skipping test" << endl;
+        return false;
+        // LCOV_EXCL_STOP
+    }
+};
+
+TEST_F(VolumeCachesTest, not_removable)
+{
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               // Bind mounts of a directory are not volumes.
+               "90 17 8:1 /home/user/stuff " MEDIA_DIR "/user/bind rw,relatime shared:1 - ext4 /dev/sda1 rw\n"));
+    auto caches = make_caches();
+
+    string relative_path;
+    EXPECT_EQ(nullptr, caches->find("/home/user/Pictures/a.jpg", relative_path));
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/bind/a.jpg", relative_path));
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path));
+    EXPECT_EQ(0, caches->open_caches());
+}
+
+TEST_F(VolumeCachesTest, cache_per_file_system)
+{
+    string device;
+    if (!make_uuid_link(device))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               "100 17 ") + device + " / " MEDIA_DIR "/user/CARD rw,nosuid,nodev shared:50 - vfat /dev/sdb1 rw\n"
+               // No UUID, so no cache.
+               "102 17 8:49 / " MEDIA_DIR "/user/OTHER rw,nosuid,nodev shared:51 - vfat /dev/sdd1 rw\n");
+    auto caches = make_caches();
+
+    string relative_path;
+    auto cache = caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    EXPECT_EQ("DCIM/a.jpg", relative_path);
+    EXPECT_TRUE(boost::filesystem::is_directory(TEST_DIR "/volumes/" UUID));
+    EXPECT_FALSE(boost::filesystem::exists(MEDIA_DIR "/user/CARD/.unity-thumbnailer"));  // Volume is left alone.
+    EXPECT_EQ(1, caches->open_caches());
+    cache->put("key", "value");
+
+    // The same cache for other files on the volume.
+    EXPECT_EQ(cache, caches->find(MEDIA_DIR "/user/CARD/b.jpg", relative_path));
+    EXPECT_EQ("b.jpg", relative_path);
+
+    // The mount point itself is not on the volume.
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/CARD", relative_path));
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/CARDS/a.jpg", relative_path));
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/OTHER/a.jpg", relative_path));
+    cache.reset();
+
+    // Unmounted. The cache is closed.
+    write_file(MOUNT_INFO, string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"));
+    wait_for_refresh();
+    EXPECT_EQ(nullptr, caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path));
+    EXPECT_EQ(0, caches->open_caches());
+
+    // Mounted again, elsewhere. The mount table escapes the space.
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               "101 17 ") + device + " / " MEDIA_DIR "/user/MY\\040CARD rw,nosuid,nodev shared:50 - vfat /dev/sdc1 rw\n");
+    wait_for_refresh();
+    cache = caches->find(MEDIA_DIR "/user/MY CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    EXPECT_EQ("DCIM/a.jpg", relative_path);
+    auto value = cache->get("key");
+    ASSERT_TRUE(bool(value));
+    EXPECT_EQ("value", *value);
+}
+
+TEST_F(VolumeCachesTest, idle_caches_closed)
+{
+    string device;
+    if (!make_uuid_link(device))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               "100 17 ") + device + " / " MEDIA_DIR "/user/CARD rw,nosuid,nodev shared:50 - vfat /dev/sdb1 rw\n");
+    auto caches = make_caches(chrono::milliseconds(200));
+
+    string relative_path;
+    auto cache = caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    cache->put("key", "value");
+    EXPECT_EQ(1, caches->open_caches());
+
+    // Closed without another call to find().
+    this_thread::sleep_for(chrono::milliseconds(500));
+    EXPECT_EQ(0, caches->open_caches());
+
+    // A request that still has the cache can keep using it, and gets the same one back.
+    auto same = caches->find(MEDIA_DIR "/user/CARD/b.jpg", relative_path);
+    EXPECT_EQ(cache, same);
+    same.reset();
+    cache.reset();
+
+    this_thread::sleep_for(chrono::milliseconds(500));
+    EXPECT_EQ(0, caches->open_caches());
+
+    // Opened again on demand.
+    cache = caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    EXPECT_EQ(1, caches->open_caches());
+    auto value = cache->get("key");
+    ASSERT_TRUE(bool(value));
+    EXPECT_EQ("value", *value);
+}
+
+TEST_F(VolumeCachesTest, clear_and_compact)
+{
+    string device;
+    if (!make_uuid_link(device))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               "100 17 ") + device + " / " MEDIA_DIR "/user/CARD rw,nosuid,nodev shared:50 - vfat /dev/sdb1 rw\n");
+    // The cache of a volume that is not mounted.
+    {
+        auto other = PersistentCacheHelper::open(TEST_DIR "/volumes/5678-EF01", 1024 * 1024,
+                                                 core::CacheDiscardPolicy::lru_only);
+        other->put("key", "value");
+    }
+    auto caches = make_caches();
+    EXPECT_EQ(1, caches->stats().caches);
+    EXPECT_LT(0, caches->stats().disk_size);
+
+    string relative_path;
+    auto cache = caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    cache->put("key", "value");
+    EXPECT_EQ(2, caches->stats().caches);
+
+    caches->compact();
+    EXPECT_TRUE(bool(cache->get("key")));
+    EXPECT_EQ(2, caches->stats().caches);
+
+    // The cache in use is emptied, the other one is removed.
+    caches->clear();
+    EXPECT_FALSE(bool(cache->get("key")));
+    EXPECT_EQ(1, caches->stats().caches);
+    EXPECT_TRUE(boost::filesystem::is_directory(TEST_DIR "/volumes/" UUID));
+    EXPECT_FALSE(boost::filesystem::exists(TEST_DIR "/volumes/5678-EF01"));
+
+    // The cache still works.
+    cache->put("key", "value");
+    EXPECT_TRUE(bool(cache->get("key")));
+}
+
+TEST_F(VolumeCachesTest, total_size)
+{
+    string device;
+    if (!make_uuid_link(device))
+    {
+        return;  // LCOV_EXCL_LINE
+    }
+    write_file(MOUNT_INFO,
+               string("17 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n"
+               "100 17 ") + device + " / " MEDIA_DIR "/user/CARD rw,nosuid,nodev shared:50 - vfat /dev/sdb1 rw\n");
+    // Caches of volumes that are not mounted. The older one goes first.
+    boost::filesystem::create_directories(TEST_DIR "/volumes/OLD");
+    write_file(TEST_DIR "/volumes/OLD/data", string(60 * 1024, 'x'));
+    boost::filesystem::last_write_time(TEST_DIR "/volumes/OLD", time(nullptr) - 200);
+    boost::filesystem::create_directories(TEST_DIR "/volumes/NEWER");
+    write_file(TEST_DIR "/volumes/NEWER/data", string(60 * 1024, 'x'));
+    boost::filesystem::last_write_time(TEST_DIR "/volumes/NEWER", time(nullptr) - 100);
+
+    // Both fit.
+    auto caches = make_caches(chrono::seconds(10), 120 * 1024);
+    EXPECT_EQ(2, caches->stats().caches);
+
+    // Opening the cache for the card makes room.
+    string relative_path;
+    auto cache = caches->find(MEDIA_DIR "/user/CARD/DCIM/a.jpg", relative_path);
+    ASSERT_NE(nullptr, cache);
+    cache->put("key", string(40 * 1024, 'x'));
+    cache.reset();
+    caches.reset();
+    EXPECT_FALSE(boost::filesystem::exists(TEST_DIR "/volumes/OLD"));
+    EXPECT_TRUE(boost::filesystem::exists(TEST_DIR "/volumes/NEWER"));
+    EXPECT_TRUE(boost::filesystem::exists(TEST_DIR "/volumes/" UUID));
+
+    // A lower limit removes the caches that are not in use.
+    caches = make_caches(chrono::seconds(10), 1);
+    EXPECT_EQ(0, caches->stats().caches);
+}
+
+}  // namespace